@@ -2,6 +2,12 @@
 #define BYTECODE_HPP
 
 #include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "value.hpp"
 
 enum PrimType : uint8_t {
 	PT_INTEGER,
@@ -17,44 +23,113 @@ enum PrimType : uint8_t {
 // The VM's instructions are an int32_t[].
 // Everything listed here is stored in exactly 1 int32_t.
 /*
- * loc -> 
- *   if topmost bit is set, abs(loc) specifies an offset from the _stack base pointer_.
+ * The VM is a register machine: every function has a frame of `frame_size` registers,
+ * its parameters first, and instructions name the registers they read and write.
+ *
+ * reg -> the index of a register in the current frame.
+ * loc ->
+ *   if topmost bit is set, abs(loc) specifies a register.
  *   if topmist bit isn't set, abs(loc) specifies an offset inside the _constant pool_.
  *
  * Every instruction is stored as a int32_t with the lowest byte
  * as the instruction and the highest (0 <= N <= 3) bytes as the param types.
+ * The highest byte is t1, then t2 and t3.
  *
- * Every binary operator (ADD, SUB, etc.) takes 2 `loc`s and pushes the result onto the stack.
- * Every unary operator (NOT, NEG) takes 1 `loc` and pushes the result onto the stack.
+ * Every binary operator (ADD, SUB, etc.) takes a `reg` for the result and 2 `loc`s.
+ * Every unary operator (NOT, NEG, ITOR) takes a `reg` for the result and 1 `loc`.
+ * Operators come in one opcode per type of their operands, given by the suffix:
+ * I is INTEGER, R is REAL, C, B, S and D are CHAR, BOOLEAN, STRING and DATE, so
+ * ADD_RI adds an INTEGER to a REAL. Comparing DATEs only checks equality, like the interpreter.
  * JMP is an unconditional jump, taking 1 value: `ip`.
  * CJMP is a conditional jump, taking a `loc` and an `ip`. If `loc->b`, jump to `ip`.
- */ 
+ *
+ * The rest take, `reg` always being where the result goes:
+ * MOV: reg, loc.
+ * SELECT: reg, 3 `loc`s, the second if the first is true, else the third.
+ * LOADG: reg, a global variable id. STOREG: an id and a `loc`.
+ * DECLAREG: an id, a type and a `loc` if t1 is 1 (see Env::initVar). HIDEG, UNHIDEG: an id (see Env::hideGlobal).
+ * LOADE: reg, array `loc`, offset `loc`. STOREE: array, offset, value.
+ * CHECK: index `loc`, lower and upper bound `loc`s, t1 says which to check (1 lower, 2 upper).
+ * NEWARR: reg, type (an array). COPYARR: target `loc`, source `loc`, size. COPYNEW: reg, array `loc`, size.
+ * INPUT: reg, type. OUTPUT: type, `loc`. NEWLINE.
+ * CALL: reg (unused by a PROCEDURE), function, then one `loc` per parameter.
+ * CALLB: reg, builtin, number of arguments, one `loc` each.
+ * CHECKDEF, DEFFUNC: function. DEFINED: reg, function. RET: a `loc` if t1 is 1.
+ * THROW: 0 for TypeError and 1 for RuntimeError, message.
+ *
+ * Superinstructions do the work of a common sequence of the above at once
+ * (see Compiler::fusable in compiler.hpp):
+ * JEQ_II, JLT_II, etc.: 2 `loc`s and an `ip`, jumps if the comparison is true. A comparison, then CJMP.
+ * FOR_STEP_II: reg, 2 `loc`s, limit `loc`, `ip`. ADD_II into reg, then JLTEQ_II reg limit ip.
+ * MOV_JMP: reg, `loc`, `ip`.
+ * LOADE_IDX: reg, array `loc`, index `loc`, lower bound `loc`. SUB_II, then LOADE at index - lower.
+ * STOREE_IDX: array, index, lower bound, value. SUB_II, then STOREE.
+ * `type`, `function`, `builtin` and `message` index the tables in Bytecode.
+ */
 
 const int32_t TOPMOST_BIT32 = (1 << 31);
 
 #define IREP2(name, a, b) I(name##a) I(name##b)
+#define IREP3(name, a, b, c) IREP2(name, a, b) I(name##c)
 #define IREP4(name, a, b, c, d) IREP2(name, a, b) IREP2(name, c, d)
 #define IREP6(name, a, b, c, d, e, f) IREP2(name, a, b) IREP4(name, c, d, e, f)
 
 #define INSTRUCTIONS \
 	/* Operators */ \
-	I(ADD) \
-	I(SUB) \
-	I(MUL) \
-	I(DIV) \
-	I(NEG) \
-	I(EQ) \
-	I(GT) \
-	I(LT) \
-	I(GTEQ) \
-	I(LTEQ) \
-	I(NEQ) \
+	IREP3(ADD_, II, RR, RI) \
+	IREP3(SUB_, II, RR, RI) \
+	IREP3(MUL_, II, RR, RI) \
+	I(DIV_RR) \
+	I(IDIV_II) \
+	I(MOD_II) \
+	IREP2(NEG_, I, R) \
+	I(ITOR) \
+	IREP6(EQ_, II, RR, RI, CC, BB, SS) \
+	IREP6(GT_, II, RR, RI, CC, BB, SS) \
+	IREP6(LT_, II, RR, RI, CC, BB, SS) \
+	IREP6(GTEQ_, II, RR, RI, CC, BB, SS) \
+	IREP6(LTEQ_, II, RR, RI, CC, BB, SS) \
+	IREP6(NEQ_, II, RR, RI, CC, BB, SS) \
+	I(EQ_DD) \
 	I(AND) \
 	I(OR) \
 	I(NOT) \
+	I(SELECT) \
+	/* Values */ \
+	I(MOV) \
+	I(LOADG) \
+	I(STOREG) \
+	I(DECLAREG) \
+	I(HIDEG) \
+	I(UNHIDEG) \
+	/* Arrays */ \
+	I(LOADE) \
+	I(STOREE) \
+	I(CHECK) \
+	I(NEWARR) \
+	I(COPYARR) \
+	I(COPYNEW) \
+	/* I/O */ \
+	I(INPUT) \
+	I(OUTPUT) \
+	I(NEWLINE) \
+	/* Functions */ \
+	I(CALL) \
+	I(CALLB) \
+	I(CHECKDEF) \
+	I(DEFFUNC) \
+	I(DEFINED) \
+	I(RET) \
 	/* Flow */ \
 	I(JMP) \
 	I(CJMP) \
+	I(THROW) \
+	/* Superinstructions */ \
+	IREP6(J, EQ_II, GT_II, LT_II, GTEQ_II, LTEQ_II, NEQ_II) \
+	I(FOR_STEP_II) \
+	I(MOV_JMP) \
+	I(LOADE_IDX) \
+	I(STOREE_IDX) \
 
 enum Op : uint8_t {
 #define I(x) OP_##x,
@@ -63,4 +138,130 @@ enum Op : uint8_t {
 	OP_LENGTH
 };
 
+/* Order of the operand types of every comparison, see IREP6 above */
+enum CmpTypes : uint8_t { CMP_II, CMP_RR, CMP_RI, CMP_CC, CMP_BB, CMP_SS };
+
+inline int32_t makeInstr(Op op, uint8_t t1 = 0, uint8_t t2 = 0, uint8_t t3 = 0){
+	return (int32_t)((uint32_t)op | (uint32_t)t3 << 8 | (uint32_t)t2 << 16 | (uint32_t)t1 << 24);
+}
+
+const size_t MAX_BUILTIN_ARGS = 4;
+/* Registers in a frame, more than any function needs */
+const uint32_t MAX_FRAME_SIZE = 1 << 20;
+
+struct FuncInfo {
+	int32_t entry; /* index of the first instruction */
+	uint32_t params; /* the first slots of the frame */
+	uint32_t frame_size; /* registers, including the parameters */
+	bool returns; /* FUNCTION, not PROCEDURE */
+	bool local_arrays; /* COPYNEW arrays are freed on return, see EscapePass */
+};
+
+/* A compiled program (see compiler.hpp), run by VM in vm.hpp. */
+struct Bytecode {
+	std::vector<int32_t> instr;
+	std::vector<EValue> const_pool;
+	std::vector<Primitive> const_types; /* of every constant, to write them to a file */
+	std::vector<FuncInfo> funcs; /* funcs[0] is the main program */
+	std::vector<EType> types;
+	std::vector<std::string> messages;
+	std::vector<EValue (*)(EValue *)> builtins;
+	std::vector<std::pair<int32_t, int32_t>> lines; /* (instruction, line in the source) where a line starts */
+	/* The instructions of a file mapped into memory (see pcsb.hpp), used instead of `instr` */
+	const int32_t *mapped = nullptr;
+	size_t mapped_size = 0;
+	/* Loaded from a file, so nothing about it can be trusted (see verify in vm.hpp) */
+	bool from_file = false;
+
+	inline const int32_t *words() const noexcept { return mapped ? mapped : instr.data(); }
+	inline size_t length() const noexcept { return mapped ? mapped_size : instr.size(); }
+};
+
+const std::vector<std::string_view> instr_to_str = {
+#define I(x) #x,
+	INSTRUCTIONS
+#undef I
+};
+
+/* What the operands of the instruction at `code.words()[at]` are, one letter each:
+ * r a `reg`, l a `loc`, j an `ip`, n a number (variable id, size, ...),
+ * t a type, f a function, b a builtin and m a message. */
+inline std::string operandKinds(const Bytecode& code, size_t at){
+	const int32_t *instr = code.words();
+	const int32_t word = instr[at];
+	const uint8_t t1 = (uint32_t)word >> 24;
+	switch(word & 0xFF){
+		case OP_NEWLINE: return "";
+		case OP_CHECKDEF: case OP_DEFFUNC: return "f";
+		case OP_DEFINED: return "rf";
+		case OP_JMP: return "j";
+		case OP_NEG_I: case OP_NEG_R: case OP_ITOR: case OP_NOT: case OP_MOV: return "rl";
+		case OP_LOADG: return "rn";
+		case OP_STOREG: return "nl";
+		case OP_HIDEG: case OP_UNHIDEG: return "n";
+		case OP_INPUT: case OP_NEWARR: return "rt";
+		case OP_OUTPUT: return "tl";
+		case OP_CJMP: return "lj";
+		case OP_THROW: return "nm";
+		case OP_STOREE: case OP_CHECK: return "lll";
+		case OP_COPYARR: return "lln";
+		case OP_COPYNEW: return "rln";
+		case OP_JEQ_II: case OP_JGT_II: case OP_JLT_II: case OP_JGTEQ_II: case OP_JLTEQ_II: case OP_JNEQ_II:
+			return "llj";
+		case OP_MOV_JMP: return "rlj";
+		case OP_SELECT: case OP_LOADE_IDX: return "rlll";
+		case OP_STOREE_IDX: return "llll";
+		case OP_FOR_STEP_II: return "rlllj";
+		case OP_DECLAREG: return t1 ? "ntl" : "nt";
+		case OP_CALL: return "rf" + std::string(code.funcs[instr[at + 2]].params, 'l');
+		case OP_CALLB: return "rbn" + std::string(instr[at + 3], 'l');
+		case OP_RET: return t1 ? "l" : "";
+		default: return "rll"; /* binary operators and LOADE */
+	}
+}
+
+/* How many int32_ts the instruction at `code.words()[at]` takes, operands included. */
+inline size_t instrLength(const Bytecode& code, size_t at){
+	return 1 + operandKinds(code, at).size();
+}
+
+/* Prints the instructions of every function, as
+ *   12: ADD_II r3, r1, k0
+ * r being a register, k the constant pool and @ a place in the code,
+ * with the line of the source where one starts. */
+inline void print(std::ostream& os, const Bytecode& code){
+	const int32_t *instr = code.words();
+	auto line = code.lines.begin();
+	for(size_t f = 0; f < code.funcs.size(); f++){
+		const FuncInfo& func = code.funcs[f];
+		const size_t end = (f + 1 < code.funcs.size() ? code.funcs[f + 1].entry : code.length());
+		os << "function @" << f << ": " << func.params << " parameters, " << func.frame_size << " registers\n";
+		for(size_t at = func.entry; at < end; at += instrLength(code, at)){
+			for(; line != code.lines.end() && (size_t)line->first <= at; ++line){
+				if((size_t)line->first == at) os << "line " << line->second << ":\n";
+			}
+			const std::string kinds = operandKinds(code, at);
+			const uint8_t op = instr[at] & 0xFF;
+			os << '\t' << at << ": " << (op < OP_LENGTH ? instr_to_str[op] : "?");
+			for(size_t k = 0; k < kinds.size(); k++){
+				const int32_t operand = instr[at + 1 + k];
+				os << (k ? ", " : " ");
+				switch(kinds[k]){
+					case 'r': os << 'r' << operand; break;
+					case 'l':
+						if(operand & TOPMOST_BIT32) os << 'r' << (operand ^ TOPMOST_BIT32);
+						else os << 'k' << operand;
+						break;
+					case 'j': case 'f': os << '@' << operand; break;
+					case 't': os << code.types[operand]; break;
+					case 'b': os << 'B' << operand; break;
+					case 'm': os << '"' << code.messages[operand] << '"'; break;
+					default: os << operand; break;
+				}
+			}
+			os << '\n';
+		}
+	}
+}
+
 #endif /* BYTECODE_HPP */
@@ -0,0 +1,754 @@
+#ifndef CGEN_HPP
+#define CGEN_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "globals.hpp"
+#include "ir.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+/* Translates a module (see ir.hpp) to C, for `pcse --emit-c` and `pcse --aot`.
+ *
+ * The result is one self-contained C file: the runtime below (REALs, DATEs, STRINGs,
+ * arrays, input and output, all behaving like Fraction, Date and Env do),
+ * then a C function per IR function, with a variable per value and a label per block.
+ * PHIs are assigned on the edges that lead to them.
+ * Globals that weren't promoted to SSA values are C globals with a flag saying whether
+ * they have been declared. Errors print what `pcse` prints and exit, so the
+ * executable behaves like the interpreter, down to the messages. */
+namespace cgen {
+
+using ir::Op;
+using ir::ValueId;
+
+class CGenError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Runtime {{{
+
+const char *const RUNTIME = R"C(#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct { int32_t top, bot; } pcse_real; /* Fraction<>, not always simplified */
+typedef struct { uint8_t day, month; uint16_t year; } pcse_date;
+typedef struct { const char *p; size_t n; } pcse_str;
+typedef union pcse_value {
+	int64_t i;
+	pcse_real r;
+	char c;
+	bool b;
+	pcse_date d;
+	pcse_str s;
+	union pcse_value *a;
+} pcse_value;
+
+/* Errors */
+
+static inline _Noreturn void pcse_throw(const char *kind, const char *msg){
+	fflush(stdout);
+	fprintf(stderr, "%s: %s\n", kind, msg);
+	exit(EXIT_FAILURE);
+}
+#define PCSE_TYPE(msg) pcse_throw("TypeError", msg)
+#define PCSE_RUNTIME(msg) pcse_throw("RuntimeError", msg)
+/* pcse doesn't catch DateErrors */
+static inline _Noreturn void pcse_date_error(const char *msg){
+	fflush(stdout);
+	fprintf(stderr, "terminate called after throwing an instance of 'DateError'\n  what():  %s\n", msg);
+	abort();
+}
+static inline _Noreturn void pcse_out_of_bounds(int64_t index){
+	char msg[64];
+	snprintf(msg, sizeof(msg), "Out-of-bounds index %" PRId64, index);
+	PCSE_RUNTIME(msg);
+}
+
+/* INTEGERs wrap around */
+
+static inline int64_t pcse_addi(int64_t l, int64_t r){ return (int64_t)((uint64_t)l + (uint64_t)r); }
+static inline int64_t pcse_subi(int64_t l, int64_t r){ return (int64_t)((uint64_t)l - (uint64_t)r); }
+static inline int64_t pcse_muli(int64_t l, int64_t r){ return (int64_t)((uint64_t)l * (uint64_t)r); }
+static inline int64_t pcse_negi(int64_t x){ return (int64_t)(0 - (uint64_t)x); }
+static inline int64_t pcse_divi(int64_t l, int64_t r){
+	if(r == 0) PCSE_RUNTIME("Cannot divide by zero");
+	return r == -1 ? pcse_negi(l) : l / r;
+}
+static inline int64_t pcse_modi(int64_t l, int64_t r){
+	if(r == 0) PCSE_RUNTIME("Cannot divide by zero");
+	return r == -1 ? 0 : l % r;
+}
+
+/* REALs, with Fraction's 32-bit arithmetic */
+
+static inline int32_t pcse_wrap32(int64_t x){ return (int32_t)(uint32_t)(uint64_t)x; }
+static inline int64_t pcse_gcd(int64_t a, int64_t b){
+	uint64_t x = a < 0 ? 0 - (uint64_t)a : (uint64_t)a, y = b < 0 ? 0 - (uint64_t)b : (uint64_t)b;
+	while(y != 0){
+		const uint64_t t = x % y;
+		x = y;
+		y = t;
+	}
+	return (int64_t)x;
+}
+static inline pcse_real pcse_real_make(int32_t top, int32_t bot){
+	if(bot == 0) PCSE_RUNTIME("Cannot divide by zero");
+	const int32_t g = (int32_t)pcse_gcd(top, bot);
+	return (pcse_real){ top / g, bot / g };
+}
+static inline pcse_real pcse_itor(int64_t x){ return (pcse_real){ pcse_wrap32(x), 1 }; }
+static inline pcse_real pcse_negr(pcse_real x){ return (pcse_real){ pcse_wrap32(-(int64_t)x.top), x.bot }; }
+static inline pcse_real pcse_mulr(pcse_real l, pcse_real r){
+	const int32_t x = (int32_t)pcse_gcd(l.top, r.bot), y = (int32_t)pcse_gcd(r.top, l.bot);
+	return (pcse_real){ pcse_wrap32((int64_t)(l.top / x) * (r.top / y)), pcse_wrap32((int64_t)(l.bot / y) * (r.bot / x)) };
+}
+static inline pcse_real pcse_divr(pcse_real l, pcse_real r){
+	if(r.top == 0) PCSE_RUNTIME("Cannot divide by zero");
+	return pcse_mulr(l, (pcse_real){ r.bot, r.top });
+}
+static inline pcse_real pcse_addr(pcse_real l, pcse_real r){
+	const int64_t top = (int64_t)l.top * r.bot + (int64_t)r.top * l.bot, bot = (int64_t)r.bot * l.bot;
+	const int64_t g = pcse_gcd(top, bot);
+	return (pcse_real){ pcse_wrap32(top / g), pcse_wrap32(bot / g) };
+}
+static inline pcse_real pcse_subr(pcse_real l, pcse_real r){ return pcse_addr(l, pcse_negr(r)); }
+static inline pcse_real pcse_addri(pcse_real l, int64_t r){
+	return (pcse_real){ pcse_wrap32(pcse_addi(l.top, pcse_muli(r, l.bot))), l.bot };
+}
+static inline pcse_real pcse_subri(pcse_real l, int64_t r){
+	return (pcse_real){ pcse_wrap32(pcse_subi(l.top, pcse_muli(r, l.bot))), l.bot };
+}
+static inline pcse_real pcse_mulri(pcse_real l, int64_t r){
+	const int32_t g = pcse_wrap32(pcse_gcd(r, l.bot));
+	return (pcse_real){ pcse_wrap32(pcse_muli(l.top, r / g)), l.bot / g };
+}
+static inline bool pcse_eqr(pcse_real l, pcse_real r){ return l.top == r.top && l.bot == r.bot; }
+static inline bool pcse_ltr(pcse_real l, pcse_real r){ return (int64_t)l.top * r.bot < (int64_t)r.top * l.bot; }
+static inline bool pcse_eqri(pcse_real l, int64_t r){ return l.top == r && l.bot == 1; }
+static inline bool pcse_ltri(pcse_real l, int64_t r){ return (int32_t)(l.top / l.bot) < r; }
+
+/* The rest */
+
+static inline bool pcse_eqd(pcse_date l, pcse_date r){ return l.day == r.day && l.month == r.month && l.year == r.year; }
+static inline int pcse_cmps(pcse_str l, pcse_str r){
+	const int res = memcmp(l.p, r.p, l.n < r.n ? l.n : r.n);
+	if(res != 0) return res;
+	return l.n < r.n ? -1 : l.n > r.n;
+}
+
+/* Memory for the arrays of a call, freed when it returns (see Env::Region) */
+typedef struct { size_t chunk, used; } pcse_mark;
+static struct { pcse_value *mem; size_t size; } *pcse_chunks;
+static size_t pcse_nchunks, pcse_chunk, pcse_used;
+static inline pcse_mark pcse_region_mark(void){ return (pcse_mark){ pcse_chunk, pcse_used }; }
+static inline void pcse_region_release(pcse_mark m){
+	pcse_chunk = m.chunk;
+	pcse_used = m.used;
+}
+static inline pcse_value *pcse_region_alloc(size_t n){
+	for(; pcse_chunk < pcse_nchunks; pcse_chunk++, pcse_used = 0){
+		if(pcse_chunks[pcse_chunk].size - pcse_used >= n){
+			pcse_value *res = pcse_chunks[pcse_chunk].mem + pcse_used;
+			pcse_used += n;
+			return res;
+		}
+	}
+	size_t size = n > 1024 ? n : 1024;
+	if(pcse_nchunks != 0 && 2*pcse_chunks[pcse_nchunks - 1].size > size) size = 2*pcse_chunks[pcse_nchunks - 1].size;
+	pcse_chunks = realloc(pcse_chunks, (pcse_nchunks + 1) * sizeof(*pcse_chunks));
+	pcse_value *mem = malloc(size * sizeof(pcse_value));
+	if(pcse_chunks == NULL || mem == NULL) PCSE_RUNTIME("Out of memory");
+	pcse_chunks[pcse_nchunks].mem = mem;
+	pcse_chunks[pcse_nchunks].size = size;
+	pcse_chunk = pcse_nchunks++;
+	pcse_used = n;
+	return mem;
+}
+static inline pcse_value *pcse_newarr(size_t n){
+	pcse_value *res = calloc(n, sizeof(pcse_value));
+	if(res == NULL) PCSE_RUNTIME("Out of memory");
+	return res;
+}
+static inline pcse_value *pcse_copynew(const pcse_value *from, size_t n, bool local){
+	pcse_value *res = local ? pcse_region_alloc(n) : pcse_newarr(n);
+	memcpy(res, from, n * sizeof(pcse_value));
+	return res;
+}
+static inline void pcse_copyarr(pcse_value *to, const pcse_value *from, size_t n){
+	if(to != from) memcpy(to, from, n * sizeof(pcse_value));
+}
+
+/* Output */
+
+static inline void pcse_out_i(int64_t x){ printf("%" PRId64, x); }
+static inline void pcse_out_r(pcse_real x){ printf("%g", (double)x.top / (double)x.bot); }
+static inline void pcse_out_c(char x){ putchar(x); }
+static inline void pcse_out_b(bool x){ fputs(x ? "TRUE" : "FALSE", stdout); }
+static inline void pcse_out_d(pcse_date x){ printf("%d/%d/%d", x.day, x.month, x.year); }
+static inline void pcse_out_s(pcse_str x){ fwrite(x.p, 1, x.n, stdout); }
+
+/* Input, a line per value like std::getline. The line is NULL if nothing could be read. */
+
+static inline char *pcse_line(size_t *len){
+	static char *buf = NULL;
+	static size_t cap = 0;
+	fflush(stdout);
+	size_t n = 0;
+	int c;
+	while((c = getchar()) != EOF){
+		if(n + 1 >= cap){
+			cap = cap ? 2 * cap : 128;
+			buf = realloc(buf, cap);
+			if(buf == NULL) PCSE_RUNTIME("Out of memory");
+		}
+		if(c == '\n') break;
+		buf[n++] = (char)c;
+	}
+	*len = n;
+	if(c == EOF && n == 0) return NULL;
+	buf[n] = '\0';
+	return buf;
+}
+/* Like std::from_chars: the digits at `s`, returns where they end and leaves `res` as it was if there are none */
+static inline const char *pcse_digits(const char *s, const char *end, uint64_t max, uint64_t *res){
+	const char *p = s;
+	uint64_t val = 0;
+	bool overflow = false;
+	for(; p != end && *p >= '0' && *p <= '9'; p++){
+		if(val > (max - (uint64_t)(*p - '0')) / 10) overflow = true;
+		val = val * 10 + (uint64_t)(*p - '0');
+	}
+	if(p != s && !overflow) *res = val;
+	return p;
+}
+static inline int64_t pcse_in_i(void){
+	size_t len;
+	const char *s = pcse_line(&len);
+	if(s == NULL) PCSE_RUNTIME("User did not input INTEGER correctly");
+	const char *end = s + len, *p = s;
+	const bool neg = p != end && *p == '-';
+	uint64_t val = 0;
+	if(neg) p++;
+	const char *digits = p;
+	p = pcse_digits(p, end, neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX, &val);
+	if(p == digits) p = s;
+	if(p != end) PCSE_RUNTIME("User did not input INTEGER correctly");
+	return neg ? (int64_t)(0 - val) : (int64_t)val;
+}
+static inline pcse_real pcse_in_r(void){
+	size_t len;
+	const char *s = pcse_line(&len);
+	bool dot = true;
+	for(size_t i = 0; i < len; i++){
+		if((s[i] >= '0' && s[i] <= '9') || (dot && s[i] == '.')) dot &= (s[i] != '.');
+		else PCSE_RUNTIME("User did not input REAL correctly");
+	}
+	int32_t top = 0, bot = 1, mul = 1;
+	for(size_t i = len; i-- > 0;){
+		if(s[i] == '.'){
+			bot = mul;
+		} else {
+			top = pcse_wrap32((int64_t)top + (int64_t)(s[i] - '0') * mul);
+			mul = pcse_wrap32((int64_t)mul * 10);
+		}
+	}
+	return pcse_real_make(top, bot);
+}
+static inline bool pcse_in_b(void){
+	size_t len;
+	const char *s = pcse_line(&len);
+	if(s != NULL && strcmp(s, "TRUE") == 0) return true;
+	if(s != NULL && strcmp(s, "FALSE") == 0) return false;
+	PCSE_RUNTIME("User did not input BOOLEAN correctly");
+}
+static inline char pcse_in_c(void){
+	size_t len;
+	const char *s = pcse_line(&len);
+	if(s == NULL) PCSE_RUNTIME("End of input reached");
+	return s[0];
+}
+static inline pcse_date pcse_in_d(void){
+	size_t len;
+	const char *s = pcse_line(&len);
+	if(s == NULL) PCSE_RUNTIME("User did not input DATE correctly");
+	const char *end = s + len, *p = s;
+	uint64_t day = 0, month = 0, year = 0;
+	p = pcse_digits(p, end, UINT16_MAX, &day);
+	if(p == end || *p != '/') PCSE_RUNTIME("User did not input DATE correctly");
+	p = pcse_digits(p + 1, end, UINT16_MAX, &month);
+	if(p == end || *p != '/') PCSE_RUNTIME("User did not input DATE correctly");
+	p = pcse_digits(p + 1, end, UINT16_MAX, &year);
+	if(p != end) PCSE_RUNTIME("User did not input DATE correctly");
+	const pcse_date d = { (uint8_t)day, (uint8_t)month, (uint16_t)year };
+	if(d.month > 12) pcse_date_error("Month value too high");
+	int max_day = 30;
+	switch(d.month){
+		case 1: case 3: case 5: case 7: case 8: case 10: case 12: max_day = 31; break;
+		case 2: max_day = (d.year % 4 == 0 && !(d.year % 100 == 0 && d.year % 400 == 0) ? 29 : 28); break;
+	}
+	if(d.day > max_day) pcse_date_error("Day value too high");
+	return d;
+}
+static inline pcse_str pcse_in_s(void){
+	size_t len;
+	const char *s = pcse_line(&len);
+	if(s == NULL) PCSE_RUNTIME("End of input reached");
+	char *copy = malloc(len + 1);
+	if(copy == NULL) PCSE_RUNTIME("Out of memory");
+	memcpy(copy, s, len + 1);
+	return (pcse_str){ copy, len };
+}
+
+/* Builtin functions */
+
+static inline uint64_t pcse_random(void){
+	static uint64_t state = 0;
+	if(state == 0) state = ((uint64_t)time(NULL) << 20) ^ (uint64_t)clock() ^ (uint64_t)(uintptr_t)&state ^ 1;
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * UINT64_C(0x2545F4914F6CDD1D);
+}
+static inline pcse_real pcse_RND(void){ return pcse_real_make((int32_t)(pcse_random() % 65536), 65535); }
+static inline int64_t pcse_RANDOMBETWEEN(int64_t min, int64_t max){
+	const uint64_t range = (uint64_t)max - (uint64_t)min + 1;
+	return (int64_t)((uint64_t)min + (range == 0 ? pcse_random() : pcse_random() % range));
+}
+static inline int64_t pcse_INT(pcse_real x){ return x.top / x.bot; }
+)C";
+
+// }}}
+
+/* Writes the C for a module */
+class Emitter {
+	std::ostream& os;
+	const ir::Module& mod;
+	const ir::Function *f = nullptr;
+	std::vector<bool> used; /* values of `f` something reads, the others get no variable */
+	std::set<int64_t> hidden; /* globals with a HIDEG, which counts in hiddenCount(id) */
+
+	static std::string ctype(const EType& type){
+		if(type.is_array) return "pcse_value *";
+		switch(type.primtype){
+			case Primitive::INTEGER: return "int64_t";
+			case Primitive::REAL: return "pcse_real";
+			case Primitive::CHAR: return "char";
+			case Primitive::BOOLEAN: return "bool";
+			case Primitive::DATE: return "pcse_date";
+			case Primitive::STRING: return "pcse_str";
+			default: return "void";
+		}
+	}
+	/* Its member of pcse_value, and its suffix in the names of the runtime's functions */
+	static char field(const EType& type){
+		if(type.is_array) return 'a';
+		switch(type.primtype){
+			case Primitive::INTEGER: return 'i';
+			case Primitive::REAL: return 'r';
+			case Primitive::CHAR: return 'c';
+			case Primitive::BOOLEAN: return 'b';
+			case Primitive::DATE: return 'd';
+			case Primitive::STRING: return 's';
+			default: throw CGenError("A value of type " + type.to_str());
+		}
+	}
+	static std::string quote(std::string_view s){
+		std::string res = "\"";
+		for(const char ch : s){
+			const unsigned char c = ch;
+			if(c == '"' || c == '\\'){
+				res += '\\';
+				res += ch;
+			} else if(c >= 32 && c < 127 && c != '?'){
+				res += ch;
+			} else {
+				// Octal escapes never take more than 3 digits.
+				char buf[5];
+				std::snprintf(buf, sizeof(buf), "\\%03o", c);
+				res += buf;
+			}
+		}
+		return res + '"';
+	}
+	static std::string literal(const EValue& val, const EType& type){
+		if(type.is_array) return "((pcse_value *)0)";
+		switch(type.primtype){
+			case Primitive::INTEGER:
+				if(val.i64 == std::numeric_limits<int64_t>::min()) return "INT64_MIN";
+				return "INT64_C(" + std::to_string(val.i64) + ")";
+			case Primitive::REAL:
+				{
+					int32_t parts[2];
+					static_assert(sizeof(parts) == sizeof(val.frac));
+					std::memcpy(parts, &val.frac, sizeof(parts));
+					return "((pcse_real){ " + std::to_string(parts[0]) + ", " + std::to_string(parts[1]) + " })";
+				}
+			case Primitive::CHAR: return "((char)" + std::to_string((int)val.c) + ")";
+			case Primitive::BOOLEAN: return val.b ? "true" : "false";
+			case Primitive::DATE:
+				return "((pcse_date){ " + std::to_string(val.date.day) + ", " + std::to_string(val.date.month)
+					+ ", " + std::to_string(val.date.year) + " })";
+			case Primitive::STRING:
+				return "((pcse_str){ " + quote(val.str) + ", " + std::to_string(val.str.size()) + " })";
+			default: throw CGenError("A constant of type " + type.to_str());
+		}
+	}
+	static std::string zero(const EType& type){
+		EValue val;
+		std::memset(&val, 0, sizeof(val));
+		return literal(val, type);
+	}
+	static bool isValue(const ir::Inst& inst){
+		return inst.type != Primitive::INVALID && !isAnyOf(inst.op, Op::CONST, Op::PARAM, Op::UNDEF);
+	}
+	std::string name(ValueId id) const {
+		const ir::Inst& inst = f->insts[id];
+		switch(inst.op){
+			case Op::CONST: return literal(inst.imm, inst.type);
+			case Op::UNDEF: return zero(inst.type);
+			case Op::PARAM: return "a" + std::to_string(inst.a);
+			default: return "v" + std::to_string(id);
+		}
+	}
+	std::string arg(const ir::Inst& inst, size_t i) const { return name(inst.args[i]); }
+	const EType& argType(const ir::Inst& inst, size_t i) const { return f->insts[inst.args[i]].type; }
+	static std::string funcName(size_t index){ return "pcse_f" + std::to_string(index); }
+	static std::string global(int64_t id){ return "pcse_g" + std::to_string(id); }
+	static std::string declared(int64_t id){ return "pcse_gd" + std::to_string(id); }
+	static std::string hiddenCount(int64_t id){ return "pcse_gh" + std::to_string(id); }
+	/* Whether the global can be used, like Env::value */
+	std::string visible(int64_t id) const {
+		return hidden.count(id) ? '(' + declared(id) + " && " + hiddenCount(id) + " == 0)" : declared(id);
+	}
+	std::string call(const ir::Inst& inst, const std::string& fn) const {
+		std::string res = fn + '(';
+		for(size_t i = 0; i < inst.args.size(); i++) res += (i ? ", " : "") + arg(inst, i);
+		return res + ')';
+	}
+	static std::string builtin(int64_t ptr){
+		for(const auto& [name, func] : builtin::global_funcs){
+			if(reinterpret_cast<intptr_t>(func.func_loc) == ptr) return "pcse_" + std::string(name);
+		}
+		throw CGenError("An unknown builtin function");
+	}
+	static const char *cOp(TokenType op){
+		switch(op){
+			case TokenType::EQ: return "==";
+			case TokenType::LT_GT: return "!=";
+			case TokenType::LT: return "<";
+			case TokenType::GT: return ">";
+			case TokenType::LT_EQ: return "<=";
+			case TokenType::GT_EQ: return ">=";
+			default: throw CGenError("Invalid comparison");
+		}
+	}
+	/* The comparison `op` of `l` and `r`, given `eq(l, r)` and `lt(l, r)`, like Fraction's operators */
+	static std::string compare(TokenType op, const std::string& eq, const std::string& lt){
+		switch(op){
+			case TokenType::EQ: return eq;
+			case TokenType::LT_GT: return "!" + eq;
+			case TokenType::LT: return lt;
+			case TokenType::GT_EQ: return "!" + lt;
+			case TokenType::LT_EQ: return "(" + eq + " || " + lt + ")";
+			case TokenType::GT: return "!(" + eq + " || " + lt + ")";
+			default: throw CGenError("Invalid comparison");
+		}
+	}
+	/* Gives the PHIs of `to` their values for the edge from `from`, all at once */
+	void moves(ir::BlockId from, ir::BlockId to, const char *indent){
+		const size_t pred = f->predIndex(to, from);
+		std::vector<ValueId> phis;
+		for(const ValueId id : f->blocks[to].insts){
+			if(f->insts[id].op != Op::PHI) break;
+			if(used[id]) phis.push_back(id);
+		}
+		if(phis.empty()) return;
+		os << indent << "{\n";
+		for(size_t i = 0; i < phis.size(); i++){
+			const ir::Inst& phi = f->insts[phis[i]];
+			os << indent << '\t' << ctype(phi.type) << " t" << i << " = " << arg(phi, pred) << ";\n";
+		}
+		for(size_t i = 0; i < phis.size(); i++) os << indent << "\tv" << phis[i] << " = t" << i << ";\n";
+		os << indent << "}\n";
+	}
+	std::string signature(size_t index) const {
+		const ir::Function& fn = mod.funcs[index];
+		std::string res = "static " + ctype(fn.ret_type) + ' ' + funcName(index) + '(';
+		for(size_t i = 0; i < fn.params.size(); i++){
+			res += (i ? ", " : "") + ctype(fn.params[i]) + " a" + std::to_string(i);
+		}
+		if(fn.params.empty()) res += "void";
+		return res + ')';
+	}
+	void inst(ValueId id, const std::string& mark){
+		const ir::Inst& inst = f->insts[id];
+		const std::string v = "v" + std::to_string(id);
+		const auto set = [&](const std::string& expr){
+			if(used[id]) os << '\t' << v << " = " << expr << ";\n";
+			else os << "\t(void)(" << expr << ");\n";
+		};
+		const auto binary = [&](const char *fn){ set(std::string(fn) + '(' + arg(inst, 0) + ", " + arg(inst, 1) + ')'); };
+		const auto unary = [&](const char *fn){ set(std::string(fn) + '(' + arg(inst, 0) + ')'); };
+		const auto infix = [&](const std::string& op){ set(arg(inst, 0) + ' ' + op + ' ' + arg(inst, 1)); };
+		const TokenType cmp = static_cast<TokenType>(inst.a);
+		switch(inst.op){
+			case Op::CONST: case Op::UNDEF: case Op::PARAM: case Op::PHI: break;
+			case Op::SELECT: set(arg(inst, 0) + " ? " + arg(inst, 1) + " : " + arg(inst, 2)); break;
+			case Op::ADDI: binary("pcse_addi"); break;
+			case Op::SUBI: binary("pcse_subi"); break;
+			case Op::MULI: binary("pcse_muli"); break;
+			case Op::DIVI: binary("pcse_divi"); break;
+			case Op::MODI: binary("pcse_modi"); break;
+			case Op::NEGI: unary("pcse_negi"); break;
+			case Op::ADDR: binary("pcse_addr"); break;
+			case Op::SUBR: binary("pcse_subr"); break;
+			case Op::MULR: binary("pcse_mulr"); break;
+			case Op::DIVR: binary("pcse_divr"); break;
+			case Op::NEGR: unary("pcse_negr"); break;
+			case Op::ADDRI: binary("pcse_addri"); break;
+			case Op::SUBRI: binary("pcse_subri"); break;
+			case Op::MULRI: binary("pcse_mulri"); break;
+			case Op::ITOR: unary("pcse_itor"); break;
+			case Op::CMPI: case Op::CMPC: case Op::CMPB: infix(cOp(cmp)); break;
+			case Op::CMPS: set("pcse_cmps(" + arg(inst, 0) + ", " + arg(inst, 1) + ") " + cOp(cmp) + " 0"); break;
+			case Op::CMPR: case Op::CMPRI:
+				{
+					const std::string args = '(' + arg(inst, 0) + ", " + arg(inst, 1) + ')';
+					const std::string suffix = inst.op == Op::CMPR ? "r" : "ri";
+					set(compare(cmp, "pcse_eq" + suffix + args, "pcse_lt" + suffix + args));
+				}
+				break;
+			case Op::CMPD: binary("pcse_eqd"); break; /* like ir::evalOp */
+			case Op::AND: infix("&&"); break;
+			case Op::OR: infix("||"); break;
+			case Op::NOT: set("!" + arg(inst, 0)); break;
+			case Op::LOADG:
+				os << "\tif(!" << visible(inst.a) << ") PCSE_RUNTIME(\"Undefined variable\");\n";
+				set(global(inst.a) + '.' + field(inst.type));
+				break;
+			case Op::STOREG:
+				os << "\tif(!" << visible(inst.a) << ") PCSE_RUNTIME(\"Undefined variable\");\n";
+				os << '\t' << global(inst.a) << '.' << field(argType(inst, 0)) << " = " << arg(inst, 0) << ";\n";
+				break;
+			case Op::DECLAREG:
+				os << "\tif(" << declared(inst.a) << ") PCSE_RUNTIME(\"Cannot initialize already-initialized variable\");\n";
+				os << '\t' << declared(inst.a) << " = true;\n";
+				// Arrays get new storage, like Env::initVar gives them.
+				os << '\t' << global(inst.a) << '.' << field(inst.type) << " = "
+					<< (inst.type.is_array ? "pcse_newarr(" + std::to_string(inst.type.size()) + ')'
+						: inst.args.empty() ? zero(inst.type) : arg(inst, 0)) << ";\n";
+				break;
+			case Op::LOADE: set(arg(inst, 0) + '[' + arg(inst, 1) + "]." + field(inst.type)); break;
+			case Op::STOREE:
+				os << '\t' << arg(inst, 0) << '[' << arg(inst, 1) << "]." << field(argType(inst, 2)) << " = " << arg(inst, 2) << ";\n";
+				break;
+			case Op::CHECK:
+				{
+					const std::string index = arg(inst, 0);
+					std::string cond;
+					if(inst.imm.i64 & 1) cond = index + " < INT64_C(" + std::to_string(inst.a) + ')';
+					if(inst.imm.i64 & 2) cond += (cond.empty() ? "" : " || ") + index + " > INT64_C(" + std::to_string(inst.b) + ')';
+					if(!cond.empty()) os << "\tif(" << cond << ") pcse_out_of_bounds(" << index << ");\n";
+				}
+				break;
+			case Op::NEWARR: set("pcse_newarr(" + std::to_string(inst.a) + ')'); break;
+			case Op::COPYARR:
+				os << "\tpcse_copyarr(" << arg(inst, 0) << ", " << arg(inst, 1) << ", " << inst.a << ");\n";
+				break;
+			case Op::COPYNEW:
+				set("pcse_copynew(" + arg(inst, 0) + ", " + std::to_string(inst.a) + ", " + (f->local_arrays ? "true" : "false") + ')');
+				break;
+			case Op::INPUT:
+				if(inst.type.is_array) os << "\tPCSE_TYPE(\"Cannot input array\");\n";
+				else if(inst.type == Primitive::INVALID) os << "\tPCSE_TYPE(\"Cannot input an undefined variable\");\n";
+				else set(std::string("pcse_in_") + field(inst.type) + "()");
+				break;
+			case Op::OUTPUT:
+				if(argType(inst, 0).is_array) os << "\tPCSE_TYPE(\"Cannot output array\");\n";
+				else os << "\tpcse_out_" << field(argType(inst, 0)) << '(' << arg(inst, 0) << ");\n";
+				break;
+			case Op::NEWLINE: os << "\tputchar('\\n');\n"; break;
+			case Op::CALL:
+			case Op::CALLB:
+				{
+					const std::string c = call(inst, inst.op == Op::CALL ? funcName(inst.a) : builtin(inst.a));
+					if(inst.type == Primitive::INVALID) os << '\t' << c << ";\n";
+					else set(c);
+				}
+				break;
+			case Op::CHECKDEF:
+				os << "\tif(!pcse_defined[" << inst.a << "]) PCSE_RUNTIME(\"Cannot call non-function\");\n";
+				break;
+			case Op::DEFFUNC: os << "\tpcse_defined[" << inst.a << "] = true;\n"; break;
+			case Op::DEFINED: set("pcse_defined[" + std::to_string(inst.a) + "]"); break;
+			case Op::HIDEG: os << '\t' << hiddenCount(inst.a) << "++;\n"; break;
+			case Op::UNHIDEG: os << '\t' << hiddenCount(inst.a) << "--;\n"; break;
+			case Op::BR:
+				moves(inst.block, inst.targets[0], "\t");
+				os << "\tgoto b" << inst.targets[0] << ";\n";
+				break;
+			case Op::CBR:
+				os << "\tif(" << arg(inst, 0) << "){\n";
+				moves(inst.block, inst.targets[0], "\t\t");
+				os << "\t\tgoto b" << inst.targets[0] << ";\n\t} else {\n";
+				moves(inst.block, inst.targets[1], "\t\t");
+				os << "\t\tgoto b" << inst.targets[1] << ";\n\t}\n";
+				break;
+			case Op::RET:
+				// Nothing points to the parameters anymore, see the escape analysis in optimizer.hpp.
+				if(!mark.empty()) os << "\tpcse_region_release(" << mark << ");\n";
+				os << "\treturn" << (inst.args.empty() ? "" : ' ' + arg(inst, 0)) << ";\n";
+				break;
+			case Op::THROW:
+				os << '\t' << (inst.a == 0 ? "PCSE_TYPE(" : "PCSE_RUNTIME(") << quote(f->messages[inst.b]) << ");\n";
+				break;
+		}
+	}
+	void function(size_t index){
+		f = &mod.funcs[index];
+		const ir::Dominators dom(*f);
+		os << "\n/* " << f->name << " */\n" << signature(index) << "{\n";
+		const std::string mark = f->local_arrays ? "mark" : "";
+		if(!mark.empty()) os << "\tconst pcse_mark mark = pcse_region_mark();\n";
+		// What the other instructions read, and the PHIs they read read
+		used.assign(f->insts.size(), false);
+		std::vector<ValueId> work;
+		const auto use = [&](const ir::Inst& inst){
+			for(const ValueId arg : inst.args){
+				if(used[arg]) continue;
+				used[arg] = true;
+				if(f->insts[arg].op == Op::PHI) work.push_back(arg);
+			}
+		};
+		for(const ir::BlockId b : dom.rpo){
+			for(const ValueId id : f->blocks[b].insts){
+				if(f->insts[id].op != Op::PHI) use(f->insts[id]);
+			}
+		}
+		while(!work.empty()){
+			const ValueId phi = work.back();
+			work.pop_back();
+			use(f->insts[phi]);
+		}
+		std::vector<bool> read(f->params.size(), false);
+		for(const ir::BlockId b : dom.rpo){
+			for(const ValueId id : f->blocks[b].insts){
+				if(used[id] && isValue(f->insts[id])) os << '\t' << ctype(f->insts[id].type) << " v" << id << ";\n";
+				if(used[id] && f->insts[id].op == Op::PARAM) read[f->insts[id].a] = true;
+			}
+		}
+		for(size_t i = 0; i < read.size(); i++){
+			if(!read[i]) os << "\t(void)a" << i << ";\n";
+		}
+		for(const ir::BlockId b : dom.rpo){
+			if(b != 0) os << "b" << b << ":;\n";
+			for(const ValueId id : f->blocks[b].insts) inst(id, mark);
+		}
+		os << "}\n";
+	}
+	/* Every global variable id the module uses, and its type */
+	std::map<int64_t, EType> globals() const {
+		std::map<int64_t, EType> res;
+		for(const ir::Function& fn : mod.funcs){
+			for(const ir::Inst& inst : fn.insts){
+				if(isAnyOf(inst.op, Op::LOADG, Op::DECLAREG)) res.emplace(inst.a, inst.type);
+				if(inst.op == Op::STOREG) res.emplace(inst.a, fn.insts[inst.args[0]].type);
+			}
+		}
+		return res;
+	}
+public:
+	Emitter(std::ostream& os_, const ir::Module& mod_) : os(os_), mod(mod_) {}
+	void run(){
+		os << "/* Generated by pcse --emit-c */\n" << RUNTIME << '\n';
+		for(const ir::Function& fn : mod.funcs){
+			for(const ir::Inst& inst : fn.insts){
+				if(inst.op == Op::HIDEG) hidden.insert(inst.a);
+			}
+		}
+		for(const auto& [id, type] : globals()){
+			os << "static pcse_value " << global(id) << "; /* " << type << " */\n";
+			os << "static bool " << declared(id) << ";\n";
+		}
+		for(const int64_t id : hidden) os << "static int64_t " << hiddenCount(id) << ";\n";
+		if(mod.funcs.size() > 1) os << "static bool pcse_defined[" << mod.funcs.size() << "];\n";
+		os << '\n';
+		// Functions nothing calls (a definition replaced before any call) are left out
+		std::vector<bool> called(mod.funcs.size(), false);
+		called[0] = true;
+		for(const ir::Function& fn : mod.funcs){
+			for(const ir::Block& block : fn.blocks){
+				for(const ValueId id : block.insts){
+					if(fn.insts[id].op == Op::CALL) called[fn.insts[id].a] = true;
+				}
+			}
+		}
+		for(size_t i = 0; i < mod.funcs.size(); i++){
+			if(called[i]) os << signature(i) << ";\n";
+		}
+		for(size_t i = 0; i < mod.funcs.size(); i++){
+			if(called[i]) function(i);
+		}
+		os << "\nint main(void){\n\t" << funcName(0) << "();\n\tfflush(stdout);\n\treturn 0;\n}\n";
+	}
+};
+
+inline void emit(std::ostream& os, const ir::Module& mod){
+	Emitter(os, mod).run();
+}
+
+/* Compiles C `source` to the executable `output` with the system's C compiler ($CC, or cc). */
+inline void build(const std::string& source, const std::string& output, const std::string& flags = "-O2"){
+	const auto shellQuote = [](const std::string& s){
+		std::string res = "'";
+		for(const char c : s){
+			if(c == '\'') res += "'\\''";
+			else res += c;
+		}
+		return res + '\'';
+	};
+#if defined(__unix__) || defined(__APPLE__)
+	char path[] = "/tmp/pcse-XXXXXX.c";
+	const int fd = mkstemps(path, 2);
+	if(fd < 0) throw CGenError("Cannot create a temporary file");
+	close(fd);
+#else
+	char path[L_tmpnam + 2];
+	if(std::tmpnam(path) == nullptr) throw CGenError("Cannot create a temporary file");
+	std::strcat(path, ".c");
+#endif
+	{
+		std::ofstream out(path);
+		out << source;
+		if(!out) {
+			std::remove(path);
+			throw CGenError(std::string("Cannot write ") + path);
+		}
+	}
+	const char *cc = std::getenv("CC");
+	const std::string cmd = std::string(cc != nullptr && *cc ? cc : "cc") + ' ' + flags
+		+ " -o " + shellQuote(output) + ' ' + shellQuote(path);
+	const int status = std::system(cmd.c_str());
+	std::remove(path);
+	if(status != 0) throw CGenError("The C compiler failed: " + cmd);
+}
+
+} /* namespace cgen */
+
+#endif /* CGEN_HPP */
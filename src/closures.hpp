@@ -0,0 +1,508 @@
+#ifndef CLOSURES_HPP
+#define CLOSURES_HPP
+
+#include <cstring>
+#include <deque>
+#include "environment.hpp"
+#include "ir.hpp"
+
+/* Runs a module (see ir.hpp) as a tree of closures, built once before running:
+ * every instruction becomes a Node holding the function that computes it, picked for
+ * its opcode, its comparison and where its operands come from, so running it
+ * is one indirect call per node with nothing left to decide.
+ *
+ * An operand is a register of the frame, a constant, or another node, computed in place:
+ * a value used once, by the next instructions of its block, is nested in its user
+ * when nothing between them can throw or have an effect, so expressions become trees
+ * again and only the values that have to be kept somewhere go through registers.
+ * Blocks are lists of nodes, ending in a jump that moves the values of the PHIs.
+ *
+ * Frames are allocated in Env::region, so calls don't allocate either.
+ * Globals live in `env`, like for the interpreter and ir::Machine. */
+namespace closures {
+
+using ir::Op;
+using ir::ValueId;
+
+class Machine;
+struct Node;
+
+using Fn = EValue (*)(const Node& n, EValue *regs);
+
+/* Where an operand comes from */
+enum Kind : uint8_t { REG, IMM, NODE };
+
+struct Operand {
+	Kind kind = IMM;
+	int32_t reg = 0;
+	EValue imm = (int64_t)0;
+	const Node *node = nullptr;
+};
+
+struct Node {
+	Fn fn = nullptr;
+	Operand ops[3];
+	std::vector<Operand> args; /* CALL and CALLB */
+	int32_t dst = 0; /* register of the result */
+	int64_t a = 0, b = 0;
+	EValue imm = (int64_t)0;
+	EType type; /* of the result, or of the operand of OUTPUT */
+	Machine *m = nullptr;
+	const ir::Inst *inst = nullptr;
+};
+
+template<Kind K>
+inline EValue get(const Operand& o, EValue *regs){
+	if constexpr (K == REG) return regs[o.reg];
+	else if constexpr (K == IMM) return o.imm;
+	else return o.node->fn(*o.node, regs);
+}
+inline EValue get(const Operand& o, EValue *regs){
+	if(o.kind == REG) return regs[o.reg];
+	if(o.kind == IMM) return o.imm;
+	return o.node->fn(*o.node, regs);
+}
+
+// Specialized nodes {{{
+
+/* F::f(node, operands...) computes the value, the templates fetch the operands. */
+template<typename F, Kind A>
+EValue unary(const Node& n, EValue *regs){
+	return F::f(n, get<A>(n.ops[0], regs));
+}
+template<typename F, Kind A, Kind B>
+EValue binary(const Node& n, EValue *regs){
+	const EValue l = get<A>(n.ops[0], regs);
+	return F::f(n, l, get<B>(n.ops[1], regs));
+}
+template<typename F>
+Fn unaryFn(const Node& n){
+	static constexpr Fn table[] = { unary<F, REG>, unary<F, IMM>, unary<F, NODE> };
+	return table[n.ops[0].kind];
+}
+template<typename F>
+Fn binaryFn(const Node& n){
+	static constexpr Fn table[3][3] = {
+		{ binary<F, REG, REG>, binary<F, REG, IMM>, binary<F, REG, NODE> },
+		{ binary<F, IMM, REG>, binary<F, IMM, IMM>, binary<F, IMM, NODE> },
+		{ binary<F, NODE, REG>, binary<F, NODE, IMM>, binary<F, NODE, NODE> },
+	};
+	return table[n.ops[0].kind][n.ops[1].kind];
+}
+
+#define UNARY(name, expr) struct name { \
+	static inline EValue f([[maybe_unused]] const Node& n, EValue v){ return expr; } };
+#define BINARY(name, expr) struct name { \
+	static inline EValue f([[maybe_unused]] const Node& n, EValue l, EValue r){ return expr; } };
+inline EValue divide(int64_t l, int64_t r, bool mod){
+	if(r == 0) throw RuntimeError("Cannot divide by zero");
+	if(r == -1) return mod ? (int64_t)0 : (int64_t)-(uint64_t)l;
+	return mod ? l % r : l / r;
+}
+inline EValue check(const Node& n, int64_t index){
+	if(((n.imm.i64 & 1) && index < n.a) || ((n.imm.i64 & 2) && index > n.b)){
+		throw RuntimeError("Out-of-bounds index " + std::to_string(index));
+	}
+	return (int64_t)0;
+}
+BINARY(AddI, (int64_t)((uint64_t)l.i64 + (uint64_t)r.i64))
+BINARY(SubI, (int64_t)((uint64_t)l.i64 - (uint64_t)r.i64))
+BINARY(MulI, (int64_t)((uint64_t)l.i64 * (uint64_t)r.i64))
+BINARY(DivI, divide(l.i64, r.i64, false))
+BINARY(ModI, divide(l.i64, r.i64, true))
+BINARY(And, l.b && r.b)
+BINARY(Or, l.b || r.b)
+BINARY(LoadE, l.arr[r.i64])
+UNARY(NegI, (int64_t)-(uint64_t)v.i64)
+UNARY(Not, !v.b)
+UNARY(Check, check(n, v.i64))
+#undef UNARY
+#undef BINARY
+
+template<TokenType T, typename X>
+inline bool compare(X l, X r){
+	if constexpr (T == TokenType::EQ) return l == r;
+	else if constexpr (T == TokenType::GT) return l > r;
+	else if constexpr (T == TokenType::LT) return l < r;
+	else if constexpr (T == TokenType::GT_EQ) return l >= r;
+	else if constexpr (T == TokenType::LT_EQ) return l <= r;
+	else return l != r;
+}
+template<TokenType T>
+struct CmpI {
+	static inline EValue f(const Node&, EValue l, EValue r){ return compare<T>(l.i64, r.i64); }
+};
+template<TokenType T>
+struct CmpC {
+	static inline EValue f(const Node&, EValue l, EValue r){ return compare<T>(l.c, r.c); }
+};
+template<template<TokenType> typename F>
+Fn compareFn(const Node& n){
+	switch(static_cast<TokenType>(n.a)){
+		case TokenType::EQ: return binaryFn<F<TokenType::EQ>>(n);
+		case TokenType::GT: return binaryFn<F<TokenType::GT>>(n);
+		case TokenType::LT: return binaryFn<F<TokenType::LT>>(n);
+		case TokenType::GT_EQ: return binaryFn<F<TokenType::GT_EQ>>(n);
+		case TokenType::LT_EQ: return binaryFn<F<TokenType::LT_EQ>>(n);
+		case TokenType::LT_GT: return binaryFn<F<TokenType::LT_GT>>(n);
+		default: throw ir::IRError("Invalid comparison");
+	}
+}
+
+/* Everything else that only depends on its operands (REALs, STRINGs, ...) */
+inline EValue generic(const Node& n, EValue *regs){
+	EValue vals[3];
+	for(size_t i = 0; i < n.inst->args.size(); i++) vals[i] = get(n.ops[i], regs);
+	return ir::evalOp(*n.inst, vals);
+}
+
+// }}}
+
+class Machine {
+	/* A jump, and the values it gives the PHIs of its target: register, value */
+	struct Edge {
+		ir::BlockId to = 0;
+		std::vector<std::pair<int32_t, Operand>> moves;
+	};
+	enum class Exit : uint8_t { BR, CBR, RET, THROW };
+	struct Block {
+		std::vector<const Node *> body;
+		Exit exit = Exit::RET;
+		Operand value; /* condition of a CBR, result of a RET */
+		bool returns = false;
+		Edge edges[2];
+		const ir::Inst *inst = nullptr; /* THROW */
+	};
+	struct Function {
+		std::vector<Block> blocks;
+		size_t params = 0, frame = 0;
+		int32_t scratch = 0; /* registers for moving PHIs, and for results no one uses */
+		bool local_arrays = false;
+		const std::vector<std::string> *messages = nullptr;
+	};
+
+	Env& env;
+	std::deque<Node> nodes;
+	std::vector<Function> funcs;
+	std::vector<bool> defined; /* functions defined by DEFFUNC so far */
+
+	// Nodes with effects {{{
+
+	static EValue loadG(const Node& n, EValue *){
+		return n.m->env.value(n.a);
+	}
+	static EValue storeG(const Node& n, EValue *regs){
+		n.m->env.value(n.a) = get(n.ops[0], regs);
+		return EValue((int64_t)0);
+	}
+	static EValue declareG(const Node& n, EValue *regs){
+		const EValue val = n.inst->args.empty() ? EValue((int64_t)0) : get(n.ops[0], regs);
+		n.m->env.initVar(n.a, n.m->env.GLOBAL_LEVEL, n.type, val);
+		return EValue((int64_t)0);
+	}
+	static EValue storeE(const Node& n, EValue *regs){
+		const EValue arr = get(n.ops[0], regs), index = get(n.ops[1], regs);
+		arr.arr[index.i64] = get(n.ops[2], regs);
+		return EValue((int64_t)0);
+	}
+	static EValue newArr(const Node& n, EValue *){
+		EValue *arr = new EValue[n.a];
+		std::fill(arr, arr + n.a, EValue((int64_t)0));
+		return arr;
+	}
+	static EValue copyArr(const Node& n, EValue *regs){
+		const EValue to = get(n.ops[0], regs), from = get(n.ops[1], regs);
+		if(to.arr != from.arr) std::copy(from.arr, from.arr + n.a, to.arr);
+		return EValue((int64_t)0);
+	}
+	static EValue copyNew(const Node& n, EValue *regs){
+		const EValue from = get(n.ops[0], regs);
+		EValue *arr = n.b ? n.m->env.region.alloc(n.a) : new EValue[n.a];
+		std::copy(from.arr, from.arr + n.a, arr);
+		return arr;
+	}
+	static EValue input(const Node& n, EValue *){
+		EValue res;
+		n.m->env.input(res, n.type);
+		return res;
+	}
+	static EValue output(const Node& n, EValue *regs){
+		n.m->env.output(get(n.ops[0], regs), n.type);
+		return EValue((int64_t)0);
+	}
+	static EValue newline(const Node& n, EValue *){
+		n.m->env.out << '\n';
+		return EValue((int64_t)0);
+	}
+	static EValue callF(const Node& n, EValue *regs){
+		return n.m->call(n.a, n.args.data(), regs);
+	}
+	static EValue callB(const Node& n, EValue *regs){
+		Env::Region& region = n.m->env.region;
+		const Env::Region::Mark mark = region.mark();
+		EValue *args = region.alloc(n.args.size());
+		for(size_t i = 0; i < n.args.size(); i++) args[i] = get(n.args[i], regs);
+		const EValue res = reinterpret_cast<EValue (*)(EValue *)>(n.a)(args);
+		region.release(mark);
+		return res;
+	}
+	static EValue checkDef(const Node& n, EValue *){
+		if(!n.m->defined[n.a]) throw RuntimeError("Cannot call non-function");
+		return EValue((int64_t)0);
+	}
+	static EValue defFunc(const Node& n, EValue *){
+		n.m->defined[n.a] = true;
+		return EValue((int64_t)0);
+	}
+	static EValue isDefined(const Node& n, EValue *){
+		return EValue((bool)n.m->defined[n.a]);
+	}
+	static EValue hideG(const Node& n, EValue *){
+		n.m->env.hideGlobal(n.a);
+		return EValue((int64_t)0);
+	}
+	static EValue unhideG(const Node& n, EValue *){
+		n.m->env.unhideGlobal(n.a);
+		return EValue((int64_t)0);
+	}
+
+	// }}}
+
+	// Building {{{
+
+	/* Builds the closures of one function */
+	class Builder {
+		Machine& m;
+		const ir::Function& f;
+		Function& out;
+		std::vector<uint32_t> uses, pos;
+		std::vector<ValueId> user;
+		std::vector<int32_t> regs;
+		std::vector<const Node *> built;
+
+		/* Can `id` be computed by its user, in its place? */
+		bool nested(ValueId id) const {
+			const ir::Inst& inst = f.insts[id];
+			if(uses[id] != 1 || isAnyOf(inst.op, Op::PHI, Op::PARAM, Op::CONST, Op::UNDEF)) return false;
+			if(ir::opFlags(inst.op) & (ir::EFFECT | ir::TERM)) return false;
+			const ir::Inst& u = f.insts[user[id]];
+			if(u.block != inst.block || u.op == Op::PHI) return false;
+			const auto& insts = f.blocks[inst.block].insts;
+			for(uint32_t i = pos[id] + 1; i < pos[user[id]]; i++){
+				if(ir::opFlags(f.insts[insts[i]].op) != ir::PURE) return false;
+			}
+			return true;
+		}
+		Operand operand(ValueId id){
+			const ir::Inst& inst = f.insts[id];
+			Operand res;
+			if(inst.op == Op::CONST){
+				res.imm = inst.imm;
+			} else if(inst.op == Op::UNDEF){
+				std::memset(&res.imm, 0, sizeof(EValue));
+			} else if(regs[id] >= 0){
+				res.kind = REG;
+				res.reg = regs[id];
+			} else {
+				res.kind = NODE;
+				res.node = node(id);
+			}
+			return res;
+		}
+		const Node *node(ValueId id){
+			if(built[id] != nullptr) return built[id];
+			const ir::Inst& inst = f.insts[id];
+			Node& n = m.nodes.emplace_back();
+			n.m = &m;
+			n.inst = &inst;
+			n.a = inst.a;
+			n.b = inst.b;
+			n.imm = inst.imm;
+			n.type = inst.type;
+			n.dst = regs[id] >= 0 ? regs[id] : out.scratch;
+			const bool calls = isAnyOf(inst.op, Op::CALL, Op::CALLB);
+			for(size_t i = 0; i < inst.args.size(); i++){
+				if(calls) n.args.push_back(operand(inst.args[i]));
+				else n.ops[i] = operand(inst.args[i]);
+			}
+			n.fn = pick(n);
+			built[id] = &n;
+			return &n;
+		}
+		Fn pick(Node& n){
+			switch(n.inst->op){
+				case Op::ADDI: return binaryFn<AddI>(n);
+				case Op::SUBI: return binaryFn<SubI>(n);
+				case Op::MULI: return binaryFn<MulI>(n);
+				case Op::DIVI: return binaryFn<DivI>(n);
+				case Op::MODI: return binaryFn<ModI>(n);
+				case Op::NEGI: return unaryFn<NegI>(n);
+				case Op::CMPI: return compareFn<CmpI>(n);
+				case Op::CMPC: return compareFn<CmpC>(n);
+				case Op::AND: return binaryFn<And>(n);
+				case Op::OR: return binaryFn<Or>(n);
+				case Op::NOT: return unaryFn<Not>(n);
+				case Op::CHECK: return unaryFn<Check>(n);
+				case Op::LOADE: return binaryFn<LoadE>(n);
+				case Op::LOADG: return loadG;
+				case Op::STOREG: return storeG;
+				case Op::DECLAREG: return declareG;
+				case Op::STOREE: return storeE;
+				case Op::NEWARR: return newArr;
+				case Op::COPYARR: return copyArr;
+				case Op::COPYNEW:
+					n.b = f.local_arrays;
+					return copyNew;
+				case Op::INPUT: return input;
+				case Op::OUTPUT:
+					n.type = f.insts[n.inst->args[0]].type;
+					return output;
+				case Op::NEWLINE: return newline;
+				case Op::CALL: return callF;
+				case Op::CALLB: return callB;
+				case Op::CHECKDEF: return checkDef;
+				case Op::DEFFUNC: return defFunc;
+				case Op::DEFINED: return isDefined;
+				case Op::HIDEG: return hideG;
+				case Op::UNHIDEG: return unhideG;
+				default: return generic;
+			}
+		}
+		Edge edge(ir::BlockId from, ir::BlockId to){
+			Edge e;
+			e.to = to;
+			const size_t pred = f.predIndex(to, from);
+			for(const ValueId id : f.blocks[to].insts){
+				if(f.insts[id].op != Op::PHI) break;
+				e.moves.emplace_back(regs[id], operand(f.insts[id].args[pred]));
+			}
+			return e;
+		}
+	public:
+		Builder(Machine& m_, const ir::Function& f_, Function& out_) : m(m_), f(f_), out(out_),
+			uses(f.insts.size(), 0), pos(f.insts.size(), 0), user(f.insts.size(), ir::NONE),
+			regs(f.insts.size(), -1), built(f.insts.size(), nullptr) {}
+		void run(){
+			size_t phis = 0;
+			for(const ir::Block& blk : f.blocks){
+				if(blk.dead) continue;
+				size_t block_phis = 0;
+				for(uint32_t i = 0; i < blk.insts.size(); i++){
+					const ValueId id = blk.insts[i];
+					pos[id] = i;
+					block_phis += f.insts[id].op == Op::PHI;
+					for(const ValueId arg : f.insts[id].args){
+						uses[arg]++;
+						user[arg] = id;
+					}
+				}
+				phis = std::max(phis, block_phis);
+			}
+			// The parameters come first, where call() puts them.
+			out.params = f.params.size();
+			int32_t next = out.params;
+			for(const ir::Block& blk : f.blocks){
+				if(blk.dead) continue;
+				for(const ValueId id : blk.insts){
+					const ir::Inst& inst = f.insts[id];
+					if(inst.op == Op::PARAM) regs[id] = inst.a;
+					else if(inst.type != Primitive::INVALID && !isAnyOf(inst.op, Op::CONST, Op::UNDEF) && !nested(id)) regs[id] = next++;
+				}
+			}
+			out.scratch = next;
+			out.frame = next + std::max<size_t>(phis, 1);
+			out.local_arrays = f.local_arrays;
+			out.messages = &f.messages;
+			out.blocks.resize(f.blocks.size());
+			for(ir::BlockId b = 0; b < f.blocks.size(); b++){
+				if(f.blocks[b].dead) continue;
+				Block& blk = out.blocks[b];
+				for(const ValueId id : f.blocks[b].insts){
+					const ir::Inst& inst = f.insts[id];
+					switch(inst.op){
+						case Op::PHI: case Op::PARAM: case Op::CONST: case Op::UNDEF:
+							break;
+						case Op::BR:
+							blk.exit = Exit::BR;
+							blk.edges[0] = edge(b, inst.targets[0]);
+							break;
+						case Op::CBR:
+							blk.exit = Exit::CBR;
+							blk.value = operand(inst.args[0]);
+							blk.edges[0] = edge(b, inst.targets[0]);
+							blk.edges[1] = edge(b, inst.targets[1]);
+							break;
+						case Op::RET:
+							blk.exit = Exit::RET;
+							blk.returns = !inst.args.empty();
+							if(blk.returns) blk.value = operand(inst.args[0]);
+							break;
+						case Op::THROW:
+							blk.exit = Exit::THROW;
+							blk.inst = &inst;
+							break;
+						default:
+							if(regs[id] >= 0 || inst.type == Primitive::INVALID) blk.body.push_back(node(id));
+							break;
+					}
+				}
+			}
+		}
+	};
+
+	// }}}
+
+	/* The values of the PHIs all move at once, through the scratch registers. */
+	static inline const Block *jump(const Function& f, const Edge& e, EValue *regs){
+		const size_t n = e.moves.size();
+		if(n == 1){
+			regs[e.moves[0].first] = get(e.moves[0].second, regs);
+		} else if(n > 1){
+			for(size_t i = 0; i < n; i++) regs[f.scratch + i] = get(e.moves[i].second, regs);
+			for(size_t i = 0; i < n; i++) regs[e.moves[i].first] = regs[f.scratch + i];
+		}
+		return &f.blocks[e.to];
+	}
+
+	/* Calls function `index`, evaluating `args` in the caller's `caller_regs` */
+	EValue call(size_t index, const Operand *args, EValue *caller_regs){
+		const Function& f = funcs[index];
+		// Nothing a function allocates in the region outlives it, see the escape analysis in optimizer.hpp.
+		const Env::Region::Mark mark = env.region.mark();
+		EValue *regs = env.region.alloc(f.frame);
+		for(size_t i = 0; i < f.params; i++) regs[i] = get(args[i], caller_regs);
+		const Block *b = &f.blocks[0];
+		for(;;){
+			for(const Node *n : b->body) regs[n->dst] = n->fn(*n, regs);
+			switch(b->exit){
+				case Exit::BR:
+					b = jump(f, b->edges[0], regs);
+					break;
+				case Exit::CBR:
+					b = jump(f, b->edges[get(b->value, regs).b ? 0 : 1], regs);
+					break;
+				case Exit::RET:
+					{
+						const EValue res = b->returns ? get(b->value, regs) : EValue();
+						env.region.release(mark);
+						return res;
+					}
+				case Exit::THROW:
+					if(b->inst->a == 0) throw TypeError((*f.messages)[b->inst->b]);
+					throw RuntimeError((*f.messages)[b->inst->b]);
+			}
+		}
+	}
+
+public:
+	Machine(Env& env_, const ir::Module& mod) : env(env_), funcs(mod.funcs.size()), defined(mod.funcs.size(), false) {
+		for(size_t i = 0; i < mod.funcs.size(); i++) Builder(*this, mod.funcs[i], funcs[i]).run();
+	}
+	void run(){
+		call(0, nullptr, nullptr);
+	}
+};
+
+} /* namespace closures */
+
+#endif /* CLOSURES_HPP */
@@ -0,0 +1,521 @@
+#ifndef COMPILER_HPP
+#define COMPILER_HPP
+
+#include <map>
+#include <cstring>
+#include "ir.hpp"
+#include "lowering.hpp"
+#include "bytecode.hpp"
+
+/* Turns a module of IR (see ir.hpp) into Bytecode for the VM in vm.hpp.
+ *
+ * Every function gets a frame: its parameters, then a register for every other value
+ * the IR computes, which is where the instruction computing it puts it.
+ * Constants go in the constant pool instead, so they cost nothing.
+ * PHIs become MOVs on the edges into their block. The PHIs of a block all take
+ * their values at once, so the moves are ordered such that no register is written
+ * before it is read, going through a spare register to break cycles.
+ * Blocks are laid out in reverse postorder, and jumps to the next block are left out.
+ * Common sequences of instructions are fused into superinstructions, see fusable(). */
+class Compiler {
+	const ir::Module& mod;
+	const bool superinstructions;
+	Bytecode code;
+	std::map<intptr_t, int32_t> builtins; /* function pointer to its index */
+
+	// The function being compiled {{{
+	const ir::Function *fn = nullptr;
+	std::vector<int32_t> locs; /* of every value */
+	uint32_t frame_size = 0;
+	int32_t spare = -1; /* register for breaking cycles of moves, made when needed */
+	std::vector<uint32_t> uses; /* of every value */
+	std::vector<bool> fused; /* computed by the superinstruction of the instruction using it */
+	std::vector<size_t> block_start; /* index in `instr` */
+	size_t last = 0; /* index of the last instruction */
+	std::vector<std::pair<size_t, ir::BlockId>> fixups; /* jumps whose target isn't known yet */
+	int32_t first_message = 0;
+	size_t line = 0; /* of the instruction being compiled, see Bytecode::lines */
+	bool new_function = true; /* its first line starts a new entry even if it's the same */
+	// }}}
+
+	inline void word(int32_t w){
+		code.instr.push_back(w);
+	}
+	inline void instr(Op op, uint8_t t1 = 0, uint8_t t2 = 0){
+		last = code.instr.size();
+		if(line != 0 && (new_function || code.lines.back().second != (int32_t)line)){
+			code.lines.emplace_back(last, line);
+			new_function = false;
+		}
+		word(makeInstr(op, t1, t2));
+	}
+	int32_t constant(EValue val, Primitive type){
+		code.const_pool.push_back(val);
+		code.const_types.push_back(type);
+		return code.const_pool.size() - 1;
+	}
+	int32_t type(const EType& t){
+		code.types.push_back(t);
+		return code.types.size() - 1;
+	}
+	inline int32_t loc(ir::ValueId val) const {
+		return locs[val];
+	}
+	/* The register of `val` */
+	inline int32_t reg(ir::ValueId val) const {
+		return locs[val] ^ TOPMOST_BIT32;
+	}
+	/* Does `inst` put a result in a register? DECLAREG only has the type it declares,
+	 * and builtins always return something. */
+	static bool hasResult(const ir::Inst& inst){
+		return (inst.type != Primitive::INVALID && inst.op != ir::Op::DECLAREG) || inst.op == ir::Op::CALLB;
+	}
+	void jump(ir::BlockId target){
+		fixups.emplace_back(code.instr.size(), target);
+		word(0);
+	}
+
+	/* Gives every value its loc, returns the size of the frame. */
+	uint32_t assignLocs(const std::vector<ir::BlockId>& order){
+		locs.assign(fn->insts.size(), 0);
+		uint32_t next = fn->params.size();
+		for(const ir::BlockId b : order){
+			for(const ir::ValueId id : fn->blocks[b].insts){
+				const ir::Inst& inst = fn->insts[id];
+				switch(inst.op){
+					case ir::Op::CONST:
+						locs[id] = constant(inst.imm, inst.type.primtype);
+						break;
+					case ir::Op::UNDEF:
+						{
+							EValue zero;
+							std::memset(&zero, 0, sizeof(zero));
+							locs[id] = constant(zero, inst.type.primtype);
+						}
+						break;
+					case ir::Op::PARAM:
+						locs[id] = TOPMOST_BIT32 | inst.a;
+						break;
+					default:
+						if(hasResult(inst)) locs[id] = TOPMOST_BIT32 | next++;
+						break;
+				}
+			}
+		}
+		return next;
+	}
+
+	/* Moves the values of the PHIs of `to` that come from `from` into place.
+	 * Returns whether there was anything to move. */
+	bool edge(ir::BlockId from, ir::BlockId to){
+		const ir::Block& blk = fn->blocks[to];
+		const size_t pred = fn->predIndex(to, from);
+		std::vector<std::pair<int32_t, int32_t>> moves; /* register, loc */
+		for(size_t i = 0; i < blk.insts.size() && fn->insts[blk.insts[i]].op == ir::Op::PHI; i++){
+			const int32_t src = loc(fn->insts[blk.insts[i]].args[pred]);
+			if(src != loc(blk.insts[i])) moves.emplace_back(reg(blk.insts[i]), src);
+		}
+		auto isRead = [&moves](int32_t r){
+			for(const auto& move : moves) if(move.second == (TOPMOST_BIT32 | r)) return true;
+			return false;
+		};
+		const bool moved = !moves.empty();
+		while(!moves.empty()){
+			size_t i = 0;
+			for(; i < moves.size() && isRead(moves[i].first); i++);
+			if(i == moves.size()){
+				// Every register left is still to be read: a cycle
+				if(spare < 0) spare = frame_size++;
+				const int32_t saved = moves[0].first;
+				mov(spare, TOPMOST_BIT32 | saved);
+				for(auto& move : moves) if(move.second == (TOPMOST_BIT32 | saved)) move.second = TOPMOST_BIT32 | spare;
+				i = 0;
+			}
+			mov(moves[i].first, moves[i].second);
+			moves.erase(moves.begin() + i);
+		}
+		return moved;
+	}
+	void mov(int32_t dest, int32_t src){
+		instr(OP_MOV);
+		word(dest);
+		word(src);
+	}
+	inline bool hasPhis(ir::BlockId b) const {
+		const ir::Block& blk = fn->blocks[b];
+		return !blk.insts.empty() && fn->insts[blk.insts[0]].op == ir::Op::PHI;
+	}
+
+	/* The comparison `op` (a TokenType) between operands of `types` */
+	static Op comparison(int64_t op, CmpTypes types){
+		Op first;
+		switch(static_cast<TokenType>(op)){
+			case TokenType::EQ: first = OP_EQ_II; break;
+			case TokenType::GT: first = OP_GT_II; break;
+			case TokenType::LT: first = OP_LT_II; break;
+			case TokenType::GT_EQ: first = OP_GTEQ_II; break;
+			case TokenType::LT_EQ: first = OP_LTEQ_II; break;
+			case TokenType::LT_GT: first = OP_NEQ_II; break;
+			default: throw ir::IRError("Invalid comparison");
+		}
+		return static_cast<Op>(first + types);
+	}
+
+	static Op compareJump(int64_t op){
+		switch(static_cast<TokenType>(op)){
+			case TokenType::EQ: return OP_JEQ_II;
+			case TokenType::GT: return OP_JGT_II;
+			case TokenType::LT: return OP_JLT_II;
+			case TokenType::GT_EQ: return OP_JGTEQ_II;
+			case TokenType::LT_EQ: return OP_JLTEQ_II;
+			case TokenType::LT_GT: return OP_JNEQ_II;
+			default: throw ir::IRError("Invalid comparison");
+		}
+	}
+
+	/* The operators, from SELECT to NOT in IR_OPS, all compiled by operation() */
+	static bool isOperator(ir::Op op){
+		return op >= ir::Op::SELECT && op <= ir::Op::NOT;
+	}
+
+	/* Decides which superinstructions to use, going by the pairs of instructions
+	 * that ran the most in a set of loop-heavy programs:
+	 * - an INTEGER comparison only used by the CBR after it becomes a JEQ_II, JLT_II, etc.
+	 * - a SUB_II only used for the offset of the LOADE or STOREE after it, as in
+	 *   a[i], becomes LOADE_IDX or STOREE_IDX.
+	 * - an operator right before a BR, only used by a PHI of the block it jumps to,
+	 *   puts its result in the PHI's register rather than a MOV doing it (as in x <- x + 1).
+	 * - the MOV before a JMP becomes MOV_JMP.
+	 * - a BR to a block with nothing but PHIs and a fused comparison, as the test of
+	 *   a loop, copies the comparison instead of jumping to it. If an ADD_II into the
+	 *   register being compared comes right before, as for the variable of a FOR loop,
+	 *   they become FOR_STEP_II. */
+	void fusable(){
+		uses.assign(fn->insts.size(), 0);
+		fused.assign(fn->insts.size(), false);
+		for(const ir::Block& blk : fn->blocks){
+			for(const ir::ValueId id : blk.insts){
+				for(const ir::ValueId arg : fn->insts[id].args) uses[arg]++;
+			}
+		}
+		if(!superinstructions) return;
+		for(ir::BlockId b = 0; b < fn->blocks.size(); b++){
+			const std::vector<ir::ValueId>& insts = fn->blocks[b].insts;
+			for(size_t k = 1; k < insts.size(); k++){
+				const ir::ValueId prev = insts[k - 1];
+				const ir::Inst& inst = fn->insts[insts[k]];
+				if(uses[prev] != 1) continue;
+				switch(fn->insts[prev].op){
+					case ir::Op::CMPI:
+						fused[prev] = (inst.op == ir::Op::CBR && inst.args[0] == prev);
+						break;
+					case ir::Op::SUBI:
+						fused[prev] = ((inst.op == ir::Op::LOADE || inst.op == ir::Op::STOREE) && inst.args[1] == prev);
+						break;
+					default:
+						break;
+				}
+			}
+			if(insts.size() < 2 || fn->insts[insts.back()].op != ir::Op::BR) continue;
+			const ir::ValueId val = insts[insts.size() - 2];
+			if(!isOperator(fn->insts[val].op) || uses[val] != 1) continue;
+			const ir::BlockId to = fn->insts[insts.back()].targets[0];
+			const size_t pred = fn->predIndex(to, b);
+			const std::vector<ir::ValueId>& phis = fn->blocks[to].insts;
+			for(size_t i = 0; i < phis.size() && fn->insts[phis[i]].op == ir::Op::PHI; i++){
+				if(fn->insts[phis[i]].args[pred] != val) continue;
+				// The other PHIs mustn't need the value it had.
+				bool read = false;
+				for(size_t j = 0; j < phis.size() && fn->insts[phis[j]].op == ir::Op::PHI; j++){
+					read |= (fn->insts[phis[j]].args[pred] == phis[i]);
+				}
+				if(!read) locs[val] = locs[phis[i]];
+				break;
+			}
+		}
+	}
+	/* Does `b` only test a fused comparison, for blocks without PHIs? */
+	bool isTest(ir::BlockId b) const {
+		const std::vector<ir::ValueId>& insts = fn->blocks[b].insts;
+		size_t n = 0;
+		for(; n < insts.size() && fn->insts[insts[n]].op == ir::Op::PHI; n++);
+		if(insts.size() != n + 2 || !fused[insts[n]]) return false;
+		const ir::Inst& cbr = fn->insts[insts[n + 1]];
+		return !hasPhis(cbr.targets[0]) && !hasPhis(cbr.targets[1]);
+	}
+	/* CJMP `cond`, without its target */
+	void branch(ir::ValueId cond){
+		if(fused[cond]){
+			const ir::Inst& cmp = fn->insts[cond];
+			instr(compareJump(cmp.a));
+			word(loc(cmp.args[0]));
+			word(loc(cmp.args[1]));
+		} else {
+			instr(OP_CJMP);
+			word(loc(cond));
+		}
+	}
+
+	/* Operators: the register for the result, then the operands */
+	void operation(Op op, ir::ValueId id){
+		instr(op);
+		word(reg(id));
+		for(const ir::ValueId arg : fn->insts[id].args) word(loc(arg));
+	}
+
+	void inst(ir::ValueId id, ir::BlockId next){
+		const ir::Inst& inst = fn->insts[id];
+		using ir::Op;
+		if(fused[id]) return;
+		line = inst.line;
+		switch(inst.op){
+			case Op::CONST: case Op::UNDEF: case Op::PARAM: case Op::PHI:
+				return;
+			case Op::ADDI: operation(OP_ADD_II, id); break;
+			case Op::ADDR: operation(OP_ADD_RR, id); break;
+			case Op::ADDRI: operation(OP_ADD_RI, id); break;
+			case Op::SUBI: operation(OP_SUB_II, id); break;
+			case Op::SUBR: operation(OP_SUB_RR, id); break;
+			case Op::SUBRI: operation(OP_SUB_RI, id); break;
+			case Op::MULI: operation(OP_MUL_II, id); break;
+			case Op::MULR: operation(OP_MUL_RR, id); break;
+			case Op::MULRI: operation(OP_MUL_RI, id); break;
+			case Op::DIVR: operation(OP_DIV_RR, id); break;
+			case Op::DIVI: operation(OP_IDIV_II, id); break;
+			case Op::MODI: operation(OP_MOD_II, id); break;
+			case Op::NEGI: operation(OP_NEG_I, id); break;
+			case Op::NEGR: operation(OP_NEG_R, id); break;
+			case Op::ITOR: operation(OP_ITOR, id); break;
+			case Op::CMPI: operation(comparison(inst.a, CMP_II), id); break;
+			case Op::CMPR: operation(comparison(inst.a, CMP_RR), id); break;
+			case Op::CMPRI: operation(comparison(inst.a, CMP_RI), id); break;
+			case Op::CMPC: operation(comparison(inst.a, CMP_CC), id); break;
+			case Op::CMPB: operation(comparison(inst.a, CMP_BB), id); break;
+			case Op::CMPS: operation(comparison(inst.a, CMP_SS), id); break;
+			case Op::CMPD: operation(OP_EQ_DD, id); break;
+			case Op::AND: operation(OP_AND, id); break;
+			case Op::OR: operation(OP_OR, id); break;
+			case Op::NOT: operation(OP_NOT, id); break;
+			case Op::SELECT: operation(OP_SELECT, id); break;
+			case Op::LOADG:
+				instr(OP_LOADG);
+				word(reg(id));
+				word(inst.a);
+				break;
+			case Op::STOREG:
+				instr(OP_STOREG);
+				word(inst.a);
+				word(loc(inst.args[0]));
+				break;
+			case Op::DECLAREG:
+				instr(OP_DECLAREG, !inst.args.empty());
+				word(inst.a);
+				word(type(inst.type));
+				if(!inst.args.empty()) word(loc(inst.args[0]));
+				break;
+			case Op::LOADE:
+				if(fused[inst.args[1]]){
+					const ir::Inst& sub = fn->insts[inst.args[1]];
+					instr(OP_LOADE_IDX);
+					word(reg(id));
+					word(loc(inst.args[0]));
+					word(loc(sub.args[0]));
+					word(loc(sub.args[1]));
+				} else {
+					operation(OP_LOADE, id);
+				}
+				break;
+			case Op::STOREE:
+				if(fused[inst.args[1]]){
+					const ir::Inst& sub = fn->insts[inst.args[1]];
+					instr(OP_STOREE_IDX);
+					word(loc(inst.args[0]));
+					word(loc(sub.args[0]));
+					word(loc(sub.args[1]));
+					word(loc(inst.args[2]));
+				} else {
+					instr(OP_STOREE);
+					for(const ir::ValueId arg : inst.args) word(loc(arg));
+				}
+				break;
+			case Op::CHECK:
+				instr(OP_CHECK, inst.imm.i64);
+				word(loc(inst.args[0]));
+				word(constant(inst.a, Primitive::INTEGER));
+				word(constant(inst.b, Primitive::INTEGER));
+				break;
+			case Op::NEWARR:
+				instr(OP_NEWARR);
+				word(reg(id));
+				word(type(inst.type));
+				break;
+			case Op::COPYARR:
+				instr(OP_COPYARR);
+				word(loc(inst.args[0]));
+				word(loc(inst.args[1]));
+				word(inst.a);
+				break;
+			case Op::COPYNEW:
+				operation(OP_COPYNEW, id);
+				word(inst.a);
+				break;
+			case Op::INPUT:
+				instr(OP_INPUT);
+				word(reg(id));
+				word(type(inst.type));
+				break;
+			case Op::OUTPUT:
+				instr(OP_OUTPUT);
+				word(type(fn->insts[inst.args[0]].type));
+				word(loc(inst.args[0]));
+				break;
+			case Op::NEWLINE:
+				instr(OP_NEWLINE);
+				break;
+			case Op::CALL:
+				instr(OP_CALL);
+				word(hasResult(inst) ? reg(id) : 0);
+				word(inst.a);
+				for(const ir::ValueId arg : inst.args) word(loc(arg));
+				break;
+			case Op::CALLB:
+				{
+					if(inst.args.size() > MAX_BUILTIN_ARGS) throw ir::Unsupported("a builtin has too many arguments");
+					const auto [it, added] = builtins.try_emplace(inst.a, code.builtins.size());
+					if(added) code.builtins.push_back(reinterpret_cast<EValue (*)(EValue *)>(inst.a));
+					instr(OP_CALLB);
+					word(reg(id));
+					word(it->second);
+					word(inst.args.size());
+					for(const ir::ValueId arg : inst.args) word(loc(arg));
+				}
+				break;
+			case Op::CHECKDEF:
+				instr(OP_CHECKDEF);
+				word(inst.a);
+				break;
+			case Op::DEFFUNC:
+				instr(OP_DEFFUNC);
+				word(inst.a);
+				break;
+			case Op::DEFINED:
+				instr(OP_DEFINED);
+				word(reg(id));
+				word(inst.a);
+				break;
+			case Op::HIDEG:
+			case Op::UNHIDEG:
+				instr(inst.op == Op::HIDEG ? OP_HIDEG : OP_UNHIDEG);
+				word(inst.a);
+				break;
+			case Op::BR:
+				{
+					const ir::BlockId t = inst.targets[0];
+					const size_t start = code.instr.size();
+					const bool moved = edge(inst.block, t);
+					if(superinstructions && isTest(t)){
+						const ir::Inst& cbr = fn->insts[fn->blocks[t].insts.back()];
+						const ir::Inst& cmp = fn->insts[cbr.args[0]];
+						if(static_cast<TokenType>(cmp.a) == TokenType::LT_EQ && last >= block_start[inst.block]
+								&& last + 4 == code.instr.size() && code.instr[last] == makeInstr(OP_ADD_II)
+								&& (TOPMOST_BIT32 | code.instr[last + 1]) == loc(cmp.args[0])){
+							code.instr[last] = makeInstr(OP_FOR_STEP_II);
+							word(loc(cmp.args[1]));
+						} else {
+							branch(cbr.args[0]);
+						}
+						jump(cbr.targets[0]);
+						if(cbr.targets[1] != next){
+							instr(OP_JMP);
+							jump(cbr.targets[1]);
+						}
+					} else if(t != next){
+						if(superinstructions && moved && last >= start){
+							code.instr[last] = makeInstr(OP_MOV_JMP);
+						} else {
+							instr(OP_JMP);
+						}
+						jump(t);
+					}
+				}
+				return;
+			case Op::CBR:
+				{
+					const ir::BlockId t = inst.targets[0], f = inst.targets[1];
+					// The moves for the true edge go after the false edge.
+					size_t true_edge = 0;
+					branch(inst.args[0]);
+					if(hasPhis(t)){
+						true_edge = code.instr.size();
+						word(0);
+					} else {
+						jump(t);
+					}
+					edge(inst.block, f);
+					if(f != next || true_edge){
+						instr(OP_JMP);
+						jump(f);
+					}
+					if(true_edge){
+						code.instr[true_edge] = code.instr.size();
+						edge(inst.block, t);
+						instr(OP_JMP);
+						jump(t);
+					}
+				}
+				return;
+			case Op::RET:
+				instr(OP_RET, !inst.args.empty());
+				if(!inst.args.empty()) word(loc(inst.args[0]));
+				return;
+			case Op::THROW:
+				instr(OP_THROW);
+				word(inst.a);
+				word(first_message + inst.b);
+				return;
+			default:
+				throw ir::IRError("Cannot compile " + std::string(ir::opToStr(inst.op)));
+		}
+	}
+
+	void function(const ir::Function& f){
+		fn = &f;
+		new_function = true;
+		const std::vector<ir::BlockId> order = f.reversePostorder();
+		FuncInfo info;
+		info.entry = code.instr.size();
+		info.params = f.params.size();
+		frame_size = assignLocs(order);
+		if(frame_size > MAX_FRAME_SIZE) throw ir::Unsupported("a function needs too many registers");
+		spare = -1;
+		fusable();
+		info.returns = (f.ret_type != Primitive::INVALID);
+		info.local_arrays = f.local_arrays;
+		code.funcs.push_back(info);
+		first_message = code.messages.size();
+		code.messages.insert(code.messages.end(), f.messages.begin(), f.messages.end());
+		block_start.assign(f.blocks.size(), 0);
+		fixups.clear();
+		for(size_t i = 0; i < order.size(); i++){
+			const ir::BlockId b = order[i];
+			block_start[b] = code.instr.size();
+			const ir::BlockId next = (i + 1 < order.size() ? order[i + 1] : ir::NONE);
+			for(const ir::ValueId id : f.blocks[b].insts) inst(id, next);
+		}
+		for(const auto& [at, target] : fixups) code.instr[at] = block_start[target];
+		code.funcs.back().frame_size = frame_size;
+	}
+
+public:
+	Compiler(const ir::Module& mod_, bool superinstructions_) : mod(mod_), superinstructions(superinstructions_) {}
+	Bytecode run(){
+		for(const ir::Function& f : mod.funcs) function(f);
+		return std::move(code);
+	}
+};
+
+inline Bytecode compile(const ir::Module& mod, bool superinstructions = true){
+	return Compiler(mod, superinstructions).run();
+}
+
+#endif /* COMPILER_HPP */
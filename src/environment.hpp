@@ -8,6 +8,7 @@
 #include <memory>
 #include <sstream>
 #include <charconv>
+#include <algorithm>
 
 #include "utils.hpp"
 #include "value.hpp"
@@ -24,6 +25,7 @@ public:
 	using std::runtime_error::runtime_error;
 };
 
+class Tiers;
 
 /* Space for variables and such. */
 class Env {
@@ -46,6 +48,20 @@ public:
 	const int32_t GLOBAL_LEVEL = 0;
 	
 	std::map<int64_t, EFunc> functable;
+private:
+	static uint64_t newVersion() noexcept {
+		static uint64_t last = 0;
+		return ++last;
+	}
+public:
+	/* Changes whenever `functable` does, and is never the same in two Envs (see CallCache). */
+	uint64_t functable_version = newVersion();
+	inline void functableChanged() noexcept { functable_version = newVersion(); }
+
+	/* Where the tree-walker hands hot functions and loops, if anywhere (see interpreter.hpp) */
+	Tiers *tiers = nullptr;
+	/* The lowest address of the stack a call may start at, when running on a HeapStack (see stack.hpp) */
+	uintptr_t stack_low = 0;
 	
 	size_t line_number = 1;
 
@@ -60,6 +76,10 @@ public:
 		}
 		return var_vals[var];
 	}
+	/* Number of variable ids */
+	inline size_t variables() const noexcept {
+		return var_vals.size();
+	}
 	inline EValue& value_unchecked(int64_t var) noexcept {
 		return var_vals[var];
 	}
@@ -78,15 +98,18 @@ public:
 	inline void setLevel(int64_t var, int32_t level) noexcept {
 		var_call_level[var] = level;
 	}
-	inline void setType(int64_t var, EType type){
+	inline void setType(int64_t var, const EType& type){
 		if(var_types[var].primtype != Primitive::INVALID){
 			throw TypeError("Variable already has type " + var_types[var].to_str()
 					+ ", but was attempted to be redeclared with " + type.to_str());
 		}
 		var_types[var] = type;
 	}
+	/* Keeps the storage of the bounds, for the next type the variable gets (see CallStack) */
 	inline void deleteVar(int64_t var) noexcept {
-		var_types[var] = Primitive::INVALID;
+		var_types[var].primtype = Primitive::INVALID;
+		var_types[var].is_array = false;
+		var_types[var].bounds.clear();
 	}
 	inline void expectType(int64_t var, const EType& type) const {
 		if(var_types[var] != type){
@@ -95,55 +118,149 @@ public:
 		}
 	}
 private:
-	void allocArr(EValue *val, const Primitive primtype, const std::vector<std::pair<int64_t,int64_t>> bounds, size_t currpos){
-		if(currpos >= bounds.size()){
-			allocVar(val, primtype);
-			return;
-		}
-		// e.g. ARRAY[10:0]
-		if(bounds[currpos].first > bounds[currpos].second){
-			throw TypeError("Cannot have array with larger start index than end");
-		}
-		val->vals = new std::vector<EValue>(bounds[currpos].second - bounds[currpos].first + 1);
-		for(EValue& v : *val->vals){
-			allocArr(&v, primtype, bounds, currpos+1);
+	/* Arrays are stored flat, in row-major order:
+	 * ARRAY[1:2] OF ARRAY[1:3] has its elements at [1][1], [1][2], [1][3], [2][1], ... */
+	EValue *allocArr(const EType& etype, bool local){
+		for(const auto& b : etype.bounds){
+			// e.g. ARRAY[10:0]
+			if(b.first > b.second){
+				throw TypeError("Cannot have array with larger start index than end");
+			}
 		}
+		return local ? region.alloc(etype.size()) : new EValue[etype.size()];
 	}
 
 	inline void allocVar(EValue *val, const EType& etype){
 		// Only arrays need allocation (for now).
 		if(etype.is_array){
-			allocArr(val, etype.primtype, etype.bounds, 0);
+			val->arr = allocArr(etype, false);
+			std::fill(val->arr, val->arr + etype.size(), EValue((int64_t)0));
 		}
 	}
-	inline void copyArr(EValue *og, EValue *val, size_t dim){
-		if(dim == 0){
-			*val = *og;
-		} else {
-			val->vals = new std::vector<EValue>(og->vals->size());
-			for(size_t i = 0; i < og->vals->size(); i++){
-				copyArr(&(*og->vals)[i], &(*val->vals)[i], dim-1);
+public:
+	/* Memory for the arrays of a function call.
+	 * Allocating just bumps a pointer, and everything allocated after a `mark()`
+	 * is freed at once by `release()`.
+	 * Chunks are kept around after being released, for the next calls. */
+	class Region {
+		static constexpr size_t MIN_CHUNK = 1024;
+		std::vector<std::pair<std::unique_ptr<EValue[]>, size_t>> chunks; /* memory, size */
+		size_t chunk = 0; /* chunk we are allocating from */
+		size_t used = 0; /* amount used in that chunk */
+	public:
+		struct Mark {
+			size_t chunk, used;
+		};
+		inline Mark mark() const noexcept {
+			return { chunk, used };
+		}
+		inline void release(const Mark m) noexcept {
+			chunk = m.chunk;
+			used = m.used;
+		}
+		EValue *alloc(size_t n){
+			for(; chunk < chunks.size(); chunk++, used = 0){
+				if(chunks[chunk].second - used >= n){
+					EValue *res = chunks[chunk].first.get() + used;
+					used += n;
+					return res;
+				}
 			}
+			const size_t size = std::max({n, MIN_CHUNK, chunks.empty() ? 0 : 2*chunks.back().second});
+			chunks.emplace_back(std::make_unique<EValue[]>(size), size);
+			chunk = chunks.size() - 1;
+			used = n;
+			return chunks.back().first.get();
 		}
+	} region;
+
+	/* A variable hidden by a parameter while a function runs */
+	struct Hidden {
+		EType type;
+		EValue val;
+		int32_t level = 0;
+	};
+	/* Arguments of the tree-walker's calls and the variables they hide (see callFunc).
+	 * It only grows, and what it holds keeps its storage, so a call doesn't allocate
+	 * once it's been as deep before. */
+	class CallStack {
+		std::vector<EValue> args;
+		std::vector<Hidden> hidden;
+		size_t top = 0;
+	public:
+		/* `n` entries on top, until this goes */
+		class Frame {
+			CallStack& stack;
+			const size_t base;
+		public:
+			Frame(CallStack& stack_, size_t n) : stack(stack_), base(stack_.top) {
+				stack.top += n;
+				if(stack.args.size() < stack.top){
+					stack.args.resize(stack.top);
+					stack.hidden.resize(stack.top);
+				}
+			}
+			Frame(const Frame&) = delete;
+			Frame& operator=(const Frame&) = delete;
+			~Frame(){ stack.top = base; }
+			inline EValue& arg(size_t i) noexcept { return stack.args[base + i]; }
+			/* Only until the next Frame, which can move them */
+			inline EValue *args() noexcept { return stack.args.data() + base; }
+			inline Hidden& hidden(size_t i) noexcept { return stack.hidden[base + i]; }
+		};
+	} calls;
+
+	/* Moves variable `id` out of the way into `h`, type and all, and deletes it. */
+	inline void hideVar(int64_t id, Hidden& h) noexcept {
+		std::swap(h.type, var_types[id]);
+		h.val = var_vals[id];
+		h.level = var_call_level[id];
+		deleteVar(id);
 	}
-public:
+	/* Undoes hideVar */
+	inline void unhideVar(int64_t id, Hidden& h) noexcept {
+		deleteVar(id);
+		if(h.type == Primitive::INVALID) return;
+		std::swap(h.type, var_types[id]);
+		var_vals[id] = h.val;
+		var_call_level[id] = h.level;
+	}
+	/* hideVar for compiled programs, whose parameters and FOR variables aren't in Env:
+	 * the global keeps its value, but is undefined (its level below GLOBAL_LEVEL)
+	 * until every hideGlobal has been undone. Only for whole programs, which never
+	 * change call_number, so no variable has a level but GLOBAL_LEVEL otherwise. */
+	inline void hideGlobal(int64_t id) noexcept {
+		var_call_level[id]--;
+	}
+	inline void unhideGlobal(int64_t id) noexcept {
+		var_call_level[id]++;
+	}
+
 	inline void allocVar(int64_t id, const EType& type){
 		allocVar(&value_unchecked(id), type);
 	}
+	/* Arrays are copied into the target's storage, which always has the same size. */
 	inline void copyValue(EValue val, const EType& type, EValue *target) {
 		if(type.is_array){
-			copyArr(&val, target, type.bounds.size());
+			if(val.arr != target->arr){
+				std::copy(val.arr, val.arr + type.size(), target->arr);
+			}
 		} else {
 			*target = val;
 		}
 	}
-	inline void copyVar(EValue val, const EType& type, int32_t level, int64_t target_id) {
+	/* `local` arrays go in the region, and must not be used after it is released. */
+	inline void copyVar(EValue val, const EType& type, int32_t level, int64_t target_id, bool local = false) {
 		if(type == Primitive::INVALID) {
 			throw RuntimeError("Attempt to copy variable which doesn't exist");
 		}
 		setType(target_id, type);
 		setLevel(target_id, level);
-		copyValue(val, type, &value(target_id));
+		EValue& target = value(target_id);
+		if(type.is_array){
+			target.arr = allocArr(type, local);
+		}
+		copyValue(val, type, &target);
 	}
 	inline void initVar(int64_t id, int32_t call_level, const EType& type, const EValue val){
 		if(getType(id) != Primitive::INVALID){
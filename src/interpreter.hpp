@@ -1,6 +1,7 @@
 #ifndef INTERPRETER_HPP
 #define INTERPRETER_HPP
 
+#include <optional>
 #include "parser.hpp"
 
 
@@ -12,19 +13,59 @@ void expectTypeEqual(const EType& t1, const Args&... args){
 }
 
 /* More understandable error messages when we only expect one type */
-void expectTypeEqual(const EType& t1, const EType& t2){
+inline void expectTypeEqual(const EType& t1, const EType& t2){
 	if(t1 != t2){
 		throw TypeError("Bad type " + t1.to_str() + ", expected " + t2.to_str());
 	}
 }
 
+// Tiers {{{
+
+/* Faster ways of running the code that turns out to be hot, see tiers.hpp.
+ * The tree-walker counts the calls of every function and the back-edges of every loop,
+ * and hands them over when a count reaches its threshold. Once they've taken something,
+ * it goes straight back to them the next time. */
+class Tiers {
+public:
+	const uint32_t call_threshold, loop_threshold;
+	Tiers(uint32_t call_threshold_, uint32_t loop_threshold_) :
+		call_threshold(call_threshold_), loop_threshold(loop_threshold_) {}
+	virtual ~Tiers() = default;
+	/* Runs `func` with `args` (which have been checked), false leaves it to the tree-walker. */
+	virtual bool call(Env& env, int64_t id, const EFunc& func, const EValue *args, std::optional<EValue>& ret) = 0;
+	/* Carries on with a loop from a back-edge. A FOR also gets the value its variable
+	 * takes next, and its start, end and step.
+	 * Returns the RETURN the loop ran into (nullptr when it ended),
+	 * or nothing to leave it to the tree-walker. */
+	virtual std::optional<const Expr *> loop(Env& env, const Stmt<true>& stmt, const EValue *state) = 0;
+	virtual std::optional<const Expr *> loop(Env& env, const Stmt<false>& stmt, const EValue *state) = 0;
+};
+
+/* Counts a back-edge, true when the loop has just got hot */
+inline bool backEdge(const Env& env, uint32_t& hotness){
+	return env.tiers != nullptr && ++hotness == env.tiers->loop_threshold;
+}
+
+template<bool TopLevel>
+std::optional<const Expr *> tierUp(Env& env, const Stmt<TopLevel>& stmt, const EValue *state = nullptr){
+	const auto ret = env.tiers->loop(env, stmt, state);
+	// The next time the loop runs, its first back-edge goes back there.
+	if(ret) stmt.hotness--;
+	return ret;
+}
+
+// }}}
+
 // defFunc, callFunc {{{
 
-void defFunc(Env& env, const Stmt<true> &stmt){
+inline void defFunc(Env& env, const Stmt<true> &stmt){
 	uint_least8_t arity = stmt.params.size();
 	env.functable.try_emplace(stmt.ids[0], arity, EFunc::What::RUNTIME);
 	EFunc& func = env.functable[stmt.ids[0]];
 	func.func_loc = (void *)&stmt.blocks[0];
+	func.local_arrays = stmt.local_arrays;
+	func.calls = stmt.counts;
+	env.functableChanged();
 	for(size_t i = 0; i < stmt.params.size(); i++){
 		const Param &param = stmt.params[i];
 		if(param.byref) throw RuntimeError("BYREF is not supported");
@@ -36,69 +77,121 @@ void defFunc(Env& env, const Stmt<true> &stmt){
 	}
 }
 
-// Calls a function.
-const std::optional<EValue> callFunc(Env& env, int64_t id, const std::vector<Expr>& args) {
-	auto func_it = env.functable.find(id);
-	if(func_it == env.functable.end()){
-		throw RuntimeError("Cannot call non-function");
+// typeReads: the variables the type of an expression depends on (see CallCache) {{{
+
+template<uint16_t Level>
+void typeReads(const BinExpr<Level>& e, std::vector<int64_t>& reads);
+
+inline void typeReads(const Primary& p, std::vector<int64_t>& reads){
+	// The type of a call is the type it returns, and an element's type only depends on the array.
+	if(p.primtype() == TokenType::IDENTIFIER) reads.push_back(p.main().lvalue.id);
+	else if(p.primtype() == TokenType::INVALID) typeReads(*p.main().expr, reads);
+}
+
+inline void typeReads(const UnaryExpr& e, std::vector<int64_t>& reads){
+	if(e.op == TokenType::INVALID) typeReads(*e.main.primary, reads);
+	else typeReads(*e.main.unexpr, reads);
+}
+
+template<uint16_t Level>
+void typeReads(const BinExpr<Level>& e, std::vector<int64_t>& reads){
+	typeReads(e.left, reads);
+	if(e.opt.op != TokenType::INVALID) typeReads(*e.opt.right, reads);
+}
+
+// }}}
+
+/* Is `cache` still right for calling with `args`? */
+inline bool cacheHit(const Env& env, const CallCache& cache){
+	if(cache.func == nullptr || cache.version != env.functable_version) return false;
+	for(size_t i = 0; i < cache.reads.size(); i++){
+		if(env.getType(cache.reads[i]) != cache.read_types[i]) return false;
 	}
-	const EFunc &func = env.functable[id];
-	if(args.size() != func.arity){
-		throw RuntimeError("Invalid number of parameters for function");
+	return true;
+}
+
+/* A call found the stack full (see stack.hpp). The calls it leaves add their functions
+ * to `chain` on the way out, innermost first. */
+struct StackOverflow {
+	std::vector<int64_t> chain;
+};
+
+// Calls a function.
+inline const std::optional<EValue> callFunc(Env& env, int64_t id, const std::vector<Expr>& args, CallCache& cache) {
+	const bool hit = cacheHit(env, cache);
+	if(!hit){
+		auto func_it = env.functable.find(id);
+		if(func_it == env.functable.end()){
+			throw RuntimeError("Cannot call non-function");
+		}
+		cache.func = &func_it->second;
+		cache.version = 0;
+		if(args.size() != cache.func->arity){
+			throw RuntimeError("Invalid number of parameters for function");
+		}
+		if(!cache.collected){
+			for(const Expr& arg : args) typeReads(arg, cache.reads);
+			cache.collected = true;
+		}
+		cache.read_types.clear();
+		for(const int64_t var : cache.reads) cache.read_types.push_back(env.getType(var));
 	}
-	const std::unique_ptr<EValue[]> argvals(new EValue[func.arity]);
+	const EFunc &func = *cache.func;
+	Env::CallStack::Frame frame(env.calls, func.arity);
 	for(size_t i = 0; i < args.size(); i++){
-		expectTypeEqual(args[i].type(env), func.types[i]);
-		argvals[i] = args[i].eval(env);
+		if(!hit) expectTypeEqual(args[i].type(env), func.types[i]);
+		// The call can grow env.calls.
+		const EValue val = args[i].eval(env);
+		frame.arg(i) = val;
 	}
+	// The arguments checked out.
+	if(!hit) cache.version = env.functable_version;
 	std::optional<EValue> retval = std::nullopt;
 	if(func.what == EFunc::What::BUILTIN){ // builtin function
 		// Builtin functions take an array of `EValue`s and return an EValue
 		auto func_ptr = (EValue (*)(EValue *))func.func_loc;
-		EValue ret = func_ptr(argvals.get());
+		EValue ret = func_ptr(frame.args());
 		if(func.ret_type != Primitive::INVALID){
 			retval = ret;
 		}
 	} else { // runtime function
-		std::vector<EType> old_types(func.arity);
-		std::vector<EValue> old_vals(func.arity);
-		std::vector<int32_t> old_levels(func.arity);
-		{
-			// Keep track of the old variables.
-			for(size_t i = 0; i < args.size(); i++){
-				int64_t ident = func.ids[i];
-				old_types[i] = env.getType(ident);
-				if(old_types[i] != Primitive::INVALID){
-					old_vals[i] = env.getValue(ident);
-					old_levels[i] = env.getLevel(ident);
-				}
-			}
-			// Put in the new ones.
-			env.call_number++;
-			for(size_t i = 0; i < args.size(); i++){
-				int64_t ident = func.ids[i];
-				env.deleteVar(ident);
-				env.copyVar(argvals[i], func.types[i], env.call_number, ident);
-			}
-		}
-		const Expr *ret = ((Block *)func.func_loc)->eval(env);
-		if(ret == nullptr && func.ret_type != Primitive::INVALID){ // should have returned, but didn't
-			throw TypeError("Function didn't return");
+		const char here = 0;
+		if(reinterpret_cast<uintptr_t>(&here) < env.stack_low) throw StackOverflow{ { id } };
+		if(env.tiers != nullptr && ++func.hotness == env.tiers->call_threshold
+				&& env.tiers->call(env, id, func, frame.args(), retval)){
+			// Every call from now on goes there.
+			func.hotness--;
+			return retval;
 		}
-		if(ret != nullptr){
-			// make sure the return type and the expr are equal
-			expectTypeEqual(ret->type(env), func.ret_type);
-			retval = ret->eval(env);
+		const Env::Region::Mark mark = env.region.mark();
+		if(func.calls != nullptr) ++*func.calls;
+		// Keep the old variables out of the way.
+		for(size_t i = 0; i < args.size(); i++) env.hideVar(func.ids[i], frame.hidden(i));
+		// Put in the new ones.
+		env.call_number++;
+		for(size_t i = 0; i < args.size(); i++){
+			env.deleteVar(func.ids[i]);
+			env.copyVar(frame.arg(i), func.types[i], env.call_number, func.ids[i], func.local_arrays);
 		}
-		env.call_number--;
-		// Restore the old variables.
-		for(size_t i = 0; i < func.arity; i++){
-			int64_t varid = func.ids[i];
-			env.deleteVar(varid);
-			if(old_types[i] != Primitive::INVALID){
-				env.initVar(varid, old_levels[i], old_types[i], old_vals[i]);
+		try {
+			const Expr *ret = ((Block *)func.func_loc)->eval(env);
+			if(ret == nullptr && func.ret_type != Primitive::INVALID){ // should have returned, but didn't
+				throw TypeError("Function didn't return");
+			}
+			if(ret != nullptr){
+				// make sure the return type and the expr are equal
+				expectTypeEqual(ret->type(env), func.ret_type);
+				retval = ret->eval(env);
 			}
+		} catch(StackOverflow& e){
+			e.chain.push_back(id);
+			throw;
 		}
+		env.call_number--;
+		// Restore the old variables, backwards for a parameter named twice.
+		for(size_t i = func.arity; i-- > 0;) env.unhideVar(func.ids[i], frame.hidden(i));
+		// Nothing points to the parameters anymore, see the escape analysis in optimizer.hpp.
+		env.region.release(mark);
 	}
 	return retval;
 }
@@ -107,7 +200,7 @@ const std::optional<EValue> callFunc(Env& env, int64_t id, const std::vector<Exp
 
 // Primary, (Unary|Bin)Expr (all the eval() functions which return `EValue`s) {{{
 
-EValue Primary::eval(Env& env) const {
+inline EValue Primary::eval(Env& env) const {
 #define IF(x) if(all.primtype == TokenType:: x) 
 	IF(REAL_C) return main().lt.frac;
 	IF(INT_C) return main().lt.i64;
@@ -119,7 +212,7 @@ EValue Primary::eval(Env& env) const {
 	IF(IDENTIFIER) return all.main.lvalue.eval(env);
 	IF(CALL) {
 		// Typechecking should be done for us. :P
-		const std::optional<EValue> retval = callFunc(env, all.func_id, *all.main.args);
+		const std::optional<EValue> retval = callFunc(env, all.func_id, *all.main.args, *all.call);
 		if(!retval) {
 			throw TypeError("Cannot call procedure without using CALL");
 		}
@@ -129,7 +222,21 @@ EValue Primary::eval(Env& env) const {
 	throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
 }
 
-EType Primary::type(Env& env) const {
+inline Primitive Primary::kind(Env& env) const {
+	switch(all.primtype){
+		case TokenType::IDENTIFIER: return all.main.lvalue.kind(env);
+		case TokenType::INT_C: return Primitive::INTEGER;
+		case TokenType::REAL_C: return Primitive::REAL;
+		case TokenType::INVALID: return all.main.expr->kind(env);
+		default:
+			{
+				const EType t = type(env);
+				return t.is_array ? Primitive::INVALID : t.primtype;
+			}
+	}
+}
+
+inline EType Primary::type(Env& env) const {
 #define RET(x) return Primitive:: x
 	IF(REAL_C) RET(REAL);
 	IF(INT_C) RET(INTEGER);
@@ -140,6 +247,9 @@ EType Primary::type(Env& env) const {
 	IF(STR_C) RET(STRING);
 	IF(IDENTIFIER) return all.main.lvalue.type(env);
 	IF(CALL){
+		if(all.call->func != nullptr && all.call->version == env.functable_version){
+			return all.call->func->ret_type;
+		}
 		auto func_it = env.functable.find(all.func_id);
 		if(func_it == env.functable.end()){
 			throw RuntimeError("Cannot call non-function");
@@ -156,55 +266,230 @@ EType Primary::type(Env& env) const {
 	throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
 }
 
-EValue LValue::eval(Env& env) const {
-	const EType& type = env.getType(id);
+inline EValue *LValue::locate(Env& env) const {
 	if(indexes != nullptr){
-		const EValue *val = &env.getValue(id);
+		if(cse.isUse()) return cse.slot->ref;
+		if(iv != nullptr && iv->active){
+			EValue *val = iv->base + iv->pos;
+			if(cse.def) cse.slot->ref = val;
+			return val;
+		}
+		const EType& type = env.getType(id);
+		EValue *val = &env.value(id);
 		if(indexes->size() != type.bounds.size()){
 			throw TypeError("Cannot index a non-array");
 		}
+		// Once the indexes have been INTEGERs, they're only checked after evaluating them.
+		size_t offset = 0;
 		for(size_t i = 0; i < type.bounds.size(); i++){
-			expectTypeEqual((*indexes)[i].type(env), Primitive::INTEGER);
-			const int64_t index = (*indexes)[i].eval(env).i64;
+			const Expr& expr = (*indexes)[i];
+			if(spec != Spec::INT) expectTypeEqual(expr.type(env), Primitive::INTEGER);
+			const int64_t index = expr.eval(env).i64;
+			if(spec == Spec::INT && expr.kind(env) != Primitive::INTEGER){
+				spec = Spec::GENERIC;
+				expectTypeEqual(expr.type(env), Primitive::INTEGER);
+			}
 			if(index < type.bounds[i].first || index > type.bounds[i].second){
 				throw RuntimeError("Out-of-bounds index " + std::to_string(index));
 			}
-			val = &(*val->vals)[index - type.bounds[i].first];
+			offset = offset * (type.bounds[i].second - type.bounds[i].first + 1)
+				+ (index - type.bounds[i].first);
 		}
-		return *val;
+		if(spec == Spec::UNINIT) spec = Spec::INT;
+		val = &val->arr[offset];
+		if(cse.def) cse.slot->ref = val;
+		return val;
 	} else {
-		return env.getValue(id);
+		return &env.value(id);
 	}
 }
 
-EValue& LValue::ref(Env& env) const {
-	const EType& type = env.getType(id);
-	if(indexes != nullptr){
-		EValue *val = &env.value(id);
-		if(indexes->size() != type.bounds.size()){
-			throw TypeError("Cannot index a non-array");
-		}
-		for(size_t i = 0; i < type.bounds.size(); i++){
-			expectTypeEqual((*indexes)[i].type(env), Primitive::INTEGER);
-			const int64_t index = (*indexes)[i].eval(env).i64;
-			if(index < type.bounds[i].first || index > type.bounds[i].second){
-				throw RuntimeError("Out-of-bounds index " + std::to_string(index));
+// Induction::start {{{
+
+/* Evaluates a loop invariant index (see isInvariant() in optimizer.hpp).
+ * Returns false instead of throwing if it can't be evaluated,
+ * so the access is left for the interpreter to report. */
+template<uint16_t Level>
+bool evalInvariant(const BinExpr<Level>& e, Env& env, int64_t& res);
+
+inline bool evalInvariant(const Primary& p, Env& env, int64_t& res){
+	switch(p.primtype()){
+		case TokenType::INT_C:
+			res = p.main().lt.i64;
+			return true;
+		case TokenType::IDENTIFIER:
+			{
+				const int64_t id = p.main().lvalue.id;
+				if(p.main().lvalue.indexes != nullptr || !env.checkLevel(id)
+					|| env.getType(id) != Primitive::INTEGER){
+					return false;
+				}
+				res = env.value_unchecked(id).i64;
+				return true;
 			}
-			val = &(*val->vals)[index - type.bounds[i].first];
-		}
-		return *val;
+		case TokenType::INVALID:
+			return evalInvariant(*p.main().expr, env, res);
+		default:
+			return false;
+	}
+}
+
+inline bool evalInvariant(const UnaryExpr& e, Env& env, int64_t& res){
+	if(e.op == TokenType::INVALID) return evalInvariant(*e.main.primary, env, res);
+	if(e.op != TokenType::MINUS || !evalInvariant(*e.main.unexpr, env, res)) return false;
+	res = -res;
+	return true;
+}
+
+template<uint16_t Level>
+bool evalInvariant(const BinExpr<Level>& e, Env& env, int64_t& res){
+	if(!evalInvariant(e.left, env, res)) return false;
+	if(e.opt.op == TokenType::INVALID) return true;
+	int64_t right;
+	if(!evalInvariant(*e.opt.right, env, right)) return false;
+	switch(e.opt.op){
+		case TokenType::PLUS: res += right; return true;
+		case TokenType::MINUS: res -= right; return true;
+		case TokenType::STAR: res *= right; return true;
+		default: return false;
+	}
+}
+
+inline void Induction::start(Env& env, int64_t from, int64_t to, int64_t step){
+	active = false;
+	// Find the last value the loop variable takes (see LOOPCOND in Stmt::eval).
+	// Loops that never end are left alone.
+	int64_t last;
+	if(from <= to && step > 0){
+		last = from + (int64_t)(((uint64_t)to - (uint64_t)from) / step * step);
+	} else if(from > to && step < 0){
+		last = from - (int64_t)(((uint64_t)from - (uint64_t)to) / -(uint64_t)step * -(uint64_t)step);
 	} else {
-		return env.value(id);
+		return;
+	}
+	const int64_t lo = std::min(from, last), hi = std::max(from, last);
+	const EType& type = env.getType(lv->id);
+	if(!env.checkLevel(lv->id) || !type.is_array || type.bounds.size() != by_loopvar.size()){
+		return;
+	}
+	// Every access has to be in bounds, otherwise the interpreter has to report it.
+	ptrdiff_t offset = 0, iv_stride = 0;
+	for(size_t i = 0; i < type.bounds.size(); i++){
+		const auto [first, second] = type.bounds[i];
+		offset *= second - first + 1;
+		iv_stride *= second - first + 1;
+		if(by_loopvar[i]){
+			if(lo < first || hi > second) return;
+			offset += from - first;
+			iv_stride++;
+		} else {
+			int64_t index;
+			if(!evalInvariant((*lv->indexes)[i], env, index)) return;
+			if(index < first || index > second) return;
+			offset += index - first;
+		}
 	}
+	base = env.value_unchecked(lv->id).arr;
+	pos = offset;
+	stride = iv_stride * step;
+	active = true;
 }
 
-EValue UnaryExpr::eval(Env& env) const {
+// }}}
+
+// Idiom::run {{{
+
+inline bool Idiom::run(Env& env, int64_t from, int64_t to, int64_t step, int64_t& next) const {
+	// Loops going the other way never end, and to + 1 has to exist.
+	if(step != 1 || from > to || from == INT64_MIN || to == INT64_MAX) return false;
+	const EType& type = env.getType(arr);
+	if(!env.checkLevel(arr) || !type.is_array || type.bounds.size() != 1 || type.primtype != Primitive::INTEGER){
+		return false;
+	}
+	// Every access has to be in bounds, otherwise the interpreter has to report it.
+	const auto [first, second] = type.bounds[0];
+	if(from + offset < first || to + offset + (kind == Kind::BUBBLE) > second) return false;
+	if(kind != Kind::FIND){
+		const Primitive want = (kind == Kind::SEARCH && value != TokenType::IDENTIFIER ? Primitive::BOOLEAN : Primitive::INTEGER);
+		if(!env.checkLevel(var) || env.getType(var) != want) return false;
+	}
+	int64_t k = 0;
+	if(key != nullptr && !evalInvariant(*key, env, k)) return false;
+
+	EValue *a = env.value_unchecked(arr).arr + (from + offset - first);
+	const size_t n = to - from + 1;
+	const auto test = [this](int64_t l, int64_t r){
+		switch(cmp){
+			case TokenType::EQ: return l == r;
+			case TokenType::GT: return l > r;
+			case TokenType::LT: return l < r;
+			case TokenType::GT_EQ: return l >= r;
+			case TokenType::LT_EQ: return l <= r;
+			default: return l != r;
+		}
+	};
+	EValue& v = env.value_unchecked(var);
+	next = to + 1;
+	switch(kind){
+		case Kind::SUM:
+			{
+				// (wraps around like the interpreter does)
+				uint64_t sum = v.i64;
+				for(size_t i = 0; i < n; i++) sum += a[i].i64;
+				v.i64 = sum;
+			}
+			break;
+		case Kind::COUNT:
+			{
+				uint64_t count = v.i64;
+				for(size_t i = 0; i < n; i++) count += test(a[i].i64, k);
+				v.i64 = count;
+			}
+			break;
+		case Kind::REPLACE:
+			for(size_t i = 0; i < n; i++){
+				if(test(a[i].i64, v.i64)) v.i64 = a[i].i64;
+			}
+			break;
+		case Kind::SEARCH:
+			for(size_t i = n; i-- > 0;){
+				if(test(a[i].i64, k)){
+					if(value == TokenType::IDENTIFIER) v.i64 = from + i;
+					else v.b = (value == TokenType::TRUE);
+					break;
+				}
+			}
+			break;
+		case Kind::FIND:
+			// The interpreter runs the iteration that returns.
+			for(size_t i = 0; i < n; i++){
+				if(test(a[i].i64, k)){
+					next = from + i;
+					break;
+				}
+			}
+			break;
+		case Kind::BUBBLE:
+			for(size_t i = 0; i < n; i++){
+				if(test(a[i].i64, a[i + 1].i64)){
+					v.i64 = (value == TokenType::LEFT_SQ ? a[i].i64 : a[i + 1].i64);
+					std::swap(a[i], a[i + 1]);
+				}
+			}
+			break;
+	}
+	return true;
+}
+
+// }}}
+
+inline EValue UnaryExpr::eval(Env& env) const {
 	if(op == TokenType::INVALID){
 		return main.primary->eval(env);
 	} else if(op == TokenType::NOT){
-		expectTypeEqual(main.unexpr->type(env), Primitive::INTEGER);
+		expectTypeEqual(main.unexpr->type(env), Primitive::BOOLEAN);
 		/* Did you know C++ has a `not` keyword? :) */
-		return not (main.primary->eval(env).b);
+		return not (main.unexpr->eval(env).b);
 	} else if(op == TokenType::MINUS){
 		const auto& type = main.unexpr->type(env);
 		expectTypeEqual(type, Primitive::INTEGER, Primitive::REAL);
@@ -225,6 +510,10 @@ EType BinExpr<Level>::type(Env& env) const {
 		const EType rtype = opt.right->type(env);
 		if constexpr (Level == 3){
 			// Plus, Minus
+			if(!(isAnyOf(ltype, Primitive::REAL, Primitive::INTEGER) &&
+				 isAnyOf(rtype, Primitive::REAL, Primitive::INTEGER))){
+				throw TypeError("Invalid type applied to math expression");
+			}
 			// Choose which one is a REAL
 			if(rtype == Primitive::REAL) return rtype;
 			else if(ltype == Primitive::REAL) return ltype;
@@ -257,16 +546,145 @@ EType BinExpr<Level>::type(Env& env) const {
 
 template<uint16_t Level>
 EValue BinExpr<Level>::eval(Env& env) const {
+	if(cse.isUse()) return cse.slot->val;
+	const EValue res = compute(env);
+	if(cse.def) cse.slot->val = res;
+	return res;
+}
+
+/* `l op r` for a comparison operator */
+template<typename L, typename R>
+inline bool compareBy(const TokenType op, const L& l, const R& r){
+	switch(op){
+		case TokenType::EQ: return l == r;
+		case TokenType::GT: return l > r;
+		case TokenType::LT: return l < r;
+		case TokenType::GT_EQ: return l >= r;
+		case TokenType::LT_EQ: return l <= r;
+		case TokenType::LT_GT: return l != r;
+		default: throw RuntimeError("Invalid operator for comparison expr. (INTERNAL ERROR)");
+	}
+}
+
+/* What a node with the operator `op` specializes to for operands of these types,
+ * GENERIC if it has no specialization for them */
+template<uint16_t Level>
+inline Spec specFor(const TokenType op, const Primitive l, const Primitive r) noexcept {
+	if(Level == 4 && (op == TokenType::MOD || op == TokenType::DIV)){
+		return l == Primitive::INTEGER && r == Primitive::INTEGER ? Spec::INT_INT : Spec::GENERIC;
+	}
+	if(l == Primitive::INTEGER){
+		if(r == Primitive::INTEGER) return Spec::INT_INT;
+		if(r == Primitive::REAL) return Spec::INT_REAL;
+	} else if(l == Primitive::REAL){
+		if(r == Primitive::INTEGER) return Spec::REAL_INT;
+		if(r == Primitive::REAL) return Spec::REAL_REAL;
+	}
+	return Spec::GENERIC;
+}
+
+template<uint16_t Level>
+Primitive BinExpr<Level>::kind(Env& env) const {
+	if(opt.op == TokenType::INVALID) return left.kind(env);
+	if constexpr (Level <= 2) return Primitive::BOOLEAN;
+	switch(spec){
+		case Spec::INT_INT:
+			return Level == 4 && opt.op == TokenType::SLASH ? Primitive::REAL : Primitive::INTEGER;
+		case Spec::INT_REAL:
+		case Spec::REAL_INT:
+		case Spec::REAL_REAL:
+			return Primitive::REAL;
+		default:
+			return type(env).primtype;
+	}
+}
+
+/* Arithmetic and comparisons are specialized to the types of their operands,
+ * which are found with kind() after evaluating them rather than with type() beforehand.
+ * OR and AND only check that theirs are BOOLEANs the same way. */
+template<uint16_t Level>
+EValue BinExpr<Level>::compute(Env& env) const {
 	EValue leftval = left.eval(env);
 	if(opt.op == TokenType::INVALID) return leftval;
-	const EType ltype = left.type(env);
-	EValue rightval = opt.right->eval(env);
+	if constexpr (Level <= 1) {
+		const Primitive lkind = left.kind(env);
+		EValue rightval = opt.right->eval(env);
+		if(lkind != Primitive::BOOLEAN || opt.right->kind(env) != Primitive::BOOLEAN){
+			return generic(env, leftval, left.type(env), rightval);
+		}
+		if constexpr (Level == 0) leftval.b |= rightval.b;
+		else leftval.b &= rightval.b;
+		return leftval;
+	} else {
+		if(spec != Spec::GENERIC){
+			const Primitive lkind = left.kind(env);
+			const EValue rightval = opt.right->eval(env);
+			const Spec seen = specFor<Level>(opt.op, lkind, opt.right->kind(env));
+			if(spec == Spec::UNINIT) spec = seen;
+			if(spec == seen){
+				const EValue& l = leftval, & r = rightval;
+				if constexpr (Level == 2) {
+					switch(spec){
+						case Spec::INT_INT: return compareBy(opt.op, l.i64, r.i64);
+						case Spec::INT_REAL: return compareBy(mirrorComparison(opt.op), r.frac, l.i64);
+						case Spec::REAL_INT: return compareBy(opt.op, l.frac, r.i64);
+						case Spec::REAL_REAL: return compareBy(opt.op, l.frac, r.frac);
+						default: break;
+					}
+				} else if constexpr (Level == 3) {
+					const bool plus = opt.op == TokenType::PLUS;
+					switch(spec){
+						case Spec::INT_INT: return plus ? l.i64 + r.i64 : l.i64 - r.i64;
+						case Spec::INT_REAL: return plus ? Fraction<>(l.i64) + r.frac : Fraction<>(l.i64) - r.frac;
+						case Spec::REAL_INT: return plus ? l.frac + r.i64 : l.frac - r.i64;
+						case Spec::REAL_REAL: return plus ? l.frac + r.frac : l.frac - r.frac;
+						default: break;
+					}
+				} else /* if constexpr (Level == 4) */ {
+					switch(opt.op){
+						case TokenType::STAR:
+							switch(spec){
+								case Spec::INT_INT: return l.i64 * r.i64;
+								case Spec::INT_REAL: return Fraction<>(l.i64) * r.frac;
+								case Spec::REAL_INT: return l.frac * r.i64;
+								case Spec::REAL_REAL: return l.frac * r.frac;
+								default: break;
+							}
+							break;
+						case TokenType::SLASH:
+							return (spec == Spec::INT_INT || spec == Spec::INT_REAL ? Fraction<>(l.i64) : l.frac)
+								/ (spec == Spec::INT_INT || spec == Spec::REAL_INT ? Fraction<>(r.i64) : r.frac);
+						default: /* MOD, DIV */
+							if(r.i64 == 0){
+								throw RuntimeError("Cannot divide by zero");
+							}
+							// INT64_MIN / -1 overflows (and traps), it wraps like the VM instead
+							if(r.i64 == -1) return opt.op == TokenType::DIV ? (int64_t)-(uint64_t)l.i64 : (int64_t)0;
+							return opt.op == TokenType::DIV ? l.i64 / r.i64 : l.i64 % r.i64;
+					}
+				}
+			}
+			spec = Spec::GENERIC;
+			return generic(env, leftval, left.type(env), rightval);
+		}
+		const EType ltype = left.type(env);
+		return generic(env, leftval, ltype, opt.right->eval(env));
+	}
+}
+
+/* Any types, checking that they can be used together */
+template<uint16_t Level>
+EValue BinExpr<Level>::generic(Env& env, EValue leftval, const EType& ltype, EValue rightval) const {
 	if constexpr (Level == 0) {
 		// OR
+		expectTypeEqual(ltype, Primitive::BOOLEAN);
+		expectTypeEqual(opt.right->type(env), Primitive::BOOLEAN);
 		leftval.b |= rightval.b;
 		return leftval;
 	} else if constexpr (Level == 1) {
 		// AND
+		expectTypeEqual(ltype, Primitive::BOOLEAN);
+		expectTypeEqual(opt.right->type(env), Primitive::BOOLEAN);
 		leftval.b &= rightval.b;
 		return leftval;
 	} else if constexpr (Level == 2){
@@ -289,7 +707,8 @@ EValue BinExpr<Level>::eval(Env& env) const {
 		if(ltype == Primitive::REAL && rtype == Primitive::INTEGER){
 			OPAPPLY(leftval.frac, rightval.i64, opt.op);
 		} else if(ltype == Primitive::INTEGER && rtype == Primitive::REAL){
-			OPAPPLY(rightval.frac, leftval.i64, opt.op);
+			// The same comparison from the other side, e.g. `1 < x` is `x > 1`
+			OPAPPLY(rightval.frac, leftval.i64, mirrorComparison(opt.op));
 		}
 		if(ltype != rtype) throw TypeError("Cannot compare two different types");
 		if(ltype.is_array) throw TypeError("Cannot compare arrays");
@@ -336,7 +755,7 @@ EValue BinExpr<Level>::eval(Env& env) const {
 	} else { \
 		if(rtype == Primitive::REAL){ \
 			leftval.frac = Fraction<>(leftval.i64);\
-			leftval.frac -= rightval.frac;\
+			leftval.frac op##= rightval.frac;\
 		}\
 		else leftval.i64 op##= rightval.i64; \
 	}\
@@ -360,6 +779,12 @@ EValue BinExpr<Level>::eval(Env& env) const {
 			case TokenType::DIV:
 				expectTypeEqual(ltype, Primitive::INTEGER);
 				expectTypeEqual(rtype, Primitive::INTEGER);
+				if(rightval.i64 == 0){
+					throw RuntimeError("Cannot divide by zero");
+				}
+				if(rightval.i64 == -1){
+					return opt.op == TokenType::DIV ? (int64_t)-(uint64_t)leftval.i64 : (int64_t)0;
+				}
 				return (opt.op == TokenType::DIV ? 
 						leftval.i64 / rightval.i64 :
 						leftval.i64 % rightval.i64);
@@ -373,7 +798,7 @@ EValue BinExpr<Level>::eval(Env& env) const {
 
 // {Stmt<>, Block, Program}::{eval, type} {{{
 
-EType Type::to_etype(Env& env, bool is_top) const {
+inline EType Type::to_etype(Env& env, bool is_top) const {
 	if(is_array()){
 		auto nextType = all.name.rec->to_etype(env, false);
 		if(!(all.start->type(env) == Primitive::INTEGER && all.end->type(env) == Primitive::INTEGER)){
@@ -438,11 +863,15 @@ anylevelstmt:
 					throw RuntimeError("Undefined variable");
 				}
 				const EType exprtype = exprs[0].type(env);
+				// The right hand side is always evaluated before the target is located,
+				// the optimizer relies on this order.
 				if(type == Primitive::REAL && exprtype == Primitive::INTEGER){
-					lvalues[0].ref(env).frac = Fraction<>(exprs[0].eval(env).i64);
+					const Fraction<> val(exprs[0].eval(env).i64);
+					lvalues[0].ref(env).frac = val;
 				} else {
 					expectTypeEqual(exprtype, type);
-					env.copyValue(exprs[0].eval(env), type, &lvalues[0].ref(env));
+					const EValue val = exprs[0].eval(env);
+					env.copyValue(val, type, &lvalues[0].ref(env));
 				}
 			}
 			break;
@@ -458,8 +887,11 @@ anylevelstmt:
 		CASE(IF):
 			expectTypeEqual(exprs[0].type(env), Primitive::BOOLEAN);
 			if(exprs[0].eval(env).b){
+				if(counts != nullptr) counts[0]++;
 				return blocks[0].eval(env);
-			} else if(blocks.size() == 2){ // if there is an ELSE statement
+			}
+			if(counts != nullptr) counts[1]++;
+			if(blocks.size() == 2){ // if there is an ELSE statement
 				return blocks[1].eval(env);
 			}
 			break;
@@ -501,10 +933,12 @@ anylevelstmt:
 #undef PRIM
 					}
 					if(result){
+						if(counts != nullptr) counts[i]++;
 						return blocks[i].eval(env);
 						goto endcase;
 					}
 				}
+				if(counts != nullptr) counts[exprs.size()]++;
 				if(blocks.size() > exprs.size()){
 					// the last block is an OTHERWISE
 					return blocks.back().eval(env);
@@ -540,6 +974,7 @@ endcase:
 				env.setType(ids[0], is_frac ? Primitive::REAL : Primitive::INTEGER);
 				env.setLevel(ids[0], env.call_number); // Assigns the scope. (See environment.hpp).
 				// (We'll assign the value in the individual cases.)
+				if(counts != nullptr) counts[0]++;
 
 				// The loop condition can change depending on how it is written.
 				// `FOR i <- 1 TO 10 STEP 2` => `for(i = 1; i <= 10; i += 2)`
@@ -561,26 +996,53 @@ endcase:
 						LOOPCOND(vals[0].frac, vals[1].frac, loopvar);
 						loopvar += step){
 						env.value(ids[0]) = loopvar;
+						if(counts != nullptr) counts[1]++;
 						const Expr *ret = blocks[0].eval(env);
 						if(ret != nullptr){
 							// The loop returned
 							return ret;
 						}
+						if(backEdge(env, hotness)){
+							const EValue state[4] = { loopvar + step, vals[0], vals[1], step };
+							if(const auto tiered = tierUp(env, *this, state)){
+								if(*tiered != nullptr) return *tiered;
+								break;
+							}
+						}
 					}
 				} else {
 					// Integer for loop.
 					const auto step = (exprs.size() == 3 ? vals[2].i64 : 1);
+					// An idiom runs the loop (or the part of it before a RETURN) by itself.
+					auto start = vals[0].i64;
+					if(idiom) idiom->run(env, vals[0].i64, vals[1].i64, step, start);
+					if(counts != nullptr) counts[1] += start - vals[0].i64;
+					for(Induction& ind : inductions) ind.start(env, start, vals[1].i64, step);
 					for(
-						auto loopvar = vals[0].i64;
+						auto loopvar = start;
 						LOOPCOND(vals[0].i64, vals[1].i64, loopvar);
 						loopvar += step){
 						env.value(ids[0]) = loopvar;
+						if(counts != nullptr) counts[1]++;
 						const Expr *ret = blocks[0].eval(env);
 						if(ret != nullptr){
 							// loop returned
+							for(Induction& ind : inductions) ind.active = false;
 							return ret;
 						}
+						for(Induction& ind : inductions) ind.next();
+						if(backEdge(env, hotness)){
+							const EValue state[4] = { (int64_t)(loopvar + step), vals[0], vals[1], (int64_t)step };
+							if(const auto tiered = tierUp(env, *this, state)){
+								if(*tiered != nullptr){
+									for(Induction& ind : inductions) ind.active = false;
+									return *tiered;
+								}
+								break;
+							}
+						}
 					}
+					for(Induction& ind : inductions) ind.active = false;
 				}
 #undef LOOPCOND
 				// Restore the old variable.
@@ -594,21 +1056,32 @@ endcase:
 			break;
 		CASE(REPEAT):
 			expectTypeEqual(exprs[0].type(env), Primitive::BOOLEAN);
-			do {
+			if(counts != nullptr) counts[0]++;
+			for(;;){
+				if(counts != nullptr) counts[1]++;
 				const Expr *ret = blocks[0].eval(env);
 				if(ret != nullptr) return ret;
-			} while(!exprs[0].eval(env).b);
+				if(exprs[0].eval(env).b) break;
+				if(backEdge(env, hotness)){
+					if(const auto tiered = tierUp(env, *this)) return *tiered;
+				}
+			}
 			break;
 		CASE(WHILE):
 			expectTypeEqual(exprs[0].type(env), Primitive::BOOLEAN);
+			if(counts != nullptr) counts[0]++;
 			while(exprs[0].eval(env).b){
+				if(counts != nullptr) counts[1]++;
 				const Expr *ret = blocks[0].eval(env);
 				if(ret != nullptr) return ret;
+				if(backEdge(env, hotness)){
+					if(const auto tiered = tierUp(env, *this)) return *tiered;
+				}
 			}
 			break;
 		CASE(CALL):
 			// all the typechecking will be done for us
-			callFunc(env, ids[0], exprs);
+			callFunc(env, ids[0], exprs, *call);
 			break;
 		default:
 			// RETURN will be handled in Block::eval.
@@ -618,7 +1091,7 @@ endcase:
 #undef CASE
 }
 
-const Expr *Block::eval(Env& env) const {
+inline const Expr *Block::eval(Env& env) const {
 	for(const auto& stmt : stmts){
 		if(stmt.form == StmtForm::RETURN){
 			return &stmt.exprs[0];
@@ -633,7 +1106,7 @@ const Expr *Block::eval(Env& env) const {
 	return nullptr;
 }
 
-void Program::eval(Env& env) const {
+inline void Program::eval(Env& env) const {
 	for(const auto& stmt : stmts){
 		stmt.eval(env);
 	}
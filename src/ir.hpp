@@ -0,0 +1,655 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "value.hpp"
+#include "lexer.hpp"
+
+/* A typed intermediate representation in SSA form.
+ *
+ * Every function is a list of basic blocks, each ending in exactly one terminator
+ * (BR, CBR, RET or THROW). Every instruction defines at most one value, named by
+ * its index in Function::insts, and every value is defined exactly once.
+ * Where control flow joins, PHI instructions (always first in their block) pick
+ * the value coming from each predecessor, in the order of Block::preds.
+ *
+ * Types are static: each instruction knows the EType it produces, and
+ * the arithmetic and comparison opcodes are split by operand type,
+ * so a pass never has to look at the syntax tree again.
+ * See lowering.hpp for how the syntax tree gets here, irpasses.hpp for what is done
+ * with it and irexec.hpp for running it. */
+
+namespace ir {
+
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+class IRError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Opcodes {{{
+
+/* What an instruction may do, besides computing its result. */
+enum OpFlags : uint8_t {
+	PURE = 0, /* nothing: can be moved, merged or removed */
+	THROWS = 1, /* may throw, but always does the same for the same operands */
+	MEMORY = 2, /* reads memory that other instructions can change */
+	EFFECT = 4, /* changes something outside of its result */
+	TERM = 8, /* ends a block */
+};
+
+/* INST(name, flags)
+ * The comment after each is its operands and the meaning of a, b and imm.
+ * Suffixes: I is INTEGER, R is REAL, RI is a REAL and an INTEGER (in that order),
+ * C, B, S and D are CHAR, BOOLEAN, STRING and DATE. */
+#define IR_OPS \
+	INST(CONST, PURE) /* imm */ \
+	INST(UNDEF, PURE) /* value of a variable on a path that never defines it */ \
+	INST(PARAM, PURE) /* a = index */ \
+	INST(PHI, PURE) /* one value per predecessor */ \
+	INST(SELECT, PURE) /* cond, if true, if false */ \
+	INST(ADDI, PURE) INST(SUBI, PURE) INST(MULI, PURE) INST(NEGI, PURE) \
+	INST(DIVI, THROWS) INST(MODI, THROWS) \
+	INST(ADDR, THROWS) INST(SUBR, THROWS) INST(MULR, THROWS) INST(DIVR, THROWS) INST(NEGR, THROWS) \
+	INST(ADDRI, THROWS) INST(SUBRI, THROWS) INST(MULRI, THROWS) \
+	INST(ITOR, PURE) /* INTEGER to REAL */ \
+	INST(CMPI, PURE) INST(CMPR, PURE) INST(CMPRI, PURE) /* a = the comparison's TokenType */ \
+	INST(CMPC, PURE) INST(CMPB, PURE) INST(CMPS, PURE) INST(CMPD, PURE) \
+	INST(AND, PURE) INST(OR, PURE) INST(NOT, PURE) \
+	INST(LOADG, THROWS | MEMORY) /* a = global variable id */ \
+	INST(STOREG, THROWS | EFFECT) /* value; a = global variable id */ \
+	INST(DECLAREG, THROWS | EFFECT) /* [value]; a = global variable id, the type is the declared one */ \
+	INST(HIDEG, EFFECT) /* a = global variable id, undefined for the functions called until UNHIDEG (see Env::hideGlobal) */ \
+	INST(UNHIDEG, EFFECT) /* a = global variable id */ \
+	INST(LOADE, MEMORY) /* array, offset */ \
+	INST(STOREE, EFFECT) /* array, offset, value */ \
+	INST(CHECK, THROWS) /* index; a, b = bounds, imm = which of them to check (1 lower, 2 upper) */ \
+	INST(NEWARR, PURE) /* a = size, every element is 0 */ \
+	INST(COPYARR, EFFECT) /* target, source; a = size */ \
+	INST(COPYNEW, PURE) /* array; a = size. A new copy, freed on return if the function allows it */ \
+	INST(INPUT, EFFECT) \
+	INST(OUTPUT, THROWS | EFFECT) /* value */ \
+	INST(NEWLINE, EFFECT) \
+	INST(CALL, THROWS | MEMORY | EFFECT) /* arguments; a = function */ \
+	INST(CALLB, MEMORY | EFFECT) /* arguments; a = builtin function pointer */ \
+	INST(CHECKDEF, THROWS) /* a = function, throws if it hasn't been defined yet */ \
+	INST(DEFFUNC, EFFECT) /* a = function */ \
+	INST(DEFINED, MEMORY) /* a = function, whether DEFFUNC has defined it yet */ \
+	INST(BR, TERM) /* targets[0] */ \
+	INST(CBR, TERM) /* cond; targets[0] if true, targets[1] if false */ \
+	INST(RET, TERM) /* [value] */ \
+	INST(THROW, TERM) /* a = 0 for TypeError and 1 for RuntimeError, b = message */
+
+enum class Op : uint8_t {
+#define INST(name, flags) name,
+	IR_OPS
+#undef INST
+};
+
+const std::vector<std::string_view> op_to_str = {
+#define INST(name, flags) #name,
+	IR_OPS
+#undef INST
+};
+
+const std::vector<uint8_t> op_flags = {
+#define INST(name, flags) flags,
+	IR_OPS
+#undef INST
+};
+
+inline std::string_view opToStr(const Op op){
+	return op_to_str[static_cast<int>(op)];
+}
+inline uint8_t opFlags(const Op op){
+	return op_flags[static_cast<int>(op)];
+}
+inline bool isTerminator(const Op op){
+	return opFlags(op) & TERM;
+}
+/* Can it go away if nothing uses its result? */
+inline bool isRemovable(const Op op){
+	return !(opFlags(op) & (THROWS | EFFECT | TERM));
+}
+/* Does it always give the same result for the same operands? */
+inline bool isDeterministic(const Op op){
+	return !(opFlags(op) & (MEMORY | EFFECT | TERM)) && op != Op::UNDEF && op != Op::PARAM
+		&& op != Op::PHI && op != Op::NEWARR && op != Op::COPYNEW;
+}
+
+// }}}
+
+// Inst, Block, Function, Module {{{
+
+struct Inst {
+	Op op;
+	EType type; /* of the result, INVALID if there is none */
+	std::vector<ValueId> args;
+	EValue imm = (int64_t)0;
+	int64_t a = 0, b = 0;
+	BlockId targets[2] = { NONE, NONE };
+	BlockId block = NONE;
+	size_t line = 0; /* of the statement it comes from, 0 if none */
+	Inst(Op op_, EType type_, std::vector<ValueId> args_ = {}) : op(op_), type(std::move(type_)), args(std::move(args_)) {}
+};
+
+struct Block {
+	std::vector<ValueId> insts; /* PHIs first, the terminator last */
+	std::vector<BlockId> preds;
+	bool dead = false; /* removed, see Function::removeBlock */
+};
+
+struct Function {
+	std::string name;
+	std::vector<Inst> insts;
+	std::vector<Block> blocks; /* blocks[0] is the entry */
+	std::vector<EType> params;
+	EType ret_type = Primitive::INVALID; /* for functions */
+	bool local_arrays = false; /* COPYNEW arrays can be freed on return, see EscapePass */
+	std::vector<std::string> messages; /* for THROW */
+
+	inline BlockId newBlock(){
+		blocks.emplace_back();
+		return blocks.size() - 1;
+	}
+	inline ValueId add(Inst inst){
+		insts.push_back(std::move(inst));
+		return insts.size() - 1;
+	}
+	/* Adds `inst` to the end of block `b`. */
+	inline ValueId append(BlockId b, Inst inst){
+		inst.block = b;
+		const ValueId id = add(std::move(inst));
+		blocks[b].insts.push_back(id);
+		return id;
+	}
+	/* Adds a PHI to the start of block `b`. */
+	inline ValueId prependPhi(BlockId b, EType type){
+		Inst inst(Op::PHI, std::move(type));
+		inst.block = b;
+		const ValueId id = add(std::move(inst));
+		blocks[b].insts.insert(blocks[b].insts.begin(), id);
+		return id;
+	}
+	inline const Inst *terminator(BlockId b) const {
+		const Block& blk = blocks[b];
+		if(blk.insts.empty()) return nullptr;
+		const Inst& last = insts[blk.insts.back()];
+		return isTerminator(last.op) ? &last : nullptr;
+	}
+	inline std::vector<BlockId> succs(BlockId b) const {
+		std::vector<BlockId> res;
+		const Inst *term = terminator(b);
+		if(term == nullptr) return res;
+		for(const BlockId t : term->targets){
+			if(t != NONE) res.push_back(t);
+		}
+		return res;
+	}
+	inline size_t predIndex(BlockId b, BlockId pred) const {
+		const auto& preds = blocks[b].preds;
+		for(size_t i = 0; i < preds.size(); i++){
+			if(preds[i] == pred) return i;
+		}
+		throw IRError("Block " + std::to_string(pred) + " is not a predecessor of " + std::to_string(b));
+	}
+	/* Removes the edge from `from` to `to`, and the values its PHIs took from it. */
+	void removeEdge(BlockId from, BlockId to){
+		const size_t i = predIndex(to, from);
+		Block& blk = blocks[to];
+		blk.preds.erase(blk.preds.begin() + i);
+		for(const ValueId id : blk.insts){
+			Inst& inst = insts[id];
+			if(inst.op != Op::PHI) break;
+			inst.args.erase(inst.args.begin() + i);
+		}
+	}
+	/* Takes an unreachable block out of the function. */
+	void removeBlock(BlockId b){
+		for(const BlockId s : succs(b)){
+			if(!blocks[s].dead) removeEdge(b, s);
+		}
+		blocks[b].insts.clear();
+		blocks[b].preds.clear();
+		blocks[b].dead = true;
+	}
+	/* Blocks reachable from the entry, in reverse postorder. */
+	std::vector<BlockId> reversePostorder() const {
+		std::vector<BlockId> order;
+		std::vector<uint8_t> state(blocks.size(), 0); /* 0 = new, 1 = on the stack, 2 = done */
+		std::vector<std::pair<BlockId, size_t>> stack = { { 0, 0 } };
+		state[0] = 1;
+		while(!stack.empty()){
+			auto& [b, next] = stack.back();
+			const std::vector<BlockId> s = succs(b);
+			if(next < s.size()){
+				const BlockId n = s[next++];
+				if(state[n] == 0){
+					state[n] = 1;
+					stack.emplace_back(n, 0);
+				}
+			} else {
+				state[b] = 2;
+				order.push_back(b);
+				stack.pop_back();
+			}
+		}
+		std::reverse(order.begin(), order.end());
+		return order;
+	}
+	/* Calls `f` on every operand of every instruction, so it can replace them. */
+	template<typename F>
+	void forEachUse(F f){
+		for(Block& blk : blocks){
+			for(const ValueId id : blk.insts){
+				for(ValueId& arg : insts[id].args) f(arg);
+			}
+		}
+	}
+};
+
+struct Module {
+	std::vector<Function> funcs; /* funcs[0] is the main program */
+	std::map<int64_t, size_t> func_index; /* identifier of a FUNCTION/PROCEDURE to its index (the first definition's) */
+};
+
+// }}}
+
+// Dominators {{{
+
+/* The dominator tree of the reachable blocks (Cooper, Harvey and Kennedy's algorithm).
+ * A block dominates another if every path from the entry to the other goes through it. */
+class Dominators {
+	std::vector<BlockId> idom_;
+	std::vector<size_t> rpo_index;
+public:
+	std::vector<BlockId> rpo;
+	std::vector<std::vector<BlockId>> children;
+	explicit Dominators(const Function& f) : idom_(f.blocks.size(), NONE),
+		rpo_index(f.blocks.size(), NONE), children(f.blocks.size()) {
+		rpo = f.reversePostorder();
+		for(size_t i = 0; i < rpo.size(); i++) rpo_index[rpo[i]] = i;
+		idom_[0] = 0;
+		bool changed = true;
+		while(changed){
+			changed = false;
+			for(size_t i = 1; i < rpo.size(); i++){
+				const BlockId b = rpo[i];
+				BlockId res = NONE;
+				for(const BlockId p : f.blocks[b].preds){
+					if(rpo_index[p] == NONE || idom_[p] == NONE) continue;
+					res = (res == NONE ? p : intersect(p, res));
+				}
+				if(res != idom_[b]){
+					idom_[b] = res;
+					changed = true;
+				}
+			}
+		}
+		for(size_t i = 1; i < rpo.size(); i++) children[idom_[rpo[i]]].push_back(rpo[i]);
+	}
+	inline bool reachable(BlockId b) const { return rpo_index[b] != NONE; }
+	/* NONE for the entry and unreachable blocks */
+	inline BlockId idom(BlockId b) const { return b == 0 ? NONE : idom_[b]; }
+	bool dominates(BlockId a, BlockId b) const {
+		if(!reachable(a) || !reachable(b)) return false;
+		while(rpo_index[b] > rpo_index[a]) b = idom_[b];
+		return a == b;
+	}
+private:
+	BlockId intersect(BlockId a, BlockId b) const {
+		while(a != b){
+			while(rpo_index[a] > rpo_index[b]) a = idom_[a];
+			while(rpo_index[b] > rpo_index[a]) b = idom_[b];
+		}
+		return a;
+	}
+};
+
+// }}}
+
+// Evaluating {{{
+
+template<typename L, typename R>
+inline bool compare(L l, R r, const int64_t op){
+	switch(static_cast<TokenType>(op)){
+		case TokenType::EQ: return l == r;
+		case TokenType::GT: return l > r;
+		case TokenType::LT: return l < r;
+		case TokenType::GT_EQ: return l >= r;
+		case TokenType::LT_EQ: return l <= r;
+		case TokenType::LT_GT: return l != r;
+		default: throw IRError("Invalid comparison");
+	}
+}
+
+/* Computes an instruction that only depends on its operands (see isDeterministic),
+ * throwing what the interpreter throws. Shared by constant propagation and the executor,
+ * so folding a value can never change it.
+ * INTEGER arithmetic wraps around. */
+inline EValue evalOp(const Inst& inst, const EValue *args){
+	const auto wrap = [](uint64_t x){ return EValue((int64_t)x); };
+	switch(inst.op){
+		case Op::CONST: return inst.imm;
+		case Op::SELECT: return args[0].b ? args[1] : args[2];
+		case Op::ADDI: return wrap((uint64_t)args[0].i64 + (uint64_t)args[1].i64);
+		case Op::SUBI: return wrap((uint64_t)args[0].i64 - (uint64_t)args[1].i64);
+		case Op::MULI: return wrap((uint64_t)args[0].i64 * (uint64_t)args[1].i64);
+		case Op::NEGI: return wrap(-(uint64_t)args[0].i64);
+		case Op::DIVI:
+		case Op::MODI:
+			if(args[1].i64 == 0) throw RuntimeError("Cannot divide by zero");
+			if(args[1].i64 == -1) return inst.op == Op::DIVI ? wrap(-(uint64_t)args[0].i64) : EValue((int64_t)0);
+			return inst.op == Op::DIVI ? args[0].i64 / args[1].i64 : args[0].i64 % args[1].i64;
+		case Op::ADDR: return args[0].frac + args[1].frac;
+		case Op::SUBR: return args[0].frac - args[1].frac;
+		case Op::MULR: return args[0].frac * args[1].frac;
+		case Op::DIVR: return args[0].frac / args[1].frac;
+		case Op::NEGR: return -args[0].frac;
+		case Op::ADDRI: { Fraction<> f = args[0].frac; f += args[1].i64; return f; }
+		case Op::SUBRI: { Fraction<> f = args[0].frac; f -= args[1].i64; return f; }
+		case Op::MULRI: { Fraction<> f = args[0].frac; f *= args[1].i64; return f; }
+		case Op::ITOR: return Fraction<>(args[0].i64);
+		case Op::CMPI: return compare(args[0].i64, args[1].i64, inst.a);
+		case Op::CMPR: return compare(args[0].frac, args[1].frac, inst.a);
+		case Op::CMPRI: return compare(args[0].frac, args[1].i64, inst.a);
+		case Op::CMPC: return compare(args[0].c, args[1].c, inst.a);
+		case Op::CMPB: return compare(args[0].b, args[1].b, inst.a);
+		case Op::CMPS: return compare(args[0].str, args[1].str, inst.a);
+		case Op::CMPD:
+			{
+				// Date's operators aren't const
+				Date l = args[0].date;
+				return l == args[1].date;
+			}
+		case Op::AND: return args[0].b && args[1].b;
+		case Op::OR: return args[0].b || args[1].b;
+		case Op::NOT: return !args[0].b;
+		case Op::CHECK:
+			{
+				const int64_t index = args[0].i64;
+				if(((inst.imm.i64 & 1) && index < inst.a) || ((inst.imm.i64 & 2) && index > inst.b)){
+					throw RuntimeError("Out-of-bounds index " + std::to_string(index));
+				}
+				return (int64_t)0;
+			}
+		default:
+			throw IRError(std::string("Cannot evaluate ") + std::string(opToStr(inst.op)));
+	}
+}
+
+/* Are two constants of type `type` the same? */
+inline bool sameValue(const EValue& l, const EValue& r, const EType& type){
+	if(type.is_array) return l.arr == r.arr;
+	switch(type.primtype){
+		case Primitive::INTEGER: return l.i64 == r.i64;
+		case Primitive::REAL: return l.frac == r.frac;
+		case Primitive::CHAR: return l.c == r.c;
+		case Primitive::BOOLEAN: return l.b == r.b;
+		case Primitive::STRING: return l.str == r.str;
+		case Primitive::DATE: { Date d = l.date; return d == r.date; }
+		default: return true;
+	}
+}
+
+// }}}
+
+// Printing {{{
+
+inline void printValue(std::ostream& os, const EValue& val, const EType& type){
+	if(type.is_array){
+		os << "array";
+		return;
+	}
+	switch(type.primtype){
+		case Primitive::INTEGER: os << val.i64; break;
+		case Primitive::REAL: os << val.frac; break;
+		case Primitive::CHAR: os << '\'' << val.c << '\''; break;
+		case Primitive::BOOLEAN: os << (val.b ? "TRUE" : "FALSE"); break;
+		case Primitive::DATE: os << val.date; break;
+		case Primitive::STRING: os << '"' << val.str << '"'; break;
+		default: os << "?"; break;
+	}
+}
+
+inline void print(std::ostream& os, const Function& f){
+	os << "function " << f.name << '(';
+	for(size_t i = 0; i < f.params.size(); i++){
+		os << (i ? ", " : "") << f.params[i];
+	}
+	os << ')';
+	if(f.ret_type != Primitive::INVALID) os << " -> " << f.ret_type;
+	os << " {\n";
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		const Block& blk = f.blocks[b];
+		if(blk.dead) continue;
+		os << 'b' << b << ':';
+		if(!blk.preds.empty()){
+			os << " ; preds";
+			for(const BlockId p : blk.preds) os << " b" << p;
+		}
+		os << '\n';
+		for(const ValueId id : blk.insts){
+			const Inst& inst = f.insts[id];
+			os << '\t';
+			if(inst.type != Primitive::INVALID) os << '%' << id << " = ";
+			os << opToStr(inst.op);
+			if(inst.type != Primitive::INVALID) os << ' ' << inst.type;
+			for(size_t i = 0; i < inst.args.size(); i++){
+				os << (i ? ", %" : " %") << inst.args[i];
+				if(inst.op == Op::PHI && i < blk.preds.size()) os << " from b" << blk.preds[i];
+			}
+			switch(inst.op){
+				case Op::CONST: os << ' '; printValue(os, inst.imm, inst.type); break;
+				case Op::PARAM: case Op::NEWARR: case Op::COPYARR: case Op::COPYNEW:
+					os << " [" << inst.a << ']';
+					break;
+				case Op::CMPI: case Op::CMPR: case Op::CMPRI: case Op::CMPC:
+				case Op::CMPB: case Op::CMPS: case Op::CMPD:
+					os << ' ' << tokenTypeToStr(static_cast<TokenType>(inst.a));
+					break;
+				case Op::LOADG: case Op::STOREG: case Op::DECLAREG: case Op::HIDEG: case Op::UNHIDEG:
+					os << " ~" << inst.a;
+					break;
+				case Op::CHECK:
+					os << " [" << inst.a << ':' << inst.b << ']';
+					if(inst.imm.i64 != 3) os << (inst.imm.i64 == 1 ? " lower" : " upper");
+					break;
+				case Op::CALL: case Op::CHECKDEF: case Op::DEFFUNC: case Op::DEFINED: os << " @" << inst.a; break;
+				case Op::THROW:
+					os << (inst.a == 0 ? " TypeError " : " RuntimeError ") << '"' << f.messages[inst.b] << '"';
+					break;
+				default: break;
+			}
+			if(inst.targets[0] != NONE) os << " b" << inst.targets[0];
+			if(inst.targets[1] != NONE) os << ", b" << inst.targets[1];
+			os << '\n';
+		}
+	}
+	os << "}\n";
+}
+
+inline void print(std::ostream& os, const Module& m){
+	for(size_t i = 0; i < m.funcs.size(); i++){
+		os << '@' << i << ' ';
+		print(os, m.funcs[i]);
+	}
+}
+
+// }}}
+
+// verify {{{
+
+/* Checks that a function is well formed, throws IRError if it isn't.
+ * Passes can rely on everything checked here. */
+inline void verify(const Function& f){
+	const auto fail = [&](BlockId b, const std::string& msg){
+		throw IRError("Invalid IR in " + f.name + ", block b" + std::to_string(b) + ": " + msg);
+	};
+	// The edges first, the dominator tree relies on them.
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		const Block& blk = f.blocks[b];
+		if(blk.dead) continue;
+		if(b == 0 && !blk.preds.empty()) fail(b, "the entry has predecessors");
+		const Inst *term = f.terminator(b);
+		if(term == nullptr) fail(b, "no terminator");
+		// Every successor has this block as a predecessor, once for every edge.
+		for(const BlockId s : f.succs(b)){
+			if(s >= f.blocks.size() || f.blocks[s].dead) fail(b, "branch to a nonexistent block");
+			const auto& preds = f.blocks[s].preds;
+			if(std::count(preds.begin(), preds.end(), b) != std::count(term->targets, term->targets + 2, s)){
+				fail(b, "b" + std::to_string(s) + " doesn't list it as a predecessor");
+			}
+		}
+		for(const BlockId p : blk.preds){
+			if(p >= f.blocks.size() || f.blocks[p].dead){
+				fail(b, "b" + std::to_string(p) + " is listed as a predecessor, but doesn't exist");
+			}
+			const auto s = f.succs(p);
+			if(std::find(s.begin(), s.end(), b) == s.end()){
+				fail(b, "b" + std::to_string(p) + " is listed as a predecessor, but doesn't branch here");
+			}
+		}
+	}
+	const Dominators dom(f);
+	// Where every value is defined, and at which position of its block.
+	std::vector<BlockId> def_block(f.insts.size(), NONE);
+	std::vector<size_t> def_pos(f.insts.size(), 0);
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		const Block& blk = f.blocks[b];
+		if(blk.dead) continue;
+		for(size_t i = 0; i < blk.insts.size(); i++){
+			const ValueId id = blk.insts[i];
+			if(id >= f.insts.size()) fail(b, "nonexistent instruction %" + std::to_string(id));
+			if(def_block[id] != NONE) fail(b, "%" + std::to_string(id) + " is in more than one place");
+			if(f.insts[id].block != b) fail(b, "%" + std::to_string(id) + " thinks it is in b" + std::to_string(f.insts[id].block));
+			def_block[id] = b;
+			def_pos[id] = i;
+		}
+	}
+	const auto dominatesUse = [&](ValueId def, BlockId b, size_t pos){
+		if(def_block[def] == b) return def_pos[def] < pos;
+		return dom.dominates(def_block[def], b);
+	};
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		const Block& blk = f.blocks[b];
+		if(blk.dead) continue;
+		bool phis = true;
+		for(size_t i = 0; i < blk.insts.size(); i++){
+			const ValueId id = blk.insts[i];
+			const Inst& inst = f.insts[id];
+			const std::string name = "%" + std::to_string(id);
+			if(isTerminator(inst.op) != (i + 1 == blk.insts.size())){
+				fail(b, name + ": the terminator has to be last, and only there");
+			}
+			if(inst.op == Op::PHI){
+				if(!phis) fail(b, name + ": PHIs have to come first");
+				if(inst.args.size() != blk.preds.size()) fail(b, name + ": wrong number of values");
+			} else {
+				phis = false;
+			}
+			for(size_t j = 0; j < inst.args.size(); j++){
+				const ValueId arg = inst.args[j];
+				if(arg >= f.insts.size() || def_block[arg] == NONE){
+					fail(b, name + " uses a value that isn't in the function");
+				}
+				if(!dom.reachable(b)) continue;
+				if(inst.op == Op::PHI){
+					// It has to be available at the end of the predecessor.
+					const BlockId p = blk.preds[j];
+					if(dom.reachable(p) && !dominatesUse(arg, p, f.blocks[p].insts.size())){
+						fail(b, name + ": %" + std::to_string(arg) + " isn't defined on every path from b" + std::to_string(p));
+					}
+				} else if(!dominatesUse(arg, b, i)){
+					fail(b, name + ": %" + std::to_string(arg) + " isn't defined on every path here");
+				}
+			}
+			// Operand types.
+			const auto argType = [&](size_t j) -> const EType& { return f.insts[inst.args[j]].type; };
+			const auto expect = [&](size_t n, std::initializer_list<Primitive> types){
+				if(inst.args.size() != n) fail(b, name + ": wrong number of operands");
+				size_t j = 0;
+				for(const Primitive t : types){
+					if(argType(j) != t) fail(b, name + ": operand " + std::to_string(j) + " has type " + argType(j).to_str());
+					j++;
+				}
+			};
+			switch(inst.op){
+				case Op::ADDI: case Op::SUBI: case Op::MULI: case Op::DIVI: case Op::MODI:
+					expect(2, { Primitive::INTEGER, Primitive::INTEGER });
+					break;
+				case Op::ADDR: case Op::SUBR: case Op::MULR: case Op::DIVR:
+					expect(2, { Primitive::REAL, Primitive::REAL });
+					break;
+				case Op::ADDRI: case Op::SUBRI: case Op::MULRI: case Op::CMPRI:
+					expect(2, { Primitive::REAL, Primitive::INTEGER });
+					break;
+				case Op::NEGI: case Op::ITOR: expect(1, { Primitive::INTEGER }); break;
+				case Op::NEGR: expect(1, { Primitive::REAL }); break;
+				case Op::NOT: expect(1, { Primitive::BOOLEAN }); break;
+				case Op::AND: case Op::OR: expect(2, { Primitive::BOOLEAN, Primitive::BOOLEAN }); break;
+				case Op::CMPI: expect(2, { Primitive::INTEGER, Primitive::INTEGER }); break;
+				case Op::CMPR: expect(2, { Primitive::REAL, Primitive::REAL }); break;
+				case Op::CMPC: expect(2, { Primitive::CHAR, Primitive::CHAR }); break;
+				case Op::CMPB: expect(2, { Primitive::BOOLEAN, Primitive::BOOLEAN }); break;
+				case Op::CMPS: expect(2, { Primitive::STRING, Primitive::STRING }); break;
+				case Op::CMPD: expect(2, { Primitive::DATE, Primitive::DATE }); break;
+				case Op::CBR: expect(1, { Primitive::BOOLEAN }); break;
+				case Op::CHECK: expect(1, { Primitive::INTEGER }); break;
+				case Op::SELECT:
+					if(inst.args.size() != 3 || argType(0) != Primitive::BOOLEAN
+						|| argType(1) != inst.type || argType(2) != inst.type){
+						fail(b, name + ": bad operands");
+					}
+					break;
+				case Op::PHI:
+					for(size_t j = 0; j < inst.args.size(); j++){
+						if(argType(j) != inst.type) fail(b, name + ": value of type " + argType(j).to_str());
+					}
+					break;
+				case Op::LOADE: case Op::STOREE:
+					if(inst.args.size() != (inst.op == Op::LOADE ? 2 : 3) || !argType(0).is_array
+						|| argType(1) != Primitive::INTEGER){
+						fail(b, name + ": bad operands");
+					}
+					break;
+				case Op::COPYARR:
+					if(inst.args.size() != 2 || !argType(0).is_array || !argType(1).is_array) fail(b, name + ": bad operands");
+					break;
+				case Op::BR:
+					if(inst.targets[0] == NONE || inst.targets[1] != NONE) fail(b, name + ": needs one target");
+					break;
+				default:
+					break;
+			}
+			if(inst.op == Op::CBR && (inst.targets[0] == NONE || inst.targets[1] == NONE)){
+				fail(b, name + ": needs two targets");
+			}
+			if(inst.op == Op::RET){
+				const EType want = f.ret_type;
+				if(want == Primitive::INVALID ? !inst.args.empty() : (inst.args.size() != 1 || argType(0) != want)){
+					fail(b, name + ": returns the wrong type");
+				}
+			}
+		}
+	}
+}
+
+inline void verify(const Module& m){
+	for(const Function& f : m.funcs) verify(f);
+}
+
+// }}}
+
+} /* namespace ir */
+
+#endif /* IR_HPP */
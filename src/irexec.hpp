@@ -0,0 +1,154 @@
+#ifndef IREXEC_HPP
+#define IREXEC_HPP
+
+#include <cstring>
+#include <optional>
+#include "environment.hpp"
+#include "ir.hpp"
+
+namespace ir {
+
+/* Runs a module (see ir.hpp) directly, one register per value.
+ * Globals that weren't promoted to SSA values live in `env`, like for the interpreter,
+ * so input, output and the builtin functions behave the same. */
+class Machine {
+	Env& env;
+	const Module& mod;
+	std::vector<bool> defined; /* functions defined by DEFFUNC so far */
+
+	EValue newArray(size_t size, bool local){
+		EValue *arr = local ? env.region.alloc(size) : new EValue[size];
+		return arr;
+	}
+
+	std::optional<EValue> call(size_t index, const EValue *params){
+		const Function& f = mod.funcs[index];
+		std::vector<EValue> regs(f.insts.size());
+		std::vector<EValue> phis;
+		const Env::Region::Mark mark = env.region.mark();
+		BlockId prev = NONE, b = 0;
+		for(;;){
+			const Block& blk = f.blocks[b];
+			size_t i = 0;
+			// PHIs all read their values before any of them is written.
+			if(prev != NONE){
+				const size_t pred = f.predIndex(b, prev);
+				phis.clear();
+				for(; i < blk.insts.size() && f.insts[blk.insts[i]].op == Op::PHI; i++){
+					phis.push_back(regs[f.insts[blk.insts[i]].args[pred]]);
+				}
+				for(size_t j = 0; j < i; j++) regs[blk.insts[j]] = phis[j];
+			}
+			prev = b;
+			for(; i < blk.insts.size(); i++){
+				const ValueId id = blk.insts[i];
+				const Inst& inst = f.insts[id];
+				const auto arg = [&](size_t n) -> EValue& { return regs[inst.args[n]]; };
+				switch(inst.op){
+					case Op::UNDEF:
+						std::memset(&regs[id], 0, sizeof(EValue));
+						break;
+					case Op::PARAM:
+						regs[id] = params[inst.a];
+						break;
+					case Op::LOADG:
+						regs[id] = env.value(inst.a);
+						break;
+					case Op::STOREG:
+						env.value(inst.a) = arg(0);
+						break;
+					case Op::DECLAREG:
+						env.initVar(inst.a, env.GLOBAL_LEVEL, inst.type, inst.args.empty() ? EValue((int64_t)0) : arg(0));
+						break;
+					case Op::LOADE:
+						regs[id] = arg(0).arr[arg(1).i64];
+						break;
+					case Op::STOREE:
+						arg(0).arr[arg(1).i64] = arg(2);
+						break;
+					case Op::NEWARR:
+						regs[id] = newArray(inst.a, false);
+						std::fill(regs[id].arr, regs[id].arr + inst.a, EValue((int64_t)0));
+						break;
+					case Op::COPYARR:
+						if(arg(0).arr != arg(1).arr) std::copy(arg(1).arr, arg(1).arr + inst.a, arg(0).arr);
+						break;
+					case Op::COPYNEW:
+						regs[id] = newArray(inst.a, f.local_arrays);
+						std::copy(arg(0).arr, arg(0).arr + inst.a, regs[id].arr);
+						break;
+					case Op::INPUT:
+						env.input(regs[id], inst.type);
+						break;
+					case Op::OUTPUT:
+						env.output(arg(0), f.insts[inst.args[0]].type);
+						break;
+					case Op::NEWLINE:
+						env.out << '\n';
+						break;
+					case Op::CALL:
+					case Op::CALLB:
+						{
+							std::vector<EValue> args(inst.args.size());
+							for(size_t j = 0; j < args.size(); j++) args[j] = arg(j);
+							if(inst.op == Op::CALLB){
+								auto func_ptr = reinterpret_cast<EValue (*)(EValue *)>(inst.a);
+								regs[id] = func_ptr(args.data());
+							} else {
+								const auto res = call(inst.a, args.data());
+								if(res) regs[id] = *res;
+							}
+						}
+						break;
+					case Op::CHECKDEF:
+						if(!defined[inst.a]) throw RuntimeError("Cannot call non-function");
+						break;
+					case Op::DEFFUNC:
+						defined[inst.a] = true;
+						break;
+					case Op::DEFINED:
+						regs[id] = EValue((bool)defined[inst.a]);
+						break;
+					case Op::HIDEG:
+						env.hideGlobal(inst.a);
+						break;
+					case Op::UNHIDEG:
+						env.unhideGlobal(inst.a);
+						break;
+					case Op::BR:
+						b = inst.targets[0];
+						break;
+					case Op::CBR:
+						b = inst.targets[arg(0).b ? 0 : 1];
+						break;
+					case Op::RET:
+						{
+							const std::optional<EValue> res = inst.args.empty() ? std::nullopt : std::optional<EValue>(arg(0));
+							// Nothing points to the parameters anymore, see the escape analysis in optimizer.hpp.
+							if(f.local_arrays) env.region.release(mark);
+							return res;
+						}
+					case Op::THROW:
+						if(inst.a == 0) throw TypeError(f.messages[inst.b]);
+						throw RuntimeError(f.messages[inst.b]);
+					default:
+						{
+							EValue vals[3];
+							for(size_t j = 0; j < inst.args.size(); j++) vals[j] = arg(j);
+							regs[id] = evalOp(inst, vals);
+						}
+						break;
+				}
+			}
+		}
+	}
+public:
+	Machine(Env& env_, const Module& mod_) : env(env_), mod(mod_), defined(mod_.funcs.size(), false) {}
+	void run(){
+		call(0, nullptr);
+	}
+};
+
+} /* namespace ir */
+
+#endif /* IREXEC_HPP */
@@ -0,0 +1,620 @@
+#ifndef IRPASSES_HPP
+#define IRPASSES_HPP
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include "ir.hpp"
+
+/* Optimization passes over the IR (see ir.hpp).
+ * Every pass takes a verified function and leaves a verified function behind,
+ * `PassManager::verify_each` checks that after every one of them. */
+
+namespace ir {
+
+// Helpers {{{
+
+/* Replaces every use of a value by what `repl` maps it to (following chains). */
+inline void replaceUses(Function& f, std::vector<ValueId>& repl){
+	const auto find = [&](ValueId v){
+		while(repl[v] != v) v = repl[v];
+		return v;
+	};
+	f.forEachUse([&](ValueId& arg){ arg = find(arg); });
+}
+
+inline std::vector<ValueId> identity(const Function& f){
+	std::vector<ValueId> repl(f.insts.size());
+	for(size_t i = 0; i < repl.size(); i++) repl[i] = i;
+	return repl;
+}
+
+/* Takes the instructions matching `pred` out of their blocks. */
+template<typename F>
+void removeInsts(Function& f, F pred){
+	for(Block& blk : f.blocks){
+		blk.insts.erase(std::remove_if(blk.insts.begin(), blk.insts.end(),
+					[&](ValueId id){ return pred(f.insts[id]); }), blk.insts.end());
+	}
+}
+
+/* Removes the blocks that can't be reached from the entry. */
+inline bool removeUnreachable(Function& f){
+	const Dominators dom(f);
+	bool changed = false;
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		if(!f.blocks[b].dead && !dom.reachable(b)){
+			f.removeBlock(b);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// }}}
+
+// phis: remove PHIs that only ever have one value {{{
+
+inline void simplifyPhis(Function& f){
+	std::vector<ValueId> repl = identity(f);
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(Block& blk : f.blocks){
+			if(blk.dead) continue;
+			for(const ValueId id : blk.insts){
+				Inst& inst = f.insts[id];
+				if(inst.op != Op::PHI) break;
+				if(repl[id] != id) continue;
+				// A PHI that only has itself and one other value is that value.
+				ValueId same = NONE;
+				bool trivial = true;
+				for(ValueId arg : inst.args){
+					while(repl[arg] != arg) arg = repl[arg];
+					if(arg == id || arg == same) continue;
+					if(same != NONE){
+						trivial = false;
+						break;
+					}
+					same = arg;
+				}
+				if(trivial && same != NONE){
+					repl[id] = same;
+					changed = true;
+				}
+			}
+		}
+	}
+	replaceUses(f, repl);
+	removeInsts(f, [&](const Inst& inst){
+		return inst.op == Op::PHI && repl[&inst - f.insts.data()] != (ValueId)(&inst - f.insts.data());
+	});
+}
+
+// }}}
+
+// sccp: sparse conditional constant propagation {{{
+
+/* Wegman and Zadeck's algorithm: values are assumed constant and blocks unreachable
+ * until shown otherwise, so constants flowing around loops and branches on them are found.
+ * Constants become CONST instructions, branches on them become BRs and
+ * SELECTs on them become the chosen value. */
+inline void sccp(Function& f){
+	enum class State : uint8_t { TOP, CONST, BOTTOM };
+	std::vector<State> state(f.insts.size(), State::TOP);
+	std::vector<EValue> vals(f.insts.size());
+	std::vector<bool> executable(f.blocks.size(), false);
+	std::set<std::pair<BlockId, BlockId>> edges;
+	// Users of every value.
+	std::vector<std::vector<ValueId>> users(f.insts.size());
+	for(const Block& blk : f.blocks){
+		if(blk.dead) continue;
+		for(const ValueId id : blk.insts){
+			for(const ValueId arg : f.insts[id].args) users[arg].push_back(id);
+		}
+	}
+	std::vector<ValueId> inst_work;
+	std::vector<std::pair<BlockId, BlockId>> edge_work = { { NONE, 0 } };
+
+	const auto set = [&](ValueId id, State s, const EValue& v = EValue((int64_t)0)){
+		if(state[id] == s && (s != State::CONST || sameValue(vals[id], v, f.insts[id].type))) return;
+		if(state[id] == State::CONST && s == State::CONST) s = State::BOTTOM; /* a different constant */
+		if(state[id] == State::BOTTOM) return;
+		state[id] = s;
+		if(s == State::CONST) vals[id] = v;
+		for(const ValueId u : users[id]) inst_work.push_back(u);
+	};
+	const auto visit = [&](ValueId id){
+		const Inst& inst = f.insts[id];
+		if(!executable[inst.block]) return;
+		switch(inst.op){
+			case Op::PHI:
+				{
+					const auto& preds = f.blocks[inst.block].preds;
+					bool seen = false;
+					EValue v;
+					for(size_t i = 0; i < preds.size(); i++){
+						if(!edges.count({ preds[i], inst.block })) continue;
+						const ValueId arg = inst.args[i];
+						if(state[arg] == State::TOP) continue;
+						if(state[arg] == State::BOTTOM || (seen && !sameValue(v, vals[arg], inst.type))){
+							set(id, State::BOTTOM);
+							return;
+						}
+						seen = true;
+						v = vals[arg];
+					}
+					if(seen) set(id, State::CONST, v);
+				}
+				return;
+			case Op::CBR:
+				{
+					const ValueId cond = inst.args[0];
+					if(state[cond] == State::TOP) return;
+					for(int i = 0; i < 2; i++){
+						if(state[cond] == State::BOTTOM || vals[cond].b == (i == 0)){
+							edge_work.emplace_back(inst.block, inst.targets[i]);
+						}
+					}
+				}
+				return;
+			case Op::BR:
+				edge_work.emplace_back(inst.block, inst.targets[0]);
+				return;
+			case Op::SELECT:
+				{
+					const ValueId cond = inst.args[0];
+					if(state[cond] == State::TOP) return;
+					if(state[cond] == State::CONST){
+						const ValueId chosen = inst.args[vals[cond].b ? 1 : 2];
+						if(state[chosen] != State::TOP) set(id, state[chosen], vals[chosen]);
+						return;
+					}
+				}
+				break;
+			default:
+				break;
+		}
+		if(inst.type == Primitive::INVALID || inst.type.is_array) return;
+		if(!isDeterministic(inst.op)){
+			set(id, State::BOTTOM);
+			return;
+		}
+		std::vector<EValue> args;
+		for(const ValueId arg : inst.args){
+			if(state[arg] == State::TOP) return;
+			if(state[arg] == State::BOTTOM){
+				set(id, State::BOTTOM);
+				return;
+			}
+			args.push_back(vals[arg]);
+		}
+		try {
+			set(id, State::CONST, evalOp(inst, args.data()));
+		} catch(std::runtime_error&) {
+			// It throws, which is left for when it runs.
+			set(id, State::BOTTOM);
+		}
+	};
+
+	while(!edge_work.empty() || !inst_work.empty()){
+		while(!edge_work.empty()){
+			const auto edge = edge_work.back();
+			edge_work.pop_back();
+			if(!edges.insert(edge).second) continue;
+			const BlockId b = edge.second;
+			if(executable[b]){
+				// Only the PHIs see the new edge.
+				for(const ValueId id : f.blocks[b].insts){
+					if(f.insts[id].op != Op::PHI) break;
+					visit(id);
+				}
+				continue;
+			}
+			executable[b] = true;
+			for(const ValueId id : f.blocks[b].insts) visit(id);
+		}
+		while(!inst_work.empty()){
+			const ValueId id = inst_work.back();
+			inst_work.pop_back();
+			visit(id);
+		}
+	}
+
+	// Rewrite.
+	std::vector<ValueId> repl = identity(f);
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		Block& blk = f.blocks[b];
+		if(blk.dead || !executable[b]) continue;
+		for(const ValueId id : blk.insts){
+			Inst& inst = f.insts[id];
+			if(state[id] == State::CONST && inst.op != Op::CONST && inst.op != Op::PHI){
+				inst.op = Op::CONST;
+				inst.args.clear();
+				inst.imm = vals[id];
+			} else if(inst.op == Op::SELECT && state[inst.args[0]] == State::CONST){
+				repl[id] = inst.args[vals[inst.args[0]].b ? 1 : 2];
+			} else if(inst.op == Op::CBR && state[inst.args[0]] == State::CONST){
+				const int taken = vals[inst.args[0]].b ? 0 : 1;
+				const BlockId other = inst.targets[1 - taken];
+				if(other != inst.targets[taken]) f.removeEdge(b, other);
+				inst.op = Op::BR;
+				inst.args.clear();
+				inst.targets[0] = inst.targets[taken];
+				inst.targets[1] = NONE;
+			}
+		}
+	}
+	// PHIs that became constant are replaced by a CONST at the start of the entry.
+	for(BlockId b = 0; b < f.blocks.size(); b++){
+		if(f.blocks[b].dead || !executable[b]) continue;
+		for(const ValueId id : f.blocks[b].insts){
+			if(f.insts[id].op != Op::PHI) break;
+			if(state[id] != State::CONST) continue;
+			Inst c(Op::CONST, f.insts[id].type);
+			c.imm = vals[id];
+			c.block = 0;
+			const ValueId cid = f.add(std::move(c));
+			repl.push_back(cid);
+			f.blocks[0].insts.insert(f.blocks[0].insts.begin(), cid);
+			repl[id] = cid;
+		}
+	}
+	replaceUses(f, repl);
+	removeInsts(f, [&](const Inst& inst){
+		const ValueId id = &inst - f.insts.data();
+		return id < repl.size() && repl[id] != id;
+	});
+	removeUnreachable(f);
+}
+
+// }}}
+
+// dce: dead code elimination {{{
+
+/* Removes every instruction whose result isn't needed by anything that has to happen. */
+inline void dce(Function& f){
+	std::vector<bool> live(f.insts.size(), false);
+	std::vector<ValueId> work;
+	for(const Block& blk : f.blocks){
+		if(blk.dead) continue;
+		for(const ValueId id : blk.insts){
+			if(!isRemovable(f.insts[id].op)){
+				live[id] = true;
+				work.push_back(id);
+			}
+		}
+	}
+	while(!work.empty()){
+		const ValueId id = work.back();
+		work.pop_back();
+		for(const ValueId arg : f.insts[id].args){
+			if(!live[arg]){
+				live[arg] = true;
+				work.push_back(arg);
+			}
+		}
+	}
+	removeInsts(f, [&](const Inst& inst){ return !live[&inst - f.insts.data()]; });
+}
+
+// }}}
+
+// cfg: simplify the control flow graph {{{
+
+/* Removes unreachable blocks and merges blocks that always follow each other. */
+inline void simplifyCFG(Function& f){
+	removeUnreachable(f);
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(BlockId b = 0; b < f.blocks.size(); b++){
+			if(f.blocks[b].dead) continue;
+			const Inst *term = f.terminator(b);
+			if(term->op != Op::BR) continue;
+			const BlockId s = term->targets[0];
+			if(s == b || s == 0 || f.blocks[s].preds.size() != 1) continue;
+			// s's PHIs have a single value
+			std::vector<ValueId> repl = identity(f);
+			Block& sblk = f.blocks[s];
+			size_t first = 0;
+			for(; first < sblk.insts.size() && f.insts[sblk.insts[first]].op == Op::PHI; first++){
+				repl[sblk.insts[first]] = f.insts[sblk.insts[first]].args[0];
+			}
+			Block& blk = f.blocks[b];
+			blk.insts.pop_back();
+			for(size_t i = first; i < sblk.insts.size(); i++){
+				f.insts[sblk.insts[i]].block = b;
+				blk.insts.push_back(sblk.insts[i]);
+			}
+			for(const BlockId t : f.succs(s)){
+				for(BlockId& p : f.blocks[t].preds){
+					if(p == s) p = b;
+				}
+			}
+			sblk.insts.clear();
+			sblk.preds.clear();
+			sblk.dead = true;
+			replaceUses(f, repl);
+			changed = true;
+		}
+	}
+}
+
+// }}}
+
+// gvn: global value numbering {{{
+
+/* Removes instructions that compute what a dominating instruction already has,
+ * walking the dominator tree with a scoped table of the instructions seen so far.
+ * Commutative operations have their operands sorted, so `a+b` matches `b+a`.
+ * This includes CHECK: an index checked once doesn't need checking again. */
+inline void gvn(Function& f){
+	const Dominators dom(f);
+	const auto commutative = [](const Inst& inst){
+		switch(inst.op){
+			case Op::ADDI: case Op::MULI: case Op::ADDR: case Op::MULR: case Op::AND: case Op::OR:
+				return true;
+			case Op::CMPI: case Op::CMPR: case Op::CMPC: case Op::CMPB: case Op::CMPS: case Op::CMPD:
+				return inst.a == static_cast<int64_t>(TokenType::EQ) || inst.a == static_cast<int64_t>(TokenType::LT_GT);
+			default:
+				return false;
+		}
+	};
+	const auto key = [&](const Inst& inst){
+		std::vector<ValueId> args = inst.args;
+		if(commutative(inst)) std::sort(args.begin(), args.end());
+		size_t h = static_cast<size_t>(inst.op) * 31 + std::hash<int64_t>()(inst.a) * 7 + std::hash<int64_t>()(inst.b);
+		for(const ValueId arg : args) h = h * 1000003 + arg;
+		if(inst.op == Op::CONST && inst.type == Primitive::INTEGER) h ^= std::hash<int64_t>()(inst.imm.i64);
+		return std::make_pair(h, args);
+	};
+	const auto same = [&](const Inst& x, const Inst& y, const std::vector<ValueId>& xargs, const std::vector<ValueId>& yargs){
+		if(x.op != y.op || x.a != y.a || x.b != y.b || xargs != yargs || x.type != y.type) return false;
+		if(x.type.to_str() != y.type.to_str()) return false;
+		if(x.op == Op::CONST) return sameValue(x.imm, y.imm, x.type);
+		if(x.op == Op::CHECK) return x.imm.i64 == y.imm.i64;
+		return true;
+	};
+	std::unordered_multimap<size_t, std::pair<ValueId, std::vector<ValueId>>> table;
+	std::vector<ValueId> repl = identity(f);
+	std::vector<bool> removed(f.insts.size(), false);
+	// Depth first over the dominator tree, undoing each block's entries on the way out.
+	std::function<void(BlockId)> walk = [&](BlockId b){
+		std::vector<std::unordered_multimap<size_t, std::pair<ValueId, std::vector<ValueId>>>::iterator> added;
+		for(const ValueId id : f.blocks[b].insts){
+			Inst& inst = f.insts[id];
+			for(ValueId& arg : inst.args){
+				while(repl[arg] != arg) arg = repl[arg];
+			}
+			if(!isDeterministic(inst.op)) continue;
+			auto [h, args] = key(inst);
+			const auto range = table.equal_range(h);
+			bool found = false;
+			for(auto it = range.first; it != range.second; ++it){
+				const Inst& other = f.insts[it->second.first];
+				if(same(inst, other, args, it->second.second)){
+					repl[id] = it->second.first;
+					removed[id] = true;
+					found = true;
+					break;
+				}
+			}
+			if(!found) added.push_back(table.emplace(h, std::make_pair(id, std::move(args))));
+		}
+		for(const BlockId c : dom.children[b]) walk(c);
+		for(const auto it : added) table.erase(it);
+	};
+	walk(0);
+	replaceUses(f, repl);
+	removeInsts(f, [&](const Inst& inst){ return removed[&inst - f.insts.data()]; });
+}
+
+// }}}
+
+// bounds: remove array bounds checks that can't fail {{{
+
+/* Works out the range of INTEGER values from constants, adding constants,
+ * FOR loop counters (PHIs that go up or down by a constant step without overflowing),
+ * and the comparisons of the branches that dominate the CHECK. */
+class BoundsCheck {
+	using Range = std::pair<int64_t, int64_t>;
+	static constexpr Range FULL = { std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max() };
+	Function& f;
+	const Dominators dom;
+	/* Facts that hold in each block: comparisons that are true there. */
+	std::vector<std::vector<std::pair<ValueId, bool>>> facts;
+
+	/* The comparison that leads to `b`, if it is only reached through one */
+	void findFacts(){
+		facts.resize(f.blocks.size());
+		for(const BlockId b : dom.rpo){
+			if(b != 0) facts[b] = facts[dom.idom(b)];
+			const auto& preds = f.blocks[b].preds;
+			if(preds.size() != 1) continue;
+			const Inst *term = f.terminator(preds[0]);
+			if(term->op != Op::CBR || term->targets[0] == term->targets[1]) continue;
+			facts[b].emplace_back(term->args[0], term->targets[0] == b);
+		}
+	}
+	static inline std::optional<int64_t> add(int64_t a, int64_t b){
+		int64_t res;
+		if(__builtin_add_overflow(a, b, &res)) return std::nullopt;
+		return res;
+	}
+	static inline Range intersect(Range a, Range b){
+		return { std::max(a.first, b.first), std::min(a.second, b.second) };
+	}
+	/* v + c */
+	static Range shift(Range r, int64_t c){
+		const auto lo = add(r.first, c), hi = add(r.second, c);
+		if(!lo || !hi) return FULL;
+		return { *lo, *hi };
+	}
+	/* What `cmp` (holding if `holds`) says about `v` */
+	Range fromFact(ValueId v, ValueId cmp_id, bool holds, BlockId b, int depth){
+		const Inst& cmp = f.insts[cmp_id];
+		if(cmp.op == Op::NOT) return fromFact(v, cmp.args[0], !holds, b, depth);
+		if(cmp.op != Op::CMPI) return FULL;
+		TokenType op = static_cast<TokenType>(cmp.a);
+		ValueId other;
+		if(cmp.args[0] == v) other = cmp.args[1];
+		else if(cmp.args[1] == v){
+			other = cmp.args[0];
+			op = mirror(op);
+		} else {
+			return FULL;
+		}
+		if(!holds) op = negate(op);
+		const Range o = range(other, b, depth + 1);
+		switch(op){
+			case TokenType::EQ: return o;
+			case TokenType::LT_EQ: return { FULL.first, o.second };
+			case TokenType::GT_EQ: return { o.first, FULL.second };
+			case TokenType::LT: return o.second == FULL.first ? FULL : Range{ FULL.first, o.second - 1 };
+			case TokenType::GT: return o.first == FULL.second ? FULL : Range{ o.first + 1, FULL.second };
+			default: return FULL;
+		}
+	}
+	static TokenType mirror(TokenType op){
+		switch(op){
+			case TokenType::GT: return TokenType::LT;
+			case TokenType::LT: return TokenType::GT;
+			case TokenType::GT_EQ: return TokenType::LT_EQ;
+			case TokenType::LT_EQ: return TokenType::GT_EQ;
+			default: return op;
+		}
+	}
+	static TokenType negate(TokenType op){
+		switch(op){
+			case TokenType::GT: return TokenType::LT_EQ;
+			case TokenType::LT: return TokenType::GT_EQ;
+			case TokenType::GT_EQ: return TokenType::LT;
+			case TokenType::LT_EQ: return TokenType::GT;
+			case TokenType::EQ: return TokenType::LT_GT;
+			default: return TokenType::EQ;
+		}
+	}
+	/* A counter: PHI(start, PHI + step), step a constant. The range is from the start
+	 * in the direction of the step, if the value before stepping can't overflow. */
+	Range induction(ValueId phi, int depth){
+		const Inst& inst = f.insts[phi];
+		const BlockId header = inst.block;
+		if(inst.args.size() != 2) return FULL;
+		for(int i = 0; i < 2; i++){
+			const Inst& next = f.insts[inst.args[i]];
+			if(next.op != Op::ADDI || next.args[0] != phi) continue;
+			const Inst& step = f.insts[next.args[1]];
+			if(step.op != Op::CONST || step.imm.i64 == 0) continue;
+			const BlockId latch = f.blocks[header].preds[i];
+			const BlockId entry = f.blocks[header].preds[1 - i];
+			// The start comes from outside the loop.
+			if(!dom.dominates(header, latch) || dom.dominates(header, entry)) return FULL;
+			const Range start = range(inst.args[1 - i], entry, depth + 1);
+			const Range before = rangeFromFacts(phi, next.block, depth + 1);
+			const int64_t s = step.imm.i64;
+			if(s > 0 && add(before.second, s)) return { start.first, FULL.second };
+			if(s < 0 && add(before.first, s)) return { FULL.first, start.second };
+			return FULL;
+		}
+		return FULL;
+	}
+	Range rangeFromFacts(ValueId v, BlockId b, int depth){
+		Range r = FULL;
+		for(const auto& [cmp, holds] : facts[b]) r = intersect(r, fromFact(v, cmp, holds, b, depth));
+		return r;
+	}
+public:
+	/* The values `v` can have in block `b` */
+	Range range(ValueId v, BlockId b, int depth = 0){
+		if(depth > 8) return FULL;
+		const Inst& inst = f.insts[v];
+		Range r = FULL;
+		switch(inst.op){
+			case Op::CONST: return { inst.imm.i64, inst.imm.i64 };
+			case Op::ADDI:
+			case Op::SUBI:
+				{
+					const Inst& c = f.insts[inst.args[1]];
+					if(c.op != Op::CONST) break;
+					if(inst.op == Op::SUBI && c.imm.i64 == FULL.first) break;
+					r = shift(range(inst.args[0], b, depth + 1), inst.op == Op::ADDI ? c.imm.i64 : -c.imm.i64);
+				}
+				break;
+			case Op::PHI:
+				r = induction(v, depth);
+				break;
+			default:
+				break;
+		}
+		return intersect(r, rangeFromFacts(v, b, depth));
+	}
+	explicit BoundsCheck(Function& f_) : f(f_), dom(f_) {
+		findFacts();
+	}
+	void run(){
+		for(const BlockId b : dom.rpo){
+			for(const ValueId id : f.blocks[b].insts){
+				Inst& inst = f.insts[id];
+				if(inst.op != Op::CHECK) continue;
+				const Range r = range(inst.args[0], b);
+				if(r.first >= inst.a) inst.imm.i64 &= ~1;
+				if(r.second <= inst.b) inst.imm.i64 &= ~2;
+			}
+		}
+		removeInsts(f, [](const Inst& inst){ return inst.op == Op::CHECK && inst.imm.i64 == 0; });
+	}
+};
+
+inline void boundsChecks(Function& f){
+	BoundsCheck(f).run();
+}
+
+// }}}
+
+// PassManager {{{
+
+/* Runs passes by name, in order, over every function of a module. */
+class PassManager {
+public:
+	using Pass = void (*)(Function&);
+	static inline const std::map<std::string, Pass> passes = {
+		{ "phis", simplifyPhis },
+		{ "sccp", sccp },
+		{ "gvn", gvn },
+		{ "bounds", boundsChecks },
+		{ "dce", dce },
+		{ "cfg", simplifyCFG },
+	};
+	static inline const std::vector<std::string> default_pipeline = {
+		"phis", "sccp", "phis", "gvn", "bounds", "dce", "cfg"
+	};
+	std::vector<std::string> pipeline = default_pipeline;
+	bool verify_each = false;
+
+	void run(Function& f) const {
+		for(const std::string& name : pipeline){
+			const auto it = passes.find(name);
+			if(it == passes.end()) throw IRError("Unknown pass " + name);
+			it->second(f);
+			if(verify_each){
+				try {
+					verify(f);
+				} catch(IRError& e){
+					throw IRError("After " + name + ": " + e.what());
+				}
+			}
+		}
+	}
+	void run(Module& m) const {
+		for(Function& f : m.funcs) run(f);
+	}
+};
+
+// }}}
+
+} /* namespace ir */
+
+#endif /* IRPASSES_HPP */
@@ -0,0 +1,515 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include "bytecode.hpp"
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* A baseline JIT for the VM (see vm.hpp), with `pcse --engine=vm --jit`.
+ *
+ * Every function of the bytecode is translated to x86-64 instruction by instruction,
+ * each opcode by a template of machine code. The registers of a function stay in
+ * the VM's stack, so compiled and interpreted functions can call each other.
+ * INTEGER, CHAR and BOOLEAN operators, MOV, arrays, jumps and calls are native.
+ * Everything else (REALs, STRINGs, globals, I/O, ...) calls back into the VM,
+ * which runs that one instruction (see VM::jitStep).
+ *
+ * A compiled function is `int f(Context *ctx, size_t bp)`, its registers being at
+ * `ctx->stack + bp`. It returns 0, its value in `ctx->ret`, or 1 if an error was thrown,
+ * which the VM keeps and throws again once it is out of the compiled code.
+ * Exceptions can't be thrown through the compiled code since it has no unwind information.
+ *
+ * Calls nest on the native stack, so only MAX_DEPTH of them do, and deeper ones are interpreted.
+ * Anything that can't be compiled is interpreted too: everything, off x86-64.
+ * The functions are listed in /tmp/perf-PID.map, so `perf` can name them. */
+
+namespace jit {
+
+/* What the compiled code and the VM share */
+struct Context {
+	EValue *stack = nullptr; /* the VM's registers, moved when the stack grows */
+	size_t stack_size = 0;
+	const EValue *consts = nullptr;
+	size_t depth = 0; /* compiled calls on the native stack */
+	EValue ret; /* what the last function returned */
+	void *vm = nullptr;
+};
+
+using Function = int (*)(Context *ctx, size_t bp);
+
+/* The VM's side, called by the compiled code. They return 1 if an error was thrown. */
+struct Helpers {
+	int (*step)(Context *ctx, size_t bp, const int32_t *instr, size_t func); /* runs one instruction */
+	int (*call)(Context *ctx, size_t func, size_t bp); /* interprets a call */
+	int (*grow)(Context *ctx, size_t size); /* makes the stack `size` registers long */
+	int (*enter)(Context *ctx); /* marks the region of a function with local arrays */
+	void (*leave)(Context *ctx); /* and releases it */
+};
+
+const size_t MAX_DEPTH = 1000;
+
+#ifdef JIT_X86_64
+
+// Assembler {{{
+
+enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum Cond : uint8_t { CC_B = 2, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_L = 0xC, CC_GE, CC_LE, CC_G };
+
+/* Just the x86-64 instructions the templates need */
+class Assembler {
+	void rex(bool w, int reg, int rm){
+		const uint8_t r = 0x40 | w << 3 | (reg >> 3) << 2 | (rm >> 3);
+		if(r != 0x40) byte(r);
+	}
+public:
+	std::vector<uint8_t> buf;
+
+	inline size_t pos() const noexcept { return buf.size(); }
+	void byte(uint8_t b){ buf.push_back(b); }
+	void dword(uint32_t d){ for(int i = 0; i < 4; i++) byte(d >> (8 * i)); }
+	void qword(uint64_t q){ for(int i = 0; i < 8; i++) byte(q >> (8 * i)); }
+	void patch(size_t at, uint32_t d){ for(int i = 0; i < 4; i++) buf[at + i] = d >> (8 * i); }
+
+	/* op reg, [base + disp] (or the other way around, depending on `op`) */
+	void mem(std::initializer_list<uint8_t> op, bool w, int reg, int base, int32_t disp){
+		rex(w, reg, base);
+		for(const uint8_t b : op) byte(b);
+		byte(0x80 | (reg & 7) << 3 | (base & 7));
+		if((base & 7) == RSP) byte(0x24);
+		dword(disp);
+	}
+	/* op rm, reg (or reg, rm) */
+	void regs(std::initializer_list<uint8_t> op, bool w, int reg, int rm){
+		rex(w, reg, rm);
+		for(const uint8_t b : op) byte(b);
+		byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+	}
+
+	void load(int reg, int base, int32_t disp){ mem({ 0x8B }, true, reg, base, disp); }
+	void store(int base, int32_t disp, int reg){ mem({ 0x89 }, true, reg, base, disp); }
+	void storeByte(int base, int32_t disp){ mem({ 0x88 }, false, RAX, base, disp); } /* al */
+	void loadByte(int base, int32_t disp, bool sign){ mem({ 0x0F, (uint8_t)(sign ? 0xBE : 0xB6) }, false, RAX, base, disp); } /* into eax */
+	/* 16 bytes, through xmm0 */
+	void loadValue(int base, int32_t disp){ mem({ 0x0F, 0x10 }, false, 0, base, disp); }
+	void storeValue(int base, int32_t disp){ mem({ 0x0F, 0x11 }, false, 0, base, disp); }
+	void mov(int dst, int src){ regs({ 0x89 }, true, src, dst); }
+	void movImm(int dst, uint64_t imm){
+		rex(true, 0, dst);
+		byte(0xB8 + (dst & 7));
+		qword(imm);
+	}
+	void add(int dst, int src){ regs({ 0x01 }, true, src, dst); }
+	void addImm(int dst, int32_t imm){ regs({ 0x81 }, true, 0, dst); dword(imm); }
+	void shl(int dst, uint8_t n){ regs({ 0xC1 }, true, 4, dst); byte(n); }
+	void neg(int dst){ regs({ 0xF7 }, true, 3, dst); }
+	void setcc(Cond c){ byte(0x0F); byte(0x90 + c); byte(0xC0); }
+	void testAl(){ byte(0x84); byte(0xC0); }
+	void testEax(){ byte(0x85); byte(0xC0); }
+	void push(int reg){ rex(false, 0, reg); byte(0x50 + (reg & 7)); }
+	void pop(int reg){ rex(false, 0, reg); byte(0x58 + (reg & 7)); }
+	void call(const void *func){ movImm(RAX, reinterpret_cast<uintptr_t>(func)); regs({ 0xFF }, false, 2, RAX); }
+	void ret(){ byte(0xC3); }
+	/* Jumps return where their target goes, see patch() */
+	size_t jmp(){ byte(0xE9); dword(0); return pos() - 4; }
+	size_t jcc(Cond c){ byte(0x0F); byte(0x80 + c); dword(0); return pos() - 4; }
+	size_t callRel(){ byte(0xE8); dword(0); return pos() - 4; }
+	/* Makes the jump at `at` go to `target` */
+	void link(size_t at, size_t target){ patch(at, (uint32_t)(target - (at + 4))); }
+	void bind(size_t at){ link(at, pos()); }
+};
+
+// }}}
+
+/* Executable memory with every function compiled */
+class Code {
+	void *mem = nullptr;
+	size_t size = 0;
+public:
+	std::vector<Function> funcs; /* nullptr if it's interpreted */
+	Code() = default;
+	Code(const Code&) = delete;
+	Code& operator=(const Code&) = delete;
+	~Code(){ if(mem != nullptr) munmap(mem, size); }
+
+	/* Copies `bytes` into executable memory, the functions starting at `starts` */
+	bool load(const std::vector<uint8_t>& bytes, const std::vector<size_t>& starts){
+		size = bytes.size();
+		mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED){
+			mem = nullptr;
+			return false;
+		}
+		std::memcpy(mem, bytes.data(), size);
+		if(mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) return false;
+		for(const size_t start : starts){
+			funcs.push_back(reinterpret_cast<Function>(static_cast<uint8_t *>(mem) + start));
+		}
+		// perf reads symbols of JIT code from here
+		if(FILE *map = std::fopen(("/tmp/perf-" + std::to_string(getpid()) + ".map").c_str(), "a")){
+			for(size_t f = 0; f < starts.size(); f++){
+				const size_t end = f + 1 < starts.size() ? starts[f + 1] : size;
+				std::fprintf(map, "%zx %zx pcse function @%zu\n",
+					reinterpret_cast<uintptr_t>(funcs[f]), end - starts[f], f);
+			}
+			std::fclose(map);
+		}
+		return true;
+	}
+};
+
+/* Compiles the functions of `code` */
+class Translator {
+	const Bytecode& code;
+	const Helpers& helpers;
+	Assembler a;
+	/* Registers of the compiled code: the frame, the Context, the constant pool and bp */
+	static constexpr Reg REGS = RBX, CTX = R12, CONSTS = R13, BP = R14;
+	static constexpr size_t VALUE = sizeof(EValue);
+	static_assert(sizeof(EValue) == 16, "registers are copied as 16 bytes");
+
+	std::vector<size_t> starts; /* of every function */
+	std::vector<std::pair<size_t, size_t>> calls; /* jumps to patch, the function they call */
+
+	/* Where a `reg` or a `loc` is */
+	static inline int32_t regDisp(int32_t reg) noexcept { return reg * (int32_t)VALUE; }
+	static inline int base(int32_t loc) noexcept { return loc & TOPMOST_BIT32 ? REGS : CONSTS; }
+	static inline int32_t disp(int32_t loc) noexcept { return (loc & ~TOPMOST_BIT32) * (int32_t)VALUE; }
+
+	void loadInt(int reg, int32_t loc){ a.load(reg, base(loc), disp(loc)); }
+	void copy(int dst_base, int32_t dst_disp, int32_t loc){
+		a.loadValue(base(loc), disp(loc));
+		a.storeValue(dst_base, dst_disp);
+	}
+	/* rax = &array[index], the array at `arr` and the index in rcx */
+	void element(int32_t arr){
+		loadInt(RAX, arr);
+		a.shl(RCX, 4);
+		a.add(RAX, RCX);
+	}
+	/* rbx = ctx->stack + bp, after anything that may have moved the stack */
+	void reloadRegs(){
+		a.load(REGS, CTX, offsetof(Context, stack));
+		a.mov(RAX, BP);
+		a.shl(RAX, 4);
+		a.add(REGS, RAX);
+	}
+	/* Fails the function if eax isn't 0 */
+	void check(std::vector<size_t>& errors){
+		a.testEax();
+		errors.push_back(a.jcc(CC_NE));
+	}
+
+	void function(size_t f){
+		const int32_t *instr = code.words();
+		const FuncInfo& func = code.funcs[f];
+		const size_t end = f + 1 < code.funcs.size() ? code.funcs[f + 1].entry : code.length();
+		starts.push_back(a.pos());
+		std::vector<size_t> native(end - func.entry); /* where each instruction starts */
+		std::vector<std::pair<size_t, size_t>> jumps; /* to patch, and their target instruction */
+		std::vector<size_t> errors, returns;
+		// Everything pushed keeps the stack aligned to 16 bytes for calls.
+		a.push(RBX); a.push(R12); a.push(R13); a.push(R14);
+		a.addImm(RSP, -8);
+		a.mov(CTX, RDI);
+		a.mov(BP, RSI);
+		a.load(CONSTS, CTX, offsetof(Context, consts));
+		reloadRegs();
+		if(func.local_arrays){
+			a.mov(RDI, CTX);
+			a.call((const void *)helpers.enter);
+			check(errors);
+		}
+		const auto step = [&](size_t at){
+			a.mov(RDI, CTX);
+			a.mov(RSI, BP);
+			a.movImm(RDX, reinterpret_cast<uintptr_t>(instr + at));
+			a.movImm(RCX, f);
+			a.call((const void *)helpers.step);
+			check(errors);
+		};
+		const auto jumpTo = [&](size_t at, int32_t target){ jumps.emplace_back(at, target); };
+		for(size_t at = func.entry; at < end; at += instrLength(code, at)){
+			native[at - func.entry] = a.pos();
+			const int32_t *w = instr + at + 1;
+			const uint8_t op = instr[at] & 0xFF;
+			const uint8_t t1 = (uint32_t)instr[at] >> 24;
+			switch(op){
+				case OP_ADD_II: case OP_SUB_II: case OP_MUL_II:
+					loadInt(RAX, w[1]);
+					if(op == OP_ADD_II) a.mem({ 0x03 }, true, RAX, base(w[2]), disp(w[2]));
+					else if(op == OP_SUB_II) a.mem({ 0x2B }, true, RAX, base(w[2]), disp(w[2]));
+					else a.mem({ 0x0F, 0xAF }, true, RAX, base(w[2]), disp(w[2]));
+					a.store(REGS, regDisp(w[0]), RAX);
+					break;
+				case OP_IDIV_II: case OP_MOD_II:
+					{
+						// The VM reports dividing by zero, and -1 is the one divisor idiv can overflow with.
+						loadInt(RCX, w[2]);
+						a.regs({ 0x85 }, true, RCX, RCX); /* test rcx, rcx */
+						const size_t zero = a.jcc(CC_E);
+						a.regs({ 0x83 }, true, 7, RCX); /* cmp rcx, -1 */
+						a.byte(0xFF);
+						const size_t minus_one = a.jcc(CC_E);
+						loadInt(RAX, w[1]);
+						a.byte(0x48); a.byte(0x99); /* cqo */
+						a.regs({ 0xF7 }, true, 7, RCX); /* idiv rcx */
+						a.store(REGS, regDisp(w[0]), op == OP_IDIV_II ? RAX : RDX);
+						const size_t done = a.jmp();
+						a.bind(minus_one);
+						if(op == OP_IDIV_II){
+							loadInt(RAX, w[1]);
+							a.neg(RAX);
+						} else {
+							a.regs({ 0x31 }, false, RAX, RAX); /* xor eax, eax */
+						}
+						a.store(REGS, regDisp(w[0]), RAX);
+						const size_t done_too = a.jmp();
+						a.bind(zero);
+						step(at);
+						a.bind(done);
+						a.bind(done_too);
+					}
+					break;
+				case OP_NEG_I:
+					loadInt(RAX, w[1]);
+					a.neg(RAX);
+					a.store(REGS, regDisp(w[0]), RAX);
+					break;
+#define CMP_OPS(cmp, signed_cc, unsigned_cc) \
+				case OP_##cmp##_II: \
+					loadInt(RAX, w[1]); \
+					a.mem({ 0x3B }, true, RAX, base(w[2]), disp(w[2])); \
+					a.setcc(signed_cc); \
+					a.storeByte(REGS, regDisp(w[0])); \
+					break; \
+				case OP_##cmp##_CC: case OP_##cmp##_BB: \
+					a.loadByte(base(w[1]), disp(w[1]), op == OP_##cmp##_CC); \
+					a.mem({ 0x3A }, false, RAX, base(w[2]), disp(w[2])); \
+					a.setcc(op == OP_##cmp##_CC ? signed_cc : unsigned_cc); \
+					a.storeByte(REGS, regDisp(w[0])); \
+					break;
+				CMP_OPS(EQ, CC_E, CC_E)
+				CMP_OPS(NEQ, CC_NE, CC_NE)
+				CMP_OPS(LT, CC_L, CC_B)
+				CMP_OPS(GT, CC_G, CC_A)
+				CMP_OPS(LTEQ, CC_LE, CC_BE)
+				CMP_OPS(GTEQ, CC_GE, CC_AE)
+#undef CMP_OPS
+				case OP_AND: case OP_OR:
+					a.loadByte(base(w[1]), disp(w[1]), false);
+					a.mem({ (uint8_t)(op == OP_AND ? 0x22 : 0x0A) }, false, RAX, base(w[2]), disp(w[2]));
+					a.storeByte(REGS, regDisp(w[0]));
+					break;
+				case OP_NOT:
+					a.loadByte(base(w[1]), disp(w[1]), false);
+					a.regs({ 0x83 }, false, 6, RAX); /* xor eax, 1 */
+					a.byte(1);
+					a.storeByte(REGS, regDisp(w[0]));
+					break;
+				case OP_SELECT:
+					{
+						a.loadByte(base(w[1]), disp(w[1]), false);
+						a.testAl();
+						const size_t no = a.jcc(CC_E);
+						copy(REGS, regDisp(w[0]), w[2]);
+						const size_t done = a.jmp();
+						a.bind(no);
+						copy(REGS, regDisp(w[0]), w[3]);
+						a.bind(done);
+					}
+					break;
+				case OP_MOV:
+					copy(REGS, regDisp(w[0]), w[1]);
+					break;
+				case OP_LOADE: case OP_LOADE_IDX:
+					// The VM checks the indexes of code from a file.
+					if(code.from_file){
+						step(at);
+						break;
+					}
+					loadInt(RCX, w[2]);
+					if(op == OP_LOADE_IDX) a.mem({ 0x2B }, true, RCX, base(w[3]), disp(w[3]));
+					element(w[1]);
+					a.loadValue(RAX, 0);
+					a.storeValue(REGS, regDisp(w[0]));
+					break;
+				case OP_STOREE: case OP_STOREE_IDX:
+					if(code.from_file){
+						step(at);
+						break;
+					}
+					loadInt(RCX, w[1]);
+					if(op == OP_STOREE_IDX) a.mem({ 0x2B }, true, RCX, base(w[2]), disp(w[2]));
+					element(w[0]);
+					copy(RAX, 0, w[op == OP_STOREE_IDX ? 3 : 2]);
+					break;
+				case OP_CHECK:
+					{
+						// In bounds goes straight on, the VM reports the rest.
+						std::vector<size_t> out;
+						loadInt(RAX, w[0]);
+						if(t1 & 1){
+							a.mem({ 0x3B }, true, RAX, base(w[1]), disp(w[1]));
+							out.push_back(a.jcc(CC_L));
+						}
+						if(t1 & 2){
+							a.mem({ 0x3B }, true, RAX, base(w[2]), disp(w[2]));
+							out.push_back(a.jcc(CC_G));
+						}
+						const size_t ok = a.jmp();
+						for(const size_t o : out) a.bind(o);
+						step(at);
+						a.bind(ok);
+					}
+					break;
+				case OP_JMP:
+					jumpTo(a.jmp(), w[0]);
+					break;
+				case OP_CJMP:
+					a.loadByte(base(w[0]), disp(w[0]), false);
+					a.testAl();
+					jumpTo(a.jcc(CC_NE), w[1]);
+					break;
+#define COMPARE_JUMP(cmp, cc) \
+				case OP_J##cmp##_II: \
+					loadInt(RAX, w[0]); \
+					a.mem({ 0x3B }, true, RAX, base(w[1]), disp(w[1])); \
+					jumpTo(a.jcc(cc), w[2]); \
+					break;
+				COMPARE_JUMP(EQ, CC_E)
+				COMPARE_JUMP(NEQ, CC_NE)
+				COMPARE_JUMP(LT, CC_L)
+				COMPARE_JUMP(GT, CC_G)
+				COMPARE_JUMP(LTEQ, CC_LE)
+				COMPARE_JUMP(GTEQ, CC_GE)
+#undef COMPARE_JUMP
+				case OP_FOR_STEP_II:
+					loadInt(RAX, w[1]);
+					a.mem({ 0x03 }, true, RAX, base(w[2]), disp(w[2]));
+					a.store(REGS, regDisp(w[0]), RAX);
+					a.mem({ 0x3B }, true, RAX, base(w[3]), disp(w[3]));
+					jumpTo(a.jcc(CC_LE), w[4]);
+					break;
+				case OP_MOV_JMP:
+					copy(REGS, regDisp(w[0]), w[1]);
+					jumpTo(a.jmp(), w[2]);
+					break;
+				case OP_CALL:
+					{
+						const size_t g = w[1];
+						const FuncInfo& callee = code.funcs[g];
+						// The callee's frame starts where this one ends.
+						const int32_t callee_bp = func.frame_size;
+						a.mov(RSI, BP);
+						a.addImm(RSI, callee_bp + callee.frame_size);
+						a.mem({ 0x3B }, true, RSI, CTX, offsetof(Context, stack_size));
+						const size_t room = a.jcc(CC_BE);
+						a.mov(RDI, CTX);
+						a.call((const void *)helpers.grow);
+						check(errors);
+						reloadRegs();
+						a.bind(room);
+						for(size_t i = 0; i < callee.params; i++){
+							copy(REGS, regDisp(callee_bp + i), w[2 + i]);
+						}
+						// Too deep for the native stack: interpret it.
+						a.mem({ 0x81 }, true, 7, CTX, offsetof(Context, depth));
+						a.dword(MAX_DEPTH);
+						const size_t deep = a.jcc(CC_AE);
+						a.mem({ 0xFF }, true, 0, CTX, offsetof(Context, depth)); /* inc */
+						a.mov(RDI, CTX);
+						a.mov(RSI, BP);
+						a.addImm(RSI, callee_bp);
+						calls.emplace_back(a.callRel(), g);
+						a.mem({ 0xFF }, true, 1, CTX, offsetof(Context, depth)); /* dec */
+						const size_t called = a.jmp();
+						a.bind(deep);
+						a.mov(RDI, CTX);
+						a.movImm(RSI, g);
+						a.mov(RDX, BP);
+						a.addImm(RDX, callee_bp);
+						a.call((const void *)helpers.call);
+						a.bind(called);
+						check(errors);
+						reloadRegs();
+						if(callee.returns){
+							a.loadValue(CTX, offsetof(Context, ret));
+							a.storeValue(REGS, regDisp(w[0]));
+						}
+					}
+					break;
+				case OP_RET:
+					if(t1) copy(CTX, offsetof(Context, ret), w[0]);
+					returns.push_back(a.jmp());
+					break;
+				default:
+					// THROW always fails, so nothing after it runs.
+					step(at);
+					break;
+			}
+		}
+		for(const auto& [from, target] : jumps) a.link(from, native[target - func.entry]);
+		for(const size_t e : errors) a.bind(e);
+		a.regs({ 0xC7 }, false, 0, RAX); /* mov eax, 1 */
+		a.dword(1);
+		const size_t failed = a.jmp();
+		for(const size_t r : returns) a.bind(r);
+		if(func.local_arrays){
+			a.mov(RDI, CTX);
+			a.call((const void *)helpers.leave);
+		}
+		a.regs({ 0x31 }, false, RAX, RAX); /* xor eax, eax */
+		a.bind(failed);
+		a.addImm(RSP, 8);
+		a.pop(R14); a.pop(R13); a.pop(R12); a.pop(RBX);
+		a.ret();
+	}
+
+public:
+	Translator(const Bytecode& code_, const Helpers& helpers_) : code(code_), helpers(helpers_) {}
+
+	/* Fills `out` with every function, or leaves it empty if they can't be compiled */
+	void run(Code& out){
+		// Registers and constants are addressed with 32-bit displacements.
+		const size_t limit = std::numeric_limits<int32_t>::max() / VALUE;
+		if(code.const_pool.size() > limit) return;
+		for(const FuncInfo& func : code.funcs){
+			if(2 * (size_t)func.frame_size > limit) return;
+		}
+		for(size_t f = 0; f < code.funcs.size(); f++) function(f);
+		for(const auto& [from, g] : calls) a.link(from, starts[g]);
+		out.load(a.buf, starts);
+	}
+};
+
+inline void compile(const Bytecode& code, const Helpers& helpers, Code& out){
+	Translator(code, helpers).run(out);
+}
+
+#else
+
+/* Nothing is compiled, so everything is interpreted. */
+class Code {
+public:
+	std::vector<Function> funcs;
+};
+
+inline void compile(const Bytecode&, const Helpers&, Code&){}
+
+#endif
+
+}
+
+#endif /* JIT_HPP */
@@ -0,0 +1,1228 @@
+#ifndef LOWERING_HPP
+#define LOWERING_HPP
+
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <set>
+#include "interpreter.hpp"
+#include "ir.hpp"
+
+namespace ir {
+
+/* The program uses something the IR can't express (yet),
+ * so it has to be run by the tree-walking interpreter. */
+class Unsupported : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/* Turns a syntax tree into IR, one function for the main program and one for every
+ * FUNCTION and PROCEDURE, using Braun et al.'s SSA construction: variables are looked up
+ * backwards through the blocks as they are built, and PHIs are only made where
+ * two definitions meet.
+ *
+ * Names are resolved lexically. A function sees its parameters, its FOR loop variables
+ * and the globals; globals that no function uses are kept in SSA variables by the
+ * main program, the others live in Env and are read with LOADG. The tree-walker finds
+ * globals where a function is called from, so a parameter or FOR variable in a caller
+ * hides them: where that can happen, HIDEG and UNHIDEG do the same (see hiding()).
+ * Types and array bounds are worked out here, so array bounds have to be
+ * constant (literals and CONSTANTs that never change), anything else is Unsupported.
+ *
+ * Errors are reported where the tree-walker reports them: a type error found here
+ * becomes a THROW at the point where the interpreter would have found it, after
+ * everything it would have evaluated before.
+ * The checks mirror the `type()` and `eval()` functions in interpreter.hpp. */
+class Lowering {
+	const Program& prog;
+	const Env& env; /* for the builtin functions */
+	Module mod;
+
+	// Whole program {{{
+	std::set<int64_t> assigned; /* ASSIGN and INPUT targets */
+	std::map<int64_t, std::pair<size_t, int64_t>> const_ints; /* CONSTANTs known before running: statement, value */
+	std::map<int64_t, EType> global_types; /* first DECLARE or CONSTANT */
+	std::set<size_t> byref_funcs; /* can never be defined, see defFunc */
+	std::map<int64_t, std::vector<size_t>> definitions; /* of each name, in order (see defFunc) */
+	std::map<const Stmt<true> *, size_t> def_index; /* FUNCTION/PROCEDURE statements to their function */
+	bool whole = false; /* lowering the whole program, see run() */
+	std::set<int64_t> touched; /* globals used by functions */
+	std::vector<std::set<int64_t>> hides; /* by function, the names to HIDEG, empty if none */
+	// }}}
+
+	// The function being lowered {{{
+	Function *fn = nullptr;
+	size_t fn_index = 0;
+	BlockId cur = 0;
+	std::vector<EType> var_types;
+	std::vector<std::map<BlockId, ValueId>> defs; /* definition of each variable at the end of each block */
+	std::vector<std::vector<std::pair<size_t, ValueId>>> incomplete; /* PHIs of unsealed blocks, by block */
+	std::vector<bool> sealed; /* all the predecessors are known */
+	std::map<int64_t, std::vector<size_t>> scope; /* local names to variables, innermost last */
+	std::map<int64_t, size_t> promoted; /* main program only: globals in variables */
+	std::set<int64_t> declared; /* main program only: globals declared so far */
+	std::map<int64_t, size_t> defined; /* main program only: functions defined so far, the latest */
+	bool is_main = true;
+	std::vector<int64_t> hidden; /* HIDEGs not undone yet, innermost last */
+	size_t line = 0; /* of the statement being lowered */
+	std::vector<const Expr *> *hot_returns = nullptr; /* hot loop only, see loop() */
+	int64_t hot_var = -1; /* hot loop only, the variable of the FOR */
+	BlockId hot_exit = 0; /* hot loop only, where it stores its variables back */
+	size_t hot_result = 0; /* hot loop only, variable for what it returns */
+	// }}}
+
+	// SSA construction {{{
+
+	size_t newVar(const EType& type){
+		var_types.push_back(type);
+		defs.emplace_back();
+		return var_types.size() - 1;
+	}
+	BlockId newBlock(){
+		sealed.push_back(false);
+		incomplete.emplace_back();
+		return fn->newBlock();
+	}
+	inline void write(size_t var, BlockId b, ValueId val){
+		defs[var][b] = val;
+	}
+	ValueId read(size_t var, BlockId b){
+		const auto it = defs[var].find(b);
+		if(it != defs[var].end()) return it->second;
+		ValueId val;
+		if(!sealed[b]){
+			val = fn->prependPhi(b, var_types[var]);
+			incomplete[b].emplace_back(var, val);
+		} else if(fn->blocks[b].preds.size() == 1){
+			val = read(var, fn->blocks[b].preds[0]);
+		} else if(fn->blocks[b].preds.empty()){
+			// Unreachable, or the variable was never defined.
+			Inst undef(Op::UNDEF, var_types[var]);
+			undef.block = 0;
+			val = fn->add(std::move(undef));
+			fn->blocks[0].insts.insert(fn->blocks[0].insts.begin(), val);
+		} else {
+			val = fn->prependPhi(b, var_types[var]);
+			write(var, b, val);
+			addPhiOperands(var, val);
+		}
+		write(var, b, val);
+		return val;
+	}
+	void addPhiOperands(size_t var, ValueId phi){
+		const BlockId b = fn->insts[phi].block;
+		for(size_t i = 0; i < fn->blocks[b].preds.size(); i++){
+			const ValueId val = read(var, fn->blocks[b].preds[i]);
+			fn->insts[phi].args.push_back(val);
+		}
+	}
+	void seal(BlockId b){
+		sealed[b] = true;
+		const auto phis = std::move(incomplete[b]);
+		for(const auto& [var, phi] : phis) addPhiOperands(var, phi);
+	}
+
+	// }}}
+
+	// Emitting {{{
+
+	inline const EType& irType(ValueId val) const {
+		return fn->insts[val].type;
+	}
+	ValueId emit(Op op, const EType& type, std::vector<ValueId> args = {}, int64_t a = 0, int64_t b = 0){
+		Inst inst(op, type, std::move(args));
+		inst.a = a;
+		inst.b = b;
+		inst.line = line;
+		return fn->append(cur, std::move(inst));
+	}
+	ValueId constant(const EValue val, const EType& type){
+		Inst inst(Op::CONST, type);
+		inst.imm = val;
+		return fn->append(cur, std::move(inst));
+	}
+	/* What Env::initVar gives a variable (before allocating arrays) */
+	ValueId zero(const EType& type){
+		EValue val;
+		std::memset(&val, 0, sizeof(val));
+		return constant(val, type);
+	}
+	inline ValueId intConst(int64_t val){
+		return constant(val, Primitive::INTEGER);
+	}
+	/* Nothing branches to the block after this. */
+	void unreachable(){
+		cur = newBlock();
+		seal(cur);
+	}
+	void branch(BlockId to){
+		Inst inst(Op::BR, Primitive::INVALID);
+		inst.targets[0] = to;
+		inst.line = line;
+		fn->append(cur, std::move(inst));
+		fn->blocks[to].preds.push_back(cur);
+	}
+	void condBranch(ValueId cond, BlockId if_true, BlockId if_false){
+		Inst inst(Op::CBR, Primitive::INVALID, { cond });
+		inst.targets[0] = if_true;
+		inst.targets[1] = if_false;
+		inst.line = line;
+		fn->append(cur, std::move(inst));
+		fn->blocks[if_true].preds.push_back(cur);
+		fn->blocks[if_false].preds.push_back(cur);
+	}
+	void emitThrow(bool runtime, const std::string& msg){
+		fn->messages.push_back(msg);
+		emit(Op::THROW, Primitive::INVALID, {}, runtime, fn->messages.size() - 1);
+	}
+	/* Runs `f`, turning the errors the interpreter would have thrown into a THROW.
+	 * Returns whether it got through. */
+	template<typename F>
+	bool guard(F f){
+		try {
+			f();
+			return true;
+		} catch(TypeError& e){
+			emitThrow(false, e.what());
+		} catch(RuntimeError& e){
+			emitThrow(true, e.what());
+		}
+		unreachable();
+		return false;
+	}
+
+	// }}}
+
+	// Names {{{
+
+	inline bool isBuiltin(int64_t id) const {
+		const auto it = env.functable.find(id);
+		return it != env.functable.end() && it->second.what == EFunc::What::BUILTIN;
+	}
+	/* Type of a variable, INVALID if there isn't one (like Env::getType) */
+	EType varType(int64_t id) const {
+		const auto it = scope.find(id);
+		if(it != scope.end() && !it->second.empty()) return var_types[it->second.back()];
+		const auto g = global_types.find(id);
+		if(g == global_types.end() || (is_main && !declared.count(id))) return Primitive::INVALID;
+		return g->second;
+	}
+	/* The value of a variable, like Env::value */
+	ValueId readName(int64_t id){
+		const auto it = scope.find(id);
+		if(it != scope.end() && !it->second.empty()) return read(it->second.back(), cur);
+		if(varType(id) == Primitive::INVALID) throw RuntimeError("Undefined variable");
+		const auto p = promoted.find(id);
+		if(p != promoted.end()) return read(p->second, cur);
+		if(hotPromote(id)) return read(promoted[id], cur);
+		if(!is_main) touched.insert(id);
+		return emit(Op::LOADG, global_types[id], {}, id);
+	}
+	/* `id` becomes a parameter or a FOR's variable, see hiding() */
+	void hide(int64_t id){
+		if(hides.empty() || !hides[fn_index].count(id)) return;
+		emit(Op::HIDEG, Primitive::INVALID, {}, id);
+		hidden.push_back(id);
+	}
+	void unhide(int64_t id){
+		if(hidden.empty() || hidden.back() != id) return;
+		emit(Op::UNHIDEG, Primitive::INVALID, {}, id);
+		hidden.pop_back();
+	}
+	/* Before a RET, which leaves every scope */
+	void unhideAll(){
+		for(size_t i = hidden.size(); i-- > 0;) emit(Op::UNHIDEG, Primitive::INVALID, {}, hidden[i]);
+	}
+	void writeName(int64_t id, ValueId val){
+		const auto it = scope.find(id);
+		if(it != scope.end() && !it->second.empty()){
+			write(it->second.back(), cur, val);
+			return;
+		}
+		if(varType(id) == Primitive::INVALID) throw RuntimeError("Undefined variable");
+		const auto p = promoted.find(id);
+		if(p != promoted.end() || hotPromote(id)){
+			write(promoted[id], cur, val);
+			return;
+		}
+		if(!is_main) touched.insert(id);
+		emit(Op::STOREG, Primitive::INVALID, { val }, id);
+	}
+
+	// }}}
+
+	// Static evaluation {{{
+
+	/* Integer expressions that can be worked out before running,
+	 * `limit` being the top level statement they're in. */
+	template<uint16_t Level>
+	std::optional<int64_t> staticInt(const BinExpr<Level>& e, size_t limit) const {
+		const auto left = staticInt(e.left, limit);
+		if(!left || e.opt.op == TokenType::INVALID) return left;
+		const auto right = staticInt(*e.opt.right, limit);
+		if(!right) return std::nullopt;
+		const uint64_t l = *left, r = *right;
+		switch(e.opt.op){
+			case TokenType::PLUS: return (int64_t)(l + r);
+			case TokenType::MINUS: return (int64_t)(l - r);
+			case TokenType::STAR: return (int64_t)(l * r);
+			default: return std::nullopt;
+		}
+	}
+	std::optional<int64_t> staticInt(const UnaryExpr& e, size_t limit) const {
+		if(e.op == TokenType::INVALID) return staticInt(*e.main.primary, limit);
+		if(e.op != TokenType::MINUS) return std::nullopt;
+		const auto val = staticInt(*e.main.unexpr, limit);
+		if(!val) return val;
+		return (int64_t)-(uint64_t)*val;
+	}
+	std::optional<int64_t> staticInt(const Primary& p, size_t limit) const {
+		switch(p.primtype()){
+			case TokenType::INT_C:
+				return p.main().lt.i64;
+			case TokenType::IDENTIFIER:
+				{
+					const LValue& lv = p.main().lvalue;
+					const auto it = const_ints.find(lv.id);
+					if(lv.indexes != nullptr || it == const_ints.end() || it->second.first >= limit) return std::nullopt;
+					return it->second.second;
+				}
+			case TokenType::INVALID:
+				return staticInt(*p.main().expr, limit);
+			default:
+				return std::nullopt;
+		}
+	}
+	/* Type::to_etype, for a type in the top level statement `limit` */
+	EType staticType(const Type& type, size_t limit, bool is_top = true) const {
+		if(type.is_array()){
+			EType next = staticType(*type.name().rec, limit, false);
+			const auto start = staticInt(*type.start(), limit), end = staticInt(*type.end(), limit);
+			if(!start || !end) throw Unsupported("array bounds have to be constant");
+			next.is_array = true;
+			next.bounds.emplace_back(*start, *end);
+			if(is_top) std::reverse(next.bounds.begin(), next.bounds.end());
+			return next;
+		}
+		switch(type.name().tok){
+#define CASE(x) case TokenType:: x: return Primitive:: x;
+			CASE(INTEGER);
+			CASE(STRING);
+			CASE(REAL);
+			CASE(CHAR);
+			CASE(BOOLEAN);
+			CASE(DATE);
+#undef CASE
+			default: throw Unsupported("invalid type");
+		}
+	}
+
+	// }}}
+
+	// Types, like the `type()` functions in interpreter.hpp {{{
+
+	EType typeOf(const LValue& lv) const {
+		const EType type = varType(lv.id);
+		if(lv.indexes == nullptr) return type;
+		const size_t depth = lv.indexes->size();
+		if(depth > type.bounds.size()) throw TypeError("Cannot index a non-array");
+		std::vector<std::pair<int64_t,int64_t>> bounds(type.bounds.begin() + depth, type.bounds.end());
+		return EType(bounds.size(), bounds, type.primtype);
+	}
+	EType retType(int64_t id) const {
+		if(isBuiltin(id)) return env.functable.at(id).ret_type;
+		return mod.funcs[mod.func_index.at(id)].ret_type;
+	}
+	/* The main program knows which functions have been defined so far,
+	 * functions have to check when they are called (CHECKDEF). */
+	inline bool isFunction(int64_t id) const {
+		return isBuiltin(id) || (mod.func_index.count(id) && (!is_main || defined.count(id)));
+	}
+	EType typeOf(const Primary& p) const {
+		switch(p.primtype()){
+			case TokenType::REAL_C: return Primitive::REAL;
+			case TokenType::INT_C: return Primitive::INTEGER;
+			case TokenType::CHAR_C: return Primitive::CHAR;
+			case TokenType::TRUE: case TokenType::FALSE: return Primitive::BOOLEAN;
+			case TokenType::DATE_C: return Primitive::DATE;
+			case TokenType::STR_C: return Primitive::STRING;
+			case TokenType::IDENTIFIER: return typeOf(p.main().lvalue);
+			case TokenType::CALL:
+				{
+					if(!isFunction(p.all.func_id)) throw RuntimeError("Cannot call non-function");
+					const EType type = retType(p.all.func_id);
+					if(type == Primitive::INVALID) throw RuntimeError("Cannot call procedure and use it as a value");
+					return type;
+				}
+			case TokenType::INVALID: return typeOf(*p.main().expr);
+			default: throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
+		}
+	}
+	EType typeOf(const UnaryExpr& e) const {
+		return e.op == TokenType::INVALID ? typeOf(*e.main.primary) : typeOf(*e.main.unexpr);
+	}
+	template<uint16_t Level>
+	EType typeOf(const BinExpr<Level>& e) const {
+		const EType ltype = typeOf(e.left);
+		if(e.opt.op == TokenType::INVALID) return ltype;
+		if constexpr (Level <= 2) {
+			return Primitive::BOOLEAN;
+		} else {
+			const EType rtype = typeOf(*e.opt.right);
+			if(!(isAnyOf(ltype, Primitive::REAL, Primitive::INTEGER) &&
+				 isAnyOf(rtype, Primitive::REAL, Primitive::INTEGER))){
+				throw TypeError("Invalid type applied to math expression");
+			}
+			if constexpr (Level == 3){
+				if(rtype == Primitive::REAL) return rtype;
+				return ltype;
+			} else {
+				if(e.opt.op == TokenType::SLASH) return Primitive::REAL;
+				if(e.opt.op == TokenType::STAR) return rtype == Primitive::REAL ? rtype : ltype;
+				expectTypeEqual(ltype, Primitive::INTEGER);
+				expectTypeEqual(rtype, Primitive::INTEGER);
+				return Primitive::INTEGER;
+			}
+		}
+	}
+
+	// }}}
+
+	// Expressions, like the `eval()` functions in interpreter.hpp {{{
+
+	/* Offset of an element in its array, see LValue::locate */
+	ValueId elementOffset(const LValue& lv, const EType& type){
+		if(lv.indexes->size() != type.bounds.size()) throw TypeError("Cannot index a non-array");
+		ValueId offset = NONE;
+		for(size_t i = 0; i < type.bounds.size(); i++){
+			const Expr& idx = (*lv.indexes)[i];
+			const auto [first, second] = type.bounds[i];
+			expectTypeEqual(typeOf(idx), Primitive::INTEGER);
+			const ValueId index = value(idx);
+			const ValueId check = emit(Op::CHECK, Primitive::INVALID, { index }, first, second);
+			fn->insts[check].imm = (int64_t)3;
+			const ValueId rel = emit(Op::SUBI, Primitive::INTEGER, { index, intConst(first) });
+			if(offset == NONE){
+				offset = rel;
+			} else {
+				const ValueId scaled = emit(Op::MULI, Primitive::INTEGER, { offset, intConst(second - first + 1) });
+				offset = emit(Op::ADDI, Primitive::INTEGER, { scaled, rel });
+			}
+		}
+		return offset;
+	}
+	ValueId value(const LValue& lv){
+		const EType type = varType(lv.id);
+		const ValueId val = readName(lv.id);
+		if(lv.indexes == nullptr) return val;
+		const ValueId offset = elementOffset(lv, type);
+		return emit(Op::LOADE, type.primtype, { val, offset });
+	}
+	/* Returns NONE for procedures */
+	ValueId call(int64_t id, const std::vector<Expr>& args){
+		if(!isFunction(id)) throw RuntimeError("Cannot call non-function");
+		std::vector<EType> params;
+		EType ret_type = Primitive::INVALID;
+		if(isBuiltin(id)){
+			const EFunc& func = env.functable.at(id);
+			params.assign(func.types, func.types + func.arity);
+			ret_type = func.ret_type;
+		} else {
+			const std::vector<size_t>& defs = definitions.at(id);
+			if(is_main) return callFunction(defined.at(id), args);
+			// A function calling itself has been defined, or it wouldn't be running,
+			// and it's still the latest: only the main program defines functions.
+			if(std::find(defs.begin(), defs.end(), fn_index) != defs.end()) return callFunction(fn_index, args);
+			if(defs.size() > 1) return callLatest(defs, args);
+			emit(Op::CHECKDEF, Primitive::INVALID, {}, defs[0]);
+			return callFunction(defs[0], args);
+		}
+		if(args.size() != params.size()) throw RuntimeError("Invalid number of parameters for function");
+		std::vector<ValueId> vals;
+		for(size_t i = 0; i < args.size(); i++){
+			expectTypeEqual(typeOf(args[i]), params[i]);
+			vals.push_back(value(args[i]));
+		}
+		const ValueId res = emit(Op::CALLB, ret_type, std::move(vals),
+				reinterpret_cast<intptr_t>(env.functable.at(id).func_loc));
+		return ret_type == Primitive::INVALID ? NONE : res;
+	}
+	ValueId callFunction(size_t index, const std::vector<Expr>& args){
+		const EType ret_type = mod.funcs[index].ret_type;
+		if(args.size() != mod.funcs[index].params.size()) throw RuntimeError("Invalid number of parameters for function");
+		std::vector<ValueId> vals;
+		for(size_t i = 0; i < args.size(); i++){
+			expectTypeEqual(typeOf(args[i]), mod.funcs[index].params[i]);
+			vals.push_back(value(args[i]));
+		}
+		const ValueId res = emit(Op::CALL, ret_type, std::move(vals), index);
+		return ret_type == Primitive::INVALID ? NONE : res;
+	}
+	/* A function calling one defined more than once gets the definition that ran last,
+	 * trying the latest first. They all have the same signature (see scan). */
+	ValueId callLatest(const std::vector<size_t>& defs, const std::vector<Expr>& args){
+		const EType ret_type = mod.funcs[defs[0]].ret_type;
+		const size_t result = newVar(ret_type);
+		const BlockId join = newBlock();
+		for(size_t k = defs.size(); k-- > 0;){
+			const BlockId found = newBlock(), next = newBlock();
+			condBranch(emit(Op::DEFINED, Primitive::BOOLEAN, {}, defs[k]), found, next);
+			seal(found);
+			seal(next);
+			cur = found;
+			guard([&]{
+				const ValueId res = callFunction(defs[k], args);
+				if(res != NONE) write(result, cur, res);
+			});
+			branch(join);
+			cur = next;
+		}
+		emitThrow(true, "Cannot call non-function");
+		seal(join);
+		cur = join;
+		return ret_type == Primitive::INVALID ? NONE : read(result, cur);
+	}
+	ValueId value(const Primary& p){
+		switch(p.primtype()){
+			case TokenType::REAL_C: return constant(p.main().lt.frac, Primitive::REAL);
+			case TokenType::INT_C: return constant(p.main().lt.i64, Primitive::INTEGER);
+			case TokenType::CHAR_C: return constant(p.main().lt.c, Primitive::CHAR);
+			case TokenType::TRUE: return constant(true, Primitive::BOOLEAN);
+			case TokenType::FALSE: return constant(false, Primitive::BOOLEAN);
+			case TokenType::DATE_C: return constant(p.main().lt.date, Primitive::DATE);
+			case TokenType::STR_C: return constant(p.main().lt.str, Primitive::STRING);
+			case TokenType::IDENTIFIER: return value(p.main().lvalue);
+			case TokenType::CALL:
+				{
+					const ValueId res = call(p.all.func_id, *p.main().args);
+					if(res == NONE) throw TypeError("Cannot call procedure without using CALL");
+					return res;
+				}
+			case TokenType::INVALID: return value(*p.main().expr);
+			default: throw RuntimeError("Invalid primary type. (INTERNAL ERROR)");
+		}
+	}
+	ValueId value(const UnaryExpr& e){
+		if(e.op == TokenType::INVALID) return value(*e.main.primary);
+		const EType type = typeOf(*e.main.unexpr);
+		if(e.op == TokenType::NOT){
+			expectTypeEqual(type, Primitive::BOOLEAN);
+			return emit(Op::NOT, Primitive::BOOLEAN, { value(*e.main.unexpr) });
+		}
+		expectTypeEqual(type, Primitive::INTEGER, Primitive::REAL);
+		const ValueId val = value(*e.main.unexpr);
+		return emit(type == Primitive::INTEGER ? Op::NEGI : Op::NEGR, type, { val });
+	}
+	/* l op r, where l or r is a REAL */
+	ValueId realArith(Op real, Op real_int, ValueId l, ValueId r){
+		if(irType(l) == Primitive::REAL){
+			if(irType(r) == Primitive::REAL) return emit(real, Primitive::REAL, { l, r });
+			return emit(real_int, Primitive::REAL, { l, r });
+		}
+		const ValueId lr = emit(Op::ITOR, Primitive::REAL, { l });
+		return emit(real, Primitive::REAL, { lr, r });
+	}
+	template<uint16_t Level>
+	ValueId value(const BinExpr<Level>& e){
+		const ValueId l = value(e.left);
+		if(e.opt.op == TokenType::INVALID) return l;
+		const EType ltype = typeOf(e.left);
+		const ValueId r = value(*e.opt.right);
+		const EType rtype = typeOf(*e.opt.right);
+		if constexpr (Level <= 1) {
+			expectTypeEqual(ltype, Primitive::BOOLEAN);
+			expectTypeEqual(rtype, Primitive::BOOLEAN);
+			return emit(Level == 0 ? Op::OR : Op::AND, Primitive::BOOLEAN, { l, r });
+		} else if constexpr (Level == 2) {
+			const int64_t op = static_cast<int64_t>(e.opt.op);
+			if(ltype == Primitive::REAL && rtype == Primitive::INTEGER){
+				return emit(Op::CMPRI, Primitive::BOOLEAN, { l, r }, op);
+			} else if(ltype == Primitive::INTEGER && rtype == Primitive::REAL){
+				return emit(Op::CMPRI, Primitive::BOOLEAN, { r, l }, static_cast<int64_t>(mirrorComparison(e.opt.op)));
+			}
+			if(ltype != rtype) throw TypeError("Cannot compare two different types");
+			if(ltype.is_array) throw TypeError("Cannot compare arrays");
+			Op cmp;
+			switch(ltype.primtype){
+				case Primitive::INTEGER: cmp = Op::CMPI; break;
+				case Primitive::REAL: cmp = Op::CMPR; break;
+				case Primitive::CHAR: cmp = Op::CMPC; break;
+				case Primitive::BOOLEAN: cmp = Op::CMPB; break;
+				case Primitive::STRING: cmp = Op::CMPS; break;
+				default: throw RuntimeError("Invalid types! (INTERNAL ERROR)");
+			}
+			return emit(cmp, Primitive::BOOLEAN, { l, r }, op);
+		} else {
+			if(!(isAnyOf(ltype, Primitive::REAL, Primitive::INTEGER) &&
+				 isAnyOf(rtype, Primitive::REAL, Primitive::INTEGER))){
+				throw TypeError("Invalid type applied to math expression");
+			}
+			const bool ints = ltype == Primitive::INTEGER && rtype == Primitive::INTEGER;
+			switch(e.opt.op){
+				case TokenType::PLUS:
+					return ints ? emit(Op::ADDI, Primitive::INTEGER, { l, r }) : realArith(Op::ADDR, Op::ADDRI, l, r);
+				case TokenType::MINUS:
+					return ints ? emit(Op::SUBI, Primitive::INTEGER, { l, r }) : realArith(Op::SUBR, Op::SUBRI, l, r);
+				case TokenType::STAR:
+					return ints ? emit(Op::MULI, Primitive::INTEGER, { l, r }) : realArith(Op::MULR, Op::MULRI, l, r);
+				case TokenType::SLASH:
+					{
+						const ValueId lr = ltype == Primitive::INTEGER ? emit(Op::ITOR, Primitive::REAL, { l }) : l;
+						const ValueId rr = rtype == Primitive::INTEGER ? emit(Op::ITOR, Primitive::REAL, { r }) : r;
+						return emit(Op::DIVR, Primitive::REAL, { lr, rr });
+					}
+				case TokenType::MOD:
+				case TokenType::DIV:
+					expectTypeEqual(ltype, Primitive::INTEGER);
+					expectTypeEqual(rtype, Primitive::INTEGER);
+					return emit(e.opt.op == TokenType::DIV ? Op::DIVI : Op::MODI, Primitive::INTEGER, { l, r });
+				default:
+					throw RuntimeError("Invalid operator for +-*/ expr. (INTERNAL ERROR)");
+			}
+		}
+	}
+
+	// }}}
+
+	// Statements, like Stmt::eval {{{
+
+	void store(const LValue& lv, ValueId val, const EType& type){
+		if(lv.indexes != nullptr){
+			const EType arrtype = varType(lv.id);
+			const ValueId arr = readName(lv.id);
+			const ValueId offset = elementOffset(lv, arrtype);
+			emit(Op::STOREE, Primitive::INVALID, { arr, offset, val });
+		} else if(type.is_array){
+			emit(Op::COPYARR, Primitive::INVALID, { readName(lv.id), val }, type.size());
+		} else {
+			writeName(lv.id, val);
+		}
+	}
+	void assign(const LValue& lv, const Expr& expr){
+		const EType type = typeOf(lv);
+		if(type == Primitive::INVALID) throw RuntimeError("Undefined variable");
+		const EType exprtype = typeOf(expr);
+		ValueId val;
+		if(type == Primitive::REAL && exprtype == Primitive::INTEGER){
+			val = emit(Op::ITOR, Primitive::REAL, { value(expr) });
+		} else {
+			expectTypeEqual(exprtype, type);
+			val = value(expr);
+		}
+		store(lv, val, type);
+	}
+	void input(const LValue& lv){
+		// Find the target first, like the interpreter.
+		ValueId arr = NONE, offset = NONE;
+		if(lv.indexes != nullptr){
+			const EType arrtype = varType(lv.id);
+			arr = readName(lv.id);
+			offset = elementOffset(lv, arrtype);
+		} else if(varType(lv.id) == Primitive::INVALID){
+			throw RuntimeError("Undefined variable");
+		}
+		const EType type = typeOf(lv);
+		if(type.is_array) throw TypeError("Cannot input array");
+		const ValueId val = emit(Op::INPUT, type);
+		if(arr != NONE) emit(Op::STOREE, Primitive::INVALID, { arr, offset, val });
+		else writeName(lv.id, val);
+	}
+	void output(const std::vector<Expr>& exprs){
+		for(const Expr& expr : exprs){
+			const ValueId val = value(expr);
+			const EType type = typeOf(expr);
+			if(type.is_array || type == Primitive::INVALID) throw TypeError("Cannot output array");
+			emit(Op::OUTPUT, Primitive::INVALID, { val });
+		}
+		emit(Op::NEWLINE, Primitive::INVALID);
+	}
+	void ifStmt(const Expr& cond, const std::vector<::Block>& blocks){
+		expectTypeEqual(typeOf(cond), Primitive::BOOLEAN);
+		const ValueId c = value(cond);
+		const BlockId then = newBlock(), join = newBlock();
+		const BlockId otherwise = blocks.size() == 2 ? newBlock() : join;
+		condBranch(c, then, otherwise);
+		seal(then);
+		cur = then;
+		block(blocks[0]);
+		branch(join);
+		if(blocks.size() == 2){
+			seal(otherwise);
+			cur = otherwise;
+			block(blocks[1]);
+			branch(join);
+		}
+		seal(join);
+		cur = join;
+	}
+	/* The comparison of a CASE with one of its cases, see Stmt::eval */
+	ValueId caseMatches(ValueId val, const EType& type, const Expr& expr){
+		const EType exprtype = typeOf(expr);
+		if(exprtype.is_array) throw TypeError("Cannot use array in CASE OF case");
+		if(isAnyOf(Primitive::REAL, type, exprtype) && type != exprtype){
+			if(type == Primitive::INTEGER){
+				return emit(Op::CMPRI, Primitive::BOOLEAN, { value(expr), val }, static_cast<int64_t>(TokenType::EQ));
+			} else if(exprtype == Primitive::INTEGER){
+				return emit(Op::CMPRI, Primitive::BOOLEAN, { val, value(expr) }, static_cast<int64_t>(TokenType::EQ));
+			}
+			throw TypeError("Cannot convert condition to REAL");
+		}
+		expectTypeEqual(exprtype, type);
+		const ValueId e = value(expr);
+		Op cmp;
+		switch(type.primtype){
+			case Primitive::DATE: cmp = Op::CMPD; break;
+			case Primitive::CHAR: cmp = Op::CMPC; break;
+			case Primitive::STRING: cmp = Op::CMPS; break;
+			case Primitive::BOOLEAN: cmp = Op::CMPB; break;
+			case Primitive::INTEGER: cmp = Op::CMPI; break;
+			case Primitive::REAL: cmp = Op::CMPR; break;
+			default: throw TypeError("Use of unassigned type within CASE statement");
+		}
+		return emit(cmp, Primitive::BOOLEAN, { e, val }, static_cast<int64_t>(TokenType::EQ));
+	}
+	template<bool TopLevel>
+	void caseStmt(const Stmt<TopLevel>& stmt){
+		const EType type = typeOf(stmt.lvalues[0]);
+		const ValueId val = value(stmt.lvalues[0]);
+		if(type.is_array) throw TypeError("Cannot use array in CASE OF");
+		const BlockId join = newBlock();
+		bool ok = true;
+		for(size_t i = 0; ok && i < stmt.exprs.size(); i++){
+			ValueId matches;
+			ok = guard([&]{ matches = caseMatches(val, type, stmt.exprs[i]); });
+			if(!ok) break;
+			const BlockId arm = newBlock(), next = newBlock();
+			condBranch(matches, arm, next);
+			seal(arm);
+			seal(next);
+			cur = arm;
+			block(stmt.blocks[i]);
+			branch(join);
+			cur = next;
+		}
+		if(ok && stmt.blocks.size() > stmt.exprs.size()){
+			// OTHERWISE
+			block(stmt.blocks.back());
+		}
+		branch(join);
+		seal(join);
+		cur = join;
+	}
+	template<bool TopLevel>
+	void forStmt(const Stmt<TopLevel>& stmt){
+		bool is_frac = false;
+		for(const Expr& expr : stmt.exprs){
+			const EType type = typeOf(expr);
+			expectTypeEqual(type, Primitive::REAL, Primitive::INTEGER);
+			is_frac |= (type == Primitive::REAL);
+		}
+		std::vector<ValueId> vals;
+		for(const Expr& expr : stmt.exprs) vals.push_back(value(expr));
+		const EType type = is_frac ? Primitive::REAL : Primitive::INTEGER;
+		if(is_frac){
+			for(ValueId& val : vals){
+				if(irType(val) == Primitive::INTEGER) val = emit(Op::ITOR, Primitive::REAL, { val });
+			}
+		}
+		const ValueId step = vals.size() == 3 ? vals[2]
+			: (is_frac ? constant(Fraction<>(1), type) : intConst(1));
+		hide(stmt.ids[0]);
+		const Op cmp = is_frac ? Op::CMPR : Op::CMPI;
+		// See LOOPCOND in Stmt::eval
+		const ValueId up = emit(cmp, Primitive::BOOLEAN, { vals[0], vals[1] }, static_cast<int64_t>(TokenType::LT_EQ));
+		const size_t counter = newVar(type);
+		write(counter, cur, vals[0]);
+		const BlockId header = newBlock(), body = newBlock(), exit = newBlock();
+		branch(header);
+		cur = header;
+		const ValueId i = read(counter, header);
+		const ValueId below = emit(cmp, Primitive::BOOLEAN, { i, vals[1] }, static_cast<int64_t>(TokenType::LT_EQ));
+		const ValueId above = emit(cmp, Primitive::BOOLEAN, { i, vals[1] }, static_cast<int64_t>(TokenType::GT_EQ));
+		condBranch(emit(Op::SELECT, Primitive::BOOLEAN, { up, below, above }), body, exit);
+		seal(body);
+		cur = body;
+		// The loop variable is a new variable, which the body may change without affecting the loop.
+		const size_t var = newVar(type);
+		scope[stmt.ids[0]].push_back(var);
+		write(var, cur, i);
+		block(stmt.blocks[0]);
+		scope[stmt.ids[0]].pop_back();
+		const ValueId next = emit(is_frac ? Op::ADDR : Op::ADDI, type, { read(counter, cur), step });
+		write(counter, cur, next);
+		branch(header);
+		seal(header);
+		seal(exit);
+		cur = exit;
+		unhide(stmt.ids[0]);
+	}
+	void whileStmt(const Expr& cond, const ::Block& body_block){
+		expectTypeEqual(typeOf(cond), Primitive::BOOLEAN);
+		const BlockId header = newBlock();
+		branch(header);
+		cur = header;
+		ValueId c;
+		if(!guard([&]{ c = value(cond); })){
+			seal(header);
+			return;
+		}
+		const BlockId body = newBlock(), exit = newBlock();
+		condBranch(c, body, exit);
+		seal(body);
+		cur = body;
+		block(body_block);
+		branch(header);
+		seal(header);
+		seal(exit);
+		cur = exit;
+	}
+	void repeatStmt(const Expr& cond, const ::Block& body_block){
+		expectTypeEqual(typeOf(cond), Primitive::BOOLEAN);
+		const BlockId body = newBlock();
+		branch(body);
+		cur = body;
+		block(body_block);
+		ValueId c;
+		if(!guard([&]{ c = value(cond); })){
+			seal(body);
+			return;
+		}
+		const BlockId exit = newBlock();
+		condBranch(c, exit, body);
+		seal(body);
+		seal(exit);
+		cur = exit;
+	}
+	template<bool TopLevel>
+	void stmt(const Stmt<TopLevel>& s){
+		// What comes after a nested statement is still part of this one, like the step of a FOR.
+		const size_t outer = line;
+		line = s.line;
+		guard([&]{
+			switch(s.form){
+				case StmtForm::ASSIGN: assign(s.lvalues[0], s.exprs[0]); break;
+				case StmtForm::INPUT: input(s.lvalues[0]); break;
+				case StmtForm::OUTPUT: output(s.exprs); break;
+				case StmtForm::IF: ifStmt(s.exprs[0], s.blocks); break;
+				case StmtForm::CASE: caseStmt(s); break;
+				case StmtForm::FOR: forStmt(s); break;
+				case StmtForm::REPEAT: repeatStmt(s.exprs[0], s.blocks[0]); break;
+				case StmtForm::WHILE: whileStmt(s.exprs[0], s.blocks[0]); break;
+				case StmtForm::CALL: call(s.ids[0], s.exprs); break;
+				case StmtForm::RETURN:
+					if(fn_index == 0 && hot_returns != nullptr){
+						hotReturn(s.exprs[0]);
+					} else {
+						expectTypeEqual(typeOf(s.exprs[0]), fn->ret_type);
+						const ValueId res = value(s.exprs[0]);
+						unhideAll();
+						emit(Op::RET, Primitive::INVALID, { res });
+					}
+					unreachable();
+					break;
+				default:
+					throw RuntimeError("Invalid start of statement. (INTERNAL ERROR)");
+			}
+		});
+		line = outer;
+	}
+	void block(const ::Block& b){
+		for(const auto& s : b.stmts){
+			stmt(s);
+			// Block::eval stops at a RETURN
+			if(s.form == StmtForm::RETURN) break;
+		}
+	}
+	void topStmt(const Stmt<true>& s, size_t pos){
+		line = s.line;
+		switch(s.form){
+			case StmtForm::DECLARE:
+				guard([&]{
+					const int64_t id = s.ids[0];
+					const EType type = staticType(s.types[0], pos);
+					if(declared.count(id)) throw RuntimeError("Cannot initialize already-initialized variable");
+					for(const auto& b : type.bounds){
+						if(b.first > b.second) throw TypeError("Cannot have array with larger start index than end");
+					}
+					declared.insert(id);
+					const auto p = promoted.find(id);
+					if(p == promoted.end()){
+						emit(Op::DECLAREG, type, {}, id);
+					} else if(type.is_array){
+						write(p->second, cur, emit(Op::NEWARR, type, {}, type.size()));
+					} else {
+						write(p->second, cur, zero(type));
+					}
+				});
+				break;
+			case StmtForm::CONSTANT:
+				guard([&]{
+					const int64_t id = s.ids[0];
+					const EType type = typeOf(s.exprs[0]);
+					const ValueId val = value(s.exprs[0]);
+					if(declared.count(id)) throw RuntimeError("Cannot initialize already-initialized variable");
+					declared.insert(id);
+					const auto p = promoted.find(id);
+					if(p == promoted.end()){
+						emit(Op::DECLAREG, type, { val }, id);
+					} else {
+						// Env::initVar gives arrays new storage
+						write(p->second, cur, type.is_array ? emit(Op::NEWARR, type, {}, type.size()) : val);
+					}
+				});
+				break;
+			case StmtForm::PROCEDURE:
+			case StmtForm::FUNCTION:
+				guard([&]{
+					const size_t index = def_index.at(&s);
+					if(byref_funcs.count(index)) throw RuntimeError("BYREF is not supported");
+					emit(Op::DEFFUNC, Primitive::INVALID, {}, index);
+					defined[s.ids[0]] = index;
+				});
+				break;
+			default:
+				stmt(s);
+				break;
+		}
+	}
+
+	// }}}
+
+	// Functions {{{
+
+	void begin(size_t index){
+		fn = &mod.funcs[index];
+		fn_index = index;
+		var_types.clear();
+		defs.clear();
+		incomplete.clear();
+		sealed.clear();
+		scope.clear();
+		hidden.clear();
+		cur = newBlock();
+		seal(cur);
+	}
+	void function(const Stmt<true>& stmt){
+		begin(def_index.at(&stmt));
+		is_main = false;
+		line = stmt.line;
+		for(size_t i = 0; i < stmt.params.size(); i++){
+			const EType& type = fn->params[i];
+			ValueId val = emit(Op::PARAM, type, {}, i);
+			if(type.is_array){
+				// Array parameters are copies, see Env::copyVar
+				guard([&]{
+					for(const auto& b : type.bounds){
+						if(b.first > b.second) throw TypeError("Cannot have array with larger start index than end");
+					}
+				});
+				val = emit(Op::COPYNEW, type, { val }, type.size());
+			}
+			const size_t var = newVar(type);
+			scope[stmt.params[i].ident].push_back(var);
+			write(var, cur, val);
+		}
+		for(const Param& param : stmt.params) hide(param.ident);
+		block(stmt.blocks[0]);
+		if(stmt.form == StmtForm::FUNCTION){
+			emitThrow(false, "Function didn't return");
+		} else {
+			unhideAll();
+			emit(Op::RET, Primitive::INVALID);
+		}
+	}
+	void allFunctions(){
+		is_main = false;
+		for(const auto& s : prog.stmts){
+			if(s.form == StmtForm::FUNCTION || s.form == StmtForm::PROCEDURE) function(s);
+		}
+	}
+	/* The tree-walker finds a function's globals where it's called from, so a parameter
+	 * or a FOR's variable with the same name in a caller (or its callers) hides them,
+	 * while the functions here always use the global (see loop() too).
+	 * The names each function (0 being the main program) has to HIDEG while they're live,
+	 * because a function it calls can use the global with that name. */
+	std::vector<std::set<int64_t>> hiding() const {
+		// Names each function can hide, FOR variables while the loop runs
+		std::vector<std::set<int64_t>> names(mod.funcs.size());
+		std::function<void(const ::Block&, std::set<int64_t>&)> forVars = [&](const ::Block& b, std::set<int64_t>& res){
+			for(const auto& inner : b.stmts){
+				if(inner.form == StmtForm::FOR) res.insert(inner.ids[0]);
+				for(const ::Block& nested : inner.blocks) forVars(nested, res);
+			}
+		};
+		for(const auto& s : prog.stmts){
+			if(s.form == StmtForm::FUNCTION || s.form == StmtForm::PROCEDURE){
+				std::set<int64_t>& res = names[def_index.at(&s)];
+				for(const Param& param : s.params) res.insert(param.ident);
+				for(const ::Block& b : s.blocks) forVars(b, res);
+				continue;
+			}
+			if(s.form == StmtForm::FOR) names[0].insert(s.ids[0]);
+			for(const ::Block& b : s.blocks) forVars(b, names[0]);
+		}
+		std::vector<std::set<int64_t>> res(mod.funcs.size());
+		for(size_t from = 0; from < mod.funcs.size(); from++){
+			if(names[from].empty()) continue;
+			std::vector<bool> seen(mod.funcs.size(), false);
+			std::vector<size_t> work = { from };
+			while(!work.empty()){
+				const Function& f = mod.funcs[work.back()];
+				const bool callee = (work.back() != from || seen[from]);
+				work.pop_back();
+				for(const Inst& inst : f.insts){
+					if(callee && isAnyOf(inst.op, Op::LOADG, Op::STOREG) && names[from].count(inst.a)){
+						res[from].insert(inst.a);
+					}
+					if(inst.op == Op::CALL && !seen[inst.a]){
+						seen[inst.a] = true;
+						work.push_back(inst.a);
+					}
+				}
+			}
+		}
+		return res;
+	}
+
+	// }}}
+
+	// Hot loops, see loop() {{{
+
+	/* The tree-walker evaluates the RETURN, so the FOR's variable has to be back in Env. */
+	void hotReturn(const Expr& expr){
+		for(const auto& [id, vars] : scope){
+			if(vars.empty()) continue;
+			// The variable of a FOR in the loop isn't in Env yet.
+			if(id != hot_var || vars.size() != 1) throw Unsupported("a RETURN inside a FOR inside a hot loop");
+			emit(Op::STOREG, Primitive::INVALID, { read(vars[0], cur) }, id);
+		}
+		hot_returns->push_back(&expr);
+		write(hot_result, cur, intConst(hot_returns->size()));
+		branch(hot_exit);
+	}
+	/* A variable no function can see lives in an SSA variable while the loop runs,
+	 * loaded when it starts and stored back when it ends. */
+	bool hotPromote(int64_t id){
+		if(hot_returns == nullptr || fn_index != 0 || touched.count(id)) return false;
+		const int32_t level = env.getLevel(id);
+		if(level != env.GLOBAL_LEVEL && level != env.call_number) return false;
+		const size_t var = newVar(global_types[id]);
+		Inst load(Op::LOADG, global_types[id]);
+		load.a = id;
+		load.block = 0;
+		const ValueId val = fn->add(std::move(load));
+		fn->blocks[0].insts.insert(fn->blocks[0].insts.begin(), val);
+		write(var, 0, val);
+		promoted[id] = var;
+		return true;
+	}
+	/* The FOR from the value its variable takes next, its other values being parameters */
+	template<bool TopLevel>
+	void hotFor(const Stmt<TopLevel>& stmt){
+		const EType type = varType(stmt.ids[0]);
+		fn->params.assign(4, type);
+		ValueId vals[4];
+		for(size_t i = 0; i < 4; i++) vals[i] = emit(Op::PARAM, type, {}, i);
+		const Op cmp = type == Primitive::REAL ? Op::CMPR : Op::CMPI;
+		const ValueId up = emit(cmp, Primitive::BOOLEAN, { vals[1], vals[2] }, static_cast<int64_t>(TokenType::LT_EQ));
+		const size_t counter = newVar(type);
+		write(counter, cur, vals[0]);
+		const BlockId header = newBlock(), body = newBlock(), exit = newBlock();
+		branch(header);
+		cur = header;
+		const ValueId i = read(counter, header);
+		const ValueId below = emit(cmp, Primitive::BOOLEAN, { i, vals[2] }, static_cast<int64_t>(TokenType::LT_EQ));
+		const ValueId above = emit(cmp, Primitive::BOOLEAN, { i, vals[2] }, static_cast<int64_t>(TokenType::GT_EQ));
+		condBranch(emit(Op::SELECT, Primitive::BOOLEAN, { up, below, above }), body, exit);
+		seal(body);
+		cur = body;
+		const size_t var = newVar(type);
+		scope[stmt.ids[0]].push_back(var);
+		hot_var = stmt.ids[0];
+		write(var, cur, i);
+		block(stmt.blocks[0]);
+		scope[stmt.ids[0]].pop_back();
+		const ValueId next = emit(type == Primitive::REAL ? Op::ADDR : Op::ADDI, type, { read(counter, cur), vals[3] });
+		write(counter, cur, next);
+		branch(header);
+		seal(header);
+		seal(exit);
+		cur = exit;
+	}
+
+	// }}}
+
+	/* Facts about the whole program, worked out before lowering any of it. */
+	void scan(){
+		// Everything that gets assigned somewhere
+		std::function<void(const ::Block&)> scanBlock;
+		const auto scanStmt = [&](const auto& s){
+			if(s.form == StmtForm::ASSIGN || s.form == StmtForm::INPUT) assigned.insert(s.lvalues[0].id);
+			for(const ::Block& b : s.blocks) scanBlock(b);
+		};
+		scanBlock = [&](const ::Block& b){
+			for(const auto& s : b.stmts) scanStmt(s);
+		};
+		std::map<int64_t, size_t> declarations;
+		for(const auto& s : prog.stmts){
+			scanStmt(s);
+			if(s.form == StmtForm::DECLARE || s.form == StmtForm::CONSTANT) declarations[s.ids[0]]++;
+		}
+		// CONSTANTs that are only set once, to something known
+		for(size_t i = 0; i < prog.stmts.size(); i++){
+			const auto& s = prog.stmts[i];
+			if(s.form != StmtForm::CONSTANT || assigned.count(s.ids[0]) || declarations[s.ids[0]] != 1) continue;
+			const auto val = staticInt(s.exprs[0], i);
+			if(val) const_ints[s.ids[0]] = { i, *val };
+		}
+		// Signatures of the functions
+		mod.funcs.emplace_back();
+		mod.funcs[0].name = "main";
+		for(size_t i = 0; i < prog.stmts.size(); i++){
+			const auto& s = prog.stmts[i];
+			if(s.form != StmtForm::FUNCTION && s.form != StmtForm::PROCEDURE) continue;
+			const int64_t id = s.ids[0];
+			// Calls from the functions to the one defined last need the whole program
+			if(isBuiltin(id) || (mod.func_index.count(id) && !whole)) throw Unsupported("a function is defined more than once");
+			Function f;
+			f.name = "~" + std::to_string(id);
+			std::set<int64_t> names;
+			for(const Param& param : s.params){
+				if(param.byref) byref_funcs.insert(mod.funcs.size());
+				if(!names.insert(param.ident).second) throw Unsupported("two parameters have the same name");
+				f.params.push_back(staticType(param.type, i));
+			}
+			if(s.form == StmtForm::FUNCTION) f.ret_type = staticType(s.types[0], i);
+			f.local_arrays = s.local_arrays;
+			if(mod.func_index.count(id)){
+				// Env keeps the first definition's arity and return type
+				const Function& first = mod.funcs[mod.func_index.at(id)];
+				if(f.params.size() != first.params.size() || f.ret_type != first.ret_type){
+					throw Unsupported("a function is redefined with another signature");
+				}
+			}
+			mod.func_index.try_emplace(id, mod.funcs.size());
+			definitions[id].push_back(mod.funcs.size());
+			def_index[&s] = mod.funcs.size();
+			mod.funcs.push_back(std::move(f));
+		}
+		// Types of the globals, as they are declared
+		for(size_t i = 0; i < prog.stmts.size(); i++){
+			const auto& s = prog.stmts[i];
+			if(s.form != StmtForm::DECLARE && s.form != StmtForm::CONSTANT) continue;
+			const int64_t id = s.ids[0];
+			if(global_types.count(id)) continue;
+			if(s.form == StmtForm::DECLARE){
+				global_types[id] = staticType(s.types[0], i);
+			} else {
+				try {
+					const EType type = typeOf(s.exprs[0]);
+					if(type != Primitive::INVALID) global_types[id] = type;
+				} catch(TypeError&) {
+				} catch(RuntimeError&) {
+				}
+			}
+			declared.insert(id);
+		}
+		declared.clear();
+	}
+
+public:
+	Lowering(const Program& prog_, const Env& env_) : prog(prog_), env(env_) {}
+
+	Module run(){
+		whole = true;
+		scan();
+		allFunctions();
+		begin(0);
+		is_main = true;
+		for(const auto& [id, type] : global_types){
+			if(!touched.count(id)) promoted[id] = newVar(type);
+		}
+		for(size_t i = 0; i < prog.stmts.size(); i++) topStmt(prog.stmts[i], i);
+		emit(Op::RET, Primitive::INVALID);
+		if(hides.empty()){
+			std::vector<std::set<int64_t>> needed = hiding();
+			if(std::any_of(needed.begin(), needed.end(), [](const auto& names){ return !names.empty(); })){
+				// Again, knowing where to hide them
+				Lowering again(prog, env);
+				again.hides = std::move(needed);
+				return again.run();
+			}
+		}
+		return std::move(mod);
+	}
+	/* Just the functions, for calling them one at a time. The main program does nothing. */
+	Module functions(){
+		scan();
+		allFunctions();
+		begin(0);
+		emit(Op::RET, Primitive::INVALID);
+		return std::move(mod);
+	}
+	/* A loop the tree-walker found hot, as the main program, carrying on from a back-edge
+	 * (see Tiers::loop): a WHILE from its condition, a REPEAT from its body and
+	 * a FOR from the value its variable takes next (its first parameter),
+	 * the start, end and step being the others.
+	 * Every name that isn't a FOR's variable is a variable in Env, of the type it has now,
+ * kept in an SSA variable while the loop runs if no function can see it.
+	 * It returns 0 when the loop ends, and i for the RETURN in `returns[i - 1]`. */
+	template<bool TopLevel>
+	Module loop(const Stmt<TopLevel>& s, std::vector<const Expr *>& returns){
+		scan();
+		allFunctions();
+		// A function called by the loop runs at the same level, Env has to
+		// hold the globals it uses, not a local variable (or a FOR's) with the same name.
+		std::set<int64_t> for_vars;
+		std::function<void(const Stmt<false>&)> forVars = [&](const Stmt<false>& stmt){
+			if(stmt.form == StmtForm::FOR) for_vars.insert(stmt.ids[0]);
+			for(const ::Block& b : stmt.blocks){
+				for(const auto& inner : b.stmts) forVars(inner);
+			}
+		};
+		if(s.form == StmtForm::FOR) for_vars.insert(s.ids[0]);
+		for(const auto& inner : s.blocks[0].stmts) forVars(inner);
+		for(const int64_t id : touched){
+			const bool local = env.getType(id) != Primitive::INVALID && env.getLevel(id) != env.GLOBAL_LEVEL;
+			if(local || for_vars.count(id)) throw Unsupported("a function uses a global hidden by a local");
+		}
+		global_types.clear();
+		for(size_t id = 0; id < env.variables(); id++){
+			if(env.getType(id) != Primitive::INVALID) global_types[id] = env.getType(id);
+		}
+		begin(0);
+		hot_returns = &returns;
+		hot_exit = newBlock();
+		hot_result = newVar(Primitive::INTEGER);
+		fn->ret_type = Primitive::INTEGER;
+		line = s.line;
+		if(!isAnyOf(s.form, StmtForm::FOR, StmtForm::WHILE, StmtForm::REPEAT)) throw Unsupported("not a loop");
+		guard([&]{
+			if(s.form == StmtForm::FOR) hotFor(s);
+			else if(s.form == StmtForm::WHILE) whileStmt(s.exprs[0], s.blocks[0]);
+			else repeatStmt(s.exprs[0], s.blocks[0]);
+		});
+		write(hot_result, cur, intConst(0));
+		branch(hot_exit);
+		seal(hot_exit);
+		cur = hot_exit;
+		for(const auto& [id, var] : promoted) emit(Op::STOREG, Primitive::INVALID, { read(var, cur) }, id);
+		emit(Op::RET, Primitive::INVALID, { read(hot_result, cur) });
+		return std::move(mod);
+	}
+};
+
+inline Module lower(const Program& prog, const Env& env){
+	return Lowering(prog, env).run();
+}
+
+/* See Lowering::loop */
+template<bool TopLevel>
+Module lowerLoop(const Program& prog, const Env& env, const Stmt<TopLevel>& loop, std::vector<const Expr *>& returns){
+	return Lowering(prog, env).loop(loop, returns);
+}
+
+} /* namespace ir */
+
+#endif /* LOWERING_HPP */
@@ -1,12 +1,81 @@
 #include <iostream>
 #include <vector>
 #include "interpreter.hpp"
+#include "optimizer.hpp"
+#include "lowering.hpp"
+#include "irpasses.hpp"
+#include "irexec.hpp"
+#include "closures.hpp"
+#include "cgen.hpp"
+#include "compiler.hpp"
+#include "peephole.hpp"
+#include "pcsb.hpp"
+#include "vm.hpp"
+#include "tiers.hpp"
+#include "stack.hpp"
+
+#define CATCH_B(n) \
+	std::cerr << #n << ": " << e.what() << '\n'; \
+	return EXIT_FAILURE; \
+
+#define CATCH(name) \
+	catch(name &e) { \
+		CATCH_B(name) \
+	}
+
+/* Runs the .pcsb file at `offset` in `path` */
+static int runBytecode(const std::string& path, uint64_t offset, bool dump_bytecode, bool use_jit, bool opcode_stats){
+	try {
+		const pcsb::File file(path, offset);
+		if(dump_bytecode) print(std::cerr, file.code);
+		std::map<std::string_view, int64_t> no_ids;
+		Env env(file.variables - 1, no_ids);
+		VM vm(env, file.code);
+		if(use_jit) vm.enableJit();
+		if(opcode_stats){
+			OpcodeStats stats;
+			vm.run(stats);
+			stats.print(std::cerr);
+		} else {
+			vm.run();
+		}
+	} CATCH(TypeError) CATCH(RuntimeError) CATCH(VMRuntimeError) CATCH(VMFileError)
+	catch(std::bad_alloc&){
+		// An array bigger than memory, in a file that declares one
+		std::cerr << "RuntimeError: Out of memory\n";
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[]){
+	// A bundle runs its program, whatever the arguments.
+	const std::string self = pcsb::selfPath(argv[0]);
+	try {
+		if(const auto offset = pcsb::bundled(self)) return runBytecode(self, *offset, false, false, false);
+	} CATCH(VMFileError);
+
 	const char *filename = nullptr;
 	bool print_tokens = false;
 	bool print_tree = false;
 	bool print_line = false;
+	bool optimize_tree = true;
+	enum class Engine { TREE, IR, CLOSURE, VM, TIERED } engine = Engine::TREE;
+	bool print_ir = false;
+	bool verify_ir = false;
+	bool superinstructions = true;
+	bool dump_bytecode = false;
+	bool opcode_stats = false;
+	bool use_jit = false;
+	bool compile_only = false;
+	bool emit_c = false;
+	bool aot = false;
+	bool bundle = false;
+	const char *output = nullptr;
+	bool idioms = false;
+	const char *record_profile = nullptr;
+	const char *use_profile = nullptr;
+	size_t stack_mb = 0;
 	for(int i = 1; i < argc; i++){
 		std::string_view arg(argv[i]);
 		if(!arg.size()) goto fail;
@@ -14,10 +83,28 @@ int main(int argc, char *argv[]){
 			if(arg == "--help" || arg == "-h"){
 				fprintf(stderr, 
 					"Usage: %s [OPTIONS...] FILE\n"
-					"Interpret FILE as pseudocode.\n"
+					"Interpret FILE as pseudocode, or run it on the VM if it's bytecode (a .pcsb file).\n"
 					"Options:\n"
 					"--print-tokens: Print the token list of the file.\n"
 					"--print-tree: Print the syntax tree of the file.\n"
+					"--no-optimize: Do not optimize the syntax tree (or the IR and the bytecode) before running it.\n"
+					"--engine=tree|ir|vm: Run the syntax tree (the default), or compile it to IR and run that, or to bytecode for the VM.\n"
+					"--engine=closure: Compile it to IR, and that to a tree of closures, and run that.\n"
+					"--engine=tiered: Run the syntax tree, but run the functions and loops that get hot on the VM.\n"
+					"--print-ir: Print the IR of the file (with --engine=ir, closure or vm).\n"
+					"--verify-ir: Check the IR after every optimization pass (with --engine=ir, closure or vm).\n"
+					"--dump-bytecode: Print the bytecode of the file before and after the peephole pass (with --engine=vm).\n"
+					"--opcode-stats: Count how often every VM instruction and pair of instructions runs and time them, and print that afterwards (with --engine=vm).\n"
+					"--jit: Compile the bytecode to x86-64 machine code and run that (with --engine=vm or tiered).\n"
+					"--compile-only -o OUT: Compile FILE to bytecode and save it to OUT (a .pcsb file) instead of running it.\n"
+					"--emit-c: Compile FILE to a C program (through the IR) and print it instead of running it.\n"
+					"--aot -o OUT: Compile FILE to C, and that to the executable OUT with the system's C compiler ($CC, or cc).\n"
+					"--bundle -o OUT: Compile FILE to bytecode and write the executable OUT, a copy of pcse that runs it.\n"
+					"--no-superinstructions: Do not fuse common sequences of VM instructions (with --engine=vm).\n"
+					"--stack=MB: Run on a stack of MB MiB of its own, and report running out of it with the calls that did instead of crashing (with --engine=tree or tiered).\n"
+					"--idioms: Run common loops over INTEGER arrays (sums, searches, ...) natively, and list them.\n"
+					"--record-profile PROFILE: Count how often branches, CASEs, loops and functions run, and write it to PROFILE.\n"
+					"--use-profile PROFILE: Optimize using the counts in PROFILE (recorded for the same FILE).\n"
 					"-h, --help: Print help.\n",
 					argv[0]);
 				exit(EXIT_SUCCESS);
@@ -25,6 +112,55 @@ int main(int argc, char *argv[]){
 				print_tokens = true;
 			} else if(arg == "--print-tree"){
 				print_tree = true;
+			} else if(arg == "--no-optimize"){
+				optimize_tree = false;
+			} else if(arg == "--engine=tree"){
+				engine = Engine::TREE;
+			} else if(arg == "--engine=ir"){
+				engine = Engine::IR;
+			} else if(arg == "--engine=closure"){
+				engine = Engine::CLOSURE;
+			} else if(arg == "--engine=vm"){
+				engine = Engine::VM;
+			} else if(arg == "--engine=tiered"){
+				engine = Engine::TIERED;
+			} else if(arg == "--print-ir"){
+				print_ir = true;
+			} else if(arg == "--verify-ir"){
+				verify_ir = true;
+			} else if(arg == "--dump-bytecode"){
+				dump_bytecode = true;
+			} else if(arg == "--opcode-stats"){
+				opcode_stats = true;
+			} else if(arg == "--jit"){
+				use_jit = true;
+			} else if(arg == "--compile-only" || arg == "--bundle"){
+				(arg == "--compile-only" ? compile_only : bundle) = true;
+				engine = Engine::VM;
+			} else if(arg == "--emit-c" || arg == "--aot"){
+				(arg == "--emit-c" ? emit_c : aot) = true;
+			} else if(arg == "-o"){
+				if(i + 2 >= argc){
+					fprintf(stderr, "-o needs an OUT and a FILE\n");
+					goto fail;
+				}
+				output = argv[++i];
+			} else if(arg == "--no-superinstructions"){
+				superinstructions = false;
+			} else if(arg == "--idioms"){
+				idioms = true;
+			} else if(arg == "--record-profile" || arg == "--use-profile"){
+				if(i + 2 >= argc){
+					fprintf(stderr, "%s needs a PROFILE and a FILE\n", argv[i]);
+					goto fail;
+				}
+				(arg == "--record-profile" ? record_profile : use_profile) = argv[++i];
+			} else if(arg.substr(0, 8) == "--stack="){
+				const auto res = std::from_chars(arg.data() + 8, arg.data() + arg.size(), stack_mb);
+				if(res.ec != std::errc() || res.ptr != arg.data() + arg.size() || stack_mb == 0 || stack_mb > (SIZE_MAX >> 20)){
+					fprintf(stderr, "--stack needs a number of MiB\n");
+					goto fail;
+				}
 			} else if(arg == "-l"){
 				print_line = true;
 			} else {
@@ -47,6 +183,19 @@ fail:
 		fprintf(stderr, "No file specified!\n");
 		exit(EXIT_FAILURE);
 	}
+	if(record_profile != nullptr && (use_profile != nullptr || engine != Engine::TREE)){
+		fprintf(stderr, "--record-profile can't be used with --use-profile or another --engine\n");
+		exit(EXIT_FAILURE);
+	}
+	if((compile_only || aot || bundle) != (output != nullptr) || compile_only + emit_c + aot + bundle > 1){
+		fprintf(stderr, "-o goes with one of --compile-only, --aot or --bundle\n");
+		exit(EXIT_FAILURE);
+	}
+	if(emit_c || aot) engine = Engine::IR;
+	if(stack_mb != 0 && engine != Engine::TREE && engine != Engine::TIERED){
+		fprintf(stderr, "--stack goes with --engine=tree or tiered\n");
+		exit(EXIT_FAILURE);
+	}
 	// read all from file
 	std::ifstream in(filename, std::ios::in);
 	if(!in){
@@ -54,15 +203,10 @@ fail:
 		exit(EXIT_FAILURE);
 	}
 
-#define CATCH_B(n) \
-	std::cerr << #n << ": " << e.what() << '\n'; \
-	return EXIT_FAILURE; \
-
-#define CATCH(name) \
-	catch(name &e) { \
-		CATCH_B(name) \
+	const std::string_view name(filename);
+	if(name.size() > 5 && name.substr(name.size() - 5) == ".pcsb"){
+		return runBytecode(filename, 0, dump_bytecode, use_jit, opcode_stats);
 	}
-	
 	try {
 		Lexer lexer(in);
 		if(print_tokens){
@@ -71,11 +215,112 @@ fail:
 			}
 		}
 		Parser parser(lexer.output);
+		// Profiles number the statements as they are parsed, so they go first.
+		Profile profile(*parser.output);
+		if(use_profile != nullptr){
+			std::ifstream prof_in(use_profile);
+			if(!prof_in) throw ProfileError("Cannot open profile");
+			profile.read(prof_in);
+			if(optimize_tree) ProfilePass(*parser.output, profile).run();
+		}
+		if(record_profile != nullptr){
+			profile.record(*parser.output);
+		}
+		if(optimize_tree){
+			optimize(*parser.output);
+		}
+		if(idioms && (engine == Engine::TREE || engine == Engine::TIERED)){
+			IdiomPass pass(*parser.output);
+			pass.run();
+			for(const auto& [line, name, fit] : pass.found){
+				std::cerr << "Line " << line << ": FOR loop ";
+				switch(fit){
+					case IdiomPass::Fit::YES: std::cerr << "runs as a native " << name << " when its range is in bounds\n"; break;
+					case IdiomPass::Fit::MAYBE: std::cerr << "runs as a native " << name << " if the types allow it when it runs\n"; break;
+					case IdiomPass::Fit::NO: std::cerr << "is a " << name << ", but its types never allow running it natively\n"; break;
+				}
+			}
+		}
 		if(print_tree){
 			std::cerr << *parser.output << '\n';
 		}
 		Env env(lexer.identifier_count, lexer.id_num);
-		parser.run(env);
+		const auto walk = [&](){
+			if(stack_mb == 0) return parser.run(env);
+			HeapStack(stack_mb << 20).run(env, [&](){ parser.run(env); }, lexer.id_num);
+		};
+		if(engine == Engine::TIERED){
+			VMTiers tiers(*parser.output, optimize_tree, superinstructions, use_jit);
+			env.tiers = &tiers;
+			walk();
+			env.tiers = nullptr;
+		} else if(engine != Engine::TREE){
+			try {
+				ir::Module mod = ir::lower(*parser.output, env);
+				if(verify_ir) ir::verify(mod);
+				if(optimize_tree){
+					ir::PassManager passes;
+					passes.verify_each = verify_ir;
+					passes.run(mod);
+				}
+				if(print_ir) ir::print(std::cerr, mod);
+				if(emit_c){
+					cgen::emit(std::cout, mod);
+				} else if(aot){
+					std::ostringstream source;
+					cgen::emit(source, mod);
+					cgen::build(source.str(), output);
+				} else if(engine == Engine::IR){
+					ir::Machine(env, mod).run();
+				} else if(engine == Engine::CLOSURE){
+					closures::Machine(env, mod).run();
+				} else {
+					Bytecode code = compile(mod, superinstructions);
+					if(dump_bytecode){
+						std::cerr << "Bytecode (" << code.instr.size() << " words):\n";
+						print(std::cerr, code);
+					}
+					if(optimize_tree){
+						peephole(code);
+						if(dump_bytecode){
+							std::cerr << "After the peephole pass (" << code.instr.size() << " words):\n";
+							print(std::cerr, code);
+						}
+					}
+					if(compile_only){
+						std::ofstream out(output, std::ios::binary);
+						pcsb::write(out, code, env.variables());
+						if(!out) throw VMFileError(std::string("Cannot write ") + output);
+					} else if(bundle){
+						std::ostringstream program;
+						pcsb::write(program, code, env.variables());
+						pcsb::bundle(self, program.str(), output);
+					} else {
+						VM vm(env, code);
+						if(use_jit) vm.enableJit();
+						if(opcode_stats){
+							OpcodeStats stats;
+							vm.run(stats);
+							stats.print(std::cerr);
+						} else {
+							vm.run();
+						}
+					}
+				}
+			} catch(ir::Unsupported& e){
+				if(compile_only || bundle) throw VMFileError(std::string("Cannot compile to bytecode: ") + e.what());
+				if(emit_c || aot) throw cgen::CGenError(std::string("Cannot compile to C: ") + e.what());
+				std::cerr << "Cannot compile to IR (" << e.what() << "), interpreting instead\n";
+				parser.run(env);
+			}
+		} else {
+			walk();
+		}
+		if(record_profile != nullptr){
+			std::ofstream prof_out(record_profile);
+			profile.write(prof_out);
+			if(!prof_out) throw ProfileError("Cannot write profile");
+		}
 	} catch(std::istream::failure& e){ 
 		std::cerr << "File error: Failure to read file\n";
 		std::cerr << "istream::failure::what(): " << e.what() << '\n';
@@ -86,7 +331,7 @@ fail:
 	} catch(ParseError& e){
 		if(print_line) std::cerr << e.token.line << ':' << e.token.col << '\n';
 		CATCH_B(ParseError);
-	} CATCH(TypeError) CATCH(RuntimeError);
+	} CATCH(TypeError) CATCH(RuntimeError) CATCH(ir::IRError) CATCH(ProfileError) CATCH(VMRuntimeError) CATCH(VMFileError) CATCH(cgen::CGenError);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,975 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include "parser.hpp"
+#include "profile.hpp"
+
+/* Passes over the syntax tree.
+ * They run once after parsing and only annotate the tree,
+ * so Program::eval behaves the same with or without them. */
+
+// Effects {{{
+
+/* What a piece of code may write to. */
+struct Effects {
+	std::set<int64_t> writes;
+	std::set<int64_t> rebinds; /* written as a whole (not just an element) */
+	std::set<int64_t> callees;
+	bool calls = false; /* a call may write anything */
+};
+
+template<uint16_t Level>
+void exprEffects(const BinExpr<Level>& e, Effects& eff);
+
+inline void exprEffects(const Primary& p, Effects& eff){
+	switch(p.primtype()){
+		case TokenType::CALL:
+			eff.calls = true;
+			eff.callees.insert(p.all.func_id);
+			for(const Expr& arg : *p.main().args) exprEffects(arg, eff);
+			break;
+		case TokenType::IDENTIFIER:
+			if(p.main().lvalue.indexes != nullptr){
+				for(const Expr& idx : *p.main().lvalue.indexes) exprEffects(idx, eff);
+			}
+			break;
+		case TokenType::INVALID:
+			exprEffects(*p.main().expr, eff);
+			break;
+		default:
+			break;
+	}
+}
+
+inline void exprEffects(const UnaryExpr& e, Effects& eff){
+	if(e.op == TokenType::INVALID) exprEffects(*e.main.primary, eff);
+	else exprEffects(*e.main.unexpr, eff);
+}
+
+template<uint16_t Level>
+void exprEffects(const BinExpr<Level>& e, Effects& eff){
+	exprEffects(e.left, eff);
+	if(e.opt.op != TokenType::INVALID) exprEffects(*e.opt.right, eff);
+}
+
+inline void blockEffects(const Block& b, Effects& eff);
+
+template<bool TopLevel>
+void stmtEffects(const Stmt<TopLevel>& stmt, Effects& eff){
+	for(const Expr& e : stmt.exprs) exprEffects(e, eff);
+	for(const LValue& lv : stmt.lvalues){
+		if(lv.indexes != nullptr){
+			for(const Expr& idx : *lv.indexes) exprEffects(idx, eff);
+		}
+	}
+	switch(stmt.form){
+		case StmtForm::ASSIGN:
+		case StmtForm::INPUT:
+			eff.writes.insert(stmt.lvalues[0].id);
+			if(stmt.lvalues[0].indexes == nullptr) eff.rebinds.insert(stmt.lvalues[0].id);
+			break;
+		case StmtForm::FOR:
+		case StmtForm::DECLARE:
+		case StmtForm::CONSTANT:
+			eff.writes.insert(stmt.ids[0]);
+			eff.rebinds.insert(stmt.ids[0]);
+			break;
+		case StmtForm::CALL:
+			eff.calls = true;
+			eff.callees.insert(stmt.ids[0]);
+			break;
+		default:
+			break;
+	}
+	if(stmt.form != StmtForm::PROCEDURE && stmt.form != StmtForm::FUNCTION){
+		for(const Block& b : stmt.blocks) blockEffects(b, eff);
+	}
+}
+
+inline void blockEffects(const Block& b, Effects& eff){
+	for(const auto& stmt : b.stmts) stmtEffects(stmt, eff);
+}
+
+// }}}
+
+// CSEPass {{{
+
+/* Local common subexpression elimination.
+ *
+ * Walks the tree in the exact order the interpreter evaluates it,
+ * keeping track of which pure subexpressions are "available": already evaluated,
+ * and not invalidated by a write to anything they read since then.
+ * Arithmetic expressions (+, -, *, /, MOD, DIV) share their value;
+ * indexed array accesses share the address of the element,
+ * which stays valid while the array itself and the indexes are not reassigned.
+ * Subexpressions are matched structurally by their printed form.
+ *
+ * Any call kills everything that is available.
+ * This also keeps recursion safe: a recursive call may overwrite
+ * the slots of the caller, but the caller never reads them after the call.
+ */
+class CSEPass {
+	struct Avail {
+		CSE *def;
+		std::set<int64_t> vdeps; /* value is read */
+		std::set<int64_t> bdeps; /* only the address is used (array base) */
+	};
+	using AvailMap = std::map<std::string, Avail>;
+
+	struct Deps {
+		std::set<int64_t> ids;
+		bool call = false;
+		inline void merge(const Deps& d){
+			ids.insert(d.ids.begin(), d.ids.end());
+			call |= d.call;
+		}
+	};
+
+	Program& prog;
+
+	static void kill(AvailMap& avail, int64_t id, bool whole){
+		for(auto it = avail.begin(); it != avail.end();){
+			if(it->second.vdeps.count(id) || (whole && it->second.bdeps.count(id))){
+				it = avail.erase(it);
+			} else ++it;
+		}
+	}
+
+	static void kill(AvailMap& avail, const Effects& eff){
+		if(eff.calls){
+			avail.clear();
+			return;
+		}
+		for(const int64_t id : eff.writes) kill(avail, id, eff.rebinds.count(id));
+	}
+
+	void use(CSE& cse, const Avail& av){
+		if(av.def->slot == nullptr){
+			prog.cse_slots.push_back(std::make_unique<CSESlot>());
+			av.def->slot = prog.cse_slots.back().get();
+			av.def->def = true;
+		}
+		cse.slot = av.def->slot;
+		cse.def = false;
+	}
+
+	template<typename T>
+	static std::string keyOf(char kind, const T& node){
+		std::ostringstream os;
+		os << kind << node;
+		return os.str();
+	}
+
+	void visit(LValue& lv, AvailMap& avail, Deps& deps){
+		deps.ids.insert(lv.id);
+		if(lv.indexes == nullptr) return;
+		const std::string key = keyOf('L', lv);
+		auto it = avail.find(key);
+		if(it != avail.end()){
+			use(lv.cse, it->second);
+			deps.ids.insert(it->second.vdeps.begin(), it->second.vdeps.end());
+			return;
+		}
+		Deps sub;
+		for(Expr& idx : *lv.indexes) visit(idx, avail, sub);
+		if(!sub.call) avail[key] = Avail{ &lv.cse, sub.ids, { lv.id } };
+		deps.merge(sub);
+	}
+
+	void visit(Primary& p, AvailMap& avail, Deps& deps){
+		switch(p.primtype()){
+			case TokenType::CALL:
+				for(Expr& arg : *p.all.main.args) visit(arg, avail, deps);
+				avail.clear();
+				deps.call = true;
+				break;
+			case TokenType::IDENTIFIER:
+				visit(p.all.main.lvalue, avail, deps);
+				break;
+			case TokenType::INVALID:
+				visit(*p.all.main.expr, avail, deps);
+				break;
+			default:
+				break;
+		}
+	}
+
+	void visit(UnaryExpr& e, AvailMap& avail, Deps& deps){
+		if(e.op == TokenType::INVALID){
+			visit(*e.main.primary, avail, deps);
+		} else if(e.op == TokenType::MINUS){
+			visit(*e.main.unexpr, avail, deps);
+		} else {
+			// NOT doesn't evaluate its operand the usual way,
+			// so don't share anything through it.
+			Effects eff;
+			exprEffects(e, eff);
+			if(eff.calls) avail.clear();
+			deps.call = true;
+		}
+	}
+
+	template<uint16_t Level>
+	void visit(BinExpr<Level>& e, AvailMap& avail, Deps& deps){
+		const bool candidate = Level >= 3 && e.opt.op != TokenType::INVALID;
+		std::string key;
+		if(candidate){
+			key = keyOf('0' + Level, e);
+			auto it = avail.find(key);
+			if(it != avail.end()){
+				use(e.cse, it->second);
+				deps.ids.insert(it->second.vdeps.begin(), it->second.vdeps.end());
+				return;
+			}
+		}
+		Deps sub;
+		visit(e.left, avail, sub);
+		if(e.opt.op != TokenType::INVALID) visit(*e.opt.right, avail, sub);
+		if(candidate && !sub.call) avail[key] = Avail{ &e.cse, sub.ids, {} };
+		deps.merge(sub);
+	}
+
+	inline void visit(Expr& e, AvailMap& avail){
+		Deps deps;
+		visit(e, avail, deps);
+	}
+
+	void visit(Block& b, AvailMap& avail){
+		for(auto& stmt : b.stmts) visit(stmt, avail);
+	}
+
+	template<bool TopLevel>
+	void visit(Stmt<TopLevel>& stmt, AvailMap& avail){
+		Effects eff;
+		stmtEffects(stmt, eff);
+		switch(stmt.form){
+			case StmtForm::DECLARE:
+				// The bounds may contain anything.
+				avail.clear();
+				break;
+			case StmtForm::CONSTANT:
+				visit(stmt.exprs[0], avail);
+				kill(avail, stmt.ids[0], true);
+				break;
+			case StmtForm::PROCEDURE:
+			case StmtForm::FUNCTION:
+				{
+					AvailMap body;
+					visit(stmt.blocks[0], body);
+					avail.clear();
+				}
+				break;
+			case StmtForm::ASSIGN:
+				{
+					// (see Stmt::eval: the value is evaluated before the target is located)
+					visit(stmt.exprs[0], avail);
+					Deps deps;
+					visit(stmt.lvalues[0], avail, deps);
+					kill(avail, stmt.lvalues[0].id, stmt.lvalues[0].indexes == nullptr);
+				}
+				break;
+			case StmtForm::INPUT:
+				{
+					Deps deps;
+					visit(stmt.lvalues[0], avail, deps);
+					kill(avail, stmt.lvalues[0].id, stmt.lvalues[0].indexes == nullptr);
+				}
+				break;
+			case StmtForm::OUTPUT:
+			case StmtForm::RETURN:
+				for(Expr& e : stmt.exprs) visit(e, avail);
+				break;
+			case StmtForm::IF:
+				visit(stmt.exprs[0], avail);
+				// Each branch runs at most once, right after the condition.
+				for(Block& b : stmt.blocks){
+					AvailMap branch = avail;
+					visit(b, branch);
+				}
+				kill(avail, eff);
+				break;
+			case StmtForm::CASE:
+				{
+					Deps deps;
+					visit(stmt.lvalues[0], avail, deps);
+					// The cases are only evaluated until one matches,
+					// so what they make available can't outlive the statement.
+					AvailMap cases = avail;
+					for(size_t i = 0; i < stmt.exprs.size(); i++){
+						visit(stmt.exprs[i], cases);
+						AvailMap branch = cases;
+						visit(stmt.blocks[i], branch);
+					}
+					if(stmt.blocks.size() > stmt.exprs.size()){
+						AvailMap branch = cases;
+						visit(stmt.blocks.back(), branch);
+					}
+					kill(avail, eff);
+				}
+				break;
+			case StmtForm::FOR:
+				{
+					for(Expr& e : stmt.exprs) visit(e, avail);
+					// Only what survives every iteration may be used in the body.
+					AvailMap body = avail;
+					kill(body, eff);
+					visit(stmt.blocks[0], body);
+					kill(avail, eff);
+				}
+				break;
+			case StmtForm::REPEAT:
+				{
+					AvailMap body = avail;
+					kill(body, eff);
+					visit(stmt.blocks[0], body);
+					// The condition directly follows the body.
+					visit(stmt.exprs[0], body);
+					kill(avail, eff);
+				}
+				break;
+			case StmtForm::WHILE:
+				{
+					AvailMap body = avail;
+					kill(body, eff);
+					// The body directly follows the condition.
+					visit(stmt.exprs[0], body);
+					visit(stmt.blocks[0], body);
+					kill(avail, eff);
+				}
+				break;
+			case StmtForm::CALL:
+				for(Expr& e : stmt.exprs) visit(e, avail);
+				avail.clear();
+				break;
+		}
+	}
+
+public:
+	CSEPass(Program& prog_) : prog(prog_) {}
+	void run(){
+		AvailMap avail;
+		for(auto& stmt : prog.stmts) visit(stmt, avail);
+	}
+};
+
+// }}}
+
+// InductionPass {{{
+
+/* The Primary that `e` consists of, if it has no operators. */
+inline const Primary *onlyPrimary(const Expr& e){
+	const UnaryExpr& un = e.left.left.left.left.left;
+	if(e.opt.op != TokenType::INVALID || e.left.opt.op != TokenType::INVALID
+		|| e.left.left.opt.op != TokenType::INVALID || e.left.left.left.opt.op != TokenType::INVALID
+		|| e.left.left.left.left.opt.op != TokenType::INVALID || un.op != TokenType::INVALID){
+		return nullptr;
+	}
+	return un.main.primary;
+}
+
+/* Is `e` exactly the variable `id`? */
+inline bool isVar(const Expr& e, int64_t id){
+	const Primary *p = onlyPrimary(e);
+	return p != nullptr && p->primtype() == TokenType::IDENTIFIER
+		&& p->main().lvalue.indexes == nullptr && p->main().lvalue.id == id;
+}
+
+/* Is `e` an integer expression (literals, variables, +, -, *) that doesn't change in the loop?
+ * These are the ones evalInvariant() can evaluate. */
+template<uint16_t Level>
+bool isInvariant(const BinExpr<Level>& e, const Effects& eff);
+
+inline bool isInvariant(const Primary& p, const Effects& eff){
+	switch(p.primtype()){
+		case TokenType::INT_C:
+			return true;
+		case TokenType::IDENTIFIER:
+			return p.main().lvalue.indexes == nullptr && !eff.writes.count(p.main().lvalue.id);
+		case TokenType::INVALID:
+			return isInvariant(*p.main().expr, eff);
+		default:
+			return false;
+	}
+}
+
+inline bool isInvariant(const UnaryExpr& e, const Effects& eff){
+	if(e.op == TokenType::INVALID) return isInvariant(*e.main.primary, eff);
+	return e.op == TokenType::MINUS && isInvariant(*e.main.unexpr, eff);
+}
+
+template<uint16_t Level>
+bool isInvariant(const BinExpr<Level>& e, const Effects& eff){
+	// A common subexpression has to be evaluated where it is.
+	if(e.cse.slot != nullptr) return false;
+	if(!isInvariant(e.left, eff)) return false;
+	if(e.opt.op == TokenType::INVALID) return true;
+	return isAnyOf(e.opt.op, TokenType::PLUS, TokenType::MINUS, TokenType::STAR)
+		&& isInvariant(*e.opt.right, eff);
+}
+
+/* Calls `f` on every LValue in a piece of code. */
+template<typename F>
+void forEachLValue(Block& b, F& f);
+
+template<typename F>
+void forEachLValue(Primary& p, F& f);
+
+template<typename F>
+void forEachLValue(UnaryExpr& e, F& f){
+	if(e.op == TokenType::INVALID) forEachLValue(*e.main.primary, f);
+	else forEachLValue(*e.main.unexpr, f);
+}
+
+template<uint16_t Level, typename F>
+void forEachLValue(BinExpr<Level>& e, F& f){
+	forEachLValue(e.left, f);
+	if(e.opt.op != TokenType::INVALID) forEachLValue(*e.opt.right, f);
+}
+
+template<typename F>
+void forEachLValue(LValue& lv, F& f){
+	if(lv.indexes != nullptr){
+		for(Expr& idx : *lv.indexes) forEachLValue(idx, f);
+	}
+	f(lv);
+}
+
+template<typename F>
+void forEachLValue(Primary& p, F& f){
+	switch(p.primtype()){
+		case TokenType::CALL:
+			for(Expr& arg : *p.all.main.args) forEachLValue(arg, f);
+			break;
+		case TokenType::IDENTIFIER:
+			forEachLValue(p.all.main.lvalue, f);
+			break;
+		case TokenType::INVALID:
+			forEachLValue(*p.all.main.expr, f);
+			break;
+		default:
+			break;
+	}
+}
+
+template<bool TopLevel, typename F>
+void forEachLValue(Stmt<TopLevel>& stmt, F& f){
+	for(Expr& e : stmt.exprs) forEachLValue(e, f);
+	for(LValue& lv : stmt.lvalues) forEachLValue(lv, f);
+	for(Block& b : stmt.blocks) forEachLValue(b, f);
+}
+
+template<typename F>
+void forEachLValue(Block& b, F& f){
+	for(auto& stmt : b.stmts) forEachLValue(stmt, f);
+}
+
+/* Induction variable strength reduction.
+ *
+ * In an INTEGER FOR loop, an array access like A[i] or M[k][i] (i being the loop variable,
+ * k anything that doesn't change in the loop) moves through the array by a fixed
+ * stride every iteration. Such accesses get an Induction, and the interpreter then
+ * keeps a position inside the array instead of recomputing it from the indexes.
+ * Since arrays are stored flat in row-major order, the innermost loop of a row-major
+ * traversal moves through memory one element at a time.
+ *
+ * This needs the array to stay where it is for the whole loop, so the loop body
+ * may not reassign the array, the loop variable, or call any user function
+ * (which could do both, or run this very loop recursively).
+ * Each access belongs to the innermost loop it qualifies for.
+ */
+class InductionPass {
+	Program& prog;
+	std::set<int64_t> funcs; /* user defined functions and procedures */
+
+	template<bool TopLevel>
+	void visit(Stmt<TopLevel>& stmt){
+		for(Block& b : stmt.blocks) visit(b);
+		if(stmt.form == StmtForm::FOR) reduce(stmt);
+	}
+
+	void visit(Block& b){
+		for(auto& stmt : b.stmts) visit(stmt);
+	}
+
+	template<bool TopLevel>
+	void reduce(Stmt<TopLevel>& stmt){
+		const int64_t var = stmt.ids[0];
+		Effects eff;
+		blockEffects(stmt.blocks[0], eff);
+		if(eff.writes.count(var)) return;
+		// `i + 1` isn't invariant either.
+		eff.writes.insert(var);
+		for(const int64_t callee : eff.callees){
+			if(funcs.count(callee)) return;
+		}
+		std::vector<std::pair<LValue *, std::vector<bool>>> found;
+		auto check = [&](LValue& lv){
+			if(lv.indexes == nullptr || lv.iv != nullptr || lv.cse.isUse()) return;
+			if(eff.rebinds.count(lv.id)) return;
+			std::vector<bool> by_loopvar(lv.indexes->size());
+			bool any = false;
+			for(size_t i = 0; i < lv.indexes->size(); i++){
+				const Expr& idx = (*lv.indexes)[i];
+				by_loopvar[i] = isVar(idx, var);
+				any |= by_loopvar[i];
+				if(!by_loopvar[i] && !isInvariant(idx, eff)) return;
+			}
+			if(any) found.emplace_back(&lv, std::move(by_loopvar));
+		};
+		forEachLValue(stmt.blocks[0], check);
+		stmt.inductions.reserve(found.size());
+		for(auto& [lv, by_loopvar] : found){
+			stmt.inductions.emplace_back(lv, std::move(by_loopvar));
+			lv->iv = &stmt.inductions.back();
+		}
+	}
+
+public:
+	InductionPass(Program& prog_) : prog(prog_) {
+		for(const auto& stmt : prog.stmts){
+			if(stmt.form == StmtForm::FUNCTION || stmt.form == StmtForm::PROCEDURE){
+				funcs.insert(stmt.ids[0]);
+			}
+		}
+	}
+	void run(){
+		for(auto& stmt : prog.stmts) visit(stmt);
+	}
+};
+
+// }}}
+
+// EscapePass {{{
+
+/* Escape analysis for array parameters.
+ *
+ * A function gets its own copy of every array passed to it. If none of these copies
+ * can outlive the call, they are put in the call's region (see Env::Region) and
+ * freed when it returns.
+ * Assigning an array or passing it to a function copies it, so the only way out
+ * is being returned, maybe in parentheses. Returning a scalar parameter is fine.
+ */
+class EscapePass {
+	Program& prog;
+
+	static bool isVarInParens(const Expr& e, int64_t id){
+		const Primary *p = onlyPrimary(e);
+		if(p == nullptr) return false;
+		if(p->primtype() == TokenType::INVALID) return isVarInParens(*p->main().expr, id);
+		return isVar(e, id);
+	}
+
+	static bool returnsParam(const Block& b, const std::vector<Param>& params){
+		for(const auto& stmt : b.stmts){
+			if(stmt.form == StmtForm::RETURN){
+				for(const Param& param : params){
+					if(param.type.is_array() && isVarInParens(stmt.exprs[0], param.ident)) return true;
+				}
+			}
+			for(const Block& inner : stmt.blocks){
+				if(returnsParam(inner, params)) return true;
+			}
+		}
+		return false;
+	}
+
+public:
+	EscapePass(Program& prog_) : prog(prog_) {}
+	void run(){
+		for(auto& stmt : prog.stmts){
+			if(stmt.form == StmtForm::FUNCTION || stmt.form == StmtForm::PROCEDURE){
+				stmt.local_arrays = !returnsParam(stmt.blocks[0], stmt.params);
+			}
+		}
+	}
+};
+
+// }}}
+
+// IdiomPass {{{
+
+/* The BinExpr<Level> that `e` consists of, if the levels in between have no operators. */
+template<uint16_t Level, uint16_t From>
+const BinExpr<Level> *descend(const BinExpr<From>& e){
+	if constexpr (From == Level) return &e;
+	else return e.opt.op == TokenType::INVALID ? descend<Level>(e.left) : nullptr;
+}
+
+inline const Primary *primaryOf(const UnaryExpr& e){
+	return e.op == TokenType::INVALID ? e.main.primary : nullptr;
+}
+
+/* The Primary that `e` consists of, if it has no operators. */
+template<uint16_t Level>
+const Primary *primaryOf(const BinExpr<Level>& e){
+	return e.opt.op == TokenType::INVALID ? primaryOf(e.left) : nullptr;
+}
+
+/* Is `e` a single operator of `Level` (`l op r`) applied to two Primaries? */
+template<uint16_t Level>
+bool isBinary(const Expr& e, TokenType& op, const Primary *&l, const Primary *&r){
+	const BinExpr<Level> *b = descend<Level>(e);
+	if(b == nullptr || b->opt.op == TokenType::INVALID) return false;
+	op = b->opt.op;
+	l = primaryOf(b->left);
+	r = primaryOf(*b->opt.right);
+	return l != nullptr && r != nullptr;
+}
+
+inline bool isVar(const Primary *p, int64_t id){
+	return p->primtype() == TokenType::IDENTIFIER && p->main().lvalue.indexes == nullptr
+		&& p->main().lvalue.id == id;
+}
+
+inline bool isIntLiteral(const Primary *p, int64_t val){
+	return p->primtype() == TokenType::INT_C && p->main().lt.i64 == val;
+}
+
+/* Is `lv` A[i], A[i + 1] or A[i - 1], `i` being `var`? */
+inline bool isElement(const LValue& lv, int64_t var, int64_t& arr, int64_t& offset){
+	if(lv.indexes == nullptr || lv.indexes->size() != 1) return false;
+	const Expr& idx = (*lv.indexes)[0];
+	arr = lv.id;
+	offset = 0;
+	if(isVar(idx, var)) return true;
+	TokenType op;
+	const Primary *l, *r;
+	if(!isBinary<3>(idx, op, l, r) || !isVar(l, var) || !isIntLiteral(r, 1)) return false;
+	offset = (op == TokenType::PLUS ? 1 : -1);
+	return true;
+}
+
+inline bool isElement(const Primary *p, int64_t var, int64_t& arr, int64_t& offset){
+	return p->primtype() == TokenType::IDENTIFIER && isElement(p->main().lvalue, var, arr, offset);
+}
+
+/* Is `p` exactly the array element A[var + offset]? */
+inline bool isElementOf(const Primary *p, int64_t var, int64_t arr, int64_t offset){
+	int64_t a, o;
+	return isElement(p, var, a, o) && a == arr && o == offset;
+}
+
+/* Idiom recognition.
+ *
+ * Finds FOR loops that do one of a few common things with a one-dimensional array,
+ * like summing it up or finding its maximum (see IDIOM_LIST in parser.hpp),
+ * which the interpreter then runs natively (see Idiom::run in interpreter.hpp).
+ * Only the exact shapes are recognized: a loop doing anything else may behave differently.
+ *
+ * Whether the loop may run natively depends on the types, which are only known when it runs:
+ * the array has to be INTEGER and every access in bounds, so the
+ * native loop never has to report an error, and the step has to be 1.
+ * The loop variable is restored after the loop either way, so it doesn't need to be set,
+ * except for the iteration that RETURNs, which is left to the interpreter.
+ * The declarations of the names tell whether the types can be right (see `found`).
+ */
+class IdiomPass {
+public:
+	/* Whether a recognized loop runs natively, going by the declarations of the names it uses there */
+	enum class Fit { YES, MAYBE, NO };
+	struct Found {
+		size_t line;
+		std::string_view name;
+		Fit fit;
+	};
+private:
+	/* Every type each name is declared with: whether it's an array and the primitive
+	 * (of the elements), INVALID if that isn't known. */
+	using Declarations = std::map<int64_t, std::vector<std::pair<bool, TokenType>>>;
+
+	Program& prog;
+	/* The main program's, and the parameters and FOR variables of the function being visited.
+	 * A function can't use its callers' variables, they only hide the globals (see Env::checkLevel). */
+	Declarations globals, params, locals;
+
+	static void add(Declarations& decls, int64_t id, const Type& type){
+		const Type& elem = type.is_array() ? *type.name().rec : type;
+		decls[id].emplace_back(type.is_array(), elem.is_array() ? TokenType::INVALID : elem.name().tok);
+	}
+
+	template<bool TopLevel>
+	static void declarations(const Stmt<TopLevel>& stmt, Declarations& decls){
+		if(stmt.form == StmtForm::DECLARE) add(decls, stmt.ids[0], stmt.types[0]);
+		else if(stmt.form == StmtForm::CONSTANT) decls[stmt.ids[0]].emplace_back(false, TokenType::INVALID);
+		else if(stmt.form == StmtForm::FOR) decls[stmt.ids[0]].emplace_back(false, TokenType::INTEGER);
+		for(const Block& b : stmt.blocks){
+			for(const auto& inner : b.stmts) declarations(inner, decls);
+		}
+	}
+
+	/* Is `id` always declared as `type` (an array of them if `array`) where it's used?
+	 * In a function, a parameter is local, and a FOR variable is outside its loop. */
+	Fit fit(int64_t id, bool array, TokenType type) const {
+		std::vector<std::pair<bool, TokenType>> decls;
+		const auto append = [&](const Declarations& from){
+			const auto it = from.find(id);
+			if(it != from.end()) decls.insert(decls.end(), it->second.begin(), it->second.end());
+		};
+		append(locals);
+		append(params.count(id) ? params : globals);
+		if(decls.empty()) return Fit::MAYBE;
+		bool all = true, any = false;
+		for(const auto& [is_array, prim] : decls){
+			const bool unknown = !is_array && prim == TokenType::INVALID;
+			const bool same = (is_array == array && prim == type);
+			all &= same;
+			any |= same || unknown;
+		}
+		return all ? Fit::YES : any ? Fit::MAYBE : Fit::NO;
+	}
+
+	/* The types Idiom::run checks */
+	Fit fit(const Idiom& idiom) const {
+		const Fit arr = fit(idiom.arr, true, TokenType::INTEGER);
+		Fit var = Fit::YES;
+		if(idiom.kind != Idiom::Kind::FIND){
+			const bool flag = (idiom.kind == Idiom::Kind::SEARCH && idiom.value != TokenType::IDENTIFIER);
+			var = fit(idiom.var, false, flag ? TokenType::BOOLEAN : TokenType::INTEGER);
+		}
+		return std::max(arr, var);
+	}
+
+	template<bool TopLevel>
+	void visit(Stmt<TopLevel>& stmt){
+		if constexpr (TopLevel){
+			params.clear();
+			locals.clear();
+			if(isAnyOf(stmt.form, StmtForm::FUNCTION, StmtForm::PROCEDURE)){
+				for(const Param& param : stmt.params) add(params, param.ident, param.type);
+				for(const Block& b : stmt.blocks){
+					for(const auto& inner : b.stmts) declarations(inner, locals);
+				}
+			}
+		}
+		for(Block& b : stmt.blocks) visit(b);
+		if(stmt.form == StmtForm::FOR){
+			stmt.idiom = recognize(stmt);
+			if(stmt.idiom) found.push_back({ stmt.line, stmt.idiom->name(), fit(*stmt.idiom) });
+		}
+	}
+
+	void visit(Block& b){
+		for(auto& stmt : b.stmts) visit(stmt);
+	}
+
+	/* `IF A[i] > A[i + 1] THEN t <- A[i] A[i] <- A[i + 1] A[i + 1] <- t ENDIF` and its variations */
+	static std::optional<Idiom> bubble(const Stmt<false>& stmt, int64_t var, const Primary *l, const Primary *r, TokenType cmp){
+		int64_t arr, lo, arr2, hi;
+		if(!isElement(l, var, arr, lo) || !isElement(r, var, arr2, hi) || arr != arr2) return std::nullopt;
+		if(lo > hi){
+			std::swap(lo, hi);
+			cmp = mirrorComparison(cmp);
+		}
+		if(hi != lo + 1) return std::nullopt;
+		const auto& swap = stmt.blocks[0].stmts;
+		if(swap.size() != 3) return std::nullopt;
+		for(const auto& s : swap){
+			if(s.form != StmtForm::ASSIGN) return std::nullopt;
+		}
+		// t <- A[x]  A[x] <- A[y]  A[y] <- t
+		const int64_t t = swap[0].lvalues[0].id;
+		const Primary *saved = primaryOf(swap[0].exprs[0]);
+		int64_t x;
+		if(swap[0].lvalues[0].indexes != nullptr || t == var
+			|| saved == nullptr || !isElement(saved, var, arr2, x) || arr2 != arr){
+			return std::nullopt;
+		}
+		const int64_t y = (x == lo ? hi : lo);
+		const Primary *moved = primaryOf(swap[1].exprs[0]);
+		const Primary *restored = primaryOf(swap[2].exprs[0]);
+		int64_t o;
+		if(!isElement(swap[1].lvalues[0], var, arr2, o) || arr2 != arr || o != x
+			|| moved == nullptr || !isElementOf(moved, var, arr, y)
+			|| !isElement(swap[2].lvalues[0], var, arr2, o) || arr2 != arr || o != y
+			|| restored == nullptr || !isVar(restored, t)){
+			return std::nullopt;
+		}
+		Idiom res(Idiom::Kind::BUBBLE, arr);
+		res.var = t;
+		res.offset = lo;
+		res.cmp = cmp;
+		res.value = (x == lo ? TokenType::LEFT_SQ : TokenType::RIGHT_SQ);
+		return res;
+	}
+
+	template<bool TopLevel>
+	static std::optional<Idiom> recognize(const Stmt<TopLevel>& loop){
+		const int64_t var = loop.ids[0];
+		const auto& body = loop.blocks[0].stmts;
+		if(body.size() != 1) return std::nullopt;
+		if(loop.exprs.size() == 3){
+			const Primary *step = primaryOf(loop.exprs[2]);
+			if(step == nullptr || !isIntLiteral(step, 1)) return std::nullopt;
+		}
+		Effects eff;
+		blockEffects(loop.blocks[0], eff);
+		eff.writes.insert(var);
+		const Stmt<false>& stmt = body[0];
+		TokenType op;
+		const Primary *l, *r;
+		int64_t arr, offset;
+
+		if(stmt.form == StmtForm::ASSIGN){
+			// s <- s + A[i]
+			const LValue& target = stmt.lvalues[0];
+			if(target.indexes != nullptr || target.id == var) return std::nullopt;
+			if(!isBinary<3>(stmt.exprs[0], op, l, r) || op != TokenType::PLUS) return std::nullopt;
+			if(isVar(r, target.id)) std::swap(l, r);
+			if(!isVar(l, target.id) || !isElement(r, var, arr, offset) || offset != 0) return std::nullopt;
+			Idiom res(Idiom::Kind::SUM, arr);
+			res.var = target.id;
+			return res;
+		}
+
+		if(stmt.form != StmtForm::IF || stmt.blocks.size() != 1) return std::nullopt;
+		if(!isBinary<2>(stmt.exprs[0], op, l, r)) return std::nullopt;
+		if(stmt.blocks[0].stmts.size() != 1) return bubble(stmt, var, l, r, op);
+		// Everything else compares A[i] with something.
+		if(!isElement(l, var, arr, offset)){
+			std::swap(l, r);
+			op = mirrorComparison(op);
+			if(!isElement(l, var, arr, offset)) return std::nullopt;
+		}
+		if(offset != 0) return std::nullopt;
+		const Primary *key = r;
+		const Stmt<false>& then = stmt.blocks[0].stmts[0];
+		Idiom res(Idiom::Kind::FIND, arr);
+		res.cmp = op;
+		res.key = key;
+		if(then.form == StmtForm::RETURN){
+			// IF A[i] = k THEN RETURN ... ENDIF
+			return isInvariant(*key, eff) ? std::optional(res) : std::nullopt;
+		}
+		if(then.form != StmtForm::ASSIGN) return std::nullopt;
+		const LValue& target = then.lvalues[0];
+		if(target.indexes != nullptr || target.id == var) return std::nullopt;
+		res.var = target.id;
+		const Primary *val = primaryOf(then.exprs[0]);
+		if(val != nullptr && isVar(key, target.id) && isElementOf(val, var, arr, 0)){
+			// IF A[i] > m THEN m <- A[i] ENDIF
+			res.kind = Idiom::Kind::REPLACE;
+			res.key = nullptr;
+			return res;
+		}
+		if(!isInvariant(*key, eff)) return std::nullopt;
+		if(val != nullptr && (isVar(val, var) || isAnyOf(val->primtype(), TokenType::TRUE, TokenType::FALSE))){
+			// IF A[i] = k THEN found <- i ENDIF
+			res.kind = Idiom::Kind::SEARCH;
+			res.value = val->primtype();
+			return res;
+		}
+		// IF A[i] = k THEN c <- c + 1 ENDIF
+		if(!isBinary<3>(then.exprs[0], op, l, r) || op != TokenType::PLUS) return std::nullopt;
+		if(isVar(r, target.id)) std::swap(l, r);
+		if(!isVar(l, target.id) || !isIntLiteral(r, 1)) return std::nullopt;
+		res.kind = Idiom::Kind::COUNT;
+		return res;
+	}
+
+public:
+	/* Every loop that was recognized */
+	std::vector<Found> found;
+	IdiomPass(Program& prog_) : prog(prog_) {}
+	void run(){
+		for(const auto& stmt : prog.stmts){
+			if(!isAnyOf(stmt.form, StmtForm::FUNCTION, StmtForm::PROCEDURE)) declarations(stmt, globals);
+		}
+		for(auto& stmt : prog.stmts) visit(stmt);
+	}
+};
+
+// }}}
+
+// ProfilePass {{{
+
+/* The literal `e` is (maybe negated), or INVALID if it isn't one. */
+inline TokenType literalType(const Expr& e){
+	const BinExpr<MAX_BINARY_LEVEL> *b = descend<MAX_BINARY_LEVEL>(e);
+	if(b == nullptr || b->opt.op != TokenType::INVALID) return TokenType::INVALID;
+	const UnaryExpr *u = &b->left;
+	const bool negated = (u->op == TokenType::MINUS);
+	if(negated) u = u->main.unexpr;
+	const Primary *p = primaryOf(*u);
+	if(p == nullptr) return TokenType::INVALID;
+	if(isAnyOf(p->primtype(), TokenType::INT_C, TokenType::REAL_C)) return p->primtype();
+	if(!negated && isAnyOf(p->primtype(), TokenType::STR_C, TokenType::CHAR_C, TokenType::DATE_C,
+		TokenType::TRUE, TokenType::FALSE)){
+		return p->primtype();
+	}
+	return TokenType::INVALID;
+}
+
+/* Uses a recorded profile (see profile.hpp).
+ *
+ * CASE tests its cases one after another, so the ones that matched most often
+ * are moved to the front. This is only done when every case is a literal of the
+ * same kind: then testing one can't fail or do anything unless testing all of them would,
+ * and only the first of two equal cases can have matched, so it stays in front.
+ *
+ * The tree has no inlining or code layout to decide, so the other counts
+ * are only there to be read.
+ */
+class ProfilePass {
+	Program& prog;
+	const Profile& profile;
+	size_t next = 0;
+
+	template<bool TopLevel>
+	void visit(Stmt<TopLevel>& stmt){
+		// Numbered before the statements inside, like forEachProfiled does.
+		const Profile::Entry *entry = (profileSize(stmt) != 0 ? &profile.entries[next++] : nullptr);
+		for(Block& b : stmt.blocks){
+			for(auto& s : b.stmts) visit(s);
+		}
+		if(stmt.form == StmtForm::CASE) reorder(stmt, entry->counts);
+	}
+
+	template<bool TopLevel>
+	static void reorder(Stmt<TopLevel>& stmt, const std::vector<uint64_t>& counts){
+		const size_t n = stmt.exprs.size();
+		const TokenType type = literalType(stmt.exprs[0]);
+		if(type == TokenType::INVALID) return;
+		for(const Expr& e : stmt.exprs){
+			if(literalType(e) != type) return;
+		}
+		std::vector<size_t> order(n);
+		for(size_t i = 0; i < n; i++) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&counts](size_t l, size_t r){
+			return counts[l] > counts[r];
+		});
+		std::vector<Expr> exprs;
+		std::vector<Block> blocks;
+		exprs.reserve(n);
+		blocks.reserve(stmt.blocks.size());
+		for(const size_t i : order){
+			exprs.push_back(std::move(stmt.exprs[i]));
+			blocks.push_back(std::move(stmt.blocks[i]));
+		}
+		// OTHERWISE stays last.
+		if(stmt.blocks.size() > n) blocks.push_back(std::move(stmt.blocks.back()));
+		stmt.exprs = std::move(exprs);
+		stmt.blocks = std::move(blocks);
+	}
+
+public:
+	ProfilePass(Program& prog_, const Profile& profile_) : prog(prog_), profile(profile_) {}
+	void run(){
+		for(auto& stmt : prog.stmts) visit(stmt);
+	}
+};
+
+// }}}
+
+inline void optimize(Program& prog){
+	// Induction variables depend on what CSE decided.
+	CSEPass(prog).run();
+	InductionPass(prog).run();
+	EscapePass(prog).run();
+}
+
+#endif /* OPTIMIZER_HPP */
@@ -2,6 +2,7 @@
 #define PARSER_HPP
 #include <string>
 #include <map>
+#include <optional>
 #include <vector>
 #include "lexer.hpp"
 #include "environment.hpp"
@@ -105,23 +106,139 @@ class BinExpr;
 using Expr = BinExpr<0>;
 std::ostream& operator<<(std::ostream& os, const Expr& expr) noexcept;
 
+/* Storage for a common subexpression (see optimizer.hpp).
+ * `val` holds the value of an arithmetic expression,
+ * `ref` holds the resolved address of an array element. */
+struct CSESlot {
+	EValue val;
+	EValue *ref = nullptr;
+};
+
+/* A node's role in common subexpression elimination.
+ * If `slot` is set, the node either defines it (`def`, the first evaluation,
+ * which stores its result) or uses it (every later occurrence, which reads the
+ * stored result instead of evaluating anything). */
+struct CSE {
+	CSESlot *slot = nullptr;
+	bool def = false;
+	inline bool isUse() const noexcept { return slot != nullptr && !def; }
+};
+
+/* The operand types an arithmetic, comparison or index node has been evaluated with
+ * (see BinExpr::compute and LValue::locate in interpreter.hpp).
+ * A node starts UNINIT, specializes to the types it sees the first time,
+ * and becomes GENERIC for good once it sees any others. */
+enum class Spec : uint8_t {
+	UNINIT,
+	INT, /* index nodes: every index is an INTEGER */
+	INT_INT, INT_REAL, REAL_INT, REAL_REAL,
+	GENERIC
+};
+
+class LValue;
+class Primary;
+
+/* An inline cache for a call site, filled by callFunc (see interpreter.hpp).
+ * It remembers the function that was called and that the arguments had the right types,
+ * so calling it again skips looking it up and checking the arguments.
+ * The types of the arguments only depend on the types of the variables they read,
+ * so the check still holds while those are the same and the functions haven't changed. */
+struct CallCache {
+	const EFunc *func = nullptr;
+	uint64_t version = 0; /* Env::functable_version when it was filled */
+	bool collected = false; /* `reads` has been found */
+	std::vector<int64_t> reads;
+	std::vector<EType> read_types;
+};
+
+/* An array access in the body of a FOR loop whose indexes are all either
+ * the loop variable or invariant in the loop (see optimizer.hpp).
+ * While `active`, the element is at `base + pos`, and the interpreter
+ * advances `pos` by `stride` every iteration instead of locating it from scratch. */
+struct Induction {
+	LValue *lv;
+	std::vector<bool> by_loopvar; /* which of the indexes are the loop variable */
+	bool active = false;
+	EValue *base = nullptr;
+	ptrdiff_t pos = 0, stride = 0;
+	Induction(LValue *lv_, std::vector<bool> by_loopvar_) : lv(lv_), by_loopvar(std::move(by_loopvar_)) {}
+	void start(Env& env, int64_t from, int64_t to, int64_t step);
+	inline void next() noexcept { pos += stride; }
+};
+
+#define IDIOM_LIST \
+	IDIOM(SUM, "sum") /* s <- s + A[i] */ \
+	IDIOM(COUNT, "count") /* IF A[i] = k THEN c <- c + 1 ENDIF */ \
+	IDIOM(REPLACE, "maximum/minimum") /* IF A[i] > m THEN m <- A[i] ENDIF */ \
+	IDIOM(SEARCH, "linear search") /* IF A[i] = k THEN found <- i ENDIF */ \
+	IDIOM(FIND, "linear search with RETURN") /* IF A[i] = k THEN RETURN ... ENDIF */ \
+	IDIOM(BUBBLE, "bubble sort pass") /* IF A[j] > A[j + 1] THEN (swap them using t) ENDIF */
+
+/* The body of an INTEGER FOR loop that does one of a few common things
+ * with a one-dimensional INTEGER array (see IdiomPass in optimizer.hpp).
+ * If everything it touches has the expected type and the whole loop stays
+ * in bounds, the interpreter runs it natively, otherwise it is interpreted as usual. */
+struct Idiom {
+	enum class Kind {
+#define IDIOM(x, name) x,
+		IDIOM_LIST
+#undef IDIOM
+	} kind;
+	int64_t arr; /* the array, A[i + offset] is compared with `key` */
+	int64_t var = 0; /* the variable that is written, the temporary for BUBBLE */
+	int64_t offset = 0;
+	TokenType cmp = TokenType::INVALID; /* the array element is on the left */
+	const Primary *key = nullptr; /* invariant, nullptr for SUM, REPLACE and BUBBLE */
+	/* SEARCH: what `var` is set to, the loop variable (IDENTIFIER), TRUE or FALSE.
+	 * BUBBLE: which element the temporary ends up with, the first (LEFT_SQ) or the second. */
+	TokenType value = TokenType::INVALID;
+	Idiom(Kind kind_, int64_t arr_) : kind(kind_), arr(arr_) {}
+	/* Runs the loop from `from` to `to` and sets `next` to where the interpreter
+	 * has to continue it. Returns false if it can't be run natively. */
+	bool run(Env& env, int64_t from, int64_t to, int64_t step, int64_t& next) const;
+	std::string_view name() const noexcept;
+};
+
+const std::vector<std::string_view> idiom_names = {
+#define IDIOM(x, name) name,
+	IDIOM_LIST
+#undef IDIOM
+};
+
+inline std::string_view Idiom::name() const noexcept {
+	return idiom_names[static_cast<int>(kind)];
+}
+
 class LValue {
 public:
 	int64_t id;
 	std::vector<Expr> *indexes = nullptr;
+	CSE cse;
+	Induction *iv = nullptr;
+	mutable Spec spec = Spec::UNINIT;
 	LValue(Parser& p, int64_t id = 0);
 	/* copy */ LValue(LValue& l) = delete;
-	/* move */ LValue(LValue&& l) noexcept : id(l.id), indexes(l.indexes) {
+	/* move */ LValue(LValue&& l) noexcept : id(l.id), indexes(l.indexes), cse(l.cse), iv(l.iv), spec(l.spec) {
 		l.indexes = nullptr;
 	}
 	LValue& operator=(LValue&& l) noexcept {
 		id = l.id;
 		indexes = l.indexes;
+		cse = l.cse;
+		iv = l.iv;
+		spec = l.spec;
 		l.indexes = nullptr;
 		return *this;
 	}
-	EValue& ref(Env& env) const;
-	EValue eval(Env& env) const;
+	EValue *locate(Env& env) const;
+	inline EValue& ref(Env& env) const { return *locate(env); }
+	inline EValue eval(Env& env) const { return *locate(env); }
+	/* The primitive type of the value, INVALID for an array (see BinExpr::kind) */
+	inline Primitive kind(const Env& env) const noexcept {
+		const EType& type = env.getType(id);
+		const size_t depth = indexes == nullptr ? 0 : indexes->size();
+		return type.bounds.size() == depth ? type.primtype : Primitive::INVALID;
+	}
 	inline EType type(const Env& env) const {
 		const EType& type = env.getType(id);
 		if(indexes == nullptr) return type;
@@ -158,6 +275,7 @@ public:
 		// TRUE, FALSE, CALL [function call], INVALID [(expr)]
 		TokenType primtype;
 		int64_t func_id;
+		CallCache *call = nullptr; /* CALL only */
 		union Main {
 			LValue lvalue;
 			Token::Literal lt;
@@ -176,10 +294,12 @@ public:
 	/* move */ Primary(Primary&& pri) noexcept {
 		std::memcpy(&all, &pri.all, sizeof(All));
 		pri.all.main.expr = nullptr;
+		pri.all.call = nullptr;
 	}
 	~Primary();
 	EValue eval(Env& env) const;
 	EType type(Env& env) const;
+	Primitive kind(Env& env) const;
 	// friend operator<< {{{
 	/* make easier to debug */
 	friend std::ostream& operator<<(std::ostream& os, const Primary& p) noexcept {
@@ -198,6 +318,9 @@ public:
 			CASE(CHAR_C):
 				os << '\'' << p.main().lt.c << '\'';
 				break;
+			CASE(DATE_C):
+				os << p.main().lt.date;
+				break;
 			CASE(TRUE):
 			CASE(FALSE):
 				os << tokenTypeToStr(p.primtype());
@@ -273,6 +396,9 @@ public:
 	inline EType type(Env& env) const {
 		return (op == TokenType::INVALID ? main.primary->type(env) : main.unexpr->type(env));
 	}
+	inline Primitive kind(Env& env) const {
+		return (op == TokenType::INVALID ? main.primary->kind(env) : main.unexpr->kind(env));
+	}
 	// friend operator<< {{{
 	friend std::ostream& operator<<(std::ostream& os, const UnaryExpr& un) noexcept {
 		os << '{';
@@ -299,6 +425,17 @@ const std::vector<TokenType> binary_ops[] = {
 
 const uint16_t MAX_BINARY_LEVEL = 4;
 
+/* The comparison with its operands swapped: `a < b` is `b > a` */
+inline TokenType mirrorComparison(const TokenType op) noexcept {
+	switch(op){
+		case TokenType::GT: return TokenType::LT;
+		case TokenType::LT: return TokenType::GT;
+		case TokenType::GT_EQ: return TokenType::LT_EQ;
+		case TokenType::LT_EQ: return TokenType::GT_EQ;
+		default: return op; /* EQ, LT_GT */
+	}
+}
+
 template<uint16_t Level>
 class BinExpr {
 	static_assert(Level <= MAX_BINARY_LEVEL);
@@ -310,6 +447,8 @@ public:
 		TokenType op;
 		BinExpr<Level> *right;
 	} opt;
+	CSE cse;
+	mutable Spec spec = Spec::UNINIT;
 
 	static Opt make_opt(Parser& p){
 		for(const auto op_type : binary_ops[Level]){
@@ -324,14 +463,21 @@ public:
 	
 	BinExpr(Parser& p) : left(p), opt(make_opt(p)) {}
 	/* copy */ BinExpr(BinExpr& be) = delete;
-	/* move */ BinExpr(BinExpr&& be) noexcept : left(std::move(be.left)), opt(be.opt) {
+	/* move */ BinExpr(BinExpr&& be) noexcept : left(std::move(be.left)), opt(be.opt), cse(be.cse), spec(be.spec) {
 		be.opt = { TokenType::INVALID, nullptr };
 	}
 	~BinExpr() {
 		if(opt.op != TokenType::INVALID) delete opt.right;
 	}
 	EValue eval(Env& env) const;
+	EValue compute(Env& env) const;
 	EType type(Env& env) const;
+	/* The primitive type of the value eval() has just returned, INVALID for an array.
+	 * It's type().primtype, but a specialized node knows it without looking at its operands. */
+	Primitive kind(Env& env) const;
+private:
+	EValue generic(Env& env, EValue leftval, const EType& ltype, EValue rightval) const;
+public:
 	// friend operator<< {{{
 	friend std::ostream& operator<<(std::ostream& os, const BinExpr<Level>& b) noexcept {
 		os << '{';
@@ -382,6 +528,7 @@ inline Primary::Primary(Parser& p) {
 			/* function call */
 			all.primtype = TokenType::CALL; // lmao
 			all.func_id = n.literal.i64; /* func_id is used to store the function's identifier */
+			all.call = new CallCache();
 			all.main.args = new std::vector<Expr>();
 			if(p.match_type(TokenType::RIGHT_PAREN)){
 				return;
@@ -403,7 +550,7 @@ inline Primary::Primary(Parser& p) {
 			return;
 		}
 	} else if(n.type == TokenType::LEFT_PAREN){
-		/* all.primtype is set to INVALID by default */
+		all.primtype = TokenType::INVALID;
 		all.main.expr = new Expr(p);
 		p.expect_type(TokenType::RIGHT_PAREN);
 		return;
@@ -418,6 +565,7 @@ inline Primary::~Primary() {
 		if(all.primtype == TokenType::CALL){
 			// Deallocate the argument array.
 			delete all.main.args;
+			delete all.call;
 		} else if(all.primtype == TokenType::IDENTIFIER){
 			// delete the lvalue
 			all.main.lvalue.~LValue();
@@ -429,7 +577,7 @@ inline Primary::~Primary() {
 
 class Type {
 public:
-	const struct All {
+	struct All {
 		bool is_array;
 		Expr *start, *end;
 		union Name {
@@ -468,6 +616,10 @@ public:
 		}
 	}
 	Type(Parser& p): all(make_all(p)) {}
+	/* copy */ Type(Type& t) = delete;
+	/* move */ Type(Type&& t) noexcept : all(t.all) {
+		t.all.name.rec = nullptr;
+	}
 	~Type() {
 		if(all.is_array) {
 			delete all.name.rec;
@@ -600,6 +752,8 @@ public:
 class Program {
 public:
 	std::vector<Stmt<true>> stmts;
+	/* Owned by the program since the syntax tree points into them. */
+	std::vector<std::unique_ptr<CSESlot>> cse_slots;
 	Program(Parser& p){
 		while(!p.done()){
 			stmts.emplace_back(p);
@@ -628,6 +782,13 @@ public:
 	std::vector<Type> types;
 	std::vector<Param> params;
 	std::vector<Block> blocks;
+	mutable std::vector<Induction> inductions; /* FOR only, updated while it runs */
+	std::optional<Idiom> idiom; /* FOR only */
+	bool local_arrays = false; /* FUNCTION/PROCEDURE only, no array parameter is returned */
+	mutable uint64_t *counts = nullptr; /* only while a profile is recorded, see profile.hpp */
+	std::unique_ptr<CallCache> call; /* CALL only */
+	mutable uint32_t hotness = 0; /* loops only, back-edges taken while there are tiers (see Tiers) */
+	size_t line; /* of the first token */
 	void paramlist(Parser& p){
 		size_t param_count = 0;
 		for(;;){
@@ -720,6 +881,7 @@ public:
 				break;
 			CASE(CALL)
 				ids.push_back(CONSUME_ID());
+				call = std::make_unique<CallCache>();
 				if(p.match_type(TokenType::LEFT_PAREN)){
 					exprlist(p);
 					p.expect_type(TokenType::RIGHT_PAREN);
@@ -782,7 +944,7 @@ public:
 	}
 #undef CASE
 #undef CONSUME_ID
-	Stmt(Parser& p, bool is_func = false){
+	Stmt(Parser& p, bool is_func = false) : line(p.peek().line) {
 		if constexpr (TopLevel){
 			topstmt(p);
 		} else {
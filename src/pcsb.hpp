@@ -0,0 +1,411 @@
+#ifndef PCSB_HPP
+#define PCSB_HPP
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "bytecode.hpp"
+#include "globals.hpp"
+#include "vm.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#define PCSB_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* .pcsb files: programs compiled to bytecode (see compiler.hpp) for the VM to run later,
+ * made with `pcse --compile-only -o prog.pcsb FILE` and run with `pcse prog.pcsb`.
+ *
+ * Everything is little-endian. The file is a header, a table of sections, then the sections,
+ * each starting at a multiple of 8 bytes:
+ *   header: "PCSB", version, number of global variable ids, number of sections (u32 each)
+ *   section table: per section its kind and number of entries (u32 each), offset and size in bytes (u64 each)
+ *   STRINGS: bytes, a string anywhere else is its offset in here and its length (u32 each)
+ *   CONSTANTS: per constant its Primitive (u32), 4 bytes of padding and 16 bytes of value:
+ *     INTEGER i64, REAL numerator and denominator (i32 each), CHAR and BOOLEAN u8,
+ *     DATE day and month (u8 each) and year (u16), STRING a string
+ *   FUNCTIONS: per FuncInfo entry, params and frame_size (u32 each), returns and local_arrays (u8 each), 2 bytes of padding
+ *   TYPES: per EType its Primitive, 1 if it's an array and the number of dimensions (u32 each), then the bounds (i64 each)
+ *   MESSAGES: a string each
+ *   BUILTINS: the name of each (see builtin::global_funcs)
+ *   CODE: the instructions (i32 each)
+ *   LINES: per entry of Bytecode::lines the instruction and the line (u32 each)
+ * The file is mapped into memory and the VM runs CODE where it is. The rest is small,
+ * and is read into a Bytecode with its strings pointing into the file.
+ * Loading checks the layout of the file, then the VM verifies the code, the types of
+ * its registers included, and checks the indexes it uses (see verify in vm.hpp).
+ *
+ * Bundles, made with `pcse --bundle -o prog FILE`, are a copy of the pcse executable with a .pcsb
+ * file appended at a multiple of 8 bytes, and a trailer at the very end:
+ *   the offset and size of the .pcsb file (u64 each), then "PCSEBNDL"
+ * pcse looks for the trailer in its own executable when it starts, and runs the program it finds.
+ */
+
+namespace pcsb {
+
+const char MAGIC[4] = { 'P', 'C', 'S', 'B' };
+const uint32_t VERSION = 4;
+const size_t HEADER_SIZE = 16, SECTION_SIZE = 24, CONSTANT_SIZE = 24, FUNCTION_SIZE = 16;
+/* Global variable ids a file can have, far more than a program has identifiers */
+const uint32_t MAX_VARIABLES = 1 << 20;
+const char BUNDLE_MAGIC[8] = { 'P', 'C', 'S', 'E', 'B', 'N', 'D', 'L' };
+const size_t TRAILER_SIZE = 24;
+
+enum Section : uint32_t { STRINGS, CONSTANTS, FUNCTIONS, TYPES, MESSAGES, BUILTINS, CODE, LINES, SECTIONS };
+
+/* Bytes of a file being written, little-endian */
+class Writer {
+public:
+	std::vector<uint8_t> bytes;
+	template<typename Int>
+	void put(Int n){
+		for(size_t i = 0; i < sizeof(Int); i++) bytes.push_back((uint8_t)((std::make_unsigned_t<Int>)n >> (8 * i)));
+	}
+	void pad(size_t to){
+		while(bytes.size() % to) bytes.push_back(0);
+	}
+};
+
+inline void write(std::ostream& out, const Bytecode& code, size_t variables){
+	if(variables > MAX_VARIABLES) throw VMFileError("Cannot save a program with that many variables");
+	Writer sections[SECTIONS];
+	uint32_t counts[SECTIONS] = {};
+	Writer& strings = sections[STRINGS];
+	auto string = [&strings](Writer& w, std::string_view str){
+		w.put<uint32_t>(strings.bytes.size());
+		w.put<uint32_t>(str.size());
+		strings.bytes.insert(strings.bytes.end(), str.begin(), str.end());
+	};
+	for(size_t i = 0; i < code.const_pool.size(); i++){
+		Writer& w = sections[CONSTANTS];
+		const EValue& val = code.const_pool[i];
+		const size_t start = w.bytes.size();
+		w.put<uint32_t>((uint32_t)code.const_types[i]);
+		w.put<uint32_t>(0);
+		switch(code.const_types[i]){
+			case Primitive::REAL:
+				{
+					int32_t parts[2];
+					static_assert(sizeof(parts) == sizeof(val.frac));
+					std::memcpy(parts, &val.frac, sizeof(parts));
+					w.put(parts[0]);
+					w.put(parts[1]);
+				}
+				break;
+			case Primitive::CHAR: w.put<uint8_t>(val.c); break;
+			case Primitive::BOOLEAN: w.put<uint8_t>(val.b); break;
+			case Primitive::DATE:
+				w.put(val.date.day);
+				w.put(val.date.month);
+				w.put(val.date.year);
+				break;
+			case Primitive::STRING: string(w, val.str); break;
+			default: w.put(val.i64); break;
+		}
+		w.bytes.resize(start + CONSTANT_SIZE);
+	}
+	counts[CONSTANTS] = code.const_pool.size();
+	for(const FuncInfo& func : code.funcs){
+		Writer& w = sections[FUNCTIONS];
+		w.put<uint32_t>(func.entry);
+		w.put(func.params);
+		w.put(func.frame_size);
+		w.put<uint8_t>(func.returns);
+		w.put<uint8_t>(func.local_arrays);
+		w.put<uint16_t>(0);
+	}
+	counts[FUNCTIONS] = code.funcs.size();
+	for(const EType& type : code.types){
+		Writer& w = sections[TYPES];
+		w.put<uint32_t>((uint32_t)type.primtype);
+		w.put<uint32_t>(type.is_array);
+		w.put<uint32_t>(type.bounds.size());
+		for(const auto& [lo, hi] : type.bounds){
+			w.put(lo);
+			w.put(hi);
+		}
+	}
+	counts[TYPES] = code.types.size();
+	for(const std::string& message : code.messages) string(sections[MESSAGES], message);
+	counts[MESSAGES] = code.messages.size();
+	for(const auto builtin : code.builtins){
+		auto it = builtin::global_funcs.begin();
+		while(it != builtin::global_funcs.end() && it->second.func_loc != (void *)builtin) ++it;
+		if(it == builtin::global_funcs.end()) throw VMFileError("Cannot save a builtin without a name");
+		string(sections[BUILTINS], it->first);
+	}
+	counts[BUILTINS] = code.builtins.size();
+	for(size_t at = 0; at < code.length(); at++) sections[CODE].put(code.words()[at]);
+	counts[CODE] = code.length();
+	for(const auto& [at, line] : code.lines){
+		sections[LINES].put<uint32_t>(at);
+		sections[LINES].put<uint32_t>(line);
+	}
+	counts[LINES] = code.lines.size();
+	counts[STRINGS] = strings.bytes.size();
+
+	Writer file;
+	file.bytes.insert(file.bytes.end(), std::begin(MAGIC), std::end(MAGIC));
+	file.put(VERSION);
+	file.put<uint32_t>(variables);
+	file.put<uint32_t>(SECTIONS);
+	uint64_t offset = HEADER_SIZE + SECTIONS * SECTION_SIZE;
+	for(uint32_t s = 0; s < SECTIONS; s++){
+		file.put(s);
+		file.put(counts[s]);
+		file.put(offset);
+		file.put<uint64_t>(sections[s].bytes.size());
+		offset += sections[s].bytes.size();
+		offset += (8 - offset % 8) % 8;
+	}
+	for(Writer& section : sections){
+		file.bytes.insert(file.bytes.end(), section.bytes.begin(), section.bytes.end());
+		file.pad(8);
+	}
+	out.write(reinterpret_cast<const char *>(file.bytes.data()), file.bytes.size());
+}
+
+/* A .pcsb file, mapped into memory for as long as this lives. */
+class File {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+	size_t mapped_size = 0;
+	std::vector<uint64_t> buffer; /* the file, when it can't be mapped */
+#ifdef PCSB_MMAP
+	void *mapping = MAP_FAILED;
+#endif
+	struct Entry {
+		uint32_t count;
+		const uint8_t *at;
+		uint64_t size;
+	} sections[SECTIONS] = {};
+
+	[[noreturn]] static void fail(const std::string& msg){
+		throw VMFileError("Invalid bytecode file: " + msg);
+	}
+	std::string_view string(const uint8_t *at) const {
+		const uint32_t offset = readAsLE<uint32_t>(at), length = readAsLE<uint32_t>(at + 4);
+		if((uint64_t)offset + length > sections[STRINGS].size) fail("a string is outside STRINGS");
+		return std::string_view(reinterpret_cast<const char *>(sections[STRINGS].at) + offset, length);
+	}
+	/* The section, after checking it has `count * entry` bytes */
+	const uint8_t *section(Section s, size_t entry){
+		if(entry != 0 && sections[s].size != (uint64_t)sections[s].count * entry) fail("wrong size of section " + std::to_string(s));
+		return sections[s].at;
+	}
+
+	/* Maps all of `path`, then keeps the bytes from `offset` on */
+	void open(const std::string& path, uint64_t offset){
+#ifdef PCSB_MMAP
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0) throw VMFileError("Cannot open " + path);
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_size > 0){
+			mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(mapping != MAP_FAILED){
+				data = static_cast<const uint8_t *>(mapping);
+				size = mapped_size = st.st_size;
+			}
+		}
+		::close(fd);
+		if(mapping != MAP_FAILED){
+			if(offset > size) fail("the program is outside the file");
+			data += offset;
+			size -= offset;
+			return;
+		}
+#endif
+		std::ifstream in(path, std::ios::binary);
+		if(!in) throw VMFileError("Cannot open " + path);
+		in.seekg(offset);
+		const std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		buffer.resize((bytes.size() + 7) / 8);
+		std::memcpy(buffer.data(), bytes.data(), bytes.size());
+		data = reinterpret_cast<const uint8_t *>(buffer.data());
+		size = bytes.size();
+	}
+
+	void read(){
+		if(size < HEADER_SIZE || std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0) fail("not a bytecode file");
+		if(readAsLE<uint32_t>(data + 4) != VERSION) fail("version " + std::to_string(readAsLE<uint32_t>(data + 4)) + " isn't supported");
+		variables = readAsLE<uint32_t>(data + 8);
+		const uint32_t count = readAsLE<uint32_t>(data + 12);
+		if(count > (size - HEADER_SIZE) / SECTION_SIZE) fail("the section table is outside the file");
+		for(uint32_t i = 0; i < count; i++){
+			const uint8_t *entry = data + HEADER_SIZE + i * SECTION_SIZE;
+			const uint32_t kind = readAsLE<uint32_t>(entry);
+			const uint64_t offset = readAsLE<uint64_t>(entry + 8), length = readAsLE<uint64_t>(entry + 16);
+			if(offset % 8 != 0 || offset > size || length > size - offset) fail("section " + std::to_string(kind) + " is outside the file");
+			// Sections from later versions are skipped.
+			if(kind < SECTIONS) sections[kind] = { readAsLE<uint32_t>(entry + 4), data + offset, length };
+		}
+		if(variables == 0 || sections[FUNCTIONS].count == 0) fail("no program");
+		if(variables > MAX_VARIABLES) fail("too many variables");
+
+		const uint8_t *at = section(CONSTANTS, CONSTANT_SIZE);
+		for(uint32_t i = 0; i < sections[CONSTANTS].count; i++, at += CONSTANT_SIZE){
+			const uint32_t type = readAsLE<uint32_t>(at);
+			const uint8_t *val = at + 8;
+			EValue res;
+			std::memset(&res, 0, sizeof(res));
+			switch((Primitive)type){
+				case Primitive::INTEGER: res.i64 = readAsLE<int64_t>(val); break;
+				case Primitive::REAL:
+					{
+						const int32_t parts[2] = { readAsLE<int32_t>(val), readAsLE<int32_t>(val + 4) };
+						std::memcpy(&res.frac, parts, sizeof(parts));
+					}
+					break;
+				case Primitive::CHAR: res.c = val[0]; break;
+				case Primitive::BOOLEAN: res.b = val[0] != 0; break;
+				case Primitive::DATE:
+					res.date.day = val[0];
+					res.date.month = val[1];
+					res.date.year = readAsLE<uint16_t>(val + 2);
+					break;
+				case Primitive::STRING: res.str = string(val); break;
+				default: fail("constant " + std::to_string(i) + " has an unknown type");
+			}
+			code.const_pool.push_back(res);
+			code.const_types.push_back((Primitive)type);
+		}
+		at = section(FUNCTIONS, FUNCTION_SIZE);
+		for(uint32_t i = 0; i < sections[FUNCTIONS].count; i++, at += FUNCTION_SIZE){
+			code.funcs.push_back({
+				readAsLE<int32_t>(at), readAsLE<uint32_t>(at + 4), readAsLE<uint32_t>(at + 8), at[12] != 0, at[13] != 0
+			});
+			const FuncInfo& func = code.funcs.back();
+			if(func.frame_size > MAX_FRAME_SIZE || func.params > func.frame_size){
+				fail("function " + std::to_string(i) + " has too many registers or parameters");
+			}
+		}
+		at = section(TYPES, 0);
+		const uint8_t *const types_end = at + sections[TYPES].size;
+		for(uint32_t i = 0; i < sections[TYPES].count; i++){
+			if(types_end - at < 12) fail("TYPES ends early");
+			const uint32_t prim = readAsLE<uint32_t>(at), dims = readAsLE<uint32_t>(at + 8);
+			if(prim >= (uint32_t)Primitive::INVALID) fail("type " + std::to_string(i) + " is unknown");
+			EType type(readAsLE<uint32_t>(at + 4) != 0, {}, (Primitive)prim);
+			at += 12;
+			if((uint64_t)(types_end - at) < (uint64_t)dims * 16) fail("TYPES ends early");
+			// The number of elements has to fit, as arrays are allocated by it.
+			uint64_t elements = 1;
+			for(uint32_t d = 0; d < dims; d++, at += 16){
+				const int64_t lo = readAsLE<int64_t>(at), hi = readAsLE<int64_t>(at + 8);
+				const uint64_t length = (uint64_t)hi - (uint64_t)lo + 1;
+				if(lo > hi || length == 0 || __builtin_mul_overflow(elements, length, &elements) || elements > INT64_MAX){
+					fail("type " + std::to_string(i) + " has bad bounds");
+				}
+				type.bounds.emplace_back(lo, hi);
+			}
+			code.types.push_back(std::move(type));
+		}
+		at = section(MESSAGES, 8);
+		for(uint32_t i = 0; i < sections[MESSAGES].count; i++, at += 8) code.messages.emplace_back(string(at));
+		at = section(BUILTINS, 8);
+		for(uint32_t i = 0; i < sections[BUILTINS].count; i++, at += 8){
+			const auto it = builtin::global_funcs.find(string(at));
+			if(it == builtin::global_funcs.end()) fail("unknown builtin " + std::string(string(at)));
+			code.builtins.push_back(reinterpret_cast<EValue (*)(EValue *)>(it->second.func_loc));
+		}
+		at = section(LINES, 8);
+		for(uint32_t i = 0; i < sections[LINES].count; i++, at += 8){
+			code.lines.emplace_back(readAsLE<int32_t>(at), readAsLE<int32_t>(at + 4));
+		}
+		code.from_file = true;
+		at = section(CODE, 4);
+		const uint16_t probe = 1;
+		if(*reinterpret_cast<const uint8_t *>(&probe) == 1){
+			code.mapped = reinterpret_cast<const int32_t *>(at);
+			code.mapped_size = sections[CODE].count;
+		} else {
+			for(uint32_t i = 0; i < sections[CODE].count; i++) code.instr.push_back(readAsLE<int32_t>(at + 4 * i));
+		}
+	}
+public:
+	Bytecode code;
+	size_t variables = 0; /* global variable ids, see Env::variables */
+
+	/* `offset` is where the .pcsb file starts in `path`, for bundles (see bundled) */
+	explicit File(const std::string& path, uint64_t offset = 0){
+		open(path, offset);
+		try {
+			read();
+		} catch(...){
+			close();
+			throw;
+		}
+	}
+	File(const File&) = delete;
+	File& operator=(const File&) = delete;
+	~File(){ close(); }
+private:
+	void close(){
+#ifdef PCSB_MMAP
+		if(mapping != MAP_FAILED) munmap(mapping, mapped_size);
+		mapping = MAP_FAILED;
+#endif
+	}
+};
+
+// Bundles {{{
+/* Where the .pcsb file bundled into the executable `path` starts, if it has one */
+inline std::optional<uint64_t> bundled(const std::string& path){
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	if(!in) return std::nullopt;
+	const uint64_t size = in.tellg();
+	if(size < TRAILER_SIZE) return std::nullopt;
+	uint8_t trailer[TRAILER_SIZE];
+	in.seekg(size - TRAILER_SIZE);
+	if(!in.read(reinterpret_cast<char *>(trailer), TRAILER_SIZE)) return std::nullopt;
+	if(std::memcmp(trailer + 16, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0) return std::nullopt;
+	const uint64_t offset = readAsLE<uint64_t>(trailer), length = readAsLE<uint64_t>(trailer + 8);
+	if(offset % 8 != 0 || offset > size - TRAILER_SIZE || length != size - TRAILER_SIZE - offset){
+		throw VMFileError("Invalid bundle: the program is outside the file");
+	}
+	return offset;
+}
+
+/* Writes the executable `runtime` with `program` (a .pcsb file) appended to `out`, and makes it executable */
+inline void bundle(const std::string& runtime, std::string_view program, const std::string& out){
+	std::ifstream in(runtime, std::ios::binary);
+	if(!in) throw VMFileError("Cannot open " + runtime);
+	Writer file;
+	file.bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	// pcse itself could be a bundle
+	if(const auto offset = bundled(runtime)) file.bytes.resize(*offset);
+	file.pad(8);
+	const uint64_t offset = file.bytes.size();
+	file.bytes.insert(file.bytes.end(), program.begin(), program.end());
+	file.put(offset);
+	file.put<uint64_t>(program.size());
+	file.bytes.insert(file.bytes.end(), std::begin(BUNDLE_MAGIC), std::end(BUNDLE_MAGIC));
+	std::ofstream res(out, std::ios::binary | std::ios::trunc);
+	res.write(reinterpret_cast<const char *>(file.bytes.data()), file.bytes.size());
+	res.close();
+	if(!res) throw VMFileError("Cannot write " + out);
+#ifdef PCSB_MMAP
+	chmod(out.c_str(), 0755);
+#endif
+}
+
+/* The path of the running executable, `argv0` if there's no better way to find it */
+inline std::string selfPath(const char *argv0){
+#ifdef __linux__
+	(void)argv0;
+	return "/proc/self/exe";
+#else
+	return argv0;
+#endif
+}
+// }}}
+
+} /* namespace pcsb */
+
+#endif /* PCSB_HPP */
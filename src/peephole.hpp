@@ -0,0 +1,353 @@
+#ifndef PEEPHOLE_HPP
+#define PEEPHOLE_HPP
+
+#include <unordered_map>
+#include "bytecode.hpp"
+
+/* A peephole pass over compiled bytecode (see compiler.hpp), cleaning up what
+ * the compiler leaves behind one instruction at a time:
+ * - jumps to jumps go straight to the end of the chain, jumps to the next instruction go away;
+ * - a conditional jump on constants becomes a JMP, or nothing;
+ * - a comparison of two constants becomes a MOV of the result;
+ * - NOT of a NOT becomes a MOV;
+ * - LOADG right after a STOREG of the same variable becomes a MOV, a STOREG of what was just loaded goes away;
+ * - a register MOVed from a constant or another register is read from there until the end of its block;
+ * - writes to a register nothing reads (or that are overwritten before they are read) go away.
+ *
+ * The instructions are decoded into a list, rewritten until nothing changes,
+ * and encoded back, moving every jump and FuncInfo::entry to where its target went. */
+class Peephole {
+	struct Instr {
+		std::vector<int32_t> words; /* the opcode, then the operands. 'j' operands index `list` */
+		std::string kinds; /* see operandKinds */
+		bool dead = false;
+		bool leader = false; /* a block starts here */
+		bool target = false; /* something jumps here, or a function starts here */
+		Op op() const noexcept { return (Op)(words[0] & 0xFF); }
+	};
+	Bytecode& code;
+	std::vector<Instr> list;
+	std::vector<size_t> entries; /* of every function, in `list` */
+	int32_t bools[2] = { -1, -1 }; /* FALSE and TRUE in the constant pool */
+
+	static bool isReg(int32_t loc) noexcept { return loc & TOPMOST_BIT32; }
+	static bool isComparison(Op op) noexcept { return op >= OP_EQ_II && op <= OP_NEQ_SS; }
+	static bool isCompareJump(Op op) noexcept { return op >= OP_JEQ_II && op <= OP_JNEQ_II; }
+	static bool endsBlock(Op op) noexcept { return op == OP_RET || op == OP_THROW; }
+	/* Nothing after these runs, unless something jumps there */
+	static bool isUnconditional(Op op) noexcept {
+		return endsBlock(op) || op == OP_JMP || op == OP_MOV_JMP;
+	}
+	/* Instructions that only write their register: nothing else happens and they can't fail */
+	static bool isPure(Op op) noexcept {
+		return (op <= OP_SELECT && op != OP_DIV_RR && op != OP_IDIV_II && op != OP_MOD_II)
+			|| op == OP_MOV || op == OP_LOADG;
+	}
+
+	/* `which` is EQ, GT, LT, GTEQ, LTEQ, NEQ in the order of INSTRUCTIONS */
+	static bool compare(int which, CmpTypes types, EValue l, EValue r){
+		auto cmp = [which](auto a, auto b) -> bool {
+			switch(which){
+				case 0: return a == b;
+				case 1: return a > b;
+				case 2: return a < b;
+				case 3: return a >= b;
+				case 4: return a <= b;
+				default: return a != b;
+			}
+		};
+		switch(types){
+			case CMP_II: return cmp(l.i64, r.i64);
+			case CMP_RR: return cmp(l.frac, r.frac);
+			case CMP_RI: return cmp(l.frac, r.i64);
+			case CMP_CC: return cmp(l.c, r.c);
+			case CMP_BB: return cmp(l.b, r.b);
+			default: return cmp(l.str, r.str);
+		}
+	}
+	int32_t constant(bool b){
+		if(bools[b] < 0){
+			bools[b] = code.const_pool.size();
+			code.const_pool.push_back(EValue(b));
+			code.const_types.push_back(Primitive::BOOLEAN);
+		}
+		return bools[b];
+	}
+
+	/* The next instruction that is still there, list.size() at the end */
+	size_t next(size_t i) const noexcept {
+		for(i++; i < list.size() && list[i].dead; i++);
+		return i;
+	}
+	/* `i`, or the next instruction that is still there */
+	size_t live(size_t i) const noexcept {
+		return i < list.size() && list[i].dead ? next(i) : i;
+	}
+	/* Whether `i` runs right after `prev` every time */
+	bool follows(size_t prev, size_t i) const noexcept {
+		return i < list.size() && !list[i].leader && next(prev) == i;
+	}
+	void replace(Instr& in, std::vector<int32_t> words, std::string kinds){
+		in.words = std::move(words);
+		in.kinds = std::move(kinds);
+	}
+
+	void decode(){
+		const int32_t *instr = code.words();
+		std::vector<size_t> index(code.length(), SIZE_MAX);
+		for(size_t at = 0; at < code.length();){
+			Instr in;
+			in.kinds = operandKinds(code, at);
+			in.words.assign(instr + at, instr + at + 1 + in.kinds.size());
+			index[at] = list.size();
+			list.push_back(std::move(in));
+			at += list.back().words.size();
+		}
+		for(Instr& in : list){
+			for(size_t k = 0; k < in.kinds.size(); k++){
+				if(in.kinds[k] == 'j') in.words[k + 1] = index[in.words[k + 1]];
+			}
+		}
+		for(const FuncInfo& func : code.funcs) entries.push_back(index[func.entry]);
+		for(auto& [at, line] : code.lines) at = index[at];
+	}
+
+	void findLeaders(){
+		for(Instr& in : list) in.leader = in.target = false;
+		auto mark = [this](size_t i, bool target){
+			i = live(i);
+			if(i < list.size()){
+				list[i].leader = true;
+				list[i].target |= target;
+			}
+		};
+		for(size_t entry : entries) mark(entry, true);
+		for(size_t i = 0; i < list.size(); i++){
+			if(list[i].dead) continue;
+			for(size_t k = 0; k < list[i].kinds.size(); k++){
+				if(list[i].kinds[k] == 'j') mark(list[i].words[k + 1], true);
+			}
+			if(list[i].kinds.find('j') != std::string::npos || endsBlock(list[i].op())) mark(i + 1, false);
+		}
+	}
+
+	/* Where a jump to `target` ends up, through dead instructions and JMPs */
+	size_t resolve(size_t target) const noexcept {
+		for(size_t steps = 0; steps <= list.size(); steps++){
+			target = live(target);
+			if(target == list.size() || list[target].op() != OP_JMP) break;
+			target = list[target].words[1];
+		}
+		return target;
+	}
+
+	bool jumps(){
+		bool changed = false;
+		bool reachable = true;
+		for(size_t i = 0; i < list.size(); i++){
+			Instr& in = list[i];
+			if(in.dead) continue;
+			reachable |= in.target;
+			if(!reachable){
+				in.dead = true;
+				changed = true;
+				continue;
+			}
+			reachable = !isUnconditional(in.op());
+			for(size_t k = 0; k < in.kinds.size(); k++){
+				if(in.kinds[k] != 'j') continue;
+				const int32_t target = resolve(in.words[k + 1]);
+				if(target != in.words[k + 1] && (size_t)target != i){
+					in.words[k + 1] = target;
+					changed = true;
+				}
+			}
+			if(in.op() == OP_CJMP && !isReg(in.words[1])){
+				if(code.const_pool[in.words[1]].b) replace(in, { makeInstr(OP_JMP), in.words[2] }, "j");
+				else in.dead = true;
+				changed = true;
+			} else if(isCompareJump(in.op()) && !isReg(in.words[1]) && !isReg(in.words[2])){
+				const auto& pool = code.const_pool;
+				if(compare(in.op() - OP_JEQ_II, CMP_II, pool[in.words[1]], pool[in.words[2]])){
+					replace(in, { makeInstr(OP_JMP), in.words[3] }, "j");
+				} else in.dead = true;
+				changed = true;
+			}
+			if(in.dead){
+				reachable = true;
+				continue;
+			}
+			const Op op = in.op();
+			const size_t n = next(i);
+			/* a compare jump over a JMP: the opposite comparison jumps where the JMP goes */
+			if(isCompareJump(op) && n < list.size() && list[n].op() == OP_JMP && !list[n].target
+				&& (size_t)in.words[3] == next(n)){
+				in.words[0] = makeInstr((Op)(OP_JNEQ_II - (op - OP_JEQ_II)));
+				in.words[3] = list[n].words[1];
+				list[n].dead = true;
+				changed = true;
+				continue;
+			}
+			/* a jump to the next instruction */
+			const size_t last = in.kinds.size();
+			if((op == OP_JMP || op == OP_CJMP || isCompareJump(op) || op == OP_MOV_JMP)
+				&& in.kinds[last - 1] == 'j' && (size_t)in.words[last] == n){
+				if(op == OP_MOV_JMP) replace(in, { makeInstr(OP_MOV), in.words[1], in.words[2] }, "rl");
+				else in.dead = true;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	/* Rewrites within a block */
+	bool local(){
+		bool changed = false;
+		std::unordered_map<int32_t, int32_t> copies; /* register -> the `loc` it was last MOVed from */
+		std::unordered_map<int32_t, size_t> unread; /* register -> pure instruction that last wrote it */
+		size_t prev = SIZE_MAX;
+		for(size_t i = 0; i < list.size(); i++){
+			Instr& in = list[i];
+			if(in.dead) continue;
+			if(in.leader){
+				copies.clear();
+				unread.clear();
+				prev = SIZE_MAX;
+			}
+			for(size_t k = 0; k < in.kinds.size(); k++){
+				if(in.kinds[k] != 'l' || !isReg(in.words[k + 1])) continue;
+				auto c = copies.find(in.words[k + 1] ^ TOPMOST_BIT32);
+				if(c != copies.end()){
+					in.words[k + 1] = c->second;
+					changed = true;
+				}
+			}
+			Op op = in.op();
+			if(prev != SIZE_MAX && follows(prev, i)){
+				const Instr& p = list[prev];
+				if(op == OP_NOT && p.op() == OP_NOT && in.words[2] == (p.words[1] | TOPMOST_BIT32)
+					&& p.words[2] != in.words[2]){
+					replace(in, { makeInstr(OP_MOV), in.words[1], p.words[2] }, "rl");
+					changed = true;
+				} else if(op == OP_LOADG && p.op() == OP_STOREG && in.words[2] == p.words[1]){
+					replace(in, { makeInstr(OP_MOV), in.words[1], p.words[2] }, "rl");
+					changed = true;
+				} else if(op == OP_STOREG && p.op() == OP_LOADG && in.words[1] == p.words[2]
+					&& in.words[2] == (p.words[1] | TOPMOST_BIT32)){
+					in.dead = true;
+					changed = true;
+					continue;
+				}
+			}
+			op = in.op();
+			if(isComparison(op) && !isReg(in.words[2]) && !isReg(in.words[3])){
+				const int n = op - OP_EQ_II;
+				const bool res = compare(n / 6, (CmpTypes)(n % 6), code.const_pool[in.words[2]], code.const_pool[in.words[3]]);
+				replace(in, { makeInstr(OP_MOV), in.words[1], constant(res) }, "rl");
+				op = OP_MOV;
+				changed = true;
+			}
+			if(op == OP_MOV && in.words[2] == (in.words[1] | TOPMOST_BIT32)){
+				in.dead = true;
+				changed = true;
+				continue;
+			}
+			for(size_t k = 0; k < in.kinds.size(); k++){
+				if(in.kinds[k] == 'l' && isReg(in.words[k + 1])) unread.erase(in.words[k + 1] ^ TOPMOST_BIT32);
+			}
+			for(size_t k = 0; k < in.kinds.size(); k++){
+				if(in.kinds[k] != 'r') continue;
+				const int32_t reg = in.words[k + 1];
+				copies.erase(reg);
+				for(auto c = copies.begin(); c != copies.end();){
+					if(c->second == (reg | TOPMOST_BIT32)) c = copies.erase(c);
+					else ++c;
+				}
+				auto w = unread.find(reg);
+				if(w != unread.end()){
+					list[w->second].dead = true;
+					unread.erase(w);
+					changed = true;
+				}
+				if(isPure(op)) unread[reg] = i;
+			}
+			if(op == OP_MOV) copies[in.words[1]] = in.words[2];
+			if(in.kinds.find('j') != std::string::npos || endsBlock(op)) unread.clear();
+			prev = i;
+		}
+		return changed;
+	}
+
+	/* Pure instructions writing a register no instruction of the function reads */
+	bool unused(){
+		bool changed = false;
+		for(size_t f = 0; f < entries.size(); f++){
+			const size_t end = (f + 1 < entries.size() ? entries[f + 1] : list.size());
+			std::vector<bool> read(code.funcs[f].frame_size);
+			for(size_t i = entries[f]; i < end; i++){
+				if(list[i].dead) continue;
+				for(size_t k = 0; k < list[i].kinds.size(); k++){
+					const int32_t w = list[i].words[k + 1];
+					if(list[i].kinds[k] == 'l' && isReg(w)) read[w ^ TOPMOST_BIT32] = true;
+				}
+			}
+			for(size_t i = entries[f]; i < end; i++){
+				if(!list[i].dead && isPure(list[i].op()) && !read[list[i].words[1]]){
+					list[i].dead = true;
+					changed = true;
+				}
+			}
+		}
+		return changed;
+	}
+
+	void encode(){
+		std::vector<int32_t> at(list.size() + 1, 0);
+		std::vector<int32_t> instr;
+		for(size_t i = 0; i < list.size(); i++){
+			at[i] = instr.size();
+			if(!list[i].dead) instr.insert(instr.end(), list[i].words.begin(), list[i].words.end());
+		}
+		at[list.size()] = instr.size();
+		/* dead instructions map to the next live one */
+		for(size_t i = list.size(); i-- > 0;){
+			if(list[i].dead) at[i] = at[i + 1];
+		}
+		for(size_t i = 0; i < list.size(); i++){
+			if(list[i].dead) continue;
+			for(size_t k = 0; k < list[i].kinds.size(); k++){
+				if(list[i].kinds[k] == 'j') instr[at[i] + k + 1] = at[list[i].words[k + 1]];
+			}
+		}
+		for(size_t f = 0; f < entries.size(); f++) code.funcs[f].entry = at[entries[f]];
+		// A line whose instructions are all gone starts where the next one does.
+		std::vector<std::pair<int32_t, int32_t>> lines;
+		for(const auto& [i, line] : code.lines){
+			if(!lines.empty() && lines.back().first == at[i]) lines.pop_back();
+			lines.emplace_back(at[i], line);
+		}
+		code.lines = std::move(lines);
+		code.instr = std::move(instr);
+		code.mapped = nullptr;
+	}
+public:
+	explicit Peephole(Bytecode& code_): code(code_) {}
+	void run(){
+		decode();
+		bool changed = true;
+		while(changed){
+			findLeaders();
+			changed = jumps();
+			findLeaders();
+			changed |= local();
+			changed |= unused();
+		}
+		encode();
+	}
+};
+
+inline void peephole(Bytecode& code){
+	Peephole(code).run();
+}
+
+#endif /* PEEPHOLE_HPP */
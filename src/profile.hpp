@@ -0,0 +1,125 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "parser.hpp"
+
+class ProfileError : public std::runtime_error {
+	using std::runtime_error::runtime_error;
+};
+
+/* How many counters a statement has in a profile:
+ * IF: THEN taken, not taken
+ * CASE: one per case, then one for OTHERWISE (or no case matching)
+ * FOR, WHILE, REPEAT: times entered, iterations
+ * FUNCTION, PROCEDURE: calls */
+template<bool TopLevel>
+size_t profileSize(const Stmt<TopLevel>& stmt) noexcept {
+	switch(stmt.form){
+		case StmtForm::IF:
+		case StmtForm::FOR:
+		case StmtForm::WHILE:
+		case StmtForm::REPEAT:
+			return 2;
+		case StmtForm::CASE:
+			return stmt.exprs.size() + 1;
+		case StmtForm::FUNCTION:
+		case StmtForm::PROCEDURE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Calls `f` on every statement that has counters, in the order they appear in the file. */
+template<typename F>
+void forEachProfiled(Block& b, F& f);
+
+template<bool TopLevel, typename F>
+void forEachProfiled(Stmt<TopLevel>& stmt, F& f){
+	if(profileSize(stmt) != 0) f(stmt);
+	for(Block& b : stmt.blocks) forEachProfiled(b, f);
+}
+
+template<typename F>
+void forEachProfiled(Block& b, F& f){
+	for(auto& stmt : b.stmts) forEachProfiled(stmt, f);
+}
+
+template<typename F>
+void forEachProfiled(Program& prog, F& f){
+	for(auto& stmt : prog.stmts) forEachProfiled(stmt, f);
+}
+
+/* Execution counts of a program, recorded with `--record-profile`
+ * and used by the optimizer with `--use-profile` (see ProfilePass in optimizer.hpp).
+ *
+ * The file is text: a header line, then one line per statement with counters:
+ *   IF 12 30 2
+ * being the form, the line it starts on and the counters (see profileSize).
+ * A profile only fits the program it was recorded for, so reading checks
+ * that every statement is still there.
+ */
+class Profile {
+public:
+	struct Entry {
+		StmtForm form;
+		size_t line;
+		std::vector<uint64_t> counts;
+	};
+	std::vector<Entry> entries;
+	static constexpr std::string_view HEADER = "PCSE PROFILE 1";
+
+	/* Zero counts for every statement of `prog`. */
+	explicit Profile(Program& prog){
+		auto add = [this](const auto& stmt){
+			entries.push_back({ stmt.form, stmt.line, std::vector<uint64_t>(profileSize(stmt)) });
+		};
+		forEachProfiled(prog, add);
+	}
+
+	/* Makes the interpreter count into this profile while it runs `prog`. */
+	void record(Program& prog){
+		size_t i = 0;
+		auto attach = [this, &i](const auto& stmt){
+			stmt.counts = entries[i++].counts.data();
+		};
+		forEachProfiled(prog, attach);
+	}
+
+	void read(std::istream& in){
+		std::string line;
+		if(!std::getline(in, line) || line != HEADER){
+			throw ProfileError("Not a profile");
+		}
+		for(Entry& entry : entries){
+			std::string form;
+			size_t at;
+			if(!std::getline(in, line)) throw ProfileError("Profile ended early");
+			std::istringstream fields(line);
+			if(!(fields >> form >> at) || form != stmtformToStr(entry.form) || at != entry.line){
+				throw ProfileError("Profile doesn't match the program at line " + std::to_string(entry.line));
+			}
+			for(uint64_t& count : entry.counts){
+				if(!(fields >> count)) throw ProfileError("Missing count at line " + std::to_string(entry.line));
+			}
+		}
+		if(in >> line) throw ProfileError("Profile has more statements than the program");
+	}
+
+	void write(std::ostream& out) const {
+		out << HEADER << '\n';
+		for(const Entry& entry : entries){
+			out << stmtformToStr(entry.form) << ' ' << entry.line;
+			for(const uint64_t count : entry.counts) out << ' ' << count;
+			out << '\n';
+		}
+	}
+};
+
+#endif /* PROFILE_HPP */
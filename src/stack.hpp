@@ -0,0 +1,116 @@
+#ifndef STACK_HPP
+#define STACK_HPP
+
+#include <exception>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include "interpreter.hpp"
+#if defined(__unix__)
+#define PCSE_HEAP_STACK
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+/* Runs the tree-walker on a stack of `size` bytes of its own, mapped from the heap, instead of
+ * the native one (`pcse --stack=MB`), so how deep it recurses is up to that size.
+ * Every call of a runtime function checks there's still MARGIN bytes left (see env.stack_low),
+ * which is plenty for its body up to the next call, and throws a StackOverflow if not.
+ * The calls it unwinds add themselves to it, and it comes out of run() as a RuntimeError
+ * naming them. The pages are only backed by memory once they're used. */
+class HeapStack {
+public:
+	static constexpr size_t MARGIN = 1 << 20, MIN_SIZE = 2 * MARGIN;
+	static constexpr size_t SHOWN = 4; /* calls at each end of the chain in the error */
+private:
+	const size_t size;
+#ifdef PCSE_HEAP_STACK
+	void *stack = MAP_FAILED;
+	ucontext_t caller, callee;
+#endif
+	const std::function<void()> *body = nullptr;
+	std::exception_ptr error;
+
+	static HeapStack *current;
+	static void start(){
+		HeapStack& self = *current;
+		try {
+			(*self.body)();
+		} catch(...){
+			self.error = std::current_exception();
+		}
+	}
+
+	/* The chain, outermost call first */
+	static std::string describe(const std::vector<int64_t>& chain, const std::map<std::string_view, int64_t>& ids){
+		std::map<int64_t, std::string_view> names;
+		for(const auto& [name, id] : ids) names.emplace(id, name);
+		std::string res;
+		for(size_t i = chain.size(); i-- > 0;){
+			const size_t from_start = chain.size() - 1 - i;
+			if(from_start == SHOWN && chain.size() > 2 * SHOWN){
+				res += " -> ... " + std::to_string(chain.size() - 2 * SHOWN) + " more ...";
+				i = SHOWN;
+				continue;
+			}
+			if(!res.empty()) res += " -> ";
+			const auto it = names.find(chain[i]);
+			res += it == names.end() ? "?" : std::string(it->second);
+		}
+		return res;
+	}
+public:
+	explicit HeapStack(size_t size_) : size(size_) {
+		if(size < MIN_SIZE) throw RuntimeError("The stack needs at least " + std::to_string(MIN_SIZE >> 20) + " MiB");
+#ifdef PCSE_HEAP_STACK
+		stack = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(stack == MAP_FAILED) throw RuntimeError("Cannot allocate a stack of " + std::to_string(size >> 20) + " MiB");
+		// A guard page, in case something goes past the margin anyway
+		mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+#else
+		throw RuntimeError("Running on a separate stack is not supported on this platform");
+#endif
+	}
+	HeapStack(const HeapStack&) = delete;
+	HeapStack& operator=(const HeapStack&) = delete;
+	~HeapStack(){
+#ifdef PCSE_HEAP_STACK
+		if(stack != MAP_FAILED) munmap(stack, size);
+#endif
+	}
+
+	/* Runs `f` on the stack. `ids` names the functions in the chain of a StackOverflow. */
+	void run(Env& env, const std::function<void()>& f, const std::map<std::string_view, int64_t>& ids){
+#ifdef PCSE_HEAP_STACK
+		HeapStack *const outer = current;
+		const uintptr_t outer_low = env.stack_low;
+		current = this;
+		body = &f;
+		error = nullptr;
+		env.stack_low = reinterpret_cast<uintptr_t>(stack) + MARGIN;
+		getcontext(&callee);
+		callee.uc_stack.ss_sp = stack;
+		callee.uc_stack.ss_size = size;
+		callee.uc_link = &caller;
+		makecontext(&callee, start, 0);
+		swapcontext(&caller, &callee);
+		current = outer;
+		env.stack_low = outer_low;
+		if(error == nullptr) return;
+		try {
+			std::rethrow_exception(error);
+		} catch(StackOverflow& e){
+			throw RuntimeError("Ran out of stack (" + std::to_string(size >> 20) + " MiB) after "
+				+ std::to_string(e.chain.size()) + " nested calls: " + describe(e.chain, ids));
+		}
+#else
+		(void)env, (void)f, (void)ids;
+#endif
+	}
+};
+
+inline HeapStack *HeapStack::current = nullptr;
+
+#endif /* STACK_HPP */
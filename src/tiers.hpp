@@ -0,0 +1,124 @@
+#ifndef TIERS_HPP
+#define TIERS_HPP
+
+#include <map>
+#include <memory>
+#include "interpreter.hpp"
+#include "lowering.hpp"
+#include "irpasses.hpp"
+#include "compiler.hpp"
+#include "peephole.hpp"
+#include "vm.hpp"
+
+/* Runs the hot functions and loops of a program the tree-walker is running
+ * on the VM (and as machine code, with `jit`), see Tiers.
+ *
+ * Nothing is compiled before something gets hot. The first hot function has all
+ * the functions lowered and compiled, and they are called one at a time from then on.
+ * A hot loop is compiled by itself (see Lowering::loop), along with the functions it calls,
+ * and runs from the back-edge where it got hot to its end. It's compiled again if the types
+ * of the variables have changed by the next time it runs.
+ * Globals stay in Env, so both tiers see the same ones.
+ * Anything the IR can't express stays with the tree-walker. */
+class VMTiers : public Tiers {
+	/* Compiled code and the VM running it */
+	struct Unit {
+		Bytecode code;
+		std::unique_ptr<VM> vm;
+		std::map<int64_t, size_t> func_index;
+		uint64_t version = 0; /* of the functable `vm` knows about */
+		/* Hot loops only */
+		std::vector<const Expr *> returns;
+		std::vector<std::pair<EType, int>> vars; /* of every variable in Env, see where() */
+	};
+
+	const Program& prog;
+	const bool optimized, superinstructions, jit;
+	std::unique_ptr<Unit> functions;
+	bool functions_failed = false;
+	std::map<const void *, std::unique_ptr<Unit>> loops;
+
+	std::unique_ptr<Unit> build(Env& env, ir::Module mod) const {
+		if(optimized) ir::PassManager().run(mod);
+		auto unit = std::make_unique<Unit>();
+		unit->func_index = std::move(mod.func_index);
+		unit->code = compile(mod, superinstructions);
+		if(optimized) peephole(unit->code);
+		unit->vm = std::make_unique<VM>(env, unit->code);
+		if(jit) unit->vm->enableJit();
+		return unit;
+	}
+	/* CHECKDEF is about the functions the tree-walker has defined. */
+	static void sync(const Env& env, Unit& unit){
+		if(unit.version == env.functable_version) return;
+		for(const auto& [id, f] : unit.func_index) unit.vm->define(f, env.functable.count(id));
+		unit.version = env.functable_version;
+	}
+	/* 0 for a global, 1 for a variable of the running function, 2 for one it can't see */
+	static int where(const Env& env, int64_t id){
+		const int32_t level = env.getLevel(id);
+		return level == env.GLOBAL_LEVEL ? 0 : level == env.call_number ? 1 : 2;
+	}
+	static std::vector<std::pair<EType, int>> vars(const Env& env){
+		std::vector<std::pair<EType, int>> res;
+		res.reserve(env.variables());
+		for(size_t id = 0; id < env.variables(); id++) res.emplace_back(env.getType(id), where(env, id));
+		return res;
+	}
+	template<bool TopLevel>
+	std::optional<const Expr *> runLoop(Env& env, const Stmt<TopLevel>& stmt, const EValue *state){
+		std::unique_ptr<Unit>& unit = loops[&stmt];
+		auto now = vars(env);
+		if(unit == nullptr || unit->vars != now){
+			try {
+				std::vector<const Expr *> returns;
+				ir::Module mod = ir::lowerLoop(prog, env, stmt, returns);
+				unit = build(env, std::move(mod));
+				unit->returns = std::move(returns);
+				unit->vars = std::move(now);
+			} catch(ir::Unsupported&) {
+				unit = nullptr;
+				return std::nullopt;
+			}
+		}
+		sync(env, *unit);
+		const int64_t ret = unit->vm->call(0, state).i64;
+		if(ret == 0) return nullptr;
+		return unit->returns[ret - 1];
+	}
+
+public:
+	static constexpr uint32_t CALLS = 100, BACK_EDGES = 1000;
+
+	VMTiers(const Program& prog_, bool optimized_, bool superinstructions_, bool jit_,
+			uint32_t call_threshold = CALLS, uint32_t loop_threshold = BACK_EDGES) :
+		Tiers(call_threshold, loop_threshold), prog(prog_),
+		optimized(optimized_), superinstructions(superinstructions_), jit(jit_) {}
+
+	bool call(Env& env, int64_t id, const EFunc& func, const EValue *args, std::optional<EValue>& ret) override {
+		if(functions == nullptr){
+			if(functions_failed) return false;
+			try {
+				functions = build(env, ir::Lowering(prog, env).functions());
+			} catch(ir::Unsupported&) {
+				functions_failed = true;
+				return false;
+			}
+		}
+		sync(env, *functions);
+		// Like callFunc, the function can't see the variables of its caller.
+		env.call_number++;
+		const EValue res = functions->vm->call(functions->func_index.at(id), args);
+		env.call_number--;
+		if(func.ret_type != Primitive::INVALID) ret = res;
+		return true;
+	}
+	std::optional<const Expr *> loop(Env& env, const Stmt<true>& stmt, const EValue *state) override {
+		return runLoop(env, stmt, state);
+	}
+	std::optional<const Expr *> loop(Env& env, const Stmt<false>& stmt, const EValue *state) override {
+		return runLoop(env, stmt, state);
+	}
+};
+
+#endif /* TIERS_HPP */
@@ -32,6 +32,12 @@ struct EType {
 	EType(bool is_arr, std::vector<std::pair<int64_t,int64_t>> bounds_, Primitive primtype_):
 		is_array(is_arr), bounds(bounds_), primtype(primtype_) {}
 	inline bool is_primitive() const noexcept { return is_array == false; }
+	/* Number of elements in an array */
+	inline size_t size() const noexcept {
+		size_t res = 1;
+		for(const auto& b : bounds) res *= b.second - b.first + 1;
+		return res;
+	}
 	inline bool operator==(const EType& et) const noexcept {
 		bool res = 
 			primtype == et.primtype && 
@@ -91,7 +97,7 @@ union EValue {
 	char c;
 	bool b;
 	Date date;
-	std::vector<EValue> *vals;
+	EValue *arr; /* first element of an array, see Env::allocArr */
 	inline EValue(){}
 	inline EValue(const std::string_view str_): str(str_) {}
 	inline EValue(const int64_t i64_): i64(i64_) {}
@@ -99,7 +105,7 @@ union EValue {
 	inline EValue(const char c_): c(c_) {}
 	inline EValue(const bool b_): b(b_) {}
 	inline EValue(const Date date_): date(date_) {}
-	inline EValue(std::vector<EValue> * const val_): vals(val_) {}
+	inline EValue(EValue * const arr_): arr(arr_) {}
 };
 
 
@@ -115,6 +121,12 @@ struct EFunc {
 		BUILTIN
 	} what;
 	void *func_loc = nullptr;
+	/* Array parameters can be freed when the call returns, see Env::region */
+	bool local_arrays = false;
+	/* Counts the calls while a profile is recorded, see profile.hpp */
+	uint64_t *calls = nullptr;
+	/* Calls so far, while tiers are looking for hot functions (see Tiers in interpreter.hpp) */
+	mutable uint32_t hotness = 0;
 	EFunc(uint_least8_t arity_, What what_, EType *types_, int64_t *ids_, void *func, EType ret_type_):
 		arity(arity_), types(types_), ids(ids_), ret_type(ret_type_), what(what_), func_loc(func) {}
 	EFunc(uint_least8_t arity_, What what_):
@@ -122,14 +134,15 @@ struct EFunc {
 	EFunc(): arity(0), what(What::RUNTIME) {}
 	EFunc(const EFunc& e):
 		arity(e.arity), types(new EType[arity]), ids(new int64_t[arity]), ret_type(e.ret_type),
-		what(e.what), func_loc(e.func_loc) 
+		what(e.what), func_loc(e.func_loc), local_arrays(e.local_arrays), calls(e.calls)
 	{
 		if(e.types != nullptr) std::copy(e.types, e.types+arity, types);
 		if(e.ids != nullptr) std::copy(e.ids, e.ids+arity, ids);
 	}
 	EFunc(EFunc& e): EFunc((const EFunc&)e) {}
 	EFunc(const EFunc&& e) = delete;
-	EFunc(EFunc&& e) : arity(e.arity), types(e.types), ids(e.ids), ret_type(e.ret_type), what(e.what), func_loc(e.func_loc) {
+	EFunc(EFunc&& e) : arity(e.arity), types(e.types), ids(e.ids), ret_type(e.ret_type), what(e.what), func_loc(e.func_loc),
+		local_arrays(e.local_arrays), calls(e.calls) {
 		e.ids = nullptr;
 		e.types = nullptr;
 	}
@@ -2,143 +2,1000 @@
 #define VM_HPP
 
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <exception>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <type_traits>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "date.hpp"
 #include "fraction.hpp"
 #include "bytecode.hpp"
+#include "environment.hpp"
+#include "jit.hpp"
 
 static_assert(sizeof(size_t) >= 4, "must have at least 32-bit size_t");
 
+/* VM::run dispatches with a switch, or on GCC and Clang by jumping from handler to handler
+ * through a table of labels, unless SWITCH_DISPATCH is defined.
+ * With THREADED_CODE as well, the instructions are turned into the labels' addresses before running. */
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define COMPUTED_GOTO
+#endif
+
 class VMFileError : public std::runtime_error {
 public:
-	template<typename... Args> 
+	template<typename... Args>
 	VMFileError(Args... args) : std::runtime_error(args...) {}
 };
 
 class VMRuntimeError : public std::runtime_error {
 	public:
-	template<typename... Args> 
+	template<typename... Args>
 		VMRuntimeError(Args... args) : std::runtime_error(args...) {}
 };
 
 /* Read `Int` as little-endian. */
 template<typename Int>
 Int readAsLE(const uint8_t *buf){
-	Int shift = 0;
-	Int res = 0;
+	using Unsigned = std::make_unsigned_t<Int>;
+	Unsigned res = 0;
 	for(size_t i = 0; i < sizeof(Int); i++){
-		res += (buf[i] << shift);
-		shift += 8;
+		res |= (Unsigned)buf[i] << (8 * i);
 	}
-	return res;
+	return (Int)res;
 }
 
-class VM {
+// verify {{{
+
+[[noreturn]] inline void verifyFail(size_t at, const std::string& msg){
+	throw VMFileError("Invalid bytecode at " + std::to_string(at) + ": " + msg);
+}
 
-	union Value {
-		int64_t i64;
-		Fraction<> frac;
-		std::string *str;
-		bool b;
-		Date date;
-		char c;
-		inline Value(int64_t i): i64(i) {}
-		inline Value(Fraction<> f): frac(f) {}
-		inline Value(std::string *s): str(s) {}
-		inline Value(bool a): b(a) {}
-		inline Value(Date d): date(d) {}
-		inline Value(char a): c(a) {}
+/* What a register or a constant holds, as far as checkTypes knows */
+struct Kind {
+	enum Tag : uint8_t { NONE, VALUE, ARRAY, ANY } tag = NONE; /* NONE: nothing's known yet */
+	Primitive prim = Primitive::INVALID;
+	uint64_t size = 0; /* elements of an ARRAY */
+
+	static Kind of(const EType& t){
+		return { t.is_array ? ARRAY : VALUE, t.primtype, t.is_array ? t.size() : 0 };
+	}
+	inline bool operator==(const Kind& k) const noexcept { return tag == k.tag && prim == k.prim && size == k.size; }
+	inline bool operator!=(const Kind& k) const noexcept { return !operator==(k); }
+	/* What it is where paths with `k` meet */
+	inline Kind join(const Kind& k) const noexcept {
+		if(tag == NONE) return k;
+		if(k.tag == NONE || k == *this) return *this;
+		return { ANY };
+	}
+};
+
+/* The types of the registers, for code from a file: the compiler drops the checks
+ * it proves can't fail, and a file that changes the types of the operands after that
+ * could read an INTEGER as a STRING or an array. Every operand has to have the type
+ * its instruction takes, the arguments of calls and the values of globals included,
+ * so it's worked out for every function at once. Indexes can't be known here, so
+ * the size of the array of every LOADE and STOREE goes in `limits` for the VM to check. */
+inline void checkTypes(const Bytecode& code, size_t variables, const std::vector<std::string>& kinds, std::vector<uint64_t>& limits){
+	const int32_t *instr = code.words();
+	const size_t size = code.length(), n = code.funcs.size();
+	const Kind INT{ Kind::VALUE, Primitive::INTEGER }, REAL{ Kind::VALUE, Primitive::REAL }, BOOL{ Kind::VALUE, Primitive::BOOLEAN };
+	const auto value = [](Primitive p){ return Kind{ Kind::VALUE, p }; };
+	const auto endOf = [&](size_t f){ return f + 1 < n ? (size_t)code.funcs[f + 1].entry : size; };
+	// Globals only get a type from DECLAREG.
+	std::vector<Kind> globals(variables);
+	for(size_t at = 0; at < size; at += 1 + kinds[at].size()){
+		if((instr[at] & 0xFF) != OP_DECLAREG) continue;
+		const Kind k = Kind::of(code.types[instr[at + 2]]);
+		Kind& g = globals[instr[at + 1]];
+		if(g.tag != Kind::NONE && g != k) verifyFail(at, "a global is declared with two types");
+		g = k;
+	}
+	std::vector<std::vector<Kind>> params(n);
+	for(size_t f = 0; f < n; f++) params[f].resize(code.funcs[f].params);
+	std::vector<Kind> rets(n); /* what functions return, any VALUE for a PROCEDURE that does */
+	std::vector<bool> called(n, false); /* only these can run */
+	called[0] = true;
+	bool changed = true;
+	// What a function passes on to the others only grows, until none of it changes.
+	// Then the last round checks the operands, with everything known.
+	const auto analyze = [&](size_t f, bool check){
+		const FuncInfo& func = code.funcs[f];
+		const size_t entry = func.entry, end = endOf(f);
+		std::vector<std::vector<Kind>> states(end - entry);
+		states[0].assign(func.frame_size, Kind{ Kind::ANY });
+		std::copy(params[f].begin(), params[f].end(), states[0].begin());
+		std::vector<size_t> work = { entry };
+		while(!work.empty()){
+			const size_t at = work.back();
+			work.pop_back();
+			std::vector<Kind> regs = states[at - entry];
+			const int32_t *w = instr + at + 1;
+			const Op op = (Op)(instr[at] & 0xFF);
+			const auto loc = [&](int32_t l){
+				return (l & TOPMOST_BIT32) ? regs[l ^ TOPMOST_BIT32] : value(code.const_types[l]);
+			};
+			const auto expect = [&](size_t k, const Kind& want){
+				if(check && loc(w[k]) != want){
+					verifyFail(at, std::string(instr_to_str[op]) + " has an operand " + std::to_string(k + 1) + " of the wrong type");
+				}
+			};
+			const auto array = [&](size_t k){
+				const Kind a = loc(w[k]);
+				if(check && a.tag != Kind::ARRAY) verifyFail(at, std::string(instr_to_str[op]) + " indexes something that isn't an array");
+				limits[at] = a.size;
+				return a;
+			};
+			const auto result = [&](const Kind& k){ regs[w[0]] = k; };
+			const auto grow = [&](Kind& summary, const Kind& k){
+				const Kind joined = summary.join(k);
+				if(joined != summary){
+					summary = joined;
+					changed = true;
+				}
+			};
+			bool falls_through = (op != OP_RET && op != OP_THROW && op != OP_JMP && op != OP_MOV_JMP);
+			if(op >= OP_EQ_II && op <= OP_NEQ_SS){
+				static const Primitive operands[][2] = {
+					{ Primitive::INTEGER, Primitive::INTEGER }, { Primitive::REAL, Primitive::REAL },
+					{ Primitive::REAL, Primitive::INTEGER }, { Primitive::CHAR, Primitive::CHAR },
+					{ Primitive::BOOLEAN, Primitive::BOOLEAN }, { Primitive::STRING, Primitive::STRING }
+				};
+				const auto& [l, r] = operands[(op - OP_EQ_II) % 6];
+				expect(1, value(l));
+				expect(2, value(r));
+				result(BOOL);
+			} else switch(op){
+#define OPERATOR(name, l, r, res) case OP_##name: expect(1, l); expect(2, r); result(res); break;
+				OPERATOR(ADD_II, INT, INT, INT) OPERATOR(SUB_II, INT, INT, INT) OPERATOR(MUL_II, INT, INT, INT)
+				OPERATOR(ADD_RR, REAL, REAL, REAL) OPERATOR(SUB_RR, REAL, REAL, REAL) OPERATOR(MUL_RR, REAL, REAL, REAL)
+				OPERATOR(ADD_RI, REAL, INT, REAL) OPERATOR(SUB_RI, REAL, INT, REAL) OPERATOR(MUL_RI, REAL, INT, REAL)
+				OPERATOR(DIV_RR, REAL, REAL, REAL) OPERATOR(IDIV_II, INT, INT, INT) OPERATOR(MOD_II, INT, INT, INT)
+				OPERATOR(EQ_DD, value(Primitive::DATE), value(Primitive::DATE), BOOL)
+				OPERATOR(AND, BOOL, BOOL, BOOL) OPERATOR(OR, BOOL, BOOL, BOOL)
+#undef OPERATOR
+				case OP_NEG_I: expect(1, INT); result(INT); break;
+				case OP_NEG_R: expect(1, REAL); result(REAL); break;
+				case OP_ITOR: expect(1, INT); result(REAL); break;
+				case OP_NOT: expect(1, BOOL); result(BOOL); break;
+				case OP_DEFINED: result(BOOL); break;
+				case OP_SELECT: expect(1, BOOL); result(loc(w[2]).join(loc(w[3]))); break;
+				case OP_MOV: case OP_MOV_JMP: result(loc(w[1])); break;
+				case OP_LOADG: result(globals[w[1]].tag == Kind::NONE ? Kind{ Kind::ANY } : globals[w[1]]); break;
+				case OP_STOREG: if(globals[w[0]].tag != Kind::NONE) expect(1, globals[w[0]]); break;
+				case OP_DECLAREG:
+					if(kinds[at].size() == 3 && !code.types[w[1]].is_array) expect(2, Kind::of(code.types[w[1]]));
+					break;
+				case OP_LOADE: result(value(array(1).prim)); expect(2, INT); break;
+				case OP_STOREE: expect(2, value(array(0).prim)); expect(1, INT); break;
+				case OP_LOADE_IDX: result(value(array(1).prim)); expect(2, INT); expect(3, INT); break;
+				case OP_STOREE_IDX: expect(3, value(array(0).prim)); expect(1, INT); expect(2, INT); break;
+				case OP_CHECK: expect(0, INT); expect(1, INT); expect(2, INT); break;
+				case OP_NEWARR:
+					if(!code.types[w[1]].is_array) verifyFail(at, "NEWARR of something that isn't an array");
+					result(Kind::of(code.types[w[1]]));
+					break;
+				case OP_COPYARR: case OP_COPYNEW:
+					{
+						const Kind source = loc(w[1]);
+						const Kind target = op == OP_COPYARR ? loc(w[0]) : source;
+						if(check && (source.tag != Kind::ARRAY || target != source || (uint64_t)w[2] != source.size)){
+							verifyFail(at, std::string(instr_to_str[op]) + " copies something that isn't an array of its size");
+						}
+						if(op == OP_COPYNEW) result(source);
+					}
+					break;
+				case OP_INPUT: result(Kind::of(code.types[w[1]])); break;
+				case OP_OUTPUT: expect(1, Kind::of(code.types[w[0]])); break;
+				case OP_CJMP: expect(0, BOOL); break;
+				case OP_JEQ_II: case OP_JGT_II: case OP_JLT_II: case OP_JGTEQ_II: case OP_JLTEQ_II: case OP_JNEQ_II:
+					expect(0, INT);
+					expect(1, INT);
+					break;
+				case OP_FOR_STEP_II: expect(1, INT); expect(2, INT); expect(3, INT); result(INT); break;
+				case OP_CALL:
+					{
+						const size_t callee = w[1];
+						if(!called[callee]){
+							called[callee] = true;
+							changed = true;
+						}
+						for(size_t i = 0; i < code.funcs[callee].params; i++) grow(params[callee][i], loc(w[2 + i]));
+						// Until the callee is known to return, nothing after the call runs.
+						falls_through = rets[callee].tag != Kind::NONE;
+						if(code.funcs[callee].returns) result(rets[callee]);
+					}
+					break;
+				case OP_CALLB:
+					{
+						auto it = builtin::global_funcs.begin();
+						while(it != builtin::global_funcs.end() && it->second.func_loc != (void *)code.builtins[w[1]]) ++it;
+						if(it == builtin::global_funcs.end() || it->second.arity != w[2]) verifyFail(at, "CALLB with the wrong arguments");
+						for(size_t i = 0; i < it->second.arity; i++) expect(3 + i, Kind::of(it->second.types[i]));
+						result(Kind::of(it->second.ret_type));
+					}
+					break;
+				case OP_RET:
+					grow(rets[f], kinds[at].empty() ? value(Primitive::INVALID) : loc(w[0]));
+					break;
+				default:
+					break;
+			}
+			const auto flow = [&](size_t to){
+				std::vector<Kind>& state = states[to - entry];
+				if(state.empty()) state = regs;
+				else {
+					bool grew = false;
+					for(size_t r = 0; r < state.size(); r++){
+						const Kind joined = state[r].join(regs[r]);
+						if(joined != state[r]){
+							state[r] = joined;
+							grew = true;
+						}
+					}
+					if(!grew) return;
+				}
+				work.push_back(to);
+			};
+			for(size_t k = 0; k < kinds[at].size(); k++){
+				if(kinds[at][k] == 'j') flow(w[k]);
+			}
+			if(falls_through) flow(at + 1 + kinds[at].size());
+		}
 	};
+	while(changed){
+		changed = false;
+		for(size_t f = 0; f < n; f++){
+			if(called[f]) analyze(f, false);
+		}
+	}
+	for(size_t f = 0; f < n; f++){
+		if(called[f]) analyze(f, true);
+	}
+}
+
+/* Checks bytecode once, before it runs, so the VM can trust it:
+ * every operand is in range (registers in the frame, constants in the pool, ...),
+ * every jump lands on an instruction of its own function, no function runs off its end,
+ * and every register is written on every path before it is read.
+ * The last one stands in for a stack machine's "same depth at every merge point":
+ * frames have a fixed size, so it's which registers hold a value that has to agree.
+ * Code from a file has the types of its operands checked too (see checkTypes),
+ * and what that returns is the size of the array at every LOADE and STOREE, to check
+ * the indexes against. It returns nothing for code compiled here.
+ * `variables` is the number of global variable ids (see Env::variables). */
+inline std::vector<uint64_t> verify(const Bytecode& code, size_t variables){
+	const auto fail = verifyFail;
+	const int32_t *instr = code.words();
+	const size_t size = code.length();
+	if(code.funcs.empty() || code.funcs[0].entry != 0) fail(0, "the main program doesn't start at 0");
+	// Where every instruction starts, and what its operands are.
+	std::vector<bool> starts(size + 1, false);
+	std::vector<std::string> kinds(size);
+	for(size_t at = 0; at < size;){
+		const uint8_t op = instr[at] & 0xFF;
+		if(op >= OP_LENGTH) fail(at, "unknown instruction " + std::to_string(op));
+		if(op == OP_CALL && (at + 2 >= size || instr[at + 2] < 0 || (size_t)instr[at + 2] >= code.funcs.size())){
+			fail(at, "CALL of a nonexistent function");
+		}
+		if(op == OP_CALLB && (at + 3 >= size || instr[at + 3] < 0 || (size_t)instr[at + 3] > MAX_BUILTIN_ARGS)){
+			fail(at, "CALLB with too many arguments");
+		}
+		starts[at] = true;
+		kinds[at] = operandKinds(code, at);
+		at += 1 + kinds[at].size();
+		if(at > size) fail(at, "the code ends inside an instruction");
+	}
+	starts[size] = true;
+	for(size_t f = 0; f < code.funcs.size(); f++){
+		const FuncInfo& func = code.funcs[f];
+		const size_t entry = func.entry;
+		const size_t end = (f + 1 < code.funcs.size() ? code.funcs[f + 1].entry : size);
+		if(entry >= end || end > size || !starts[entry] || !starts[end]){
+			fail(entry, "function @" + std::to_string(f) + " isn't a sequence of instructions");
+		}
+		if(func.frame_size > MAX_FRAME_SIZE) fail(entry, "too many registers");
+		if(func.params > func.frame_size) fail(entry, "more parameters than registers");
+		const auto inFrame = [&](int32_t reg){ return reg >= 0 && (uint32_t)reg < func.frame_size; };
+		const auto index = [](int32_t n, size_t count){ return n >= 0 && (size_t)n < count; };
+		size_t last = entry;
+		for(size_t at = entry; at < end; at += 1 + kinds[at].size()){
+			last = at;
+			const Op op = (Op)(instr[at] & 0xFF);
+			const uint8_t t1 = (uint32_t)instr[at] >> 24;
+			for(size_t k = 0; k < kinds[at].size(); k++){
+				const int32_t w = instr[at + 1 + k];
+				bool ok = true;
+				switch(kinds[at][k]){
+					case 'r': ok = inFrame(w) || (op == OP_CALL && !code.funcs[instr[at + 2]].returns); break;
+					case 'l': ok = (w & TOPMOST_BIT32) ? inFrame(w ^ TOPMOST_BIT32) : index(w, code.const_pool.size()); break;
+					case 'j': ok = index(w, size) && starts[w] && (size_t)w >= entry && (size_t)w < end; break;
+					case 't': ok = index(w, code.types.size()); break;
+					case 'f': ok = index(w, code.funcs.size()); break;
+					case 'b': ok = index(w, code.builtins.size()); break;
+					case 'm': ok = index(w, code.messages.size()); break;
+					default:
+						if(op == OP_LOADG || op == OP_STOREG || op == OP_DECLAREG || op == OP_HIDEG || op == OP_UNHIDEG){
+							ok = index(w, variables);
+						}
+						else if(op == OP_THROW) ok = (w == 0 || w == 1);
+						else ok = (w >= 0);
+						break;
+				}
+				if(!ok) fail(at, std::string(instr_to_str[op]) + " has an invalid operand " + std::to_string(k + 1));
+			}
+			if(op == OP_RET && (bool)t1 != func.returns) fail(at, "RET doesn't match the function");
+		}
+		const Op op = (Op)(instr[last] & 0xFF);
+		if(op != OP_RET && op != OP_THROW && op != OP_JMP && op != OP_MOV_JMP){
+			fail(last, "function @" + std::to_string(f) + " runs off its end");
+		}
+		// Registers written on every path to each instruction, from the parameters on.
+		std::vector<std::vector<bool>> written(end - entry);
+		std::vector<size_t> work = { entry };
+		written[0].assign(func.frame_size, false);
+		std::fill(written[0].begin(), written[0].begin() + func.params, true);
+		while(!work.empty()){
+			const size_t at = work.back();
+			work.pop_back();
+			std::vector<bool> regs = written[at - entry];
+			const Op op = (Op)(instr[at] & 0xFF);
+			for(size_t k = 0; k < kinds[at].size(); k++){
+				const int32_t w = instr[at + 1 + k];
+				if(kinds[at][k] == 'l' && (w & TOPMOST_BIT32) && !regs[w ^ TOPMOST_BIT32]){
+					fail(at, "r" + std::to_string(w ^ TOPMOST_BIT32) + " is read before it is written");
+				}
+			}
+			for(size_t k = 0; k < kinds[at].size(); k++){
+				if(kinds[at][k] != 'r') continue;
+				// A PROCEDURE returns nothing to its register.
+				if(op != OP_CALL || code.funcs[instr[at + 2]].returns) regs[instr[at + 1 + k]] = true;
+			}
+			const auto flow = [&](size_t to){
+				std::vector<bool>& state = written[to - entry];
+				if(state.empty()) state = regs;
+				else {
+					bool changed = false;
+					for(size_t r = 0; r < state.size(); r++){
+						if(state[r] && !regs[r]){
+							state[r] = false;
+							changed = true;
+						}
+					}
+					if(!changed) return;
+				}
+				work.push_back(to);
+			};
+			for(size_t k = 0; k < kinds[at].size(); k++){
+				if(kinds[at][k] == 'j') flow(instr[at + 1 + k]);
+			}
+			if(op != OP_RET && op != OP_THROW && op != OP_JMP && op != OP_MOV_JMP){
+				flow(at + 1 + kinds[at].size());
+			}
+		}
+	}
+	std::vector<uint64_t> limits;
+	if(code.from_file){
+		limits.resize(size);
+		checkTypes(code, variables, kinds, limits);
+	}
+	return limits;
+}
+
+// }}}
+
+// OpcodeStats {{{
+
+/* What `--opcode-stats` reports: how often every opcode and every pair of opcodes ran,
+ * and what one instruction of every opcode costs.
+ * Reading the clock around every instruction would slow everything down,
+ * so only every SAMPLE_EVERY'th instruction is timed, until the next one starts. */
+class OpcodeStats {
+	static constexpr uint64_t SAMPLE_EVERY = 61; /* odd, so loops don't always sample the same instruction */
+	std::array<uint64_t, OP_LENGTH> counts{}, cycles{}, samples{};
+	std::vector<uint64_t> pairs = std::vector<uint64_t>(OP_LENGTH * OP_LENGTH);
+	uint8_t prev = OP_LENGTH;
+	uint64_t until_sample = SAMPLE_EVERY;
+	uint64_t start = 0; /* when the sampled instruction started, 0 if none is */
+
+	/* Cycles on x86, nanoseconds elsewhere */
+	static inline uint64_t now() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
 
 public:
-	std::vector<Value> const_pool; // constant pool
+	inline uint64_t count(uint8_t op) const noexcept { return counts[op]; }
+	inline uint64_t pair(uint8_t first, uint8_t second) const noexcept { return pairs[first * OP_LENGTH + second]; }
+
+	/* Called before every instruction the VM runs */
+	inline void record(uint8_t op) noexcept {
+		if(start != 0){
+			cycles[prev] += now() - start;
+			samples[prev]++;
+			start = 0;
+		}
+		counts[op]++;
+		if(prev != OP_LENGTH) pairs[prev * OP_LENGTH + op]++;
+		prev = op;
+		if(--until_sample == 0){
+			until_sample = SAMPLE_EVERY;
+			start = now();
+		}
+	}
+
+	/* Every opcode that ran, most frequent first, then the most frequent pairs. */
+	void print(std::ostream& os, size_t top_pairs = 20) const {
+		uint64_t total = 0;
+		for(const uint64_t c : counts) total += c;
+		std::vector<uint8_t> ops;
+		for(size_t op = 0; op < OP_LENGTH; op++) if(counts[op]) ops.push_back(op);
+		std::stable_sort(ops.begin(), ops.end(), [&](uint8_t a, uint8_t b){ return counts[a] > counts[b]; });
+		os << "Instructions run: " << total << '\n';
+		os << std::left << std::setw(14) << "opcode" << std::right << std::setw(14) << "count"
+			<< std::setw(9) << "%" << std::setw(12) << "cycles" << '\n';
+		for(const uint8_t op : ops){
+			os << std::left << std::setw(14) << instr_to_str[op] << std::right << std::setw(14) << counts[op]
+				<< std::setw(9) << std::fixed << std::setprecision(2) << 100.0 * counts[op] / total << std::setw(12);
+			if(samples[op]) os << std::setprecision(1) << (double)cycles[op] / samples[op];
+			else os << '-';
+			os << '\n';
+		}
+		std::vector<size_t> pair_ids;
+		for(size_t i = 0; i < pairs.size(); i++) if(pairs[i]) pair_ids.push_back(i);
+		std::stable_sort(pair_ids.begin(), pair_ids.end(), [&](size_t a, size_t b){ return pairs[a] > pairs[b]; });
+		if(pair_ids.size() > top_pairs) pair_ids.resize(top_pairs);
+		os << "Most frequent pairs:\n";
+		for(const size_t i : pair_ids){
+			const std::string pair = std::string(instr_to_str[i / OP_LENGTH]) + " " + std::string(instr_to_str[i % OP_LENGTH]);
+			os << std::left << std::setw(28) << pair << std::right << std::setw(14) << pairs[i]
+				<< std::setw(9) << std::fixed << std::setprecision(2) << 100.0 * pairs[i] / total << '\n';
+		}
+		os << std::defaultfloat;
+	}
+};
+
+// }}}
+
+/* Runs Bytecode (see bytecode.hpp).
+ * Every call gets a frame of `frame_size` registers on the stack, starting at `bp`.
+ * Registers, constants and jumps are used without checking,
+ * the constructor verifies the code once instead (see verify).
+ * Globals live in `env`, like for the interpreter, so input, output and
+ * the builtin functions behave the same, and so do the errors.
+ * With enableJit(), functions run as machine code instead (see jit.hpp). */
+class VM {
+	using Value = EValue;
+
+	struct Frame {
+		size_t func;
+		size_t bp;
+		const int32_t *ret; /* where the caller continues */
+		int32_t reg; /* of the caller, for the result */
+		Env::Region::Mark mark;
+	};
+
+	static constexpr size_t STACK_START = 4096, FRAMES_START = 256;
+
+	Env& env;
+	const Bytecode& code;
+	const Value *const_pool;
+	const int32_t *instr;
+	/* The size of the array at every LOADE and STOREE, for code from a file (see verify) */
+	const std::vector<uint64_t> limits;
 	std::vector<Value> stack;
-	std::vector<int32_t> instr;
-private:
-	std::vector<int32_t>::const_iterator ip; /* Instruction pointer */
+	std::vector<Frame> frames;
+	std::vector<bool> defined; /* functions defined by DEFFUNC so far */
+	const int32_t *ip; /* Instruction pointer */
 	size_t bp = 0; /* Stack base pointer */
-	size_t sp = 0; /* Stack top pointer */
+	size_t sp = 0; /* Stack top pointer, the end of the frame */
+	Value *regs = nullptr; /* &stack[bp] */
 
-	inline Value& top() noexcept {
-		return stack[sp-1];
+	jit::Context jit_ctx;
+	jit::Code native;
+	std::exception_ptr jit_error; /* thrown in a helper called by the compiled code */
+	std::vector<Env::Region::Mark> jit_marks; /* of the compiled functions with local arrays */
+	size_t step_func = 0; /* the function of the instruction jitStep runs */
+#ifdef THREADED_CODE
+	/* Every word of `instr` as the address of its handler in exec<Stats>, made on its first run */
+	std::vector<const void*> threaded[2];
+#endif
+
+	inline const Value& atLoc(int32_t loc) const noexcept {
+		if(loc & TOPMOST_BIT32) return regs[loc ^ TOPMOST_BIT32];
+		return const_pool[loc];
 	}
 
-	inline Value& atLoc(int32_t loc){
-		int32_t b = loc & TOPMOST_BIT32;
-		loc ^= b;
-		if(b){
-			if(stack.size() <= sp+loc) throw VMRuntimeError("Location too large for stack");
-			return stack[sp+loc];
-		} else {
-			if(const_pool.size() <= (size_t)loc) throw VMRuntimeError("Location too large for const_pool");
-			return const_pool[loc];
+	/* Makes room for a frame of `size` registers, starting at `base`. */
+	void reserve(size_t base, size_t size){
+		if(stack.size() < base + size){
+			stack.resize(base + size);
+			regs = stack.data() + bp;
+			jit_ctx.stack = stack.data();
+			jit_ctx.stack_size = stack.size();
+		}
+	}
+	void enter(size_t f, size_t base){
+		const FuncInfo& func = code.funcs[f];
+		reserve(base, func.frame_size);
+		bp = base;
+		sp = bp + func.frame_size;
+		regs = stack.data() + bp;
+		ip = instr + func.entry;
+	}
+
+	/* Checks the element `offset` of the LOADE or STOREE being run is in its array, if it's from a file */
+	inline void checkOffset(uint64_t offset) const {
+		if(!limits.empty() && offset >= limits[ip - 1 - instr]){
+			throw RuntimeError("Out-of-bounds element " + std::to_string((int64_t)offset));
 		}
 	}
 
-	inline void push(Value val) noexcept {
-		if(sp == stack.size()) stack.emplace_back(val);
-		else stack[sp] = val;
-		++sp;
+	/* Puts `f` of the 2 `loc`s at `ip` in the register before them */
+	template<typename F>
+	inline void binary(F f){
+		regs[ip[0]] = f(atLoc(ip[1]), atLoc(ip[2]));
+		ip += 3;
 	}
 
+public:
+	VM(Env& env_, const Bytecode& code_) :
+		env(env_), code(code_), const_pool(code_.const_pool.data()), instr(code_.words()),
+		limits(verify(code_, env_.variables())), defined(code_.funcs.size(), false) {
+		// Calls only allocate when the recursion goes deeper than it has before.
+		stack.reserve(STACK_START);
+		frames.reserve(FRAMES_START);
+		jit_ctx.consts = const_pool;
+		jit_ctx.vm = this;
+	}
+
+	/* Compiles every function to machine code, which run() then uses (see jit.hpp). */
+	void enableJit(){
+		static const jit::Helpers helpers = { jitStep, jitCall, jitGrow, jitEnter, jitLeave };
+		jit::compile(code, helpers, native);
+	}
+
+	/* For code that runs alongside the tree-walker, which defines the functions (see tiers.hpp) */
+	inline void define(size_t f, bool is_defined) noexcept { defined[f] = is_defined; }
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
 	void run(){
-		ip = instr.begin();
-		while(ip < instr.end()){
-			const uint8_t 
-				t1 = *ip & (0xFF << 24),
-				t2 = *ip & (0xFF << 16),
-				t3 = *ip & (0xFF << 8),
-				ins = *ip & 0xFF;
-			++ip;
-			switch(ins){
-#define I_F_BINOP(op) do { \
-	push(atLoc(*ip)); \
-	++ip; \
-	const Value& v = atLoc(*ip); \
-	if(t1 == PT_REAL){ \
-		if(t2 == PT_REAL) top().frac op##= v.frac; \
-		else if(t2 == PT_INTEGER) top().frac op##= v.i64; \
-		else throw VMRuntimeError("Invalid math operator type"); \
-	} else if(t1 == PT_INTEGER){ \
-		if(t2 == PT_INTEGER) top().i64 op##= v.i64; \
-		else if(t2 == PT_REAL){ \
-			int64_t tmp = top().i64; \
-			top().frac = tmp; \
-			top().frac op##= v.frac; \
-		} \
-	} \
-	++ip; \
-} while(0);
-				case OP_ADD: I_F_BINOP(+); break;
-				case OP_SUB: I_F_BINOP(-); break;
-				case OP_MUL: I_F_BINOP(*); break;
-				case OP_DIV: I_F_BINOP(/); break;
-#undef I_F_BINOP
-				case OP_NOT:
-					push(!atLoc(*ip).b);
-					++ip;
-					break;
-				case OP_NEG:
-					if(t1 == PT_REAL) push(-atLoc(*ip).frac);
-					if(t1 == PT_INTEGER) push(-atLoc(*ip).i64);
-					++ip;
-					break;
-#define BOOL_BINOP(op) do { \
-	const Value& v1 = atLoc(*ip); \
-	++ip; \
-	const Value& v2 = atLoc(*ip); \
-	++ip; \
-	if(t1 == t2){ \
-		if(t1 == PT_INTEGER) push(v1.i64 == v2.i64); \
-		if(t1 == PT_STRING) push(*v1.str == *v2.str); \
-		if(t1 == PT_CHAR) push(*v1.str == *v2.str); \
+		start();
+		if(jitted(0)) callNative(0, 0);
+		else exec<false>(nullptr, 0);
+	}
+	/* Runs it, counting what the interpreter runs in `stats` */
+	void run(OpcodeStats& stats){
+		start();
+		exec<true>(&stats, 0);
+	}
+
+	/* Runs function `f` by itself with `args`, and returns what it returns. */
+	Value call(size_t f, const Value *args){
+		const FuncInfo& func = code.funcs[f];
+		bp = 0;
+		reserve(0, func.frame_size);
+		std::copy(args, args + func.params, stack.begin());
+		if(jitted(f)){
+			callNative(f, 0);
+		} else {
+			frames = { { f, 0, nullptr, 0, func.local_arrays ? env.region.mark() : Env::Region::Mark{} } };
+			enter(f, 0);
+			exec<false>(nullptr, 0);
+		}
+		return jit_ctx.ret;
+	}
+
+private:
+	void start(){
+		frames = { { 0, 0, instr + code.length(), 0, env.region.mark() } };
+		enter(0, 0);
+	}
+
+	// The compiled code {{{
+
+	inline bool jitted(size_t f) const noexcept { return f < native.funcs.size() && native.funcs[f] != nullptr; }
+	void callNative(size_t f, size_t base){
+		jit_ctx.depth++;
+		const int failed = native.funcs[f](&jit_ctx, base);
+		jit_ctx.depth--;
+		if(failed) std::rethrow_exception(jit_error);
+	}
+	/* Interprets a call of `f`, its frame at `base`, in the middle of whatever is running. */
+	void interpret(size_t f, size_t base){
+		const size_t old_bp = bp, old_sp = sp;
+		const int32_t *old_ip = ip;
+		frames.push_back({ f, bp, nullptr, 0, code.funcs[f].local_arrays ? env.region.mark() : Env::Region::Mark{} });
+		enter(f, base);
+		exec<false>(nullptr, frames.size() - 1);
+		bp = old_bp;
+		sp = old_sp;
+		ip = old_ip;
+		regs = stack.data() + bp;
+	}
+	/* The helpers of jit::Helpers. Exceptions can't go through the compiled code,
+	 * so they keep them in `jit_error` and return 1. */
+	template<typename F>
+	static int jitCatch(jit::Context *ctx, F f) noexcept {
+		VM& vm = *static_cast<VM *>(ctx->vm);
+		try {
+			f(vm);
+		} catch(...) {
+			vm.jit_error = std::current_exception();
+			return 1;
+		}
+		return 0;
+	}
+	static int jitStep(jit::Context *ctx, size_t base, const int32_t *at, size_t f){
+		return jitCatch(ctx, [&](VM& vm){
+			vm.regs = vm.stack.data() + base;
+			vm.ip = at;
+			vm.step_func = f;
+			vm.exec<false, true>(nullptr, 0);
+		});
+	}
+	static int jitCall(jit::Context *ctx, size_t f, size_t base){
+		return jitCatch(ctx, [&](VM& vm){ vm.interpret(f, base); });
+	}
+	static int jitGrow(jit::Context *ctx, size_t size){
+		return jitCatch(ctx, [&](VM& vm){ vm.reserve(0, size); });
+	}
+	static int jitEnter(jit::Context *ctx){
+		return jitCatch(ctx, [](VM& vm){ vm.jit_marks.push_back(vm.env.region.mark()); });
+	}
+	static void jitLeave(jit::Context *ctx){
+		VM& vm = *static_cast<VM *>(ctx->vm);
+		vm.env.region.release(vm.jit_marks.back());
+		vm.jit_marks.pop_back();
+	}
+
+	// }}}
+
+	/* Interprets until a RET leaves `stop` frames, or runs the one instruction at `ip` if `Single` */
+	template<bool Stats, bool Single = false>
+	void exec([[maybe_unused]] OpcodeStats *stats, size_t stop){
+/* Before dispatching the next instruction */
+#define RECORD if constexpr (Stats) stats->record(*ip & 0xFF)
+#ifdef COMPUTED_GOTO
+		// Every handler jumps straight to the next one, through the table of their addresses.
+		// It's only filled once, the compiled code runs single instructions here all the time.
+		static const void *labels[256];
+		static bool filled = false;
+		if(!filled){
+			std::fill(std::begin(labels), std::end(labels), &&L_INVALID);
+#define I(x) labels[OP_##x] = &&L_##x;
+			INSTRUCTIONS
+#undef I
+			filled = true;
+		}
+#ifdef THREADED_CODE
+		// Every word of `instr` translated to its handler beforehand, so there's nothing to decode.
+		[[maybe_unused]] const void **threaded = nullptr;
+		if constexpr (!Single){
+			std::vector<const void*>& table = this->threaded[Stats];
+			if(table.empty()){
+				table.resize(code.length());
+				for(size_t i = 0; i < table.size(); i++) table[i] = labels[instr[i] & 0xFF];
 			}
+			threaded = table.data();
 		}
+#define NEXT if constexpr (Single) return; RECORD; goto *threaded[ip++ - instr]
+#else
+#define NEXT if constexpr (Single) return; RECORD; goto *labels[*ip++ & 0xFF]
+#endif
+#define CASE(x) L_##x:
+#define INVALID_OP L_INVALID
+#define DISPATCH_START RECORD; goto *labels[*ip++ & 0xFF];
+#define DISPATCH_END
+#else
+#define NEXT break
+#define CASE(x) case OP_##x:
+#define INVALID_OP default
+#define DISPATCH_START for(;;){ RECORD; switch(*ip++ & 0xFF){
+#define DISPATCH_END } if constexpr (Single) return; }
+#endif
+/* The type byte of the instruction being run */
+#define T1 ((uint32_t)ip[-1] >> 24)
+		DISPATCH_START
+// The operands of every operator have a known type, so each of them is straight-line code.
+#define ARITH(name, op) \
+			CASE(name##_II) /* INTEGERs wrap around */ \
+				binary([](Value l, Value r){ return Value((int64_t)((uint64_t)l.i64 op (uint64_t)r.i64)); }); \
+				NEXT; \
+			CASE(name##_RR) \
+				binary([](Value l, Value r){ return Value(l.frac op##= r.frac); }); \
+				NEXT; \
+			CASE(name##_RI) \
+				binary([](Value l, Value r){ return Value(l.frac op##= r.i64); }); \
+				NEXT;
+			ARITH(ADD, +)
+			ARITH(SUB, -)
+			ARITH(MUL, *)
+#undef ARITH
+			CASE(DIV_RR)
+				binary([](Value l, Value r){ return Value(l.frac /= r.frac); });
+				NEXT;
+			CASE(IDIV_II)
+				binary([](Value l, Value r){
+					if(r.i64 == 0) throw RuntimeError("Cannot divide by zero");
+					return Value(r.i64 == -1 ? (int64_t)-(uint64_t)l.i64 : l.i64 / r.i64);
+				});
+				NEXT;
+			CASE(MOD_II)
+				binary([](Value l, Value r){
+					if(r.i64 == 0) throw RuntimeError("Cannot divide by zero");
+					return Value(r.i64 == -1 ? (int64_t)0 : l.i64 % r.i64);
+				});
+				NEXT;
+			CASE(NEG_I)
+				regs[ip[0]] = (int64_t)-(uint64_t)atLoc(ip[1]).i64;
+				ip += 2;
+				NEXT;
+			CASE(NEG_R)
+				{
+					Fraction<> f = atLoc(ip[1]).frac;
+					regs[ip[0]] = -f;
+					ip += 2;
+				}
+				NEXT;
+			CASE(ITOR)
+				regs[ip[0]] = Fraction<>(atLoc(ip[1]).i64);
+				ip += 2;
+				NEXT;
+#define COMPARISON(name, op) \
+			CASE(name##_II) binary([](Value l, Value r){ return Value(l.i64 op r.i64); }); NEXT; \
+			CASE(name##_RR) binary([](Value l, Value r){ return Value(l.frac op r.frac); }); NEXT; \
+			CASE(name##_RI) binary([](Value l, Value r){ return Value(l.frac op r.i64); }); NEXT; \
+			CASE(name##_CC) binary([](Value l, Value r){ return Value(l.c op r.c); }); NEXT; \
+			CASE(name##_BB) binary([](Value l, Value r){ return Value(l.b op r.b); }); NEXT; \
+			CASE(name##_SS) binary([](Value l, Value r){ return Value(l.str op r.str); }); NEXT;
+			COMPARISON(EQ, ==)
+			COMPARISON(GT, >)
+			COMPARISON(LT, <)
+			COMPARISON(GTEQ, >=)
+			COMPARISON(LTEQ, <=)
+			COMPARISON(NEQ, !=)
+#undef COMPARISON
+			CASE(EQ_DD)
+				// Date's operators aren't const
+				binary([](Value l, Value r){ return Value(l.date == r.date); });
+				NEXT;
+			CASE(AND)
+				binary([](Value l, Value r){ return Value(l.b && r.b); });
+				NEXT;
+			CASE(OR)
+				binary([](Value l, Value r){ return Value(l.b || r.b); });
+				NEXT;
+			CASE(NOT)
+				regs[ip[0]] = !atLoc(ip[1]).b;
+				ip += 2;
+				NEXT;
+			CASE(SELECT)
+				regs[ip[0]] = atLoc(ip[atLoc(ip[1]).b ? 2 : 3]);
+				ip += 4;
+				NEXT;
+			CASE(MOV)
+				regs[ip[0]] = atLoc(ip[1]);
+				ip += 2;
+				NEXT;
+			CASE(LOADG)
+				regs[ip[0]] = env.value(ip[1]);
+				ip += 2;
+				NEXT;
+			CASE(STOREG)
+				env.value(ip[0]) = atLoc(ip[1]);
+				ip += 2;
+				NEXT;
+			CASE(DECLAREG)
+				{
+					const bool has_value = T1;
+					env.initVar(ip[0], env.GLOBAL_LEVEL, code.types[ip[1]], has_value ? atLoc(ip[2]) : Value((int64_t)0));
+					ip += 2 + has_value;
+				}
+				NEXT;
+			CASE(LOADE)
+				checkOffset(atLoc(ip[2]).i64);
+				regs[ip[0]] = atLoc(ip[1]).arr[atLoc(ip[2]).i64];
+				ip += 3;
+				NEXT;
+			CASE(STOREE)
+				checkOffset(atLoc(ip[1]).i64);
+				atLoc(ip[0]).arr[atLoc(ip[1]).i64] = atLoc(ip[2]);
+				ip += 3;
+				NEXT;
+			CASE(CHECK)
+				{
+					const int64_t index = atLoc(ip[0]).i64;
+					const uint8_t t1 = T1;
+					if(((t1 & 1) && index < atLoc(ip[1]).i64) || ((t1 & 2) && index > atLoc(ip[2]).i64)){
+						throw RuntimeError("Out-of-bounds index " + std::to_string(index));
+					}
+					ip += 3;
+				}
+				NEXT;
+			CASE(NEWARR)
+				{
+					const size_t size = code.types[ip[1]].size();
+					Value *arr = new Value[size];
+					std::fill(arr, arr + size, Value((int64_t)0));
+					regs[ip[0]] = arr;
+					ip += 2;
+				}
+				NEXT;
+			CASE(COPYARR)
+				{
+					Value *target = atLoc(ip[0]).arr, *source = atLoc(ip[1]).arr;
+					if(target != source) std::copy(source, source + ip[2], target);
+					ip += 3;
+				}
+				NEXT;
+			CASE(COPYNEW)
+				{
+					const Value *source = atLoc(ip[1]).arr;
+					const size_t size = ip[2];
+					Value *arr = code.funcs[Single ? step_func : frames.back().func].local_arrays ? env.region.alloc(size) : new Value[size];
+					std::copy(source, source + size, arr);
+					regs[ip[0]] = arr;
+					ip += 3;
+				}
+				NEXT;
+			CASE(INPUT)
+				env.input(regs[ip[0]], code.types[ip[1]]);
+				ip += 2;
+				NEXT;
+			CASE(OUTPUT)
+				env.output(atLoc(ip[1]), code.types[ip[0]]);
+				ip += 2;
+				NEXT;
+			CASE(NEWLINE)
+				env.out << '\n';
+				NEXT;
+			CASE(CALL)
+				{
+					// The callee's frame starts where this one ends, the arguments go straight into it.
+					const size_t f = ip[1];
+					const FuncInfo& func = code.funcs[f];
+					reserve(sp, func.frame_size);
+					Value *callee = stack.data() + sp;
+					for(size_t i = 0; i < func.params; i++) callee[i] = atLoc(ip[2 + i]);
+					if(jitted(f) && jit_ctx.depth < jit::MAX_DEPTH){
+						const int32_t *next = ip + 2 + func.params;
+						const int32_t reg = ip[0];
+						callNative(f, sp);
+						regs = stack.data() + bp;
+						ip = next;
+						if(func.returns) regs[reg] = jit_ctx.ret;
+						NEXT;
+					}
+					// Only a function whose arrays are freed on return needs to know where they started.
+					frames.push_back({ f, bp, ip + 2 + func.params, ip[0], func.local_arrays ? env.region.mark() : Env::Region::Mark{} });
+					bp = sp;
+					sp += func.frame_size;
+					regs = callee;
+					ip = instr + func.entry;
+				}
+				NEXT;
+			CASE(CALLB)
+				{
+					const auto builtin = code.builtins[ip[1]];
+					const size_t n = ip[2];
+					Value args[MAX_BUILTIN_ARGS];
+					for(size_t i = 0; i < n; i++) args[i] = atLoc(ip[3 + i]);
+					regs[ip[0]] = builtin(args);
+					ip += 3 + n;
+				}
+				NEXT;
+			CASE(CHECKDEF)
+				if(!defined[*ip]) throw RuntimeError("Cannot call non-function");
+				++ip;
+				NEXT;
+			CASE(DEFFUNC)
+				defined[*ip] = true;
+				++ip;
+				NEXT;
+			CASE(DEFINED)
+				regs[ip[0]] = (bool)defined[ip[1]];
+				ip += 2;
+				NEXT;
+			CASE(HIDEG)
+				env.hideGlobal(*ip);
+				++ip;
+				NEXT;
+			CASE(UNHIDEG)
+				env.unhideGlobal(*ip);
+				++ip;
+				NEXT;
+			CASE(RET)
+				{
+					const bool returns = T1;
+					const Value res = returns ? atLoc(*ip) : Value();
+					const Frame frame = frames.back();
+					frames.pop_back();
+					// Nothing points to the parameters anymore, see the escape analysis in optimizer.hpp.
+					if(code.funcs[frame.func].local_arrays) env.region.release(frame.mark);
+					if(frames.size() == stop){
+						jit_ctx.ret = res;
+						return;
+					}
+					sp = bp;
+					bp = frame.bp;
+					regs = stack.data() + bp;
+					ip = frame.ret;
+					if(returns) regs[frame.reg] = res;
+				}
+				NEXT;
+			CASE(JMP)
+				ip = instr + *ip;
+				NEXT;
+			CASE(CJMP)
+				if(atLoc(ip[0]).b) ip = instr + ip[1];
+				else ip += 2;
+				NEXT;
+			CASE(THROW)
+				if(ip[0] == 0) throw TypeError(code.messages[ip[1]]);
+				throw RuntimeError(code.messages[ip[1]]);
+#define COMPARE_JUMP(name, op) \
+			CASE(J##name##_II) \
+				if(atLoc(ip[0]).i64 op atLoc(ip[1]).i64) ip = instr + ip[2]; \
+				else ip += 3; \
+				NEXT;
+			COMPARE_JUMP(EQ, ==)
+			COMPARE_JUMP(GT, >)
+			COMPARE_JUMP(LT, <)
+			COMPARE_JUMP(GTEQ, >=)
+			COMPARE_JUMP(LTEQ, <=)
+			COMPARE_JUMP(NEQ, !=)
+#undef COMPARE_JUMP
+			CASE(FOR_STEP_II)
+				regs[ip[0]] = (int64_t)((uint64_t)atLoc(ip[1]).i64 + (uint64_t)atLoc(ip[2]).i64);
+				if(regs[ip[0]].i64 <= atLoc(ip[3]).i64) ip = instr + ip[4];
+				else ip += 5;
+				NEXT;
+			CASE(MOV_JMP)
+				regs[ip[0]] = atLoc(ip[1]);
+				ip = instr + ip[2];
+				NEXT;
+			CASE(LOADE_IDX)
+				checkOffset((uint64_t)atLoc(ip[2]).i64 - (uint64_t)atLoc(ip[3]).i64);
+				regs[ip[0]] = atLoc(ip[1]).arr[(uint64_t)atLoc(ip[2]).i64 - (uint64_t)atLoc(ip[3]).i64];
+				ip += 4;
+				NEXT;
+			CASE(STOREE_IDX)
+				checkOffset((uint64_t)atLoc(ip[1]).i64 - (uint64_t)atLoc(ip[2]).i64);
+				atLoc(ip[0]).arr[(uint64_t)atLoc(ip[1]).i64 - (uint64_t)atLoc(ip[2]).i64] = atLoc(ip[3]);
+				ip += 4;
+				NEXT;
+			INVALID_OP:
+				throw VMRuntimeError("Invalid instruction " + std::to_string(ip[-1] & 0xFF));
+		DISPATCH_END
+#undef NEXT
+#undef CASE
+#undef INVALID_OP
+#undef T1
+#undef DISPATCH_START
+#undef DISPATCH_END
+#undef RECORD
 	}
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
 
 };
 
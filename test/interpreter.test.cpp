@@ -2,13 +2,77 @@
 #include <filesystem>
 #define TESTS
 #include "../src/interpreter.hpp"
+#include "../src/optimizer.hpp"
+#include "../src/lowering.hpp"
+#include "../src/irpasses.hpp"
+#include "../src/irexec.hpp"
+#include "../src/closures.hpp"
+#include "../src/cgen.hpp"
+#include "../src/compiler.hpp"
+#include "../src/peephole.hpp"
+#include "../src/vm.hpp"
+#include "../src/tiers.hpp"
+#include "../src/stack.hpp"
 
 namespace fs = std::filesystem;
 
+/* Heap allocations, counted while `counting` is set */
+static bool counting = false;
+static size_t allocations = 0;
+
+void *operator new(size_t size){
+	if(counting) allocations++;
+	if(void *res = std::malloc(size ? size : 1)) return res;
+	throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
 bool endsWith(const std::string& name, const std::string_view ext){
 	return name.size() >= ext.size() && name.compare(name.size()-ext.size(), ext.size(), ext) == 0;
 }
 
+enum class Engine { TREE, IR, CLOSURE, VM, JIT, TIERED };
+
+/* Runs the program with the IR engine, the closures or the VM, like `--engine=ir --verify-ir` does
+ * but without falling back to the tree-walker,
+ * compiling the bytecode to machine code too for Engine::JIT. */
+void runIR(const Program& prog, Env& env, bool optimized, Engine engine){
+	ir::Module mod;
+	try {
+		mod = ir::lower(prog, env);
+	} catch(ir::Unsupported& e){
+		// Every program in the corpus runs natively, no falling back to the tree-walker
+		FAIL("Cannot compile to IR (" << e.what() << ")");
+	}
+	ir::verify(mod);
+	if(optimized){
+		ir::PassManager passes;
+		passes.verify_each = true;
+		passes.run(mod);
+	}
+	if(engine == Engine::IR){
+		ir::Machine(env, mod).run();
+	} else if(engine == Engine::CLOSURE){
+		closures::Machine(env, mod).run();
+	} else {
+		Bytecode code = compile(mod);
+		if(optimized) peephole(code);
+		VM vm(env, code);
+		if(engine == Engine::JIT) vm.enableJit();
+		vm.run();
+	}
+}
+
+/* Runs the program with the tree-walker, moving every loop to the VM at its first back-edge
+ * and every function at its second call, so the switches happen everywhere they can. */
+void runTiered(const Program& prog, Env& env, bool optimized){
+	VMTiers tiers(prog, optimized, true, false, 2, 1);
+	env.tiers = &tiers;
+	prog.eval(env);
+	env.tiers = nullptr;
+}
+
 std::string readFile(const std::string& filepath){
 	INFO("Filepath is " << filepath);
 	std::ifstream in(filepath.c_str(), std::ios::in);
@@ -31,12 +95,19 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 		INFO("File is " << name);
 		if(!endsWith(name, ".in.pcse")) continue; /* we don't want to look at this file */
 		
+		for(const Engine engine : { Engine::TREE, Engine::IR, Engine::CLOSURE, Engine::VM, Engine::JIT, Engine::TIERED }){
+		for(const bool optimized : { false, true }){
+		INFO("Optimized: " << optimized << ", engine: " << static_cast<int>(engine));
 		std::ifstream in(file.path().c_str(), std::ios::in);
 		/* Lexer::Lexer uses a std::string_view, so we have to destroy it _before_ contents */
 		{
 
 			Lexer lex(in);
 			Parser parser(lex.output);
+			if(optimized){
+				optimize(*parser.output);
+				IdiomPass(*parser.output).run();
+			}
 			Env env(lex.identifier_count, lex.id_num);
 			std::string inpname = file.path().c_str();
 			// ".in.pcse" => ".in"
@@ -56,7 +127,9 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 			} catch(std::runtime_error& e){
 				// no input
 			}
-			parser.run(env);
+			if(engine == Engine::TIERED) runTiered(*parser.output, env, optimized);
+			else if(engine != Engine::TREE) runIR(*parser.output, env, optimized, engine);
+			else parser.run(env);
 
 			std::string outname = file.path().c_str();
 			
@@ -74,12 +147,16 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 			const std::string correct = readFile(outname);
 			REQUIRE(env.out.str() == correct);
 		}
+		}
+		}
 	}
 	for(const auto& file : fs::directory_iterator("test/invalid-files")){
 		const std::string name = file.path().filename().string();
 		INFO("File is " << name);
 		if(!endsWith(name, ".in.pcse")) continue; /* we don't want to look at this file */
 
+		for(const Engine engine : { Engine::TREE, Engine::IR, Engine::CLOSURE, Engine::VM, Engine::JIT, Engine::TIERED }){
+		INFO("Engine: " << static_cast<int>(engine));
 		std::ifstream in(file.path().c_str(), std::ios::in);
 		/* Lexer::Lexer uses a std::string_view, so we have to destroy it _before_ contents */
 		{
@@ -102,9 +179,147 @@ TEST_CASE("INTERPRETING", "[interpreter]"){
 				Lexer lex(in);
 				Parser parser(lex.output);
 				Env env(lex.identifier_count, lex.id_num);
-				parser.run(env);
+				if(engine == Engine::TIERED) runTiered(*parser.output, env, true);
+				else if(engine != Engine::TREE) runIR(*parser.output, env, true, engine);
+				else parser.run(env);
 			} CATCH(LexError) CATCH(ParseError) CATCH(TypeError) CATCH(RuntimeError);
 			REQUIRE(errmsg == correct);
 		}
+		}
+	}
+}
+
+/* Compiles every program of the corpus the IR supports to C and runs it,
+ * which has to print what the interpreter does, errors included. */
+TEST_CASE("Compiling to C", "[interpreter]"){
+	const fs::path dir = fs::temp_directory_path() / "pcse-cgen-test";
+	fs::create_directories(dir);
+	const std::string exe = (dir / "prog").string(), out = (dir / "out").string(), err = (dir / "err").string();
+	std::set<std::string> skipped;
+	for(const char *corpus : { "test/valid-files", "test/invalid-files" }){
+		const bool valid = corpus == std::string("test/valid-files");
+		for(const auto& file : fs::directory_iterator(corpus)){
+			const std::string name = file.path().string();
+			if(!endsWith(name, ".in.pcse")) continue;
+			INFO("File is " << name);
+			const std::string base = name.substr(0, name.size() - strlen(".in.pcse"));
+			std::ostringstream source;
+			try {
+				std::ifstream in(name);
+				Lexer lex(in);
+				Parser parser(lex.output);
+				optimize(*parser.output);
+				Env env(lex.identifier_count, lex.id_num);
+				ir::Module mod = ir::lower(*parser.output, env);
+				ir::PassManager().run(mod);
+				cgen::emit(source, mod);
+			} catch(std::runtime_error& e){
+				// An error found before running
+				skipped.insert(file.path().filename().string());
+				continue;
+			}
+			cgen::build(source.str(), exe, "-std=c11 -O0 -Wall -Wextra -Werror");
+			const std::string input = fs::exists(base + ".in") ? base + ".in" : "/dev/null";
+			const int status = std::system((exe + " < " + input + " > " + out + " 2> " + err).c_str());
+			if(valid){
+				REQUIRE(status == 0);
+				REQUIRE(readFile(out) == readFile(base + ".out"));
+			} else {
+				REQUIRE(status != 0);
+				REQUIRE(readFile(err) == readFile(base + ".err"));
+			}
+		}
 	}
+	fs::remove_all(dir);
+	REQUIRE(skipped == std::set<std::string>{ "proc_return.in.pcse" });
+}
+
+TEST_CASE("Running on a heap stack", "[interpreter]"){
+	std::istringstream inp(
+		"FUNCTION f(n : INTEGER) RETURNS INTEGER\nIF n = 0 THEN\nRETURN 0\nENDIF\nRETURN g(n - 1) + 1\nENDFUNCTION\n"
+		"FUNCTION g(n : INTEGER) RETURNS INTEGER\nRETURN f(n)\nENDFUNCTION\n"
+		"DECLARE n : INTEGER\nINPUT n\nOUTPUT f(n)\n");
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	const auto run = [&](const std::string& input){
+		Env env(lex.identifier_count, lex.id_num);
+		env.in = std::istringstream(input);
+		HeapStack(HeapStack::MIN_SIZE * 4).run(env, [&](){ parser.run(env); }, lex.id_num);
+		REQUIRE(env.stack_low == 0);
+		return env.out.str();
+	};
+	REQUIRE(run("1000") == "1000\n");
+	// Never ends, and would take the native stack with it
+	// (which of the two it ran out in depends on how big their frames are)
+	REQUIRE_THROWS_WITH(run("-1"), Catch::Matchers::StartsWith("Ran out of stack (8 MiB) after")
+		&& Catch::Matchers::Contains(" nested calls: f -> g -> f -> g -> ... ")
+		&& (Catch::Matchers::EndsWith(" more ... -> f -> g -> f -> g") || Catch::Matchers::EndsWith(" more ... -> g -> f -> g -> f")));
+	// Other errors come out as they are.
+	REQUIRE_THROWS_WITH(run("x"), "User did not input INTEGER correctly");
+	REQUIRE_THROWS_AS(HeapStack(HeapStack::MIN_SIZE - 1), RuntimeError);
+}
+
+TEST_CASE("Calls don't allocate", "[interpreter]"){
+	// Scalar and array parameters, a builtin, a procedure, a parameter hiding a global,
+	// a FOR in the function and recursion
+	std::istringstream inp(
+		"DECLARE x : INTEGER\nDECLARE A : ARRAY[1:3] OF INTEGER\nDECLARE n : INTEGER\nDECLARE s : INTEGER\n"
+		"FUNCTION sum(x : INTEGER, A : ARRAY[1:3] OF INTEGER) RETURNS INTEGER\n"
+		"FOR i <- 1 TO 3\nx <- x + A[i]\nNEXT\nRETURN x\nENDFUNCTION\n"
+		"FUNCTION fib(k : INTEGER) RETURNS INTEGER\nIF k < 2 THEN\nRETURN k\nENDIF\nRETURN fib(k - 1) + fib(k - 2)\nENDFUNCTION\n"
+		"PROCEDURE p(r : REAL)\nx <- x + INT(r)\nENDPROCEDURE\n"
+		"INPUT n\nx <- 0\ns <- 0\nA[2] <- 5\n"
+		"FOR j <- 1 TO n\ns <- s + sum(j, A) + fib(5)\nCALL p(1.5)\nNEXT\n"
+		"OUTPUT s, x\n");
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	optimize(*parser.output);
+	const auto run = [&](int n){
+		Env env(lex.identifier_count, lex.id_num);
+		env.in = std::istringstream(std::to_string(n));
+		allocations = 0;
+		counting = true;
+		parser.run(env);
+		counting = false;
+		REQUIRE(env.out.str() == std::to_string(n * (n + 1) / 2 + n * 10) + std::to_string(n) + "\n");
+		return allocations;
+	};
+	// The first run fills in the caches in the tree.
+	run(1);
+	const size_t few = run(10);
+	REQUIRE(run(1000) == few);
+}
+
+TEST_CASE("Specialization", "[interpreter]"){
+	std::istringstream inp("OUTPUT x * 2 + 1 > A[n]");
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	const Expr& e = parser.output->stmts[0].exprs[0];
+	const BinExpr<2>& cmp = e.left.left;
+	const BinExpr<3>& sum = cmp.left;
+	const BinExpr<4>& prod = sum.left;
+	const LValue& elem = cmp.opt.right->left.left.left.main.primary->main().lvalue;
+	const auto run = [&](const EType& xtype, EValue x, const EType& ntype){
+		Env env(lex.identifier_count, lex.id_num);
+		env.initVar(lex.id_num.at("x"), env.GLOBAL_LEVEL, xtype, x);
+		env.initVar(lex.id_num.at("n"), env.GLOBAL_LEVEL, ntype, (int64_t)1);
+		env.initVar(lex.id_num.at("A"), env.GLOBAL_LEVEL, EType(true, {{1, 3}}, Primitive::INTEGER), (int64_t)0);
+		env.value(lex.id_num.at("A")).arr[0] = (int64_t)4;
+		parser.run(env);
+		return env.out.str();
+	};
+	REQUIRE(prod.spec == Spec::UNINIT);
+	REQUIRE(run(Primitive::INTEGER, (int64_t)2, Primitive::INTEGER) == "TRUE\n");
+	REQUIRE(prod.spec == Spec::INT_INT);
+	REQUIRE(sum.spec == Spec::INT_INT);
+	REQUIRE(cmp.spec == Spec::INT_INT);
+	REQUIRE(elem.spec == Spec::INT);
+	// 3/2 * 2 + 1 is not more than 4
+	REQUIRE(run(Primitive::REAL, Fraction<>(3, 2), Primitive::INTEGER) == "FALSE\n");
+	REQUIRE(prod.spec == Spec::GENERIC);
+	REQUIRE(sum.spec == Spec::GENERIC);
+	REQUIRE(cmp.spec == Spec::GENERIC);
+	REQUIRE(elem.spec == Spec::INT);
+	REQUIRE_THROWS_AS(run(Primitive::INTEGER, (int64_t)2, Primitive::REAL), TypeError);
+	REQUIRE(elem.spec == Spec::GENERIC);
 }
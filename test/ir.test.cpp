@@ -0,0 +1,141 @@
+#include <catch2/catch.hpp>
+#define TESTS
+#include "../src/lowering.hpp"
+#include "../src/irpasses.hpp"
+
+/* Lowers `code`, runs `pipeline` over it and checks the result. */
+struct Lowered {
+	std::istringstream inp;
+	Lexer lex;
+	Parser parser;
+	Env env;
+	ir::Module mod;
+	Lowered(const std::string& code, const std::vector<std::string>& pipeline = ir::PassManager::default_pipeline) :
+		inp(code), lex(inp), parser(lex.output), env(lex.identifier_count, lex.id_num) {
+		mod = ir::lower(*parser.output, env);
+		ir::verify(mod);
+		ir::PassManager passes;
+		passes.pipeline = pipeline;
+		passes.verify_each = true;
+		passes.run(mod);
+	}
+	/* Instructions with opcode `op` left in function `f` */
+	size_t count(ir::Op op, size_t f = 0) const {
+		const ir::Function& func = mod.funcs[f];
+		size_t res = 0;
+		for(const ir::Block& blk : func.blocks){
+			for(const ir::ValueId id : blk.insts) res += func.insts[id].op == op;
+		}
+		return res;
+	}
+};
+
+TEST_CASE("Verifier", "[ir]"){
+	using namespace ir;
+	const auto entry = [](){
+		Function f;
+		f.name = "test";
+		f.newBlock();
+		return f;
+	};
+	{
+		// no terminator
+		Function f = entry();
+		f.append(0, Inst(Op::CONST, Primitive::INTEGER));
+		REQUIRE_THROWS_AS(verify(f), IRError);
+		f.append(0, Inst(Op::RET, Primitive::INVALID));
+		REQUIRE_NOTHROW(verify(f));
+	}
+	{
+		// a value used before it is defined
+		Function f = entry();
+		const ValueId a = f.add(Inst(Op::CONST, Primitive::INTEGER));
+		f.append(0, Inst(Op::NEGI, Primitive::INTEGER, { a }));
+		f.blocks[0].insts.push_back(a);
+		f.insts[a].block = 0;
+		f.append(0, Inst(Op::RET, Primitive::INVALID));
+		REQUIRE_THROWS_AS(verify(f), IRError);
+	}
+	{
+		// operand types
+		Function f = entry();
+		const ValueId a = f.append(0, Inst(Op::CONST, Primitive::REAL));
+		f.append(0, Inst(Op::ADDI, Primitive::INTEGER, { a, a }));
+		f.append(0, Inst(Op::RET, Primitive::INVALID));
+		REQUIRE_THROWS_AS(verify(f), IRError);
+	}
+	{
+		// a PHI needs a value for every predecessor, and a branch has to be listed as one
+		Function f = entry();
+		const BlockId b = f.newBlock();
+		Inst br(Op::BR, Primitive::INVALID);
+		br.targets[0] = b;
+		const ValueId a = f.append(0, Inst(Op::CONST, Primitive::INTEGER));
+		f.append(0, std::move(br));
+		f.prependPhi(b, Primitive::INTEGER);
+		f.append(b, Inst(Op::RET, Primitive::INVALID));
+		REQUIRE_THROWS_AS(verify(f), IRError);
+		f.blocks[b].preds.push_back(0);
+		REQUIRE_THROWS_AS(verify(f), IRError);
+		f.insts[f.blocks[b].insts[0]].args.push_back(a);
+		REQUIRE_NOTHROW(verify(f));
+	}
+}
+
+TEST_CASE("Constant propagation", "[ir]"){
+	{
+		Lowered l("DECLARE x : INTEGER\nx <- 2 * 3 + 1\nIF x > 5 THEN x <- x + 1 ELSE OUTPUT \"no\" ENDIF\nOUTPUT x * 2");
+		// everything is known, only the OUTPUT of 16 is left
+		REQUIRE(l.count(ir::Op::MULI) == 0);
+		REQUIRE(l.count(ir::Op::ADDI) == 0);
+		REQUIRE(l.count(ir::Op::CBR) == 0);
+		REQUIRE(l.count(ir::Op::OUTPUT) == 1);
+		const ir::Function& f = l.mod.funcs[0];
+		for(const ir::ValueId id : f.blocks[0].insts){
+			if(f.insts[id].op != ir::Op::OUTPUT) continue;
+			const ir::Inst& val = f.insts[f.insts[id].args[0]];
+			REQUIRE(val.op == ir::Op::CONST);
+			REQUIRE(val.imm.i64 == 16);
+		}
+	}
+	{
+		// dividing by zero is left for when it runs
+		Lowered l("OUTPUT 1 DIV 0");
+		REQUIRE(l.count(ir::Op::DIVI) == 1);
+	}
+}
+
+TEST_CASE("Global value numbering", "[ir]"){
+	{
+		Lowered l("DECLARE a : INTEGER\nDECLARE b : INTEGER\nINPUT a\nINPUT b\nOUTPUT a * b + b * a, a * b");
+		REQUIRE(l.count(ir::Op::MULI) == 1);
+	}
+	{
+		// a global may be changed by the call in between
+		Lowered l("DECLARE g : INTEGER\nPROCEDURE p\ng <- g + 1\nENDPROCEDURE\ng <- 1\nOUTPUT g * 2\nCALL p\nOUTPUT g * 2");
+		REQUIRE(l.count(ir::Op::MULI) == 2);
+	}
+}
+
+TEST_CASE("Bounds checks", "[ir]"){
+	{
+		Lowered l("DECLARE A : ARRAY[1:10] OF INTEGER\nFOR i <- 1 TO 10 A[i] <- i NEXT\nFOR i <- 2 TO 10 A[i] <- A[i - 1] NEXT");
+		REQUIRE(l.count(ir::Op::CHECK) == 0);
+	}
+	{
+		// 11 is out of bounds, but only the upper bound needs checking
+		Lowered l("DECLARE A : ARRAY[1:10] OF INTEGER\nFOR i <- 1 TO 11 A[i] <- i NEXT");
+		REQUIRE(l.count(ir::Op::CHECK) == 1);
+		const ir::Function& f = l.mod.funcs[0];
+		for(const ir::Block& blk : f.blocks){
+			for(const ir::ValueId id : blk.insts){
+				if(f.insts[id].op == ir::Op::CHECK) REQUIRE(f.insts[id].imm.i64 == 2);
+			}
+		}
+	}
+	{
+		// the loop bounds aren't known
+		Lowered l("DECLARE A : ARRAY[1:10] OF INTEGER\nDECLARE n : INTEGER\nINPUT n\nFOR i <- 1 TO n A[i] <- i NEXT");
+		REQUIRE(l.count(ir::Op::CHECK) == 1);
+	}
+}
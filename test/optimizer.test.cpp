@@ -0,0 +1,200 @@
+#include <catch2/catch.hpp>
+#define TESTS
+#include "../src/interpreter.hpp"
+#include "../src/optimizer.hpp"
+
+TEST_CASE("Common subexpressions", "[optimizer]"){
+	{
+		std::istringstream inp("A[i+1] <- A[i+1] + A[i]");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		Program& p = *parser.output;
+		optimize(p);
+		const Stmt<true>& stmt = p.stmts[0];
+		// the target is the element already located on the right hand side
+		REQUIRE(stmt.lvalues[0].cse.isUse());
+		// ...and so is its index
+		REQUIRE(p.cse_slots.size() == 1);
+	}
+
+	{
+		std::istringstream inp("OUTPUT x * 2 + f(1) + x * 2");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		optimize(*parser.output);
+		// the call may change x
+		REQUIRE(parser.output->cse_slots.empty());
+	}
+
+	{
+		std::istringstream inp("y <- x * 2\nx <- 3\nOUTPUT x * 2\nOUTPUT x * 2");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		Program& p = *parser.output;
+		optimize(p);
+		REQUIRE(p.cse_slots.size() == 1);
+		REQUIRE(p.stmts[0].exprs[0].left.left.left.left.cse.slot == nullptr);
+		REQUIRE(p.stmts[2].exprs[0].left.left.left.left.cse.def);
+	}
+}
+
+TEST_CASE("Induction variables", "[optimizer]"){
+	{
+		std::istringstream inp("FOR i <- 1 TO 3 FOR j <- 1 TO 3 M[i][j] <- M[k][j] + A[i] NEXT NEXT");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		Program& p = *parser.output;
+		optimize(p);
+		const Stmt<true>& outer = p.stmts[0];
+		const Stmt<false>& inner = outer.blocks[0].stmts[0];
+		// M[i][j] and M[k][j] belong to the inner loop, A[i] to the outer one
+		REQUIRE(inner.inductions.size() == 2);
+		REQUIRE(outer.inductions.size() == 1);
+		REQUIRE(outer.inductions[0].by_loopvar == std::vector<bool>{ true });
+	}
+
+	{
+		std::istringstream inp(
+			"PROCEDURE p\nENDPROCEDURE\n"
+			"FOR i <- 1 TO 3 A[i] <- 1 CALL p NEXT\n"
+			"FOR i <- 1 TO 3 A[i] <- 1 A <- B NEXT\n"
+			"FOR i <- 1 TO 3 A[i] <- 1 i <- 2 NEXT\n"
+			"FOR i <- 1 TO 3 A[i] <- INT(1.5) NEXT");
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		Program& p = *parser.output;
+		optimize(p);
+		REQUIRE(p.stmts[1].inductions.empty());
+		REQUIRE(p.stmts[2].inductions.empty());
+		REQUIRE(p.stmts[3].inductions.empty());
+		// builtins can't move arrays around
+		REQUIRE(p.stmts[4].inductions.size() == 1);
+	}
+}
+
+TEST_CASE("Escaping array parameters", "[optimizer]"){
+	std::istringstream inp(
+		"FUNCTION f(x: ARRAY[1:2] OF INTEGER) RETURNS INTEGER\nRETURN x[1]\nENDFUNCTION\n"
+		"FUNCTION g(x: ARRAY[1:2] OF INTEGER) RETURNS ARRAY[1:2] OF INTEGER\n"
+		"IF x[1] = 0 THEN\nRETURN (x)\nENDIF\nRETURN A\nENDFUNCTION\n"
+		"FUNCTION h(x: ARRAY[1:2] OF INTEGER) RETURNS ARRAY[1:2] OF INTEGER\nRETURN g(x)\nENDFUNCTION\n"
+	);
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	Program& p = *parser.output;
+	optimize(p);
+	REQUIRE(p.stmts[0].local_arrays);
+	// g may return its own copy of x
+	REQUIRE(!p.stmts[1].local_arrays);
+	// g gets a copy of h's x, so h's can go
+	REQUIRE(p.stmts[2].local_arrays);
+}
+
+TEST_CASE("Idioms", "[optimizer]"){
+	std::istringstream inp(
+		"FOR i <- 1 TO n s <- A[i] + s NEXT\n"
+		"FOR i <- 1 TO n IF A[i] <> k THEN c <- 1 + c ENDIF NEXT\n"
+		"FOR i <- 1 TO n IF m <= A[i] THEN m <- A[i] ENDIF NEXT\n"
+		"FOR i <- 1 TO n STEP 2 s <- s + A[i] NEXT\n"
+		"FOR i <- 1 TO n IF A[i] = k THEN k <- i ENDIF NEXT\n"
+		"FOR i <- 1 TO n s <- s + A[i + 1] NEXT\n"
+		"FOR j <- 1 TO n IF A[j + 1] < A[j] THEN t <- A[j + 1] A[j + 1] <- A[j] A[j] <- t ENDIF NEXT\n"
+		"FOR j <- 1 TO n IF A[j] > A[j + 1] THEN t <- A[j] A[j] <- A[j + 1] A[j] <- t ENDIF NEXT\n");
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	Program& p = *parser.output;
+	optimize(p);
+	IdiomPass pass(p);
+	pass.run();
+	REQUIRE(p.stmts[0].idiom->kind == Idiom::Kind::SUM);
+	REQUIRE(p.stmts[1].idiom->kind == Idiom::Kind::COUNT);
+	REQUIRE(p.stmts[1].idiom->cmp == TokenType::LT_GT);
+	// the comparison is turned around to have A[i] on the left
+	REQUIRE(p.stmts[2].idiom->kind == Idiom::Kind::REPLACE);
+	REQUIRE(p.stmts[2].idiom->cmp == TokenType::GT_EQ);
+	REQUIRE(!p.stmts[3].idiom);
+	// k changes while the loop runs
+	REQUIRE(!p.stmts[4].idiom);
+	REQUIRE(!p.stmts[5].idiom);
+	REQUIRE(p.stmts[6].idiom->kind == Idiom::Kind::BUBBLE);
+	REQUIRE(p.stmts[6].idiom->cmp == TokenType::GT);
+	REQUIRE(p.stmts[6].idiom->value == TokenType::RIGHT_SQ);
+	// not a swap
+	REQUIRE(!p.stmts[7].idiom);
+	REQUIRE(pass.found.size() == 4);
+	// Nothing is declared, so it depends on the types when they run.
+	REQUIRE(pass.found[0].fit == IdiomPass::Fit::MAYBE);
+}
+
+TEST_CASE("Idioms with declared types", "[optimizer]"){
+	std::istringstream inp(
+		"DECLARE A : ARRAY[1:3] OF INTEGER\nDECLARE B : ARRAY[1:3] OF REAL\n"
+		"DECLARE s : INTEGER\nDECLARE r : REAL\nDECLARE f : BOOLEAN\nDECLARE t : REAL\n"
+		"FOR i <- 1 TO 3 s <- s + A[i] NEXT\n"
+		"FOR i <- 1 TO 3 r <- r + A[i] NEXT\n"
+		"FOR i <- 1 TO 3 s <- s + B[i] NEXT\n"
+		"FOR i <- 1 TO 3 IF A[i] = 2 THEN f <- TRUE ENDIF NEXT\n"
+		"FOR i <- 1 TO 3 IF A[i] = 2 THEN s <- TRUE ENDIF NEXT\n"
+		"PROCEDURE p(t : INTEGER)\nFOR i <- 1 TO 3 t <- t + A[i] NEXT\nENDPROCEDURE\n");
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	IdiomPass pass(*parser.output);
+	pass.run();
+	REQUIRE(pass.found.size() == 6);
+	REQUIRE(pass.found[0].fit == IdiomPass::Fit::YES);
+	// Idiom::run only takes INTEGER arrays and variables
+	REQUIRE(pass.found[1].fit == IdiomPass::Fit::NO);
+	REQUIRE(pass.found[2].fit == IdiomPass::Fit::NO);
+	REQUIRE(pass.found[3].fit == IdiomPass::Fit::YES);
+	REQUIRE(pass.found[4].fit == IdiomPass::Fit::NO);
+	// t is p's INTEGER, not the global REAL
+	REQUIRE(pass.found[5].fit == IdiomPass::Fit::YES);
+}
+
+TEST_CASE("Profiles", "[optimizer]"){
+	const std::string src =
+		"DECLARE x : INTEGER\nDECLARE m : INTEGER\nDECLARE c : CHAR\nc <- 'a'\n"
+		"FOR i <- 1 TO 5\n"
+		"m <- i MOD 3 - 1\n"
+		"CASE OF m\n-1 : x <- 0\n1 : x <- 1\n2 : x <- 2\n"
+		"OTHERWISE CASE OF c\n'a' : x <- 4\n'a' : x <- 5\nENDCASE\nENDCASE\n"
+		"CASE OF i\n5 : m <- 0\n(i) : x <- x\nENDCASE\n"
+		"NEXT\n"
+		"OUTPUT x\n";
+	std::stringstream saved;
+	{
+		std::istringstream inp(src);
+		Lexer lex(inp);
+		Parser parser(lex.output);
+		Profile profile(*parser.output);
+		profile.record(*parser.output);
+		Env env(lex.identifier_count, lex.id_num);
+		parser.run(env);
+		profile.write(saved);
+		REQUIRE(profile.entries[0].counts == std::vector<uint64_t>{ 1, 5 });
+		REQUIRE(profile.entries[1].counts == std::vector<uint64_t>{ 1, 2, 0, 2 });
+		REQUIRE(profile.entries[2].counts == std::vector<uint64_t>{ 2, 0, 0 });
+		REQUIRE(profile.entries[3].counts == std::vector<uint64_t>{ 1, 4, 0 });
+	}
+	std::istringstream inp(src);
+	Lexer lex(inp);
+	Parser parser(lex.output);
+	Program& p = *parser.output;
+	Profile profile(p);
+	profile.read(saved);
+	ProfilePass(p, profile).run();
+	const auto& body = p.stmts[4].blocks[0].stmts;
+	REQUIRE(body[1].blocks[0].stmts[0].line == 9);
+	REQUIRE(body[1].blocks[1].stmts[0].line == 8);
+	REQUIRE(body[1].blocks[2].stmts[0].line == 10);
+	// OTHERWISE stays last, and the first 'a' is the one that matched
+	REQUIRE(body[1].blocks[3].stmts[0].blocks[0].stmts[0].line == 12);
+	// (i) isn't a literal
+	REQUIRE(body[2].blocks[0].stmts[0].line == 17);
+	Env env(lex.identifier_count, lex.id_num);
+	parser.run(env);
+	REQUIRE(env.out.str() == "1\n");
+
+	std::istringstream other("PCSE PROFILE 1\nFOR 5 1 5\nCASE 7 0 0 0 0\n");
+	REQUIRE_THROWS_AS(Profile(p).read(other), ProfileError);
+}
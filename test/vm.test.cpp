@@ -0,0 +1,545 @@
+#include <catch2/catch.hpp>
+#define TESTS
+#include "../src/lowering.hpp"
+#include "../src/irpasses.hpp"
+#include "../src/compiler.hpp"
+#include "../src/peephole.hpp"
+#include "../src/vm.hpp"
+#include "../src/pcsb.hpp"
+#include "../src/tiers.hpp"
+#include <chrono>
+#include <filesystem>
+
+/* Compiles `code` to bytecode, optimizing the IR first if `optimized`. */
+struct Compiled {
+	std::istringstream inp;
+	Lexer lex;
+	Parser parser;
+	Env env;
+	Bytecode code;
+	Compiled(const std::string& src, bool optimized = true, bool superinstructions = true) :
+		inp(src), lex(inp), parser(lex.output), env(lex.identifier_count, lex.id_num) {
+		ir::Module mod = ir::lower(*parser.output, env);
+		if(optimized) ir::PassManager().run(mod);
+		code = compile(mod, superinstructions);
+	}
+	/* Instructions with opcode `op` */
+	size_t count(Op op) const {
+		size_t res = 0;
+		for(size_t at = 0; at < code.instr.size(); at += instrLength(code, at)){
+			res += (code.instr[at] & 0xFF) == op;
+		}
+		return res;
+	}
+	std::string run(bool jit = false){
+		VM vm(env, code);
+		if(jit) vm.enableJit();
+		vm.run();
+		return env.out.str();
+	}
+};
+
+TEST_CASE("Compiling", "[vm]"){
+	{
+		// constants are used from the pool directly
+		Compiled c("DECLARE x : INTEGER\nINPUT x\nOUTPUT x + 2", false);
+		REQUIRE(c.count(OP_MOV) == 0);
+		c.env.in = std::istringstream("40");
+		REQUIRE(c.run() == "42\n");
+	}
+	{
+		// every operator knows the types of its operands
+		Compiled c(
+			"DECLARE r : REAL\nDECLARE n : INTEGER\nDECLARE s : STRING\nINPUT r\nINPUT n\nINPUT s\n"
+			"OUTPUT r + n, \" \", n + r, \" \", n < r, \" \", s < \"b\", \" \", NOT (r >= 1)");
+		REQUIRE(c.count(OP_ADD_RI) == 1);
+		REQUIRE(c.count(OP_ADD_RR) == 1);
+		REQUIRE(c.count(OP_ITOR) == 1);
+		REQUIRE(c.count(OP_GT_RI) == 1);
+		REQUIRE(c.count(OP_LT_SS) == 1);
+		REQUIRE(c.count(OP_GTEQ_RI) == 1);
+		c.env.in = std::istringstream("1.5\n2\na");
+		REQUIRE(c.run() == "3.5 3.5 FALSE TRUE FALSE\n");
+	}
+	{
+		// i and s are PHIs in the loop
+		Compiled c("DECLARE s : INTEGER\ns <- 0\nFOR i <- 1 TO 10\ns <- s + i\nNEXT\nOUTPUT s");
+		REQUIRE(c.run() == "55\n");
+	}
+	{
+		// a and b are PHIs that take each other's values: a cycle of moves
+		Compiled c(
+			"DECLARE a : INTEGER\nDECLARE b : INTEGER\nDECLARE t : INTEGER\nINPUT a\nINPUT b\n"
+			"FOR i <- 1 TO 3\nt <- a\na <- b\nb <- t\nNEXT\nOUTPUT a, b");
+		c.env.in = std::istringstream("1\n2");
+		REQUIRE(c.run() == "21\n");
+	}
+	{
+		Compiled c(
+			"FUNCTION fib(n : INTEGER) RETURNS INTEGER\n"
+			"IF n < 2 THEN\nRETURN n\nENDIF\nRETURN fib(n - 1) + fib(n - 2)\nENDFUNCTION\n"
+			"OUTPUT fib(15), \" \", INT(2.5)");
+		REQUIRE(c.code.funcs.size() == 2);
+		REQUIRE(c.code.funcs[1].params == 1);
+		REQUIRE(c.code.builtins.size() == 1);
+		REQUIRE(c.run() == "610 2\n");
+	}
+}
+
+TEST_CASE("Superinstructions", "[vm]"){
+	const std::string src =
+		"DECLARE a : ARRAY[1:10] OF INTEGER\nDECLARE s : INTEGER\nDECLARE n : INTEGER\nINPUT n\n"
+		"FOR i <- 1 TO 10\na[i] <- i * i\nNEXT\n"
+		"s <- 0\nFOR i <- 1 TO 10\nIF i MOD 2 = 0 THEN\ns <- s + a[i]\nENDIF\nNEXT\nOUTPUT s";
+	{
+		Compiled c(src);
+		REQUIRE(c.count(OP_FOR_STEP_II) == 1);
+		REQUIRE(c.count(OP_JEQ_II) == 1);
+		REQUIRE(c.count(OP_LOADE_IDX) == 1);
+		REQUIRE(c.count(OP_STOREE_IDX) == 1);
+		REQUIRE(c.count(OP_CJMP) == 0);
+		c.env.in = std::istringstream("10");
+		REQUIRE(c.run() == "220\n");
+	}
+	{
+		Compiled c(src, true, false);
+		REQUIRE(c.count(OP_FOR_STEP_II) == 0);
+		REQUIRE(c.count(OP_JEQ_II) == 0);
+		REQUIRE(c.count(OP_LOADE_IDX) == 0);
+		c.env.in = std::istringstream("10");
+		REQUIRE(c.run() == "220\n");
+	}
+}
+
+TEST_CASE("Calls", "[vm]"){
+	{
+		// deeper than the stack the VM starts with
+		Compiled c(
+			"FUNCTION sum(n : INTEGER) RETURNS INTEGER\nIF n = 0 THEN\nRETURN 0\nENDIF\nRETURN n + sum(n - 1)\nENDFUNCTION\n"
+			"OUTPUT sum(5000)");
+		// a function calling itself doesn't check that it's defined
+		REQUIRE(c.count(OP_CHECKDEF) == 0);
+		REQUIRE(c.run() == "12502500\n");
+	}
+	{
+		// PROCEDUREs return nothing into the caller's registers
+		Compiled c(
+			"DECLARE t : INTEGER\nt <- 0\n"
+			"PROCEDURE add(n : INTEGER)\nt <- t + n\nENDPROCEDURE\n"
+			"FUNCTION twice(n : INTEGER) RETURNS INTEGER\nCALL add(n)\nCALL add(n)\nRETURN t\nENDFUNCTION\n"
+			"OUTPUT twice(3), \" \", twice(4)");
+		REQUIRE(c.count(OP_CHECKDEF) > 0);
+		REQUIRE(c.run() == "6 14\n");
+	}
+}
+
+TEST_CASE("JIT", "[vm]"){
+	const std::string sum =
+		"FUNCTION sum(n : INTEGER) RETURNS INTEGER\nIF n = 0 THEN\nRETURN 0\nENDIF\nRETURN n + sum(n - 1)\nENDFUNCTION\n";
+	// deeper than the native stack is used, the rest is interpreted
+	REQUIRE(Compiled(sum + "OUTPUT sum(5000)").run(true) == "12502500\n");
+	// REALs, STRINGs and DIV go through the VM
+	REQUIRE(Compiled(
+		"FUNCTION f(x : REAL, s : STRING, n : INTEGER) RETURNS REAL\n"
+		"IF s < \"b\" AND n DIV 2 = 3 AND -7 MOD 2 = -1 THEN\nRETURN x * 2\nENDIF\nRETURN x\nENDFUNCTION\n"
+		"OUTPUT f(1.25, \"a\", 7), \" \", f(1.25, \"c\", 7), \" \", 9 DIV -1").run(true) == "2.5 1.25 -9\n");
+	// errors thrown in the middle of compiled code
+	REQUIRE_THROWS_WITH(Compiled(
+		"FUNCTION f(n : INTEGER) RETURNS INTEGER\nRETURN 10 DIV n\nENDFUNCTION\nOUTPUT f(2)\nOUTPUT f(0)").run(true),
+		"Cannot divide by zero");
+	REQUIRE_THROWS_WITH(Compiled(
+		"DECLARE A : ARRAY[1:3] OF INTEGER\nFOR i <- 1 TO 4\nA[i] <- i\nNEXT").run(true),
+		"Out-of-bounds index 4");
+	REQUIRE_THROWS_WITH(Compiled(sum + "FUNCTION g(n : INTEGER) RETURNS INTEGER\nRETURN sum(n) DIV (n - 2000)\nENDFUNCTION\nOUTPUT g(2000)").run(true),
+		"Cannot divide by zero");
+#ifdef JIT_X86_64
+	// perf finds the functions
+	std::ifstream map("/tmp/perf-" + std::to_string(getpid()) + ".map");
+	std::string line, last;
+	while(std::getline(map, line)) last = line;
+	REQUIRE(last.find("pcse function @") != std::string::npos);
+#endif
+}
+
+TEST_CASE("Opcode stats", "[vm]"){
+	Compiled c("DECLARE s : INTEGER\ns <- 0\nFOR i <- 1 TO 100\ns <- s + i\nNEXT\nOUTPUT s", true, false);
+	OpcodeStats stats;
+	VM(c.env, c.code).run(stats);
+	REQUIRE(c.env.out.str() == "5050\n");
+	REQUIRE(stats.count(OP_OUTPUT) == 1);
+	// the loop's condition is checked once more than its body runs
+	REQUIRE(stats.count(OP_CJMP) + stats.count(OP_JMP) >= 100);
+	REQUIRE(stats.pair(OP_OUTPUT, OP_NEWLINE) == 1);
+	std::ostringstream out;
+	stats.print(out);
+	REQUIRE(out.str().find("OUTPUT NEWLINE") != std::string::npos);
+}
+
+/* Runs `src` with the tree-walker, which hands functions to the VM at their `calls`-th call
+ * and loops at their `edges`-th back-edge (0 for never). */
+struct Tiered {
+	std::istringstream inp;
+	Lexer lex;
+	Parser parser;
+	Env env;
+	Tiered(const std::string& src, uint32_t calls, uint32_t edges, bool jit = false) :
+		inp(src), lex(inp), parser(lex.output), env(lex.identifier_count, lex.id_num) {
+		VMTiers tiers(*parser.output, true, true, jit, calls, edges);
+		if(calls != 0 || edges != 0) env.tiers = &tiers;
+		parser.run(env);
+		env.tiers = nullptr;
+	}
+	/* The count of the statement at `pos`, see Tiers */
+	uint32_t hotness(size_t pos) const { return parser.output->stmts[pos].hotness; }
+};
+
+TEST_CASE("Tiers", "[vm]"){
+	const std::string find =
+		"FUNCTION find(n : INTEGER) RETURNS INTEGER\n"
+		"FOR i <- 1 TO 100\nIF i * i > n THEN\nRETURN i\nENDIF\nNEXT\nRETURN 0\nENDFUNCTION\n"
+		"DECLARE s : INTEGER\ns <- 0\nFOR k <- 1 TO 50\ns <- s + find(k * 10)\nNEXT\nOUTPUT s";
+	const std::string expected = Tiered(find, 0, 0).env.out.str();
+	for(const bool jit : { false, true }){
+		INFO("JIT: " << jit);
+		// The loop in `find` gets hot in the first call and returns from the VM,
+		// the next calls run there, and then the main loop does too.
+		Tiered t(find, 2, 3, jit);
+		REQUIRE(t.env.out.str() == expected);
+		REQUIRE(t.env.functable.at(t.lex.id_num.at("find")).hotness == 1);
+		REQUIRE(t.hotness(3) == 2);
+		// Types and globals carry over in both directions
+		const std::string loops =
+			"DECLARE x : REAL\nDECLARE n : INTEGER\nPROCEDURE bump(by : INTEGER)\nn <- n + by\nENDPROCEDURE\nx <- 0\nn <- 0\n"
+			"FOR r <- 0.5 TO 10 STEP 0.25\nx <- x + r\nCALL bump(2)\nNEXT\n"
+			"REPEAT\nx <- x - 1\nUNTIL x < 0\nWHILE n > 0 DO\nn <- n - 5\nENDWHILE\nOUTPUT x, \" \", n";
+		REQUIRE(Tiered(loops, 2, 2, jit).env.out.str() == Tiered(loops, 0, 0).env.out.str());
+		// errors too, after the loop has moved
+		REQUIRE_THROWS_WITH(Tiered(
+			"DECLARE A : ARRAY[1:30] OF INTEGER\nFOR i <- 1 TO 40\nA[i] <- i\nNEXT", 1, 10, jit),
+			"Out-of-bounds index 31");
+	}
+}
+
+TEST_CASE("Peephole", "[vm]"){
+	const std::string branches =
+		"DECLARE x : INTEGER\nDECLARE b : BOOLEAN\nINPUT x\nb <- x > 3\n"
+		"IF NOT NOT b THEN\nIF 1 < 2 THEN\nOUTPUT x\nELSE\nOUTPUT 0\nENDIF\nENDIF\n"
+		"WHILE x > 0 DO\nx <- x - 1\nENDWHILE\nOUTPUT x";
+	for(const char *input : { "5", "2" }){
+		// the IR isn't optimized, so the compiler leaves all of it to the peephole pass
+		Compiled c(branches, false);
+		const size_t before = c.code.instr.size();
+		REQUIRE(c.count(OP_NOT) == 2);
+		REQUIRE(c.count(OP_JLT_II) == 1);
+		peephole(c.code);
+		REQUIRE(c.code.instr.size() < before);
+		REQUIRE(c.count(OP_NOT) == 0);
+		REQUIRE(c.count(OP_JLT_II) == 0);
+		REQUIRE(c.count(OP_MOV_JMP) == 0);
+		c.env.in = std::istringstream(input);
+		REQUIRE(c.run() == (input[0] == '5' ? "5\n0\n" : "0\n"));
+	}
+	{
+		// functions move, so CALL has to find them
+		Compiled c(
+			"DECLARE g : INTEGER\nFUNCTION fib(n : INTEGER) RETURNS INTEGER\n"
+			"IF n < 2 THEN\nRETURN n\nENDIF\nRETURN fib(n - 1) + fib(n - 2)\nENDFUNCTION\n"
+			"IF 1 = 1 THEN\ng <- 3\nENDIF\nOUTPUT fib(15) + g", false);
+		const int32_t entry = c.code.funcs[1].entry;
+		peephole(c.code);
+		REQUIRE(c.code.funcs[1].entry < entry);
+		REQUIRE(c.run() == "613\n");
+	}
+}
+
+TEST_CASE("VM errors", "[vm]"){
+	{
+		Compiled c("DECLARE x : INTEGER\nOUTPUT 1\nOUTPUT 5 MOD x");
+		REQUIRE_THROWS_AS(c.run(), RuntimeError);
+		// what was output before stays
+		REQUIRE(c.env.out.str() == "1\n");
+	}
+}
+
+TEST_CASE("Verifying bytecode", "[vm]"){
+	const std::string src =
+		"DECLARE x : INTEGER\nINPUT x\nWHILE x > 0 DO\nx <- x - 1\nENDWHILE\nOUTPUT x";
+	const auto rejects = [&](auto&& change){
+		Compiled c(src);
+		REQUIRE_NOTHROW(VM(c.env, c.code));
+		change(c.code);
+		REQUIRE_THROWS_AS(VM(c.env, c.code), VMFileError);
+	};
+	// an unknown instruction
+	rejects([](Bytecode& code){ code.instr[0] = OP_LENGTH; });
+	// INPUT into a register outside the frame
+	rejects([](Bytecode& code){ code.instr[1] = code.funcs[0].frame_size; });
+	// a constant outside the pool
+	rejects([](Bytecode& code){ code.const_pool.clear(); });
+	// jumps into the middle of an instruction, or past the end
+	for(const int32_t by : { 1, 1000 }){
+		rejects([by](Bytecode& code){
+			for(size_t at = 0; at < code.instr.size(); at += instrLength(code, at)){
+				const std::string kinds = operandKinds(code, at);
+				if(kinds.back() == 'j'){
+					code.instr[at + kinds.size()] += by;
+					return;
+				}
+			}
+		});
+	}
+	// the code ends inside an instruction, or runs off its end
+	rejects([](Bytecode& code){ code.instr.pop_back(); });
+	rejects([](Bytecode& code){ code.instr.push_back(makeInstr(OP_NEWLINE)); });
+	// x is read from a register nothing wrote, when INPUT goes elsewhere
+	rejects([](Bytecode& code){ code.instr[1] = code.funcs[0].frame_size - 1; });
+	// a frame no function needs
+	rejects([](Bytecode& code){ code.funcs[0].frame_size = MAX_FRAME_SIZE + 1; });
+}
+
+TEST_CASE("Verifying bytecode from a file", "[vm]"){
+	// The FOR proves the index is in range, so the compiled code doesn't check it.
+	const std::string src =
+		"DECLARE A : ARRAY[1:3] OF INTEGER\nDECLARE s : STRING\ns <- \"a\"\n"
+		"FUNCTION f(n : INTEGER) RETURNS INTEGER\nRETURN n * 2\nENDFUNCTION\n"
+		"FOR i <- 1 TO 3\nA[i] <- f(i)\nNEXT\nOUTPUT A[2], s";
+	const auto find = [](const Bytecode& code, std::initializer_list<Op> ops){
+		for(size_t at = 0; at < code.instr.size(); at += instrLength(code, at)){
+			for(const Op op : ops) if((code.instr[at] & 0xFF) == op) return at;
+		}
+		FAIL("no such instruction");
+		return (size_t)0;
+	};
+	const auto constant = [](const Bytecode& code, Primitive type){
+		for(size_t i = 0; i < code.const_pool.size(); i++) if(code.const_types[i] == type) return (int32_t)i;
+		FAIL("no such constant");
+		return (int32_t)0;
+	};
+	const auto loaded = [&](auto&& change){
+		Compiled c(src);
+		peephole(c.code);
+		c.code.from_file = true;
+		change(c.code);
+		return c;
+	};
+	for(const bool jit : { false, true }){
+		Compiled c = loaded([](Bytecode&){});
+		REQUIRE(c.run(jit) == "4a\n");
+	}
+	const auto rejects = [&](auto&& change){
+		Compiled c = loaded(change);
+		REQUIRE_THROWS_AS(VM(c.env, c.code), VMFileError);
+	};
+	// a STRING constant as the array, or as the index
+	rejects([&](Bytecode& code){ code.instr[find(code, { OP_STOREE, OP_STOREE_IDX }) + 1] = constant(code, Primitive::STRING); });
+	rejects([&](Bytecode& code){ code.instr[find(code, { OP_STOREE, OP_STOREE_IDX }) + 2] = constant(code, Primitive::STRING); });
+	// an INTEGER where a STRING is output
+	rejects([&](Bytecode& code){
+		const size_t at = find(code, { OP_OUTPUT });
+		for(size_t i = 0; i < code.types.size(); i++) if(code.types[i] == Primitive::STRING) code.instr[at + 1] = i;
+	});
+	// f called with a STRING, which it multiplies
+	rejects([&](Bytecode& code){ code.instr[find(code, { OP_CALL }) + 3] = constant(code, Primitive::STRING); });
+	// an index past the end of the array, which nothing checks but the VM
+	for(const bool jit : { false, true }){
+		Compiled c = loaded([](Bytecode& code){
+			for(size_t i = 0; i < code.const_pool.size(); i++){
+				if(code.const_types[i] == Primitive::INTEGER && code.const_pool[i].i64 == 3) code.const_pool[i].i64 = 100000;
+			}
+		});
+		REQUIRE_THROWS_AS(c.run(jit), RuntimeError);
+	}
+}
+
+TEST_CASE("Bytecode files", "[vm]"){
+	const std::string path = (std::filesystem::temp_directory_path() / "pcse-test.pcsb").string();
+	const auto save = [&path](const Compiled& c){
+		std::ofstream out(path, std::ios::binary);
+		pcsb::write(out, c.code, c.env.variables());
+	};
+	{
+		// every kind of constant, a builtin, a function, arrays and a message
+		Compiled c(
+			"DECLARE a : ARRAY[1:3] OF REAL\nDECLARE d : DATE\nDECLARE s : STRING\nINPUT s\n"
+			"FUNCTION f(x : REAL) RETURNS REAL\nRETURN x * 1.5\nENDFUNCTION\n"
+			"d <- 01/02/2003\na[2] <- f(2.0) + INT(2.5)\n"
+			"OUTPUT a[2], \" \", d, \" \", 'c', \" \", s = \"pcse\", \" \", s, \"!\"");
+		peephole(c.code);
+		save(c);
+		const pcsb::File file(path);
+		REQUIRE(file.code.mapped != nullptr);
+		REQUIRE(std::equal(c.code.instr.begin(), c.code.instr.end(), file.code.words()));
+		REQUIRE(file.code.length() == c.code.length());
+		REQUIRE(file.code.funcs.size() == 2);
+		REQUIRE(file.code.builtins == c.code.builtins);
+		REQUIRE(file.code.lines == c.code.lines);
+		for(const char *input : { "pcse", "x" }){
+			std::map<std::string_view, int64_t> no_ids;
+			Env env(file.variables - 1, no_ids);
+			env.in = std::istringstream(input);
+			VM(env, file.code).run();
+			REQUIRE(env.out.str() == std::string("5 1/2/2003 c ") + (input[0] == 'p' ? "TRUE" : "FALSE") + " " + input + "!\n");
+		}
+	}
+	{
+		Compiled c("OUTPUT 1");
+		save(c);
+		std::string bytes;
+		{
+			std::ifstream in(path, std::ios::binary);
+			bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		}
+		const auto rejects = [&](std::string changed){
+			std::ofstream(path, std::ios::binary) << changed;
+			REQUIRE_THROWS_AS(pcsb::File(path), VMFileError);
+		};
+		rejects("");
+		rejects("PCSC" + bytes.substr(4));
+		// another version
+		rejects(bytes.substr(0, 4) + (char)(pcsb::VERSION + 1) + bytes.substr(5));
+		// more variables than Env should be made with
+		rejects(bytes.substr(0, 8) + "\xFF\xFF\xFF\x7F" + bytes.substr(12));
+		// a frame that's too big, or smaller than the parameters
+		const uint64_t funcs = readAsLE<uint64_t>(reinterpret_cast<const uint8_t *>(bytes.data()) + 16 + 24 * pcsb::FUNCTIONS + 8);
+		rejects(bytes.substr(0, funcs + 8) + "\xFF\xFF\xFF\x7F" + bytes.substr(funcs + 12));
+		rejects(bytes.substr(0, funcs + 4) + "\x01" + bytes.substr(funcs + 5, 3) + "\0\0\0\0" + bytes.substr(funcs + 12));
+		// sections outside the file
+		rejects(bytes.substr(0, bytes.size() - 8));
+		// bad instructions get to the verifier
+		std::string bad = bytes;
+		const uint64_t code = readAsLE<uint64_t>(reinterpret_cast<const uint8_t *>(bad.data()) + 16 + 24 * pcsb::CODE + 8);
+		bad[code] = (char)OP_LENGTH;
+		std::ofstream(path, std::ios::binary) << bad;
+		const pcsb::File file(path);
+		Env env(file.variables - 1, c.lex.id_num);
+		REQUIRE_THROWS_AS(VM(env, file.code), VMFileError);
+	}
+	{
+		// arrays with more elements than there can be, or an end before the start
+		Compiled c("DECLARE a : ARRAY[1:3] OF INTEGER\nINPUT a[2]\nOUTPUT a[2]");
+		save(c);
+		std::string bytes;
+		{
+			std::ifstream in(path, std::ios::binary);
+			bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		}
+		const auto at = [&](size_t offset){ return reinterpret_cast<const uint8_t *>(bytes.data()) + offset; };
+		const uint64_t types = readAsLE<uint64_t>(at(16 + 24 * pcsb::TYPES + 8));
+		size_t bounds = types;
+		while(readAsLE<uint32_t>(at(bounds + 4)) == 0) bounds += 12 + 16 * readAsLE<uint32_t>(at(bounds + 8));
+		bounds += 12;
+		for(const auto& [lo, hi] : { std::pair<int64_t, int64_t>{ INT64_MIN, INT64_MAX }, { 1, 0 } }){
+			std::string changed = bytes;
+			for(size_t k = 0; k < 8; k++){
+				changed[bounds + k] = (char)((uint64_t)lo >> (8 * k));
+				changed[bounds + 8 + k] = (char)((uint64_t)hi >> (8 * k));
+			}
+			std::ofstream(path, std::ios::binary) << changed;
+			REQUIRE_THROWS_AS(pcsb::File(path), VMFileError);
+		}
+	}
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("Bundles", "[vm]"){
+	const auto dir = std::filesystem::temp_directory_path();
+	const std::string runtime = (dir / "pcse-test-runtime").string(), path = (dir / "pcse-test-bundle").string();
+	// Any file does as the runtime here, it's never run.
+	std::ofstream(runtime, std::ios::binary) << "not an executable";
+	REQUIRE_FALSE(pcsb::bundled(runtime));
+	Compiled c("FUNCTION f(x : INTEGER) RETURNS INTEGER\nRETURN x * 2\nENDFUNCTION\nOUTPUT f(21)");
+	std::ostringstream program;
+	pcsb::write(program, c.code, c.env.variables());
+	pcsb::bundle(runtime, program.str(), path);
+	const auto offset = pcsb::bundled(path);
+	REQUIRE(offset);
+	REQUIRE(*offset % 8 == 0);
+	{
+		const pcsb::File file(path, *offset);
+		REQUIRE(file.code.mapped != nullptr);
+		std::map<std::string_view, int64_t> no_ids;
+		Env env(file.variables - 1, no_ids);
+		VM(env, file.code).run();
+		REQUIRE(env.out.str() == "42\n");
+	}
+	// Bundling with a bundle replaces its program.
+	pcsb::bundle(path, program.str(), runtime);
+	REQUIRE(pcsb::bundled(runtime) == offset);
+	REQUIRE(std::filesystem::file_size(runtime) == std::filesystem::file_size(path));
+	// A trailer pointing outside the file
+	std::string bytes;
+	{
+		std::ifstream in(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	bytes[bytes.size() - 24] ^= 8;
+	std::ofstream(path, std::ios::binary) << bytes;
+	REQUIRE_THROWS_AS(pcsb::bundled(path), VMFileError);
+	std::filesystem::remove(runtime);
+	std::filesystem::remove(path);
+}
+
+/* Nanoseconds per instruction that `stmt` compiles to, run in a loop:
+ * the time of the loop, less the time of an empty one.
+ * Not optimized, so nothing is folded or removed. */
+static double nsPerInstr(const std::string& decls, const std::string& input, const std::string& stmt){
+	const int N = 200000, K = 16;
+	auto best = [&](const std::string& body){
+		std::string src = decls + "DECLARE x : BOOLEAN\nFOR i <- 1 TO " + std::to_string(N) + "\n";
+		for(int k = 0; k < K; k++) src += body;
+		src += "NEXT\n";
+		double res = 1e18;
+		for(int rep = 0; rep < 5; rep++){
+			Compiled c(src, false);
+			c.env.in = std::istringstream(input);
+			const auto start = std::chrono::steady_clock::now();
+			c.run();
+			const std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+			res = std::min(res, took.count());
+		}
+		return res;
+	};
+	return (best(stmt) - best("")) / (N * K);
+}
+
+TEST_CASE("Call overhead", "[.][benchmark]"){
+	const std::string src =
+		"FUNCTION fib(n : INTEGER) RETURNS INTEGER\nIF n < 2 THEN\nRETURN n\nENDIF\n"
+		"RETURN fib(n - 1) + fib(n - 2)\nENDFUNCTION\nOUTPUT fib(25)";
+	const auto ms = [&](bool vm){
+		double res = 1e18;
+		for(int rep = 0; rep < 3; rep++){
+			Compiled c(src);
+			const auto start = std::chrono::steady_clock::now();
+			if(vm) c.run();
+			else c.parser.run(c.env);
+			const std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+			res = std::min(res, took.count());
+		}
+		return res;
+	};
+	std::cout << "fib(25): tree " << ms(false) << " ms, VM " << ms(true) << " ms\n";
+}
+
+TEST_CASE("Dispatch", "[.][benchmark]"){
+	const std::string ints = "DECLARE a : INTEGER\nDECLARE b : INTEGER\nDECLARE y : INTEGER\nINPUT a\nINPUT b\n";
+	const std::string reals = "DECLARE a : REAL\nDECLARE b : REAL\nDECLARE y : REAL\nINPUT a\nINPUT b\n";
+	const std::string mixed = "DECLARE a : REAL\nDECLARE y : REAL\nDECLARE b : INTEGER\nINPUT a\nINPUT b\n";
+	const struct {
+		const char *name;
+		std::string decls, input, stmt;
+	} cases[] = {
+		{ "ADD INTEGER", ints, "3\n4\n", "y <- a + b\n" },
+		{ "MUL INTEGER", ints, "3\n4\n", "y <- a * b\n" },
+		{ "ADD REAL", reals, "0.5\n0.25\n", "y <- a + b\n" },
+		{ "ADD REAL INTEGER", mixed, "0.5\n4\n", "y <- a + b\n" },
+		{ "LT INTEGER", ints, "3\n4\n", "x <- a < b\n" },
+		{ "LT REAL INTEGER", mixed, "0.5\n4\n", "x <- a < b\n" },
+		{ "LT STRING", "DECLARE a : STRING\nDECLARE b : STRING\nINPUT a\nINPUT b\n", "abc\nabd\n", "x <- a < b\n" },
+		{ "EQ CHAR", "DECLARE a : CHAR\nDECLARE b : CHAR\nINPUT a\nINPUT b\n", "a\nb\n", "x <- a = b\n" },
+		{ "AND", "DECLARE a : BOOLEAN\nDECLARE b : BOOLEAN\nINPUT a\nINPUT b\n", "TRUE\nFALSE\n", "x <- a AND b\n" },
+	};
+	for(const auto& c : cases){
+		std::cout << c.name << ": " << nsPerInstr(c.decls, c.input, c.stmt) << " ns\n";
+	}
+}